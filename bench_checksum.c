@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lib_tar.h"
+#include "tar_simd.h"
+
+/**
+ * Microbenchmark of the header checksum and zero-block kernels against the previous scalar code.
+ */
+
+#define NO_BLOCKS 4096
+#define NO_ROUNDS 200
+
+/* The checksum as it was computed before the kernels: copy, overwrite the chksum field, then add byte by byte */
+static uint32_t scalar_header_sum(const void *block) {
+    char header_buf[512];
+    memcpy(&header_buf, block, 512);
+    memset((void *) &header_buf[148], ' ', 8);
+
+    uint32_t checksum = 0;
+    for (int i = 0; i < 512; ++i) {
+        checksum += (unsigned char) header_buf[i];
+    }
+    return checksum;
+}
+
+/* The zero check as it was before the kernels, but actually moving through the buffer */
+static bool scalar_is_zeros(const void *buf, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (((const char *) buf)[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint8_t *blocks;
+static volatile uint32_t sink;
+
+static void bench_sum(const char *name, uint32_t (*sum)(const void *)) {
+    // check the kernel against the scalar code before timing it
+    for (int b = 0; b < NO_BLOCKS; ++b) {
+        if (sum(blocks + b * 512) != scalar_header_sum(blocks + b * 512)) {
+            printf("%-22s MISMATCH on block %d\n", name, b);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    double start = now_ns();
+    uint32_t acc = 0;
+    for (int r = 0; r < NO_ROUNDS; ++r) {
+        for (int b = 0; b < NO_BLOCKS; ++b) {
+            acc += sum(blocks + b * 512);
+        }
+    }
+    double ns = (now_ns() - start) / ((double) NO_ROUNDS * NO_BLOCKS);
+    sink = acc;
+    printf("%-22s %8.2f ns/header %8.2f GB/s\n", name, ns, 512 / ns);
+}
+
+static void bench_zeros(const char *name, bool (*zeros)(const void *, size_t), const uint8_t *zero_blocks) {
+    double start = now_ns();
+    uint32_t acc = 0;
+    for (int r = 0; r < NO_ROUNDS; ++r) {
+        for (int b = 0; b < NO_BLOCKS; ++b) {
+            acc += zeros(zero_blocks + b * 512, 512);
+        }
+    }
+    double ns = (now_ns() - start) / ((double) NO_ROUNDS * NO_BLOCKS);
+    sink = acc;
+    printf("%-22s %8.2f ns/block  %8.2f GB/s\n", name, ns, 512 / ns);
+}
+
+int main(void) {
+    blocks = malloc(NO_BLOCKS * 512);
+    uint8_t *zero_blocks = calloc(NO_BLOCKS, 512);
+    srand(42);
+    for (int i = 0; i < NO_BLOCKS * 512; ++i) {
+        blocks[i] = rand();
+    }
+
+    printf("selected kernel: %s\n\n", tar_simd_kernel());
+
+    bench_sum("checksum scalar", scalar_header_sum);
+    bench_sum("checksum swar", tar_header_sum_swar);
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("sse2")) {
+        bench_sum("checksum sse2", tar_header_sum_sse2);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        bench_sum("checksum avx2", tar_header_sum_avx2);
+    }
+#endif
+    printf("\n");
+
+    bench_zeros("is_zeros scalar", scalar_is_zeros, zero_blocks);
+    bench_zeros("is_zeros swar", tar_block_is_zeros_swar, zero_blocks);
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("sse2")) {
+        bench_zeros("is_zeros sse2", tar_block_is_zeros_sse2, zero_blocks);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        bench_zeros("is_zeros avx2", tar_block_is_zeros_avx2, zero_blocks);
+    }
+#endif
+
+    free(blocks);
+    free(zero_blocks);
+    return 0;
+}
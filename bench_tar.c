@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lib_tar.h"
+#include "tar_index.h"
+#include "tar_iter.h"
+
+/**
+ * Measures the lib_tar.h queries on an archive and prints one JSON object per line and per measurement:
+ *
+ *   {"archive":"a.tar","op":"exists","cache":"warm","calls":200,"ops_per_sec":...,"mib_per_sec":...,
+ *    "p50_us":...,"p99_us":...}
+ *
+ * Cold measurements drop the archive from the page cache before every call, outside of the timed region.
+ * The tar_index_* measurements query one index built up front, to show the cost of the queries themselves.
+ *
+ * Usage: bench_tar [-c calls] [-s seed] archive...
+ */
+
+#define MAX_ENTRIES 4096
+#define ENTRY_LEN 512
+#define READ_LEN (1 << 20)
+
+typedef enum { CACHE_WARM, CACHE_COLD } cache_t;
+
+typedef struct {
+    char **files;
+    size_t no_files;
+    char **dirs;
+    size_t no_dirs;
+    char **all;
+    size_t no_all;
+} paths_t;
+
+typedef struct {
+    int fd;
+    tar_index_t *idx;
+    char **entries;
+    uint8_t *buf;
+} bench_ctx_t;
+
+/* runs one call on a path and returns the number of bytes it produced */
+typedef size_t (*bench_op_t)(bench_ctx_t *ctx, char *path);
+
+static uint64_t rng_state;
+
+static uint64_t next_random(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static void add_path(char ***paths, size_t *no_paths, const char *name) {
+    *paths = realloc(*paths, (*no_paths + 1) * sizeof(char *));
+    if (*paths == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    (*paths)[(*no_paths)++] = strdup(name);
+}
+
+/**
+ * Collects the paths of the archive with a single streaming pass, so that the queries are benchmarked on real names.
+ */
+static void collect_paths(int fd, paths_t *paths) {
+    memset(paths, 0, sizeof(*paths));
+    tar_iter_t *it = tar_iter_open(fd);
+    if (it == NULL) {
+        perror("tar_iter_open");
+        exit(EXIT_FAILURE);
+    }
+    tar_iter_entry_t entry;
+    int ret;
+    while ((ret = tar_iter_next(it, &entry)) == 1) {
+        add_path(&paths->all, &paths->no_all, entry.name);
+        if (entry.typeflag == DIRTYPE) {
+            add_path(&paths->dirs, &paths->no_dirs, entry.name);
+        } else if (entry.typeflag == REGTYPE || entry.typeflag == AREGTYPE) {
+            add_path(&paths->files, &paths->no_files, entry.name);
+        }
+    }
+    tar_iter_close(it);
+    if (ret < 0) {
+        fprintf(stderr, "the archive is not valid (%d)\n", ret);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void free_paths(char **paths, size_t no_paths) {
+    for (size_t i = 0; i < no_paths; ++i) {
+        free(paths[i]);
+    }
+    free(paths);
+}
+
+static size_t op_check_archive(bench_ctx_t *ctx, char *path) {
+    (void) path;
+    check_archive(ctx->fd);
+    return 0;
+}
+
+static size_t op_exists(bench_ctx_t *ctx, char *path) {
+    exists(ctx->fd, path);
+    return 0;
+}
+
+static size_t op_is_dir(bench_ctx_t *ctx, char *path) {
+    is_dir(ctx->fd, path);
+    return 0;
+}
+
+static size_t op_list(bench_ctx_t *ctx, char *path) {
+    size_t no_entries = MAX_ENTRIES;
+    list(ctx->fd, path, ctx->entries, &no_entries);
+    return 0;
+}
+
+static size_t op_read_file(bench_ctx_t *ctx, char *path) {
+    size_t len = READ_LEN;
+    return read_file(ctx->fd, path, 0, ctx->buf, &len) >= 0 ? len : 0;
+}
+
+static size_t op_index_build(bench_ctx_t *ctx, char *path) {
+    (void) path;
+    tar_index_t *idx = tar_index_build(ctx->fd);
+    if (idx == NULL) {
+        perror("tar_index_build");
+        exit(EXIT_FAILURE);
+    }
+    tar_index_free(idx);
+    return 0;
+}
+
+static size_t op_index_exists(bench_ctx_t *ctx, char *path) {
+    tar_index_exists(ctx->idx, path);
+    return 0;
+}
+
+static size_t op_index_is_dir(bench_ctx_t *ctx, char *path) {
+    tar_index_is_dir(ctx->idx, path);
+    return 0;
+}
+
+static size_t op_index_list(bench_ctx_t *ctx, char *path) {
+    size_t no_entries = MAX_ENTRIES;
+    tar_index_list(ctx->idx, path, ctx->entries, &no_entries);
+    return 0;
+}
+
+static size_t op_index_read_file(bench_ctx_t *ctx, char *path) {
+    size_t len = READ_LEN;
+    return tar_index_read_file(ctx->idx, path, 0, ctx->buf, &len) >= 0 ? len : 0;
+}
+
+/**
+ * Calls an operation on randomly picked paths and prints its throughput and latency percentiles.
+ */
+static void run(const char *archive, const char *name, bench_op_t op, bench_ctx_t *ctx, char **paths,
+                size_t no_paths, cache_t cache, size_t calls) {
+    if (no_paths == 0) {
+        return;
+    }
+    double *latencies = malloc(calls * sizeof(double));
+    if (latencies == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    size_t bytes = 0;
+    double total = 0;
+    for (size_t i = 0; i < calls; ++i) {
+        char *path = paths[next_random() % no_paths];
+        if (cache == CACHE_COLD) {
+            posix_fadvise(ctx->fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+        double start = now_us();
+        bytes += op(ctx, path);
+        latencies[i] = now_us() - start;
+        total += latencies[i];
+    }
+    qsort(latencies, calls, sizeof(double), compare_doubles);
+    double seconds = total / 1e6;
+    printf("{\"archive\":\"%s\",\"op\":\"%s\",\"cache\":\"%s\",\"calls\":%zu,\"ops_per_sec\":%.1f,"
+           "\"mib_per_sec\":%.2f,\"p50_us\":%.2f,\"p99_us\":%.2f}\n",
+           archive, name, cache == CACHE_COLD ? "cold" : "warm", calls, calls / seconds,
+           bytes / (1024.0 * 1024.0) / seconds, latencies[calls / 2], latencies[calls * 99 / 100]);
+    fflush(stdout);
+    free(latencies);
+}
+
+static void bench_archive(const char *archive, size_t calls, size_t index_calls) {
+    bench_ctx_t ctx;
+    ctx.fd = open(archive, O_RDONLY);
+    if (ctx.fd == -1) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+    ctx.entries = malloc(MAX_ENTRIES * sizeof(char *));
+    ctx.buf = malloc(READ_LEN);
+    if (ctx.entries == NULL || ctx.buf == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < MAX_ENTRIES; ++i) {
+        ctx.entries[i] = malloc(ENTRY_LEN);
+        if (ctx.entries[i] == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    paths_t paths;
+    collect_paths(ctx.fd, &paths);
+
+    for (cache_t cache = CACHE_WARM; cache <= CACHE_COLD; ++cache) {
+        run(archive, "check_archive", op_check_archive, &ctx, paths.all, paths.no_all, cache, calls);
+        run(archive, "exists", op_exists, &ctx, paths.all, paths.no_all, cache, calls);
+        run(archive, "is_dir", op_is_dir, &ctx, paths.all, paths.no_all, cache, calls);
+        run(archive, "list", op_list, &ctx, paths.dirs, paths.no_dirs, cache, calls);
+        run(archive, "read_file", op_read_file, &ctx, paths.files, paths.no_files, cache, calls);
+        run(archive, "tar_index_build", op_index_build, &ctx, paths.all, paths.no_all, cache, calls);
+    }
+
+    ctx.idx = tar_index_build(ctx.fd);
+    if (ctx.idx == NULL) {
+        perror("tar_index_build");
+        exit(EXIT_FAILURE);
+    }
+    run(archive, "tar_index_exists", op_index_exists, &ctx, paths.all, paths.no_all, CACHE_WARM, index_calls);
+    run(archive, "tar_index_is_dir", op_index_is_dir, &ctx, paths.all, paths.no_all, CACHE_WARM, index_calls);
+    run(archive, "tar_index_list", op_index_list, &ctx, paths.dirs, paths.no_dirs, CACHE_WARM, index_calls);
+    run(archive, "tar_index_read_file", op_index_read_file, &ctx, paths.files, paths.no_files, CACHE_WARM,
+        index_calls);
+    run(archive, "tar_index_read_file", op_index_read_file, &ctx, paths.files, paths.no_files, CACHE_COLD, calls);
+    tar_index_free(ctx.idx);
+
+    free_paths(paths.all, paths.no_all);
+    free_paths(paths.dirs, paths.no_dirs);
+    free_paths(paths.files, paths.no_files);
+    for (int i = 0; i < MAX_ENTRIES; ++i) {
+        free(ctx.entries[i]);
+    }
+    free(ctx.entries);
+    free(ctx.buf);
+    close(ctx.fd);
+}
+
+int main(int argc, char **argv) {
+    size_t calls = 200;
+    uint64_t seed = 42;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:s:")) != -1) {
+        switch (opt) {
+            case 'c':
+                calls = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-c calls] [-s seed] archive...\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind == argc || calls == 0) {
+        fprintf(stderr, "Usage: %s [-c calls] [-s seed] archive...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    for (int i = optind; i < argc; ++i) {
+        rng_state = seed ? seed : 1;
+        bench_archive(argv[i], calls, calls * 100);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <math.h>
+
+#include "lib_tar.h"
+
+/**
+ * Generates a synthetic ustar archive for benchmarks.
+ *
+ * Usage: gen_archive [-n entries] [-s size_dist] [-d depth] [-w width] [-l symlink_ratio] [-r seed] -o out.tar
+ *   -n  number of files and symlinks (default 10000)
+ *   -s  size distribution of the files: fixed:N, uniform:MIN:MAX or exp:MEAN (default uniform:0:4096)
+ *   -d  depth of the directory tree (default 3)
+ *   -w  number of subdirectories of each directory (default 4)
+ *   -l  fraction of the entries that are symlinks to earlier entries (default 0.05)
+ *   -r  seed of the generator, the same options and seed always give the same archive (default 42)
+ */
+
+#define NAME_LEN 100
+
+typedef enum {
+    DIST_FIXED,
+    DIST_UNIFORM,
+    DIST_EXP
+} dist_kind_t;
+
+typedef struct {
+    dist_kind_t kind;
+    double a;
+    double b;
+} size_dist_t;
+
+typedef struct {
+    char name[NAME_LEN];
+    int depth;
+} dir_t;
+
+static uint64_t rng_state;
+
+/* xorshift64*, so the archives are the same on every platform */
+static uint64_t next_random(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static double next_uniform(void) {
+    return (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static size_t next_size(const size_dist_t *dist) {
+    switch (dist->kind) {
+        case DIST_FIXED:
+            return (size_t) dist->a;
+        case DIST_UNIFORM:
+            return (size_t) (dist->a + next_uniform() * (dist->b - dist->a + 1));
+        case DIST_EXP:
+        default:
+            return (size_t) (-dist->a * log(1.0 - next_uniform()));
+    }
+}
+
+static int parse_dist(const char *str, size_dist_t *dist) {
+    if (sscanf(str, "fixed:%lf", &dist->a) == 1) {
+        dist->kind = DIST_FIXED;
+        return 0;
+    }
+    if (sscanf(str, "uniform:%lf:%lf", &dist->a, &dist->b) == 2 && dist->a <= dist->b) {
+        dist->kind = DIST_UNIFORM;
+        return 0;
+    }
+    if (sscanf(str, "exp:%lf", &dist->a) == 1) {
+        dist->kind = DIST_EXP;
+        return 0;
+    }
+    return -1;
+}
+
+/* Copies a string into a header field, without the NUL if it fills the field */
+static void copy_field(char *field, size_t field_len, const char *str) {
+    size_t len = strlen(str);
+    memcpy(field, str, len < field_len ? len : field_len);
+}
+
+/* Fills a ustar header and its checksum, the inverse of check_header_checksum() */
+static void fill_header(tar_header_t *header, const char *name, char typeflag, size_t size, const char *linkname) {
+    memset(header, 0, sizeof(tar_header_t));
+    copy_field(header->name, sizeof(header->name), name);
+    snprintf(header->mode, sizeof(header->mode), "%07o", typeflag == DIRTYPE ? 0755 : 0644);
+    snprintf(header->uid, sizeof(header->uid), "%07o", 1000);
+    snprintf(header->gid, sizeof(header->gid), "%07o", 1000);
+    snprintf(header->size, sizeof(header->size), "%011zo", size);
+    snprintf(header->mtime, sizeof(header->mtime), "%011o", 1700000000);
+    header->typeflag = typeflag;
+    if (linkname != NULL) {
+        copy_field(header->linkname, sizeof(header->linkname), linkname);
+    }
+    memcpy(header->magic, TMAGIC, TMAGLEN);
+    memcpy(header->version, TVERSION, TVERSLEN);
+    strcpy(header->uname, "bench");
+    strcpy(header->gname, "bench");
+
+    memset(header->chksum, ' ', sizeof(header->chksum));
+    unsigned int checksum = 0;
+    for (size_t i = 0; i < sizeof(tar_header_t); ++i) {
+        checksum += ((unsigned char *) header)[i];
+    }
+    snprintf(header->chksum, sizeof(header->chksum), "%06o", checksum);
+}
+
+static void write_entry(FILE *out, const char *name, char typeflag, size_t size, const char *linkname) {
+    tar_header_t header;
+    fill_header(&header, name, typeflag, size, linkname);
+    fwrite(&header, sizeof(header), 1, out);
+
+    // the data is the name repeated, so every file has distinct, checkable content
+    static uint8_t block[512];
+    size_t name_len = strlen(name);
+    for (size_t done = 0; done < size; done += sizeof(block)) {
+        for (size_t i = 0; i < sizeof(block); ++i) {
+            block[i] = name[(done + i) % name_len];
+        }
+        size_t n = size - done < sizeof(block) ? size - done : sizeof(block);
+        memset(block + n, 0, sizeof(block) - n);
+        fwrite(block, sizeof(block), 1, out);
+    }
+}
+
+int main(int argc, char **argv) {
+    long no_entries = 10000;
+    size_dist_t dist = {DIST_UNIFORM, 0, 4096};
+    int depth = 3;
+    int width = 4;
+    double symlink_ratio = 0.05;
+    uint64_t seed = 42;
+    const char *out_path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:d:w:l:r:o:")) != -1) {
+        switch (opt) {
+            case 'n':
+                no_entries = atol(optarg);
+                break;
+            case 's':
+                if (parse_dist(optarg, &dist) != 0) {
+                    fprintf(stderr, "invalid size distribution: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'd':
+                depth = atoi(optarg);
+                break;
+            case 'w':
+                width = atoi(optarg);
+                break;
+            case 'l':
+                symlink_ratio = atof(optarg);
+                break;
+            case 'r':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'o':
+                out_path = optarg;
+                break;
+            default:
+                out_path = NULL;
+                optind = argc;
+                break;
+        }
+    }
+    if (out_path == NULL || no_entries < 0 || depth < 0 || width < 1 || depth * 4 + 12 > NAME_LEN) {
+        fprintf(stderr, "Usage: %s [-n entries] [-s size_dist] [-d depth] [-w width] [-l symlink_ratio] [-r seed] -o out.tar\n", argv[0]);
+        return -1;
+    }
+    rng_state = seed == 0 ? 1 : seed;
+
+    FILE *out = fopen(out_path, "wb");
+    if (out == NULL) {
+        perror("fopen(out)");
+        return -1;
+    }
+
+    // directory tree, breadth first, capped so the files are not spread too thin
+    size_t max_dirs = no_entries / 4 + 1;
+    dir_t *dirs = malloc((max_dirs + 1) * sizeof(dir_t));
+    size_t no_dirs = 1;
+    dirs[0].name[0] = '\0'; // the root
+    dirs[0].depth = 0;
+    for (size_t i = 0; i < no_dirs && no_dirs < max_dirs; ++i) {
+        if (dirs[i].depth == depth) {
+            continue;
+        }
+        dir_t parent = dirs[i];
+        for (int w = 0; w < width && no_dirs < max_dirs; ++w) {
+            dir_t *dir = &dirs[no_dirs++];
+            if (snprintf(dir->name, NAME_LEN, "%sd%d/", parent.name, w) >= NAME_LEN) {
+                fprintf(stderr, "the directory tree is too deep for ustar names\n");
+                return -1;
+            }
+            dir->depth = parent.depth + 1;
+            write_entry(out, dir->name, DIRTYPE, 0, NULL);
+        }
+    }
+
+    // files and symlinks, each in a random directory
+    char (*files)[NAME_LEN] = malloc((no_entries + 1) * sizeof(*files));
+    size_t no_files = 0;
+    for (long i = 0; i < no_entries; ++i) {
+        dir_t *dir = &dirs[next_random() % no_dirs];
+        char name[NAME_LEN];
+
+        if (no_files > 0 && next_uniform() < symlink_ratio) {
+            // half of the links point to a file with a relative path, the others to a directory with an absolute one
+            char target[NAME_LEN * 2];
+            if (next_random() % 2 == 0) {
+                int up = 0;
+                for (int k = 0; k < dir->depth; ++k) {
+                    up += snprintf(target + up, sizeof(target) - up, "../");
+                }
+                snprintf(target + up, sizeof(target) - up, "%s", files[next_random() % no_files]);
+            } else {
+                dir_t *target_dir = &dirs[next_random() % no_dirs];
+                snprintf(target, sizeof(target), "/%s", target_dir->name);
+            }
+            if (strlen(target) >= NAME_LEN) {
+                snprintf(target, sizeof(target), "/%s", files[next_random() % no_files]);
+            }
+            if (snprintf(name, NAME_LEN, "%sl%ld", dir->name, i) >= NAME_LEN) {
+                fprintf(stderr, "the entry names are too long for ustar\n");
+                return -1;
+            }
+            write_entry(out, name, SYMTYPE, 0, target);
+            continue;
+        }
+
+        if (snprintf(name, NAME_LEN, "%sf%ld", dir->name, i) >= NAME_LEN) {
+            fprintf(stderr, "the entry names are too long for ustar\n");
+            return -1;
+        }
+        write_entry(out, name, REGTYPE, next_size(&dist), NULL);
+        strcpy(files[no_files++], name);
+    }
+
+    // two empty blocks, the end of the tarball
+    static uint8_t zeros[1024];
+    fwrite(zeros, sizeof(zeros), 1, out);
+
+    free(files);
+    free(dirs);
+    if (fclose(out) != 0) {
+        perror("fclose(out)");
+        return -1;
+    }
+    return 0;
+}
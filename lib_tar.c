@@ -1,45 +1,102 @@
+#include <errno.h>
+#include <limits.h>
 #include <malloc.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
-#include <libgen.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "lib_tar.h"
+#include "tar_entry.h"
+#include "tar_index.h"
+#include "tar_scan.h"
+#include "tar_send.h"
+#include "tar_simd.h"
+#include "tar_stats.h"
 
 bool is_zeros(const void *buf, size_t size) {
-    for (int i = 0; i < size; i++) {
-        if (*((char *) buf) != 0) {
-            return false;
+    return tar_block_is_zeros(buf, size);
+}
+
+int64_t tar_number(const char *field, size_t len) {
+    const uint8_t *bytes = (const uint8_t *) field;
+    if (len > 0 && (bytes[0] & 0x80)) {
+        if (bytes[0] & 0x40) {
+            return -1; // negative base-256 number
+        }
+        uint64_t value = bytes[0] & 0x3f;
+        for (size_t i = 1; i < len; ++i) {
+            if (value > (INT64_MAX >> 8)) {
+                return -1;
+            }
+            value = value << 8 | bytes[i];
+        }
+        return (int64_t) value;
+    }
+
+    size_t i = 0;
+    while (i < len && field[i] == ' ') {
+        i++;
+    }
+    uint64_t value = 0;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; ++i) {
+        if (value > (INT64_MAX >> 3)) {
+            return -1;
         }
+        value = value << 3 | (field[i] - '0');
     }
-    return true;
+    return (int64_t) value;
 }
 
 bool check_checksum(tar_file_t *tar) {
-    int correct_checksum = TAR_INT(tar->header.chksum);
+    return check_header_checksum(&tar->header);
+}
 
-    // store the raw bytes from the header
-    char header_buf[sizeof(tar_header_t)];
-    memcpy(&header_buf, &tar->header, sizeof(tar_header_t));
+bool check_header_checksum(const tar_header_t *header) {
+    int correct_checksum = TAR_INT(header->chksum);
 
-    // set the header bytes to ASCII spaces, this way we can compute the checksum without the original checksum getting in the way
-    memset((void *) &header_buf[148], ' ', 8);
+    // the sum of the unsigned byte values of the header, with the checksum field counted as ASCII spaces
+    return correct_checksum == (int) tar_header_sum(header);
+}
 
-    int checksum = 0;
-    // get the sum of the unsigned byte values of the header
-    for (int i = 0; i < sizeof(tar_header_t); ++i) {
-        checksum += (unsigned char) header_buf[i];
+void set_header_checksum(tar_header_t *header) {
+    // the sum counts the field as spaces whatever it holds, the largest possible sum (512 * 255) fits in six digits
+    uint32_t sum = tar_header_sum(header);
+    for (int i = 6; i-- > 0;) {
+        header->chksum[i] = (char) ('0' + (sum & 7));
+        sum >>= 3;
     }
+    header->chksum[6] = '\0';
+    header->chksum[7] = ' ';
+}
 
-    return correct_checksum == checksum;
+/**
+ * Reads the 512-byte block at the given offset with pread(), a block cut short by the end of the file is padded with 0s.
+ */
+static void read_block(int tar_fd, off_t offset, tar_header_t *block) {
+    size_t done = 0;
+    while (done < sizeof(tar_header_t)) {
+        ssize_t res = pread(tar_fd, (uint8_t *) block + done, sizeof(tar_header_t) - done, offset + done);
+        TAR_STATS_ADD(read_calls, 1);
+        TAR_STATS_ADD(bytes_read, res > 0 ? res : 0);
+        if (res == -1) {
+            perror("Failed to read header from file");
+            exit(EXIT_FAILURE);
+        }
+        if (res == 0) {
+            memset((uint8_t *) block + done, 0, sizeof(tar_header_t) - done);
+            break;
+        }
+        done += res;
+    }
 }
 
-int check_eof(int tar_fd, tar_file_t *tar) {
+int check_eof(int tar_fd, off_t *offset, tar_file_t *tar) {
     // check to see if the header was full of 0s, if that's the case, check that the next block of length 512 is also 0s, if that's also the case then we reached the end of the tarball
     if (is_zeros((void *) &tar->header, 512)) {
-        if (read(tar_fd, (void *) &tar->header, sizeof(tar_header_t)) == -1) {
-            perror("Failed to read data from file");
-            exit(EXIT_FAILURE);
-        }
+        read_block(tar_fd, *offset, &tar->header);
+        *offset += sizeof(tar_header_t);
         if (is_zeros((void *) &tar->header, 512)) {
             // two empty blocks, this is the end of the tarball
             return 1;
@@ -48,20 +105,34 @@ int check_eof(int tar_fd, tar_file_t *tar) {
     return 0;
 }
 
-int get_header(int tar_fd, tar_file_t *tar) {
+int get_header(int tar_fd, off_t *offset, tar_file_t *tar) {
     // get the header from the file
-    if (read(tar_fd, (void *) &tar->header, sizeof(tar_header_t)) == -1) {
-        perror("Failed to read header from file");
-        exit(EXIT_FAILURE);
-    }
+    read_block(tar_fd, *offset, &tar->header);
+    *offset += sizeof(tar_header_t);
 
-    if (check_eof(tar_fd, tar) == 1) {
+    if (check_eof(tar_fd, offset, tar) == 1) {
         return -1;
     }
 
     return 1;
 }
 
+int check_header(const tar_header_t *header) {
+    if (memcmp(TMAGIC, header->magic, TMAGLEN) != 0) {
+        return -1; // return -1 if the archive contains a header with an invalid magic value
+    }
+
+    if (memcmp(TVERSION, header->version, TVERSLEN) != 0) {
+        return -2; // return -2 if the archive contains a header with an invalid version value
+    }
+
+    if (!check_header_checksum(header)) {
+        return -3; // return -3 when the archive contains a header with an invalid checksum value
+    }
+
+    return 0;
+}
+
 /**
  * Checks whether the archive is valid.
  *
@@ -78,75 +149,268 @@ int get_header(int tar_fd, tar_file_t *tar) {
  *         -3 if the archive contains a header with an invalid checksum value
  */
 int check_archive(int tar_fd) {
-    // get the offset at the start of the function, this way we can go back there once we're done here
-    long start_offset = lseek(tar_fd, 0, SEEK_CUR);
-    lseek(tar_fd, 0, SEEK_SET);
+    TAR_STATS_START(start);
+    tar_scanner_t sc;
+    if (tar_scan_init(&sc, tar_fd, 0) != 0) {
+        perror("Failed to allocate the scan buffer");
+        exit(EXIT_FAILURE);
+    }
 
     int file_count = 0;
+    const tar_header_t *header;
+    off_t header_offset;
+
+    while (tar_scan_next(&sc, &header, &header_offset) > 0) {
+        int res = check_header(header);
+        if (res < 0) {
+            file_count = res;
+            break;
+        }
+        file_count++;
+    }
 
-    for (file_count = 0;; ++file_count) {
-        tar_file_t tar;
+    tar_scan_destroy(&sc);
+    TAR_STATS_END(TAR_STATS_CHECK_ARCHIVE, start);
+    return file_count;
+}
 
-        if (get_header(tar_fd, &tar) < 0) {
-            break; // reached EOF
+typedef struct {
+    int tar_fd;
+    const off_t *offsets;
+    size_t start;
+    size_t end;
+    atomic_size_t *first_bad;     /* index of the first invalid header found so far, shared by all the workers */
+    int error;                    /* error code of the first invalid header of this worker's range */
+} check_worker_t;
+
+static void *check_worker(void *arg) {
+    check_worker_t *worker = arg;
+    worker->error = 0;
+
+    for (size_t i = worker->start; i < worker->end; ++i) {
+        // a header before this one is already known to be invalid, our result can't be the first one anymore
+        if (atomic_load_explicit(worker->first_bad, memory_order_relaxed) < i) {
+            return NULL;
         }
 
-        int file_size = TAR_INT(tar.header.size);
+        tar_header_t header;
+        read_block(worker->tar_fd, worker->offsets[i], &header);
 
-        if (memcmp(TMAGIC, tar.header.magic, TMAGLEN) != 0) {
-            lseek(tar_fd, start_offset, SEEK_SET);
-            return -1; // return -1 if the archive contains a header with an invalid magic value
+        int error = check_header(&header);
+        if (error < 0) {
+            worker->error = error;
+            size_t expected = atomic_load(worker->first_bad);
+            while (i < expected && !atomic_compare_exchange_weak(worker->first_bad, &expected, i)) {
+            }
+            return NULL;
         }
+    }
+    return NULL;
+}
+
+int check_archive_parallel(int tar_fd, int nthreads) {
+    if (nthreads <= 1) {
+        return check_archive(tar_fd);
+    }
 
-        if (memcmp(TVERSION, tar.header.version, TVERSLEN) != 0) {
-            lseek(tar_fd, start_offset, SEEK_SET);
-            return -2; // return -2 if the archive contains a header with an invalid version value
+    // first pass: only follow the sizes to find where every header is
+    tar_scanner_t sc;
+    if (tar_scan_init(&sc, tar_fd, 0) != 0) {
+        perror("Failed to allocate the scan buffer");
+        exit(EXIT_FAILURE);
+    }
+
+    off_t *offsets = NULL;
+    size_t no_headers = 0;
+    size_t capacity = 0;
+    const tar_header_t *header;
+    off_t header_offset;
+    while (tar_scan_next(&sc, &header, &header_offset) > 0) {
+        if (no_headers == capacity) {
+            capacity = capacity == 0 ? 1024 : capacity * 2;
+            off_t *new_offsets = realloc(offsets, capacity * sizeof(off_t));
+            if (new_offsets == NULL) {
+                perror("Failed to allocate the header offsets");
+                exit(EXIT_FAILURE);
+            }
+            offsets = new_offsets;
         }
+        offsets[no_headers++] = header_offset;
+    }
+    tar_scan_destroy(&sc);
+
+    if ((size_t) nthreads > no_headers) {
+        nthreads = no_headers > 0 ? no_headers : 1;
+    }
 
-        if (!check_checksum(&tar)) {
-            lseek(tar_fd, start_offset, SEEK_SET);
-            return -3; // return -3 when the archive contains a header with an invalid checksum value
+    // second pass: every worker validates a contiguous range of headers
+    atomic_size_t first_bad = SIZE_MAX;
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+    check_worker_t *workers = malloc(nthreads * sizeof(check_worker_t));
+    if (threads == NULL || workers == NULL) {
+        perror("Failed to allocate the validation threads");
+        exit(EXIT_FAILURE);
+    }
+    for (int t = 0; t < nthreads; ++t) {
+        workers[t].tar_fd = tar_fd;
+        workers[t].offsets = offsets;
+        workers[t].start = no_headers * t / nthreads;
+        workers[t].end = no_headers * (t + 1) / nthreads;
+        workers[t].first_bad = &first_bad;
+        if (pthread_create(&threads[t], NULL, check_worker, &workers[t]) != 0) {
+            perror("Failed to create a validation thread");
+            exit(EXIT_FAILURE);
         }
+    }
 
-        int padding = (512 - file_size % 512) % 512;
+    int res = no_headers > INT_MAX ? INT_MAX : (int) no_headers;
+    for (int t = 0; t < nthreads; ++t) {
+        pthread_join(threads[t], NULL);
+    }
 
-        lseek(tar_fd, file_size + padding, SEEK_CUR);
+    // the ranges are in archive order, so the first worker with an error holds the first invalid header
+    for (int t = 0; t < nthreads; ++t) {
+        if (workers[t].error < 0) {
+            res = workers[t].error;
+            break;
+        }
     }
 
-    lseek(tar_fd, start_offset, SEEK_SET); // reset the fd to the offset we read at the start of the function
-    return file_count;
+    free(workers);
+    free(threads);
+    free(offsets);
+    return res;
 }
 
-int check_file_type(int tar_fd, char *path, char typeflag) {
-    // get the offset at the start of the function, this way we can go back there after we're done here
-    long start_offset = lseek(tar_fd, 0, SEEK_CUR);
-    lseek(tar_fd, 0, SEEK_SET);
+/* An index kept between the calls on the same archive, see lib_tar.h */
+typedef struct {
+    tar_index_t *idx;             /* NULL if the slot is free */
+    int tar_fd;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    unsigned refs;                /* calls using the index right now, it is only replaced when there are none */
+    bool dropped;                 /* cleared while in use, freed by the last call using it */
+    uint64_t last_use;
+} cached_index_t;
+
+static cached_index_t index_cache[TAR_INDEX_CACHE_SIZE];
+static uint64_t cache_clock;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool same_archive(const cached_index_t *c, int tar_fd, const struct stat *st) {
+    return c->idx != NULL && !c->dropped && c->tar_fd == tar_fd && c->dev == st->st_dev && c->ino == st->st_ino
+           && c->size == st->st_size && c->mtime.tv_sec == st->st_mtim.tv_sec
+           && c->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
 
-    tar_file_t tar;
-    while (get_header(tar_fd, &tar) >= 0) {
+/**
+ * Gets the index of an archive for one call, from the cache when the descriptor still names the same unchanged file,
+ * by scanning the archive otherwise. The index is built outside of the lock, so calls on other archives go on.
+ *
+ * @return the index, to be given back to release_index(), or NULL if it could not be allocated.
+ */
+static tar_index_t *acquire_index(int tar_fd) {
+    struct stat st;
+    if (fstat(tar_fd, &st) != 0) {
+        return tar_index_build(tar_fd); // not cached, the scan reports the error the usual way
+    }
 
-        int file_size = TAR_INT(tar.header.size);
-        lseek(tar_fd, file_size, SEEK_CUR);
+    pthread_mutex_lock(&cache_lock);
+    for (size_t i = 0; i < TAR_INDEX_CACHE_SIZE; ++i) {
+        if (same_archive(&index_cache[i], tar_fd, &st)) {
+            index_cache[i].refs++;
+            index_cache[i].last_use = ++cache_clock;
+            tar_index_t *idx = index_cache[i].idx;
+            pthread_mutex_unlock(&cache_lock);
+            return idx;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
 
-        // compare the filename with the path
-        if (strncmp(tar.header.name, path, strlen(path)) != 0) {
-            int padding = (512 - file_size % 512) % 512;
-            lseek(tar_fd, padding, SEEK_CUR);
-            continue;
+    tar_index_t *idx = tar_index_build(tar_fd);
+    if (idx == NULL) {
+        return NULL;
+    }
+
+    // take the least recently used slot nobody is using, the index stays private to this call if there is none
+    pthread_mutex_lock(&cache_lock);
+    cached_index_t *slot = NULL;
+    bool present = false;
+    for (size_t i = 0; i < TAR_INDEX_CACHE_SIZE && !present; ++i) {
+        cached_index_t *c = &index_cache[i];
+        present = same_archive(c, tar_fd, &st); // another thread built it meanwhile
+        if (c->refs == 0 && (slot == NULL || (slot->idx != NULL && (c->idx == NULL || c->last_use < slot->last_use)))) {
+            slot = c;
         }
+    }
+    if (slot != NULL && !present) {
+        tar_index_free(slot->idx);
+        slot->idx = idx;
+        slot->tar_fd = tar_fd;
+        slot->dev = st.st_dev;
+        slot->ino = st.st_ino;
+        slot->size = st.st_size;
+        slot->mtime = st.st_mtim;
+        slot->refs = 1;
+        slot->dropped = false;
+        slot->last_use = ++cache_clock;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return idx;
+}
+
+static void release_index(tar_index_t *idx) {
+    pthread_mutex_lock(&cache_lock);
+    for (size_t i = 0; i < TAR_INDEX_CACHE_SIZE; ++i) {
+        cached_index_t *c = &index_cache[i];
+        if (c->idx == idx) {
+            c->refs--;
+            if (c->refs == 0 && c->dropped) {
+                c->idx = NULL;
+                c->dropped = false;
+                break;
+            }
+            pthread_mutex_unlock(&cache_lock);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    tar_index_free(idx);
+}
 
-        // checks the header typeflag with the typeflag passed in as arg, and if the argument typeflag is REGTYPE, then we also want to check if the file perhaps has the old regular type AREGTYPE
-        if (tar.header.typeflag == typeflag || (typeflag == REGTYPE && tar.header.typeflag == AREGTYPE)) {
-            lseek(tar_fd, start_offset, SEEK_SET);
-            return 1; // success, we found the file, and it is the correct type
+void tar_index_cache_clear(int tar_fd) {
+    pthread_mutex_lock(&cache_lock);
+    for (size_t i = 0; i < TAR_INDEX_CACHE_SIZE; ++i) {
+        cached_index_t *c = &index_cache[i];
+        if (c->idx == NULL || (tar_fd != -1 && c->tar_fd != tar_fd)) {
+            continue;
+        }
+        if (c->refs > 0) {
+            c->dropped = true;
         } else {
-            lseek(tar_fd, start_offset, SEEK_SET);
-            return 0; // we found the file, but it is not the correct type
+            tar_index_free(c->idx);
+            c->idx = NULL;
         }
     }
-    lseek(tar_fd, start_offset, SEEK_SET);
+    pthread_mutex_unlock(&cache_lock);
+}
 
-    return 0;
+/* Releases the cached indexes when the program exits, so that leak checkers only report real leaks */
+__attribute__((destructor))
+static void clear_index_cache(void) {
+    tar_index_cache_clear(-1);
+}
+
+int check_file_type(int tar_fd, char *path, char typeflag) {
+    int res = 0;
+    tar_index_t *idx = acquire_index(tar_fd);
+    if (idx != NULL) {
+        res = tar_index_check_file_type(idx, path, typeflag);
+        release_index(idx);
+    }
+    return res;
 }
 
 /**
@@ -159,25 +423,15 @@ int check_file_type(int tar_fd, char *path, char typeflag) {
  *         any other value otherwise.
  */
 int exists(int tar_fd, char *path) {
-    // get the offset at the start of the function, this way we can go back there after we're done here
-    long start_offset = lseek(tar_fd, 0, SEEK_CUR);
-    lseek(tar_fd, 0, SEEK_SET);
-
-    tar_file_t tar;
-    while (get_header(tar_fd, &tar) >= 0) {
-        // Check if current file have the same name as path
-        if (strncmp(tar.header.name, path, strlen(path)) == 0) {
-            lseek(tar_fd, start_offset, SEEK_SET); // Back to start of file
-            return 1;
-        }
-
-        // Go to the next file
-        int file_size = TAR_INT(tar.header.size);
-        int padding = (512 - file_size % 512) % 512;
-        lseek(tar_fd, file_size + padding, SEEK_CUR);
+    TAR_STATS_START(start);
+    int res = 0;
+    tar_index_t *idx = acquire_index(tar_fd);
+    if (idx != NULL) {
+        res = tar_index_exists(idx, path);
+        release_index(idx);
     }
-    lseek(tar_fd, start_offset, SEEK_SET);
-    return 0;
+    TAR_STATS_END(TAR_STATS_EXISTS, start);
+    return res;
 }
 
 /**
@@ -190,7 +444,10 @@ int exists(int tar_fd, char *path) {
  *         any other value otherwise.
  */
 int is_dir(int tar_fd, char *path) {
-    return check_file_type(tar_fd, path, DIRTYPE);
+    TAR_STATS_START(start);
+    int res = check_file_type(tar_fd, path, DIRTYPE);
+    TAR_STATS_END(TAR_STATS_IS_DIR, start);
+    return res;
 }
 
 /**
@@ -203,7 +460,10 @@ int is_dir(int tar_fd, char *path) {
  *         any other value otherwise.
  */
 int is_file(int tar_fd, char *path) {
-    return check_file_type(tar_fd, path, REGTYPE);
+    TAR_STATS_START(start);
+    int res = check_file_type(tar_fd, path, REGTYPE);
+    TAR_STATS_END(TAR_STATS_IS_FILE, start);
+    return res;
 }
 
 /**
@@ -215,8 +475,10 @@ int is_file(int tar_fd, char *path) {
  *         any other value otherwise.
  */
 int is_symlink(int tar_fd, char *path) {
-    
-    return check_file_type(tar_fd, path, SYMTYPE);
+    TAR_STATS_START(start);
+    int res = check_file_type(tar_fd, path, SYMTYPE);
+    TAR_STATS_END(TAR_STATS_IS_SYMLINK, start);
+    return res;
 }
 
 
@@ -243,65 +505,17 @@ int is_symlink(int tar_fd, char *path) {
  *         any other value otherwise.
  */
 int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
-    long start_offset = lseek(tar_fd, 0, SEEK_CUR);
-    lseek(tar_fd, 0, SEEK_SET);
-
-    int current = 0;
-    tar_file_t tar;
-    while (current < *no_entries && get_header(tar_fd, &tar) >= 0) {
-
-        if (
-                // check the path with the name
-                (strncmp(path, tar.header.name, strlen(path)) == 0)
-                // check if it's a link
-                && (tar.header.typeflag == SYMTYPE || tar.header.typeflag == LNKTYPE)
-                // and also check that the linked item is a directory
-                && (is_dir(tar_fd, tar.header.linkname) != 0)
-                ) {
-
-            printf("linked directory: %s\n", tar.header.linkname);
-
-            size_t linked_name_len = strlen(tar.header.linkname) + 2;
-            char linkedname[linked_name_len];
-            snprintf(linkedname, linked_name_len, "%s/", tar.header.linkname);
-
-            lseek(tar_fd, start_offset, SEEK_SET);
-            return list(tar_fd, linkedname, entries, no_entries);
-        }
-
-        char *dnamedup = strdup(tar.header.name);
-        // get the directory of this file
-        char *dirname_file = dirname(dnamedup);
-
-        // if path is "" we replace it with "." to allow us to compare this with dirname_file
-        char *path_to_search = strdup(path);
-        if (strcmp(path_to_search, "") == 0) {
-            strcpy(path_to_search, ".");
-        }
-
-        if (
-            // check that the base directory is the same
-                (strncmp(dirname_file, path_to_search, strlen(path_to_search) - 1) == 0)
-                // check that the filename is not just the directory that we are listing
-                && (strncmp(path, tar.header.name, strlen(tar.header.name)) < 0)
-                // check that the directory for the path is the same as the directory for the filename
-                && (strncmp(path_to_search, dirname_file, strlen(dirname_file)) == 0)
-                ) {
-
-            strncpy(entries[current++], tar.header.name, strlen(tar.header.name));
-        }
-
-        free(dnamedup);
-        free(path_to_search);
-
-        int file_size = TAR_INT(tar.header.size);
-        int padding = (512 - file_size % 512) % 512;
-        lseek(tar_fd, file_size + padding, SEEK_CUR);
+    TAR_STATS_START(start);
+    int res = 0;
+    tar_index_t *idx = acquire_index(tar_fd);
+    if (idx == NULL) {
+        *no_entries = 0;
+    } else {
+        res = tar_index_list(idx, path, entries, no_entries);
+        release_index(idx);
     }
-
-    lseek(tar_fd, start_offset, SEEK_SET);
-    *no_entries = current;
-    return current;
+    TAR_STATS_END(TAR_STATS_LIST, start);
+    return res;
 }
 
 
@@ -324,87 +538,46 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
  *
  */
 ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len) {
-    lseek(tar_fd, 0, SEEK_SET);
-
-    while (true) {
-
-        tar_file_t tar;
-        if (get_header(tar_fd, &tar) < 0) {
-            break;
-        }
-        int file_size = TAR_INT(tar.header.size);
-
-        if (strncmp(path, tar.header.name, strlen(path)) == 0) {
-            if (tar.header.typeflag != REGTYPE && tar.header.typeflag != AREGTYPE && tar.header.typeflag != LNKTYPE && tar.header.typeflag != SYMTYPE) {
-                return -1;
-            }
-
-            // handle symbolic links
-            if (tar.header.typeflag == SYMTYPE) {
-
-                // WARNING: this is the only thing that works on iniginous because the tests assume that the link and the linked-to files are in the root directory
-//                lseek(tar_fd, 0, SEEK_SET);
-//                return read_file(tar_fd, tar.header.linkname, offset, dest, len);
-
-                char *linkedname_dup = strdup(tar.header.linkname);
-                char *dirname_linkedname = dirname(linkedname_dup);
-
-                printf("linked file: %s -> %s\n", tar.header.name, tar.header.linkname);
-
-                // if the linked file is in the same directory as the linked-to file, then we have to add the full directory in front of the linked file's name
-                // WARNING: while this is correct, it doesn't work on inginious for the reasons explained a few lines above
-                if (strcmp(dirname_linkedname, ".") == 0) {
-                    free(linkedname_dup);
-
-                    // duplicate the current filename and get the directory
-                    char *dnamedup = strdup(tar.header.name);
-                    char *dirname_file = dirname(dnamedup);
-
-                    size_t file_path_len = strlen(dirname_file) + 1 + strlen(tar.header.linkname) + 1;
-                    char linked_file_path[file_path_len];
-                    // create a new filepath with the filename
-                    snprintf(linked_file_path, file_path_len, "%s/%s", dirname_file, tar.header.linkname);
-                    free(dnamedup);
-
-                    printf("resolving a linked file: %s -> %s\n", tar.header.name, linked_file_path);
-
-                    // resolve the linked file
-                    lseek(tar_fd, 0, SEEK_SET);
-                    return read_file(tar_fd, linked_file_path, offset, dest, len);
-                } else {
-                    free(linkedname_dup);
-                    lseek(tar_fd, 0, SEEK_SET);
-                    return read_file(tar_fd, tar.header.linkname, offset, dest, len);
-                }
-
-            }
-
-            if (offset > file_size) {
-                return -2;
-            }
-
-            lseek(tar_fd, offset, SEEK_CUR);
-
-            printf("filesize: %d, offset: %zu, filesize-offset = %zu\n", file_size, offset, file_size - offset);
-
-            if (*len > file_size - offset) {
-                *len = file_size - offset;
-            }
-
-            int res = read(tar_fd, (void *) dest, *len);
-            if (res == -1) {
-                perror("Failed to read from file");
-                exit(EXIT_FAILURE);
-            }
-
-            *len = res;
+    TAR_STATS_START(start);
+    ssize_t res = -1;
+    tar_index_t *idx = acquire_index(tar_fd);
+    if (idx != NULL) {
+        res = tar_index_read_file(idx, path, offset, dest, len);
+        release_index(idx);
+    }
+    TAR_STATS_END(TAR_STATS_READ_FILE, start);
+    return res;
+}
 
-            return (ssize_t) (file_size - res - offset);
-        }
+ssize_t read_files(int tar_fd, const tar_read_req_t *reqs, size_t n) {
+    tar_index_t *idx = acquire_index(tar_fd);
+    if (idx == NULL) {
+        return -1;
+    }
+    ssize_t res = tar_index_read_files(idx, reqs, n);
+    release_index(idx);
+    return res;
+}
 
-        int padding = (512 - file_size % 512) % 512;
-        lseek(tar_fd, file_size + padding, SEEK_CUR); // we have to add file_size to the padding since we didn't read the data for this file
+ssize_t tar_send_entry(int tar_fd, char *path, int out_fd, size_t offset, size_t len) {
+    tar_index_t *idx = acquire_index(tar_fd);
+    if (idx == NULL) {
+        return -1;
     }
+    ssize_t res = tar_index_send_entry(idx, tar_fd, path, out_fd, offset, len);
+    release_index(idx);
+    return res;
+}
 
-    return -1;
+tar_entry_t *tar_entry_open(int tar_fd, char *path) {
+    tar_index_t *idx = acquire_index(tar_fd);
+    if (idx == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    tar_entry_t *e = tar_index_entry_open(idx, tar_fd, path);
+    int err = errno;
+    release_index(idx);
+    errno = err;
+    return e;
 }
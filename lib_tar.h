@@ -38,10 +38,54 @@ typedef struct posix_header
 #define LNKTYPE  '1'            /* link */
 #define SYMTYPE  '2'            /* reserved */
 #define DIRTYPE  '5'            /* directory */
+#define XHDTYPE  'x'            /* PAX extended header for the next member */
+#define XGLTYPE  'g'            /* PAX global extended header */
+#define GNUTYPE_LONGNAME 'L'    /* GNU long name of the next member */
+#define GNUTYPE_LONGLINK 'K'    /* GNU long link target of the next member */
 
 /* Converts an ASCII-encoded octal-based number into a regular integer */
 #define TAR_INT(char_ptr) strtol(char_ptr, NULL, 8)
 
+/**
+ * Converts a numeric header field into a 64-bit integer, reading at most len bytes.
+ * The field is either ASCII-encoded octal, or a big-endian base-256 number when the high bit of its first byte is
+ * set, which GNU and star use for sizes of 8 GiB and more.
+ *
+ * @return the value, or -1 if it is negative or does not fit in 63 bits.
+ */
+int64_t tar_number(const char *field, size_t len);
+
+/* Size field of a header as a 64-bit integer, -1 if it is invalid */
+#define TAR_SIZE(header) tar_number((header)->size, sizeof((header)->size))
+
+/*
+ * Every function of the library reads the archive with positional I/O (pread) and never moves the file offset of
+ * the descriptor it is given, so the functions below are safe to call concurrently from several threads on one
+ * descriptor, and the caller's offset is left untouched.
+ *
+ * The queries below index the whole archive on their first call on a descriptor, then keep the index for the next
+ * calls as long as the descriptor names the same file with the same size and modification time (fstat()), so only the
+ * first call scans the archive. Up to TAR_INDEX_CACHE_SIZE archives are kept, the least recently used one is dropped,
+ * and tar_index_cache_clear() drops them on demand.
+ * The check can't see an archive rewritten in place to the same size within one tick of the file system's clock,
+ * which is coarse on some file systems: a program that rewrites an archive while querying it clears its index after
+ * each rewrite. Callers that manage their own index use the tar_index_* functions of tar_index.h instead, and
+ * building with TAR_INDEX_CACHE_SIZE set to zero turns the cache off.
+ */
+
+/* Number of archives whose index the queries keep between calls */
+#ifndef TAR_INDEX_CACHE_SIZE
+#define TAR_INDEX_CACHE_SIZE 8
+#endif
+
+/**
+ * Drops the indexes the queries keep between calls, for instance before closing a descriptor that won't be queried
+ * again, or after rewriting an archive in place. An index in use by a call is freed when the call returns.
+ *
+ * @param tar_fd The descriptor whose index is dropped, -1 drops them all.
+ */
+void tar_index_cache_clear(int tar_fd);
+
 typedef struct {
     tar_header_t header;
     uint8_t *block;
@@ -51,9 +95,35 @@ bool is_zeros(const void *buf, size_t size);
 
 bool check_checksum(tar_file_t *tar);
 
-int check_eof(int tar_fd, tar_file_t *tar);
+bool check_header_checksum(const tar_header_t *header);
+
+/**
+ * Stores the checksum of a header in its chksum field, as six octal digits, a NUL and a space: the inverse of
+ * check_header_checksum(), once every other field is set.
+ */
+void set_header_checksum(tar_header_t *header);
 
-int get_header(int tar_fd, tar_file_t *tar);
+/**
+ * Checks the magic value, the version and the checksum of a non-null header, in that order.
+ *
+ * @return zero if the header is valid, or the check_archive() error code of the first check that failed.
+ */
+int check_header(const tar_header_t *header);
+
+/**
+ * Checks whether the header just read is the first of the two empty blocks that end the archive.
+ * If it is empty, the next block is read at *offset into tar->header, and *offset is moved past it.
+ *
+ * @return 1 if the end of the archive is reached, zero otherwise.
+ */
+int check_eof(int tar_fd, off_t *offset, tar_file_t *tar);
+
+/**
+ * Reads the header at *offset with pread() and moves *offset past it (and past the end-of-archive check).
+ *
+ * @return -1 if the end of the archive is reached, 1 otherwise.
+ */
+int get_header(int tar_fd, off_t *offset, tar_file_t *tar);
 
 int check_file_type(int tar_fd, char *path, char typeflag);
 
@@ -74,6 +144,19 @@ int check_file_type(int tar_fd, char *path, char typeflag);
  */
 int check_archive(int tar_fd);
 
+/**
+ * Checks whether the archive is valid, like check_archive(), using several threads.
+ *
+ * The header offsets are found in one sequential pass, then the magic, version and checksum checks are split across
+ * the threads, which read the headers with pread().
+ *
+ * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ * @param nthreads The number of threads to validate the headers with, 1 or less behaves exactly like check_archive().
+ *
+ * @return the same value as check_archive(), the error code being the one of the first invalid header in archive order.
+ */
+int check_archive_parallel(int tar_fd, int nthreads);
+
 /**
  * Checks whether an entry exists in the archive.
  *
@@ -163,4 +246,47 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries);
  */
 ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len);
 
+/* One read of a batch, see read_files() */
+typedef struct {
+    char *path;                   /* path of the file to read, links are resolved as read_file() does */
+    size_t offset;                /* offset in the file from which to start reading */
+    uint8_t *dest;                /* destination buffer */
+    size_t *len;                  /* in-out: the size of dest, then the number of bytes written to it */
+    ssize_t *result;              /* set to the value read_file() would return for this read */
+} tar_read_req_t;
+
+/**
+ * Reads several files of the archive at once.
+ * All the paths are resolved with a single scan, the reads are sorted by their offset in the archive, and reads that
+ * are adjacent or close to each other are merged into one preadv() call, so the archive is read mostly sequentially.
+ * Each read gets the same result as a read_file() call with the same arguments.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param reqs The reads to do, in any order. The ranges of dest must not overlap.
+ * @param n The number of reads.
+ *
+ * @return the number of reads with a zero or positive result,
+ *         -1 if the index of the archive could not be allocated, in which case no result is set.
+ */
+ssize_t read_files(int tar_fd, const tar_read_req_t *reqs, size_t n);
+
+/**
+ * Sends a byte range of a file of the archive to another descriptor, such as a socket or a pipe, without copying it
+ * through user space: the data goes out with sendfile(), or splice() when the output is a pipe, in chunks of at most
+ * TAR_SEND_CHUNK bytes. Descriptors neither call supports get a read()/write() loop instead.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive to send.  If the entry is a symlink, it is resolved as read_file() does.
+ * @param out_fd The descriptor to write to, at its current position. It may be non-blocking.
+ * @param offset An offset in the file from which to start sending, for instance the start of an HTTP range.
+ * @param len The number of bytes to send, zero or more than what is left in the file sending up to its end.
+ *
+ * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the offset is outside the file total length,
+ *         -3 with errno set if nothing could be written to out_fd (EAGAIN for a full non-blocking descriptor, EPIPE),
+ *         the number of bytes sent otherwise, which is less than asked for if out_fd stopped accepting data on the
+ *         way or if the archive is truncated.
+ */
+ssize_t tar_send_entry(int tar_fd, char *path, int out_fd, size_t offset, size_t len);
+
 #endif
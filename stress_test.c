@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "lib_tar.h"
+
+/**
+ * Calls exists(), list() and read_file() from many threads on one shared descriptor, while another thread keeps
+ * moving its file offset around, and checks every result against the single-threaded output.
+ */
+
+#define MAX_PATHS 4096
+#define MAX_ENTRIES 256
+#define ENTRY_LEN 512
+#define READ_CHUNK 4096
+#define NO_THREADS 16
+#define NO_ROUNDS 200
+
+typedef struct {
+    int exists;
+    int list_res;
+    size_t no_entries;
+    uint64_t list_hash;
+    ssize_t read_res;
+    size_t read_len;
+    uint64_t read_hash;
+} expected_t;
+
+static int tar_fd;
+static char *paths[MAX_PATHS];
+static size_t no_paths = 0;
+static expected_t expected[MAX_PATHS];
+static volatile int stop_seeking = 0;
+
+static uint64_t fnv1a(uint64_t hash, const void *buf, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= ((const uint8_t *) buf)[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static char **alloc_entries(void) {
+    char **entries = malloc(MAX_ENTRIES * sizeof(char *));
+    for (int i = 0; i < MAX_ENTRIES; ++i) {
+        entries[i] = calloc(ENTRY_LEN, sizeof(char));
+    }
+    return entries;
+}
+
+static void free_entries(char **entries) {
+    for (int i = 0; i < MAX_ENTRIES; ++i) {
+        free(entries[i]);
+    }
+    free(entries);
+}
+
+/* Collects every path reachable from the root with list(), recursing into directories */
+static void collect_paths(char *dir, char **entries) {
+    size_t no_entries = MAX_ENTRIES;
+    if (list(tar_fd, dir, entries, &no_entries) == 0) {
+        return;
+    }
+
+    size_t first = no_paths;
+    for (size_t i = 0; i < no_entries && no_paths < MAX_PATHS; ++i) {
+        paths[no_paths++] = strdup(entries[i]);
+    }
+    size_t last = no_paths;
+    for (size_t i = first; i < last; ++i) {
+        if (is_dir(tar_fd, paths[i])) {
+            collect_paths(paths[i], entries);
+        }
+    }
+}
+
+static void query(char *path, char **entries, uint8_t *buf, expected_t *out) {
+    out->exists = exists(tar_fd, path);
+
+    out->no_entries = MAX_ENTRIES;
+    out->list_res = list(tar_fd, path, entries, &out->no_entries);
+    out->list_hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < out->no_entries; ++i) {
+        out->list_hash = fnv1a(out->list_hash, entries[i], strlen(entries[i]) + 1);
+    }
+
+    // read the whole file chunk by chunk, hashing what was read
+    out->read_hash = 14695981039346656037ULL;
+    out->read_len = 0;
+    while (true) {
+        size_t len = READ_CHUNK;
+        out->read_res = read_file(tar_fd, path, out->read_len, buf, &len);
+        if (out->read_res < 0) {
+            break;
+        }
+        out->read_hash = fnv1a(out->read_hash, buf, len);
+        out->read_len += len;
+        if (out->read_res == 0) {
+            break;
+        }
+    }
+}
+
+static void *query_worker(void *arg) {
+    unsigned int seed = (unsigned int) (uintptr_t) arg;
+    char **entries = alloc_entries();
+    uint8_t *buf = malloc(READ_CHUNK);
+    long mismatches = 0;
+
+    for (int r = 0; r < NO_ROUNDS; ++r) {
+        size_t i = rand_r(&seed) % no_paths;
+        expected_t got;
+        query(paths[i], entries, buf, &got);
+        if (memcmp(&got, &expected[i], sizeof(expected_t)) != 0) {
+            fprintf(stderr, "mismatch on %s\n", paths[i]);
+            mismatches++;
+        }
+    }
+
+    free(buf);
+    free_entries(entries);
+    return (void *) mismatches;
+}
+
+static void *seek_worker(void *arg) {
+    unsigned int seed = 1;
+    while (!stop_seeking) {
+        lseek(tar_fd, rand_r(&seed) % 65536, SEEK_SET);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf("Usage: %s tar_file\n", argv[0]);
+        return -1;
+    }
+
+    tar_fd = open(argv[1], O_RDONLY);
+    if (tar_fd == -1) {
+        perror("open(tar_file)");
+        return -1;
+    }
+
+    char **entries = alloc_entries();
+    uint8_t *buf = malloc(READ_CHUNK);
+
+    collect_paths("", entries);
+    if (no_paths == 0) {
+        printf("no entries to query in %s\n", argv[1]);
+        return -1;
+    }
+    // also query a path that doesn't exist and one that is only a prefix of an entry
+    paths[no_paths++] = strdup("does/not/exist");
+    paths[no_paths++] = strndup(paths[0], 1);
+
+    memset(expected, 0, sizeof(expected));
+    for (size_t i = 0; i < no_paths; ++i) {
+        query(paths[i], entries, buf, &expected[i]);
+    }
+
+    pthread_t seeker;
+    pthread_t threads[NO_THREADS];
+    pthread_create(&seeker, NULL, seek_worker, NULL);
+    for (int t = 0; t < NO_THREADS; ++t) {
+        pthread_create(&threads[t], NULL, query_worker, (void *) (uintptr_t) (t + 1));
+    }
+
+    long mismatches = 0;
+    for (int t = 0; t < NO_THREADS; ++t) {
+        void *res;
+        pthread_join(threads[t], &res);
+        mismatches += (long) res;
+    }
+    stop_seeking = 1;
+    pthread_join(seeker, NULL);
+
+    printf("%zu paths, %d threads x %d rounds: %ld mismatches\n", no_paths, NO_THREADS, NO_ROUNDS, mismatches);
+
+    for (size_t i = 0; i < no_paths; ++i) {
+        free(paths[i]);
+    }
+    free(buf);
+    free_entries(entries);
+    close(tar_fd);
+    return mismatches == 0 ? 0 : 1;
+}
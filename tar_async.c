@@ -0,0 +1,480 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "tar_async.h"
+
+/* A read, from its submission to its callback */
+typedef struct async_req {
+    struct async_req *next;
+    uint8_t *buf;
+    size_t len;                   /* number of bytes to read */
+    size_t done;                  /* number of bytes read so far */
+    uint64_t offset;              /* offset in the archive of the first byte to read */
+    ssize_t result;               /* read_file() result if nothing is read, the bytes read are taken off at the end */
+    tar_async_cb_t callback;
+    void *arg;
+    struct iovec iov;             /* what is left to read, given to the ring */
+} async_req_t;
+
+typedef struct {
+    async_req_t *head;
+    async_req_t *tail;
+} req_queue_t;
+
+struct tar_async {
+    int tar_fd;
+    tar_index_t *idx;
+    bool own_idx;
+    unsigned depth;
+
+    req_queue_t pending;          // reads not handed to the ring or a worker yet
+    req_queue_t completed;        // reads waiting for their callback, shared with the workers
+    size_t outstanding;           // reads submitted whose data is not read yet
+    pthread_mutex_t lock;         // protects completed, and pending and outstanding for the thread pool
+
+    // io_uring backend
+    bool uring;
+    int ring_fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned in_ring;             // reads submitted to the ring and not reaped yet
+    unsigned to_submit;           // entries queued in the submission ring but not passed to the kernel yet
+
+    // thread pool backend
+    pthread_t threads[TAR_ASYNC_THREADS];
+    int no_threads;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    bool stopping;
+};
+
+static void push(req_queue_t *queue, async_req_t *req) {
+    req->next = NULL;
+    if (queue->tail == NULL) {
+        queue->head = req;
+    } else {
+        queue->tail->next = req;
+    }
+    queue->tail = req;
+}
+
+static void push_front(req_queue_t *queue, async_req_t *req) {
+    req->next = queue->head;
+    queue->head = req;
+    if (queue->tail == NULL) {
+        queue->tail = req;
+    }
+}
+
+static async_req_t *pop(req_queue_t *queue) {
+    async_req_t *req = queue->head;
+    if (req != NULL) {
+        queue->head = req->next;
+        if (queue->head == NULL) {
+            queue->tail = NULL;
+        }
+    }
+    return req;
+}
+
+static void free_queue(req_queue_t *queue) {
+    async_req_t *req;
+    while ((req = pop(queue)) != NULL) {
+        free(req);
+    }
+}
+
+/* Hands a read whose data is all read to the callbacks */
+static void complete(tar_async_t *ctx, async_req_t *req) {
+    pthread_mutex_lock(&ctx->lock);
+    push(&ctx->completed, req);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/* Calls the callbacks of the completed reads, which may submit new reads */
+static int run_callbacks(tar_async_t *ctx) {
+    pthread_mutex_lock(&ctx->lock);
+    async_req_t *req = ctx->completed.head;
+    ctx->completed.head = NULL;
+    ctx->completed.tail = NULL;
+    pthread_mutex_unlock(&ctx->lock);
+
+    int count = 0;
+    while (req != NULL) {
+        async_req_t *next = req->next;
+        req->callback(req->arg, req->result - (ssize_t) req->done, req->done);
+        free(req);
+        req = next;
+        count++;
+    }
+    return count;
+}
+
+/* ---- io_uring backend ---- */
+
+static int uring_enter(tar_async_t *ctx, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, ctx->ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/**
+ * Sets up the rings with raw system calls, so that liburing is not needed.
+ *
+ * @return zero on success, -1 if io_uring is not available.
+ */
+static int uring_init(tar_async_t *ctx) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ctx->ring_fd = (int) syscall(__NR_io_uring_setup, ctx->depth, &params);
+    if (ctx->ring_fd < 0) {
+        return -1;
+    }
+
+    ctx->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ctx->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ctx->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ctx->sq_ring = mmap(NULL, ctx->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ctx->ring_fd,
+                        IORING_OFF_SQ_RING);
+    ctx->cq_ring = mmap(NULL, ctx->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ctx->ring_fd,
+                        IORING_OFF_CQ_RING);
+    ctx->sqes = mmap(NULL, ctx->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ctx->ring_fd,
+                     IORING_OFF_SQES);
+    if (ctx->sq_ring == MAP_FAILED || ctx->cq_ring == MAP_FAILED || ctx->sqes == MAP_FAILED) {
+        if (ctx->sq_ring != MAP_FAILED) {
+            munmap(ctx->sq_ring, ctx->sq_ring_size);
+        }
+        if (ctx->cq_ring != MAP_FAILED) {
+            munmap(ctx->cq_ring, ctx->cq_ring_size);
+        }
+        if (ctx->sqes != MAP_FAILED) {
+            munmap(ctx->sqes, ctx->sqes_size);
+        }
+        close(ctx->ring_fd);
+        return -1;
+    }
+
+    uint8_t *sq = ctx->sq_ring;
+    uint8_t *cq = ctx->cq_ring;
+    ctx->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ctx->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ctx->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ctx->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ctx->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ctx->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ctx->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    // the completion ring is at least as large as the submission ring, so it never overflows
+    if (ctx->depth > params.sq_entries) {
+        ctx->depth = params.sq_entries;
+    }
+    ctx->uring = true;
+    return 0;
+}
+
+static void uring_destroy(tar_async_t *ctx) {
+    munmap(ctx->sq_ring, ctx->sq_ring_size);
+    munmap(ctx->cq_ring, ctx->cq_ring_size);
+    munmap(ctx->sqes, ctx->sqes_size);
+    close(ctx->ring_fd);
+}
+
+/* Moves pending reads to the submission ring while there is room, and passes them to the kernel */
+static void uring_submit(tar_async_t *ctx) {
+    async_req_t *req;
+    while (ctx->in_ring < ctx->depth && (req = pop(&ctx->pending)) != NULL) {
+        unsigned tail = *ctx->sq_tail;
+        unsigned index = tail & *ctx->sq_mask;
+        struct io_uring_sqe *sqe = &ctx->sqes[index];
+
+        req->iov.iov_base = req->buf + req->done;
+        req->iov.iov_len = req->len - req->done;
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd = ctx->tar_fd;
+        sqe->addr = (uint64_t) (uintptr_t) &req->iov;
+        sqe->len = 1;
+        sqe->off = req->offset + req->done;
+        sqe->user_data = (uint64_t) (uintptr_t) req;
+        ctx->sq_array[index] = index;
+        __atomic_store_n(ctx->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        ctx->in_ring++;
+        ctx->to_submit++;
+    }
+
+    while (ctx->to_submit > 0) {
+        int res = uring_enter(ctx, ctx->to_submit, 0, 0);
+        if (res < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            perror("Failed to submit reads");
+            exit(EXIT_FAILURE);
+        }
+        ctx->to_submit -= res;
+    }
+}
+
+/**
+ * Takes the completions off the completion ring, waiting for one if asked to and none is there.
+ * Reads cut short are submitted again for the rest of their data.
+ */
+static void uring_reap(tar_async_t *ctx, bool wait) {
+    unsigned head = *ctx->cq_head;
+    if (wait && head == __atomic_load_n(ctx->cq_tail, __ATOMIC_ACQUIRE) && ctx->in_ring > 0) {
+        while (uring_enter(ctx, 0, 1, IORING_ENTER_GETEVENTS) < 0) {
+            if (errno != EINTR) {
+                perror("Failed to wait for reads");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    unsigned tail = __atomic_load_n(ctx->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        struct io_uring_cqe *cqe = &ctx->cqes[head & *ctx->cq_mask];
+        async_req_t *req = (async_req_t *) (uintptr_t) cqe->user_data;
+        int res = cqe->res;
+        ctx->in_ring--;
+
+        if (res == -EINTR || res == -EAGAIN) {
+            push_front(&ctx->pending, req);
+            continue;
+        }
+        if (res < 0) {
+            errno = -res;
+            perror("Failed to read from file");
+            exit(EXIT_FAILURE);
+        }
+        req->done += res;
+        if (res > 0 && req->done < req->len) {
+            push_front(&ctx->pending, req);
+        } else {
+            ctx->outstanding--;
+            complete(ctx, req);
+        }
+    }
+    __atomic_store_n(ctx->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* ---- thread pool backend ---- */
+
+static void *worker(void *arg) {
+    tar_async_t *ctx = arg;
+    pthread_mutex_lock(&ctx->lock);
+    while (true) {
+        while (!ctx->stopping && ctx->pending.head == NULL) {
+            pthread_cond_wait(&ctx->work, &ctx->lock);
+        }
+        if (ctx->stopping) {
+            break;
+        }
+        async_req_t *req = pop(&ctx->pending);
+        pthread_mutex_unlock(&ctx->lock);
+
+        while (req->done < req->len) {
+            ssize_t res = pread(ctx->tar_fd, req->buf + req->done, req->len - req->done, req->offset + req->done);
+            if (res == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("Failed to read from file");
+                exit(EXIT_FAILURE);
+            }
+            if (res == 0) {
+                break;
+            }
+            req->done += res;
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+        push(&ctx->completed, req);
+        ctx->outstanding--;
+        pthread_cond_signal(&ctx->done);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+static int pool_init(tar_async_t *ctx) {
+    if (pthread_cond_init(&ctx->work, NULL) != 0) {
+        return -1;
+    }
+    if (pthread_cond_init(&ctx->done, NULL) != 0) {
+        pthread_cond_destroy(&ctx->work);
+        return -1;
+    }
+    int nthreads = ctx->depth < TAR_ASYNC_THREADS ? (int) ctx->depth : TAR_ASYNC_THREADS;
+    for (ctx->no_threads = 0; ctx->no_threads < nthreads; ctx->no_threads++) {
+        if (pthread_create(&ctx->threads[ctx->no_threads], NULL, worker, ctx) != 0) {
+            break;
+        }
+    }
+    if (ctx->no_threads == 0) {
+        pthread_cond_destroy(&ctx->work);
+        pthread_cond_destroy(&ctx->done);
+        return -1;
+    }
+    return 0;
+}
+
+static void pool_destroy(tar_async_t *ctx) {
+    pthread_mutex_lock(&ctx->lock);
+    ctx->stopping = true;
+    pthread_cond_broadcast(&ctx->work);
+    pthread_mutex_unlock(&ctx->lock);
+    for (int t = 0; t < ctx->no_threads; ++t) {
+        pthread_join(ctx->threads[t], NULL);
+    }
+    pthread_cond_destroy(&ctx->work);
+    pthread_cond_destroy(&ctx->done);
+}
+
+/* ---- public API ---- */
+
+tar_async_t *tar_async_open(int tar_fd, tar_index_t *idx, unsigned depth, int flags) {
+    tar_async_t *ctx = calloc(1, sizeof(tar_async_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    ctx->tar_fd = tar_fd;
+    ctx->depth = depth == 0 ? TAR_ASYNC_DEPTH : depth;
+    ctx->idx = idx;
+    if (ctx->idx == NULL) {
+        ctx->idx = tar_index_build(tar_fd);
+        ctx->own_idx = true;
+        if (ctx->idx == NULL) {
+            free(ctx);
+            return NULL;
+        }
+    }
+    if (pthread_mutex_init(&ctx->lock, NULL) != 0) {
+        goto fail;
+    }
+
+    // io_uring may be missing from the kernel, or forbidden by a seccomp filter
+    if ((flags & TAR_ASYNC_NO_URING) || uring_init(ctx) != 0) {
+        if (pool_init(ctx) != 0) {
+            pthread_mutex_destroy(&ctx->lock);
+            goto fail;
+        }
+    }
+    return ctx;
+
+fail:
+    if (ctx->own_idx) {
+        tar_index_free(ctx->idx);
+    }
+    free(ctx);
+    return NULL;
+}
+
+void tar_async_close(tar_async_t *ctx) {
+    if (ctx == NULL) {
+        return;
+    }
+    if (ctx->uring) {
+        // the kernel may still write to the buffers of the reads in the ring
+        free_queue(&ctx->pending);
+        while (ctx->in_ring > 0) {
+            uring_reap(ctx, true);
+            free_queue(&ctx->pending);
+        }
+        uring_destroy(ctx);
+    } else {
+        pool_destroy(ctx);
+        free_queue(&ctx->pending);
+    }
+    free_queue(&ctx->completed);
+    pthread_mutex_destroy(&ctx->lock);
+    if (ctx->own_idx) {
+        tar_index_free(ctx->idx);
+    }
+    free(ctx);
+}
+
+bool tar_async_uses_uring(const tar_async_t *ctx) {
+    return ctx->uring;
+}
+
+int tar_read_async(tar_async_t *ctx, const char *path, size_t offset, uint8_t *buf, size_t len,
+                   tar_async_cb_t callback, void *arg) {
+    async_req_t *req = calloc(1, sizeof(async_req_t));
+    if (req == NULL) {
+        return -1;
+    }
+    req->buf = buf;
+    req->callback = callback;
+    req->arg = arg;
+
+    // the same results as read_file(), the lookup is done now and only the data read is asynchronous
+    const tar_index_entry_t *entry = tar_index_lookup_file(ctx->idx, path);
+    if (entry == NULL || offset > entry->size) {
+        req->result = entry == NULL ? -1 : -2;
+        complete(ctx, req);
+        return 0;
+    }
+    req->len = len < entry->size - offset ? len : entry->size - offset;
+    req->offset = entry->data_offset + offset;
+    req->result = (ssize_t) (entry->size - offset);
+    if (req->len == 0) {
+        complete(ctx, req);
+        return 0;
+    }
+
+    if (ctx->uring) {
+        push(&ctx->pending, req);
+        ctx->outstanding++;
+        uring_submit(ctx);
+    } else {
+        pthread_mutex_lock(&ctx->lock);
+        push(&ctx->pending, req);
+        ctx->outstanding++;
+        pthread_cond_signal(&ctx->work);
+        pthread_mutex_unlock(&ctx->lock);
+    }
+    return 0;
+}
+
+int tar_poll(tar_async_t *ctx) {
+    if (ctx->uring) {
+        uring_reap(ctx, false);
+        uring_submit(ctx);
+    }
+    return run_callbacks(ctx);
+}
+
+int tar_wait(tar_async_t *ctx) {
+    if (ctx->uring) {
+        uring_reap(ctx, false);
+        while (ctx->completed.head == NULL && ctx->outstanding > 0) {
+            uring_submit(ctx);
+            uring_reap(ctx, true);
+        }
+        uring_submit(ctx);
+    } else {
+        pthread_mutex_lock(&ctx->lock);
+        while (ctx->completed.head == NULL && ctx->outstanding > 0) {
+            pthread_cond_wait(&ctx->done, &ctx->lock);
+        }
+        pthread_mutex_unlock(&ctx->lock);
+    }
+    return run_callbacks(ctx);
+}
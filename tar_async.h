@@ -0,0 +1,91 @@
+#ifndef TAR_ASYNC_H
+#define TAR_ASYNC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "tar_index.h"
+
+/* Number of reads in flight at once when tar_async_open() is given zero */
+#define TAR_ASYNC_DEPTH 256
+
+/* Number of threads of the fallback backend */
+#ifndef TAR_ASYNC_THREADS
+#define TAR_ASYNC_THREADS 8
+#endif
+
+/* tar_async_open() flag: use the thread pool even when io_uring is available */
+#define TAR_ASYNC_NO_URING 1
+
+/**
+ * Called when an asynchronous read completes, from tar_poll() or tar_wait().
+ *
+ * @param arg The argument given to tar_read_async().
+ * @param result The value read_file() would return for this read.
+ * @param len The number of bytes written to the buffer.
+ */
+typedef void (*tar_async_cb_t)(void *arg, ssize_t result, size_t len);
+
+/**
+ * Asynchronous reader of the files of an archive.
+ * Paths are resolved on submission with the index, so only the data reads are asynchronous: they go through an
+ * io_uring, or through a pool of threads calling pread() when io_uring is not available.
+ * A context is not thread-safe, reads are submitted and completed from one thread at a time.
+ */
+typedef struct tar_async tar_async_t;
+
+/**
+ * Creates an asynchronous reader.
+ *
+ * @param tar_fd A file descriptor of an uncompressed archive, which must outlive the reader.
+ * @param idx An index of the archive, built or loaded, which must outlive the reader.
+ *            If NULL, the archive is indexed by the reader itself.
+ * @param depth The maximum number of reads in flight, further reads are queued. Zero selects TAR_ASYNC_DEPTH.
+ * @param flags Zero or TAR_ASYNC_NO_URING.
+ *
+ * @return the reader, or NULL if it could not be allocated.
+ */
+tar_async_t *tar_async_open(int tar_fd, tar_index_t *idx, unsigned depth, int flags);
+
+/**
+ * Releases a reader, after waiting for the reads in flight. The callbacks of reads not completed yet are not called.
+ */
+void tar_async_close(tar_async_t *ctx);
+
+/**
+ * Tells whether a reader uses io_uring or its thread pool.
+ */
+bool tar_async_uses_uring(const tar_async_t *ctx);
+
+/**
+ * Starts reading a file of the archive, like read_file() does.
+ * The callback is called by a later tar_poll() or tar_wait(), even if the path does not name a file.
+ *
+ * @param path A path to an entry in the archive to read from, links are resolved.
+ * @param offset An offset in the file from which to start reading.
+ * @param buf A destination buffer, which must stay valid until the callback is called.
+ * @param len The size of buf.
+ * @param callback Called with arg once the read completes.
+ *
+ * @return zero if the read was started, -1 if it could not be allocated.
+ */
+int tar_read_async(tar_async_t *ctx, const char *path, size_t offset, uint8_t *buf, size_t len,
+                   tar_async_cb_t callback, void *arg);
+
+/**
+ * Calls the callbacks of the reads that completed, without blocking.
+ *
+ * @return the number of callbacks called.
+ */
+int tar_poll(tar_async_t *ctx);
+
+/**
+ * Waits until at least one read completes and calls the callbacks of the reads that completed.
+ *
+ * @return the number of callbacks called, zero if no read was pending.
+ */
+int tar_wait(tar_async_t *ctx);
+
+#endif
@@ -0,0 +1,263 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "tar_client.h"
+#include "tar_daemon.h"
+
+// archive descriptor received by each connection, indexed by the descriptor of the connection, -1 where there is none
+static int *archive_fds;
+static size_t archive_fds_capacity;
+static pthread_mutex_t archive_fds_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Records the archive descriptor of a connection */
+static int set_archive_fd(int tar_fd, int archive_fd) {
+    pthread_mutex_lock(&archive_fds_lock);
+    if ((size_t) tar_fd >= archive_fds_capacity) {
+        size_t capacity = archive_fds_capacity == 0 ? 64 : archive_fds_capacity;
+        while (capacity <= (size_t) tar_fd) {
+            capacity *= 2;
+        }
+        int *fds = realloc(archive_fds, capacity * sizeof(int));
+        if (fds == NULL) {
+            pthread_mutex_unlock(&archive_fds_lock);
+            return -1;
+        }
+        for (size_t i = archive_fds_capacity; i < capacity; i++) {
+            fds[i] = -1;
+        }
+        archive_fds = fds;
+        archive_fds_capacity = capacity;
+    }
+    archive_fds[tar_fd] = archive_fd;
+    pthread_mutex_unlock(&archive_fds_lock);
+    return 0;
+}
+
+static int get_archive_fd(int tar_fd) {
+    pthread_mutex_lock(&archive_fds_lock);
+    int fd = tar_fd >= 0 && (size_t) tar_fd < archive_fds_capacity ? archive_fds[tar_fd] : -1;
+    pthread_mutex_unlock(&archive_fds_lock);
+    return fd;
+}
+
+/* Sends a request and its path, whatever the number of writes it takes */
+static bool send_request(int tar_fd, uint32_t op, const char *path, uint64_t offset, uint64_t len) {
+    size_t path_len = strlen(path);
+    if (path_len > TAR_DAEMON_PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    tar_request_t req = {.op = op, .path_len = path_len, .offset = offset, .len = len};
+    struct iovec iov[2] = {
+        {.iov_base = &req, .iov_len = sizeof(req)},
+        {.iov_base = (void *) path, .iov_len = path_len}
+    };
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+
+    while (msg.msg_iovlen > 0) {
+        ssize_t res = sendmsg(tar_fd, &msg, MSG_NOSIGNAL);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        // skip what went out
+        while (msg.msg_iovlen > 0 && (size_t) res >= msg.msg_iov->iov_len) {
+            res -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (uint8_t *) msg.msg_iov->iov_base + res;
+            msg.msg_iov->iov_len -= res;
+        }
+    }
+    return true;
+}
+
+/**
+ * Receives exactly len bytes.
+ *
+ * @param passed_fd Set to the descriptor the bytes carry, if any. NULL when none is expected.
+ */
+static bool recv_all(int tar_fd, void *buf, size_t len, int *passed_fd) {
+    size_t done = 0;
+    while (done < len) {
+        struct iovec iov = {.iov_base = (uint8_t *) buf + done, .iov_len = len - done};
+        struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+        union {
+            struct cmsghdr header;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+        if (passed_fd != NULL) {
+            msg.msg_control = control.buf;
+            msg.msg_controllen = sizeof(control.buf);
+        }
+
+        ssize_t res = recvmsg(tar_fd, &msg, MSG_CMSG_CLOEXEC);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (res == 0) {
+            errno = ECONNRESET;
+            return false;
+        }
+        if (passed_fd != NULL) {
+            for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                    memcpy(passed_fd, CMSG_DATA(cmsg), sizeof(int));
+                }
+            }
+        }
+        done += res;
+    }
+    return true;
+}
+
+/* Sends a request and receives its response, without the data that follows it */
+static bool query(int tar_fd, uint32_t op, const char *path, uint64_t offset, uint64_t len, tar_response_t *resp) {
+    return send_request(tar_fd, op, path, offset, len) && recv_all(tar_fd, resp, sizeof(*resp), NULL);
+}
+
+int tar_client_open(const char *socket_path, const char *archive_path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    // the daemon knows its archives by their canonical path
+    char *path = realpath(archive_path, NULL);
+    if (path == NULL) {
+        return -1;
+    }
+
+    int tar_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (tar_fd == -1) {
+        free(path);
+        return -1;
+    }
+
+    tar_response_t resp;
+    int archive_fd = -1;
+    bool ok = connect(tar_fd, (struct sockaddr *) &addr, sizeof(addr)) == 0
+              && send_request(tar_fd, TAR_OP_OPEN, path, 0, 0)
+              && recv_all(tar_fd, &resp, sizeof(resp), &archive_fd);
+    free(path);
+    if (ok && (resp.result != 0 || archive_fd == -1)) {
+        ok = false;
+        errno = ENOENT;
+    }
+    if (!ok || set_archive_fd(tar_fd, archive_fd) == -1) {
+        int err = ok ? ENOMEM : errno;
+        if (archive_fd != -1) {
+            close(archive_fd);
+        }
+        close(tar_fd);
+        errno = err;
+        return -1;
+    }
+    return tar_fd;
+}
+
+void tar_client_close(int tar_fd) {
+    int archive_fd = get_archive_fd(tar_fd);
+    if (archive_fd != -1) {
+        set_archive_fd(tar_fd, -1);
+        close(archive_fd);
+    }
+    close(tar_fd);
+}
+
+/* Result of a query answered by a single number */
+static int query_int(int tar_fd, uint32_t op, char *path) {
+    tar_response_t resp;
+    return query(tar_fd, op, path, 0, 0, &resp) ? (int) resp.result : 0;
+}
+
+int tar_client_exists(int tar_fd, char *path) {
+    return query_int(tar_fd, TAR_OP_EXISTS, path);
+}
+
+int tar_client_is_dir(int tar_fd, char *path) {
+    return query_int(tar_fd, TAR_OP_IS_DIR, path);
+}
+
+int tar_client_is_file(int tar_fd, char *path) {
+    return query_int(tar_fd, TAR_OP_IS_FILE, path);
+}
+
+int tar_client_is_symlink(int tar_fd, char *path) {
+    return query_int(tar_fd, TAR_OP_IS_SYMLINK, path);
+}
+
+int tar_client_list(int tar_fd, char *path, char **entries, size_t *no_entries) {
+    tar_response_t resp;
+    if (!query(tar_fd, TAR_OP_LIST, path, 0, *no_entries, &resp)) {
+        *no_entries = 0;
+        return 0;
+    }
+    char *names = malloc(resp.data_len + 1);
+    if (names == NULL || !recv_all(tar_fd, names, resp.data_len, NULL)) {
+        // a response left half read would be taken for the next one
+        shutdown(tar_fd, SHUT_RDWR);
+        free(names);
+        *no_entries = 0;
+        return 0;
+    }
+
+    // the names are NUL-terminated, one after the other
+    size_t current = 0;
+    for (size_t at = 0; current < resp.len && current < *no_entries && at < resp.data_len; current++) {
+        size_t len = strnlen(names + at, resp.data_len - at);
+        memcpy(entries[current], names + at, len);
+        entries[current][len] = '\0';
+        at += len + 1;
+    }
+    free(names);
+
+    *no_entries = current;
+    return (int) resp.result;
+}
+
+ssize_t tar_client_read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len) {
+    tar_response_t resp;
+    int archive_fd = get_archive_fd(tar_fd);
+    if (archive_fd == -1 || !query(tar_fd, TAR_OP_READ_FILE, path, offset, *len, &resp)) {
+        return -1;
+    }
+    if (resp.result < 0) {
+        return resp.result;
+    }
+
+    // a single pread() transfers at most about 2 GiB on Linux, so large reads take several calls
+    size_t done = 0;
+    while (done < resp.len) {
+        ssize_t res = pread(archive_fd, dest + done, resp.len - done, resp.offset + done);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to read from file");
+            exit(EXIT_FAILURE);
+        }
+        if (res == 0) {
+            break;
+        }
+        done += res;
+    }
+
+    *len = done;
+    return (ssize_t) (resp.result + resp.len - done);
+}
@@ -0,0 +1,50 @@
+#ifndef TAR_CLIENT_H
+#define TAR_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Client side of tar_served, for processes too short-lived to amortize indexing an archive themselves: every query
+ * is answered from the index the daemon keeps resident, at the cost of one round trip on a Unix socket.
+ * A connection is opened per archive, and the descriptor it returns stands for the archive in the functions below,
+ * which take the same arguments and return the same values as their lib_tar.h counterparts.
+ * File data does not go through the socket: the daemon passes a descriptor of the archive when the connection is
+ * opened, and tar_client_read_file() reads the range the daemon answers with straight from it.
+ * A connection carries one request at a time, threads querying the same archive at once should open one each.
+ */
+
+/**
+ * Connects to a daemon and binds the connection to one of the archives it serves.
+ *
+ * @param socket_path The path the daemon listens on.
+ * @param archive_path The path of the archive, as given to the daemon or any other path to the same file.
+ *
+ * @return the descriptor of the connection, or -1 with errno set: ENOENT if the daemon does not serve the archive,
+ *         or the error of the failed connection.
+ */
+int tar_client_open(const char *socket_path, const char *archive_path);
+
+/**
+ * Closes a connection opened by tar_client_open(), and the archive descriptor received with it.
+ */
+void tar_client_close(int tar_fd);
+
+/**
+ * Queries over a connection of tar_client_open(). A connection that fails, or a daemon that goes away, is taken as
+ * an archive without the entry: the functions return zero, and -1 for tar_client_read_file().
+ */
+int tar_client_exists(int tar_fd, char *path);
+
+int tar_client_is_dir(int tar_fd, char *path);
+
+int tar_client_is_file(int tar_fd, char *path);
+
+int tar_client_is_symlink(int tar_fd, char *path);
+
+int tar_client_list(int tar_fd, char *path, char **entries, size_t *no_entries);
+
+ssize_t tar_client_read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len);
+
+#endif
@@ -0,0 +1,492 @@
+#define _GNU_SOURCE // accept4()
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "tar_daemon.h"
+#include "tar_index.h"
+
+#define MAX_EVENTS 64
+#define IDX_SUFFIX ".idx"
+
+/* An archive kept resident */
+typedef struct {
+    char *path;                   /* canonical path, matched against the path of TAR_OP_OPEN */
+    int fd;
+    tar_index_t *idx;
+} served_archive_t;
+
+/* State of a connection, requests are read into in and responses queued in out */
+typedef struct client {
+    int fd;
+    served_archive_t *archive;    /* NULL until TAR_OP_OPEN */
+    uint8_t in[sizeof(tar_request_t) + TAR_DAEMON_PATH_MAX];
+    size_t in_len;
+    uint8_t *out;
+    size_t out_len;
+    size_t out_sent;
+    size_t out_capacity;
+    int pass_fd;                  /* descriptor to send along with the first byte of out, -1 if none */
+    struct client *prev;
+    struct client *next;
+} client_t;
+
+typedef struct {
+    served_archive_t *archives;
+    size_t no_archives;
+    int epoll_fd;
+    int listen_fd;
+    int signal_fd;
+    client_t *clients;            /* open connections, most recent first */
+    size_t no_clients;
+} daemon_t;
+
+/* Markers of the listening socket and the signalfd in the epoll data, clients are given their own pointer */
+static int listen_marker;
+static int signal_marker;
+
+/* Makes room for len more bytes in the output buffer of a client */
+static bool reserve_out(client_t *c, size_t len) {
+    if (c->out_len + len <= c->out_capacity) {
+        return true;
+    }
+    size_t capacity = c->out_capacity == 0 ? 256 : c->out_capacity;
+    while (capacity < c->out_len + len) {
+        capacity *= 2;
+    }
+    uint8_t *out = realloc(c->out, capacity);
+    if (out == NULL) {
+        return false;
+    }
+    c->out = out;
+    c->out_capacity = capacity;
+    return true;
+}
+
+/* Queues a response with no data */
+static bool queue_response(client_t *c, int64_t result, uint64_t offset, uint64_t len) {
+    if (!reserve_out(c, sizeof(tar_response_t))) {
+        return false;
+    }
+    tar_response_t resp = {.result = result, .offset = offset, .len = len, .data_len = 0};
+    memcpy(c->out + c->out_len, &resp, sizeof(resp));
+    c->out_len += sizeof(resp);
+    return true;
+}
+
+/* Entry names of a TAR_OP_LIST response, appended to the output after its response header */
+typedef struct {
+    client_t *client;
+    uint64_t max;
+    uint64_t count;
+    bool failed;
+} list_ctx_t;
+
+static int list_child(void *arg, const tar_index_entry_t *entry) {
+    list_ctx_t *ctx = arg;
+    if (ctx->count == ctx->max) {
+        return 1;
+    }
+    size_t len = strlen(entry->name) + 1;
+    if (!reserve_out(ctx->client, len)) {
+        ctx->failed = true;
+        return 1;
+    }
+    memcpy(ctx->client->out + ctx->client->out_len, entry->name, len);
+    ctx->client->out_len += len;
+    ctx->count++;
+    return 0;
+}
+
+static bool handle_list(client_t *c, char *path, uint64_t max) {
+    size_t start = c->out_len;
+    if (!reserve_out(c, sizeof(tar_response_t))) {
+        return false;
+    }
+    c->out_len += sizeof(tar_response_t);
+
+    list_ctx_t ctx = {.client = c, .max = max, .count = 0, .failed = false};
+    ssize_t res = tar_index_children(c->archive->idx, path, list_child, &ctx);
+    if (ctx.failed) {
+        return false;
+    }
+    tar_response_t resp = {
+        .result = res != -1,
+        .offset = 0,
+        .len = ctx.count,
+        .data_len = c->out_len - start - sizeof(tar_response_t)
+    };
+    memcpy(c->out + start, &resp, sizeof(resp));
+    return true;
+}
+
+/* Answers with the range of the archive holding the bytes to read, the client reads them itself */
+static bool handle_read_file(client_t *c, char *path, uint64_t offset, uint64_t len) {
+    const tar_index_entry_t *entry = tar_index_lookup_file(c->archive->idx, path);
+    if (entry == NULL) {
+        return queue_response(c, -1, 0, 0);
+    }
+    if (offset > entry->size) {
+        return queue_response(c, -2, 0, 0);
+    }
+    if (len > entry->size - offset) {
+        len = entry->size - offset;
+    }
+    return queue_response(c, (int64_t) (entry->size - offset - len), entry->data_offset + offset, len);
+}
+
+static bool handle_open(daemon_t *d, client_t *c, const char *path) {
+    for (size_t i = 0; i < d->no_archives; i++) {
+        if (strcmp(d->archives[i].path, path) == 0) {
+            c->archive = &d->archives[i];
+            c->pass_fd = c->archive->fd;
+            return queue_response(c, 0, 0, 0);
+        }
+    }
+    return queue_response(c, -1, 0, 0);
+}
+
+/**
+ * Sends as much of the queued output as the socket takes, with the pending descriptor on the first byte.
+ *
+ * @return false if the connection is broken.
+ */
+static bool flush_client(client_t *c) {
+    while (c->out_sent < c->out_len) {
+        struct iovec iov = {.iov_base = c->out + c->out_sent, .iov_len = c->out_len - c->out_sent};
+        struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+        union {
+            struct cmsghdr header;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+        if (c->pass_fd != -1) {
+            memset(&control, 0, sizeof(control));
+            msg.msg_control = control.buf;
+            msg.msg_controllen = sizeof(control.buf);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &c->pass_fd, sizeof(int));
+        }
+
+        ssize_t res = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        c->pass_fd = -1;
+        c->out_sent += res;
+    }
+    return true;
+}
+
+/**
+ * Answers the complete requests of a client and sends the responses, as long as the socket takes them all so that
+ * responses go out in order.
+ *
+ * @return false if the connection must be closed: the client broke the protocol or its response could not be
+ *         allocated.
+ */
+static bool handle_requests(daemon_t *d, client_t *c) {
+    size_t consumed = 0;
+    while (c->out_sent == c->out_len && c->in_len - consumed >= sizeof(tar_request_t)) {
+        tar_request_t req;
+        memcpy(&req, c->in + consumed, sizeof(req));
+        if (req.path_len > TAR_DAEMON_PATH_MAX) {
+            return false;
+        }
+        if (c->in_len - consumed < sizeof(req) + req.path_len) {
+            break;
+        }
+
+        char path[TAR_DAEMON_PATH_MAX + 1];
+        memcpy(path, c->in + consumed + sizeof(req), req.path_len);
+        path[req.path_len] = '\0';
+        consumed += sizeof(req) + req.path_len;
+        c->out_len = 0;
+        c->out_sent = 0;
+
+        // every query is about the archive of the connection, which must come first
+        if ((req.op == TAR_OP_OPEN) != (c->archive == NULL)) {
+            return false;
+        }
+
+        bool ok;
+        switch (req.op) {
+            case TAR_OP_OPEN:
+                ok = handle_open(d, c, path);
+                break;
+            case TAR_OP_EXISTS:
+                ok = queue_response(c, tar_index_exists(c->archive->idx, path), 0, 0);
+                break;
+            case TAR_OP_IS_DIR:
+                ok = queue_response(c, tar_index_is_dir(c->archive->idx, path), 0, 0);
+                break;
+            case TAR_OP_IS_FILE:
+                ok = queue_response(c, tar_index_is_file(c->archive->idx, path), 0, 0);
+                break;
+            case TAR_OP_IS_SYMLINK:
+                ok = queue_response(c, tar_index_is_symlink(c->archive->idx, path), 0, 0);
+                break;
+            case TAR_OP_LIST:
+                ok = handle_list(c, path, req.len);
+                break;
+            case TAR_OP_READ_FILE:
+                ok = handle_read_file(c, path, req.offset, req.len);
+                break;
+            default:
+                ok = false;
+        }
+        if (!ok || !flush_client(c)) {
+            return false;
+        }
+    }
+
+    memmove(c->in, c->in + consumed, c->in_len - consumed);
+    c->in_len -= consumed;
+    return true;
+}
+
+/* Waits for input while the client has nothing pending, for room in the socket otherwise */
+static bool watch_client(daemon_t *d, client_t *c) {
+    struct epoll_event ev = {.events = c->out_sent < c->out_len ? EPOLLOUT : EPOLLIN, .data.ptr = c};
+    return epoll_ctl(d->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) == 0;
+}
+
+static void close_client(daemon_t *d, client_t *c) {
+    epoll_ctl(d->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    if (c->prev != NULL) {
+        c->prev->next = c->next;
+    } else {
+        d->clients = c->next;
+    }
+    if (c->next != NULL) {
+        c->next->prev = c->prev;
+    }
+    free(c->out);
+    free(c);
+    d->no_clients--;
+}
+
+/* Answers what a client sent, or what it could not be sent before, and flushes the responses */
+static void serve_client(daemon_t *d, client_t *c, uint32_t events) {
+    if (events & EPOLLIN) {
+        ssize_t res = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+        if (res == 0 || (res == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            close_client(d, c);
+            return;
+        }
+        if (res > 0) {
+            c->in_len += res;
+        }
+    } else if (events & (EPOLLERR | EPOLLHUP)) {
+        close_client(d, c);
+        return;
+    }
+
+    // pipelined requests are answered once the responses before them are out
+    if (!flush_client(c) || !handle_requests(d, c) || !watch_client(d, c)) {
+        close_client(d, c);
+    }
+}
+
+static void accept_clients(daemon_t *d) {
+    for (;;) {
+        int fd = accept4(d->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+
+        client_t *c = d->no_clients < TAR_DAEMON_MAX_CLIENTS ? malloc(sizeof(client_t)) : NULL;
+        if (c == NULL) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->archive = NULL;
+        c->in_len = 0;
+        c->out = NULL;
+        c->out_len = 0;
+        c->out_sent = 0;
+        c->out_capacity = 0;
+        c->pass_fd = -1;
+
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+        if (epoll_ctl(d->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            close(fd);
+            free(c);
+            continue;
+        }
+        c->prev = NULL;
+        c->next = d->clients;
+        if (d->clients != NULL) {
+            d->clients->prev = c;
+        }
+        d->clients = c;
+        d->no_clients++;
+    }
+}
+
+/* Opens an archive and indexes it, from its sidecar index if it is up to date */
+static int load_archive(served_archive_t *a, const char *path) {
+    a->path = realpath(path, NULL);
+    if (a->path == NULL) {
+        return -1;
+    }
+    a->fd = open(a->path, O_RDONLY | O_CLOEXEC);
+    if (a->fd == -1) {
+        return -1;
+    }
+
+    size_t len = strlen(a->path);
+    char *idx_path = malloc(len + sizeof(IDX_SUFFIX));
+    if (idx_path == NULL) {
+        return -1;
+    }
+    memcpy(idx_path, a->path, len);
+    memcpy(idx_path + len, IDX_SUFFIX, sizeof(IDX_SUFFIX));
+    a->idx = tar_index_load(idx_path, a->fd);
+    free(idx_path);
+    if (a->idx == NULL) {
+        a->idx = tar_index_build(a->fd);
+    }
+    if (a->idx == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+static int open_socket(const char *socket_path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    // a socket left by a previous run would make bind() fail
+    unlink(socket_path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+int tar_daemon_run(const char *socket_path, char *const *archives, size_t no_archives) {
+    daemon_t d = {.no_archives = no_archives, .epoll_fd = -1, .listen_fd = -1, .signal_fd = -1, .clients = NULL,
+                  .no_clients = 0};
+    int ret = -1;
+
+    // SIGINT and SIGTERM are taken through a signalfd so that the loop stops between two events
+    sigset_t signals, old_signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+
+    d.archives = calloc(no_archives, sizeof(served_archive_t));
+    if (d.archives == NULL) {
+        goto out;
+    }
+    for (size_t i = 0; i < no_archives; i++) {
+        d.archives[i].fd = -1;
+    }
+    for (size_t i = 0; i < no_archives; i++) {
+        if (load_archive(&d.archives[i], archives[i]) == -1) {
+            goto out;
+        }
+    }
+
+    d.signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    d.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    d.listen_fd = open_socket(socket_path);
+    if (d.signal_fd == -1 || d.epoll_fd == -1 || d.listen_fd == -1) {
+        goto out;
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &listen_marker};
+    struct epoll_event sig_ev = {.events = EPOLLIN, .data.ptr = &signal_marker};
+    if (epoll_ctl(d.epoll_fd, EPOLL_CTL_ADD, d.listen_fd, &ev) == -1
+        || epoll_ctl(d.epoll_fd, EPOLL_CTL_ADD, d.signal_fd, &sig_ev) == -1) {
+        goto out;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    bool running = true;
+    while (running) {
+        int n = epoll_wait(d.epoll_fd, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            goto out;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &signal_marker) {
+                // consumed, or it would be delivered once unblocked on return
+                struct signalfd_siginfo info;
+                while (read(d.signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                }
+                running = false;
+            } else if (events[i].data.ptr == &listen_marker) {
+                accept_clients(&d);
+            } else {
+                serve_client(&d, events[i].data.ptr, events[i].events);
+            }
+        }
+    }
+    ret = 0;
+
+out:;
+    int err = errno;
+    while (d.clients != NULL) {
+        close_client(&d, d.clients);
+    }
+    if (d.listen_fd != -1) {
+        close(d.listen_fd);
+        unlink(socket_path);
+    }
+    if (d.epoll_fd != -1) {
+        close(d.epoll_fd);
+    }
+    if (d.signal_fd != -1) {
+        close(d.signal_fd);
+    }
+    if (d.archives != NULL) {
+        for (size_t i = 0; i < no_archives; i++) {
+            if (d.archives[i].idx != NULL) {
+                tar_index_free(d.archives[i].idx);
+            }
+            if (d.archives[i].fd != -1) {
+                close(d.archives[i].fd);
+            }
+            free(d.archives[i].path);
+        }
+        free(d.archives);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    errno = err;
+    return ret;
+}
@@ -0,0 +1,63 @@
+#ifndef TAR_DAEMON_H
+#define TAR_DAEMON_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Protocol between tar_served and the tar_client.h shim, over a Unix stream socket.
+ * Both ends run on the same host, so numbers are in its byte order.
+ * A client sends a request, a tar_request_t followed by path_len bytes of path, and waits for its response, a
+ * tar_response_t followed by data_len bytes of data. The first request of a connection is TAR_OP_OPEN, which binds
+ * it to an archive and whose response carries a descriptor of the archive (SCM_RIGHTS); the queries that follow
+ * are answered from the resident index of that archive. read_file() data never goes through the socket: the
+ * response gives the range of the archive to read with the descriptor.
+ */
+
+/* Longest path of a request, including the archive path of TAR_OP_OPEN */
+#define TAR_DAEMON_PATH_MAX 4096
+
+/* Most connections served at once, the next ones are refused until one closes */
+#ifndef TAR_DAEMON_MAX_CLIENTS
+#define TAR_DAEMON_MAX_CLIENTS 1024
+#endif
+
+enum {
+    TAR_OP_OPEN = 1,              /* path: the archive, result: 0, or -1 if it is not served */
+    TAR_OP_EXISTS,                /* result: the return value of exists() */
+    TAR_OP_IS_DIR,
+    TAR_OP_IS_FILE,
+    TAR_OP_IS_SYMLINK,
+    TAR_OP_LIST,                  /* len: the most entries to list, result: the return value of list() */
+    TAR_OP_READ_FILE              /* offset, len: as for read_file(), result: its return value */
+};
+
+typedef struct {
+    uint32_t op;
+    uint32_t path_len;            /* bytes of path following the request, without NUL */
+    uint64_t offset;
+    uint64_t len;
+} tar_request_t;
+
+typedef struct {
+    int64_t result;
+    uint64_t offset;              /* TAR_OP_READ_FILE: offset of the first byte to read in the archive */
+    uint64_t len;                 /* TAR_OP_READ_FILE: bytes to read there, TAR_OP_LIST: number of entries */
+    uint64_t data_len;            /* TAR_OP_LIST: bytes of the NUL-terminated entry names following the response */
+} tar_response_t;
+
+/**
+ * Serves queries on a set of archives over a Unix socket until SIGINT or SIGTERM.
+ * Every archive is indexed once at startup, from its sidecar index ("<archive>.idx", see tar_index_save()) when it is
+ * up to date, with a scan otherwise, and its index stays resident. Clients are handled by a single thread on an
+ * epoll loop: the queries only read the indexes, so each one is answered as soon as its request is complete.
+ *
+ * @param socket_path The path to listen on, an existing socket there is replaced and removed on exit.
+ * @param archives The paths of the archives to serve.
+ *
+ * @return zero once stopped by a signal, -1 with errno set if an archive could not be opened or indexed, or if the
+ *         socket could not be set up.
+ */
+int tar_daemon_run(const char *socket_path, char *const *archives, size_t no_archives);
+
+#endif
@@ -0,0 +1,116 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "tar_entry.h"
+#include "tar_stats.h"
+
+struct tar_entry {
+    int tar_fd;
+    off_t data_offset;            /* offset of the first data byte in the archive */
+    uint64_t size;
+    uint64_t position;
+    uint64_t advised;             /* end of the range already given to POSIX_FADV_WILLNEED, relative to the data */
+};
+
+tar_entry_t *tar_index_entry_open(tar_index_t *idx, int tar_fd, char *path) {
+    const tar_index_entry_t *entry = tar_index_lookup_file(idx, path);
+    if (entry == NULL) {
+        errno = ENOENT;
+        return NULL;
+    }
+    tar_entry_t *e = malloc(sizeof(tar_entry_t));
+    if (e == NULL) {
+        return NULL;
+    }
+    e->tar_fd = tar_fd;
+    e->data_offset = entry->data_offset;
+    e->size = entry->size;
+    e->position = 0;
+    e->advised = 0;
+
+    // only a hint, a descriptor that doesn't support it is read all the same
+    posix_fadvise(tar_fd, e->data_offset, e->size, POSIX_FADV_SEQUENTIAL);
+    return e;
+}
+
+void tar_entry_close(tar_entry_t *e) {
+    free(e);
+}
+
+uint64_t tar_entry_size(const tar_entry_t *e) {
+    return e->size;
+}
+
+ssize_t tar_entry_pread(tar_entry_t *e, void *buf, size_t len, uint64_t offset) {
+    if (offset >= e->size) {
+        return 0;
+    }
+    if (len > e->size - offset) {
+        len = e->size - offset;
+    }
+
+    // a single pread() transfers at most about 2 GiB on Linux, so large reads take several calls
+    size_t done = 0;
+    while (done < len) {
+        ssize_t res = pread(e->tar_fd, (uint8_t *) buf + done, len - done, e->data_offset + offset + done);
+        TAR_STATS_ADD(read_calls, 1);
+        TAR_STATS_ADD(bytes_read, res > 0 ? res : 0);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to read from file");
+            exit(EXIT_FAILURE);
+        }
+        if (res == 0) {
+            break; // the archive is truncated
+        }
+        done += res;
+    }
+    return done;
+}
+
+ssize_t tar_entry_read(tar_entry_t *e, void *buf, size_t len) {
+    // keep the kernel one window ahead of the reads, within the file
+    if (e->position + len > e->advised && e->advised < e->size) {
+        uint64_t start = e->position > e->advised ? e->position : e->advised;
+        uint64_t end = e->position + len + TAR_ENTRY_READAHEAD;
+        if (end > e->size) {
+            end = e->size;
+        }
+        if (end > start) {
+            posix_fadvise(e->tar_fd, e->data_offset + start, end - start, POSIX_FADV_WILLNEED);
+            e->advised = end;
+        }
+    }
+
+    ssize_t res = tar_entry_pread(e, buf, len, e->position);
+    e->position += res;
+    return res;
+}
+
+off_t tar_entry_seek(tar_entry_t *e, off_t offset, int whence) {
+    int64_t base;
+    switch (whence) {
+        case SEEK_SET:
+            base = 0;
+            break;
+        case SEEK_CUR:
+            base = e->position;
+            break;
+        case SEEK_END:
+            base = e->size;
+            break;
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+    if ((offset < 0 && base + offset < 0) || (offset > 0 && base > INT64_MAX - offset)) {
+        errno = EINVAL;
+        return -1;
+    }
+    e->position = base + offset;
+    return e->position;
+}
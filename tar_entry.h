@@ -0,0 +1,78 @@
+#ifndef TAR_ENTRY_H
+#define TAR_ENTRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "tar_index.h"
+
+/* Bytes ahead of the position that tar_entry_read() asks the kernel to read ahead */
+#ifndef TAR_ENTRY_READAHEAD
+#define TAR_ENTRY_READAHEAD (1 << 20)
+#endif
+
+/**
+ * An open file of an archive: its path is resolved once, then its data is read like a file of its own, with a
+ * position and reads that never go past its end.
+ * A handle is not thread-safe, except for tar_entry_pread() which does not use the position.
+ */
+typedef struct tar_entry tar_entry_t;
+
+/**
+ * Opens a file of the archive, following links the same way read_file() does.
+ * The file is found with the index the queries of lib_tar.h keep for the descriptor, so opening several files of an
+ * archive scans it once, and every read goes straight to the data. The kernel is told that the data is read
+ * sequentially, which on Linux doubles the readahead of the archive descriptor.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file, which must outlive the handle.
+ * @param path A path to an entry in the archive.
+ *
+ * @return the handle, or NULL with errno set: ENOENT if no file exists at the path (or the entry is not a file),
+ *         ENOMEM if an allocation failed.
+ */
+tar_entry_t *tar_entry_open(int tar_fd, char *path);
+
+/**
+ * Opens a file with an index of the archive, see tar_entry_open(). The index may be freed once this returns.
+ *
+ * @param tar_fd A file descriptor of the uncompressed archive the index describes.
+ */
+tar_entry_t *tar_index_entry_open(tar_index_t *idx, int tar_fd, char *path);
+
+/**
+ * Releases a handle. Does not close the archive descriptor.
+ */
+void tar_entry_close(tar_entry_t *e);
+
+/**
+ * Size of the file in bytes.
+ */
+uint64_t tar_entry_size(const tar_entry_t *e);
+
+/**
+ * Reads from the position of the handle and moves it past the bytes read.
+ * The data past the position is announced to the kernel TAR_ENTRY_READAHEAD bytes at a time.
+ *
+ * @return the number of bytes read, less than len only at the end of the file or of a truncated archive,
+ *         zero once the position is at the end of the file.
+ */
+ssize_t tar_entry_read(tar_entry_t *e, void *buf, size_t len);
+
+/**
+ * Reads from an offset of the file, without using or moving the position of the handle.
+ *
+ * @return the number of bytes read, as tar_entry_read().
+ */
+ssize_t tar_entry_pread(tar_entry_t *e, void *buf, size_t len, uint64_t offset);
+
+/**
+ * Moves the position of the handle, like lseek(). The position may go past the end of the file, reads there return 0.
+ *
+ * @param whence SEEK_SET, SEEK_CUR or SEEK_END.
+ *
+ * @return the new position, or -1 with errno set to EINVAL if it would be negative or whence is unknown.
+ */
+off_t tar_entry_seek(tar_entry_t *e, off_t offset, int whence);
+
+#endif
@@ -0,0 +1,215 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tar_ext.h"
+
+void tar_ext_init(tar_ext_t *ext) {
+    memset(ext, 0, sizeof(*ext));
+    ext->size = -1;
+    ext->global_size = -1;
+}
+
+void tar_ext_destroy(tar_ext_t *ext) {
+    free(ext->name);
+    free(ext->linkname);
+    free(ext->global_name);
+    free(ext->global_linkname);
+    free(ext->name_buf);
+    free(ext->link_buf);
+    tar_ext_init(ext);
+}
+
+bool tar_is_ext_header(const tar_header_t *header) {
+    return header->typeflag == XHDTYPE || header->typeflag == XGLTYPE
+           || header->typeflag == GNUTYPE_LONGNAME || header->typeflag == GNUTYPE_LONGLINK;
+}
+
+/* Replaces a string value, an empty value removes it as PAX requires */
+static int set_value(char **dest, const char *value, size_t len) {
+    free(*dest);
+    *dest = NULL;
+    if (len == 0) {
+        return 0;
+    }
+    *dest = strndup(value, len);
+    return *dest == NULL ? -1 : 0;
+}
+
+/* Parses a PAX size value, -1 if it is empty or not a decimal number */
+static int64_t parse_decimal(const char *value, size_t len) {
+    if (len == 0) {
+        return -1;
+    }
+    int64_t res = 0;
+    for (size_t i = 0; i < len; ++i) {
+        if (value[i] < '0' || value[i] > '9' || res > (INT64_MAX - 9) / 10) {
+            return -1;
+        }
+        res = res * 10 + (value[i] - '0');
+    }
+    return res;
+}
+
+/* Parses a value of lowercase or uppercase hexadecimal digits into len bytes, false if it is not exactly that */
+static bool parse_hex(const char *value, size_t value_len, uint8_t *dest, size_t len) {
+    if (value_len != 2 * len) {
+        return false;
+    }
+    for (size_t i = 0; i < value_len; ++i) {
+        char c = value[i];
+        int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                  : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (digit < 0) {
+            return false;
+        }
+        dest[i / 2] = i % 2 == 0 ? digit << 4 : dest[i / 2] | digit;
+    }
+    return true;
+}
+
+/**
+ * Parses PAX records, each of them being "<length> <key>=<value>\n" where length counts the whole record.
+ */
+static int add_pax_records(tar_ext_t *ext, bool global, const char *data, size_t len) {
+    size_t pos = 0;
+    while (pos < len) {
+        size_t record_len = 0;
+        size_t i = pos;
+        while (i < len && data[i] >= '0' && data[i] <= '9' && record_len <= len) {
+            record_len = record_len * 10 + (data[i++] - '0');
+        }
+        if (i == pos || i >= len || data[i] != ' ' || record_len <= i - pos || record_len > len - pos
+            || data[pos + record_len - 1] != '\n') {
+            return 0; // malformed, the rest of the records can't be delimited
+        }
+
+        const char *key = data + i + 1;
+        const char *end = data + pos + record_len - 1;
+        const char *equals = memchr(key, '=', end - key);
+        pos += record_len;
+        if (equals == NULL) {
+            continue;
+        }
+        size_t key_len = equals - key;
+        const char *value = equals + 1;
+        size_t value_len = end - value;
+
+        int res = 0;
+        if (key_len == 4 && memcmp(key, "path", 4) == 0) {
+            res = set_value(global ? &ext->global_name : &ext->name, value, value_len);
+        } else if (key_len == 8 && memcmp(key, "linkpath", 8) == 0) {
+            res = set_value(global ? &ext->global_linkname : &ext->linkname, value, value_len);
+        } else if (key_len == 4 && memcmp(key, "size", 4) == 0) {
+            *(global ? &ext->global_size : &ext->size) = parse_decimal(value, value_len);
+        } else if (!global && key_len == strlen(TAR_PAX_CRC32C) && memcmp(key, TAR_PAX_CRC32C, key_len) == 0) {
+            uint8_t crc[4];
+            ext->digest.has_crc32c = parse_hex(value, value_len, crc, sizeof(crc));
+            ext->digest.crc32c = (uint32_t) crc[0] << 24 | crc[1] << 16 | crc[2] << 8 | crc[3];
+        } else if (!global && key_len == strlen(TAR_PAX_SHA256) && memcmp(key, TAR_PAX_SHA256, key_len) == 0) {
+            ext->digest.has_sha256 = parse_hex(value, value_len, ext->digest.sha256, TAR_SHA256_LEN);
+        }
+        if (res != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int tar_ext_add(tar_ext_t *ext, const tar_header_t *header, const void *data, size_t len) {
+    switch (header->typeflag) {
+        case XHDTYPE:
+        case XGLTYPE:
+            return add_pax_records(ext, header->typeflag == XGLTYPE, data, len);
+        case GNUTYPE_LONGNAME:
+            // the data is the NUL-terminated name
+            return set_value(&ext->name, data, strnlen(data, len));
+        case GNUTYPE_LONGLINK:
+            return set_value(&ext->linkname, data, strnlen(data, len));
+        default:
+            return 0;
+    }
+}
+
+/* Makes sure a buffer holds at least len bytes */
+static int reserve_buf(char **buf, size_t *cap, size_t len) {
+    if (len <= *cap) {
+        return 0;
+    }
+    size_t new_cap = *cap == 0 ? 256 : *cap;
+    while (new_cap < len) {
+        new_cap *= 2;
+    }
+    char *new_buf = realloc(*buf, new_cap);
+    if (new_buf == NULL) {
+        return -1;
+    }
+    *buf = new_buf;
+    *cap = new_cap;
+    return 0;
+}
+
+/* Copies the concatenation of two strings, the first one followed by a slash if it is not empty */
+static int join(char **buf, size_t *cap, const char *dir, size_t dir_len, const char *name, size_t name_len) {
+    if (reserve_buf(buf, cap, dir_len + name_len + 2) != 0) {
+        return -1;
+    }
+    size_t len = 0;
+    if (dir_len > 0) {
+        memcpy(*buf, dir, dir_len);
+        (*buf)[dir_len] = '/';
+        len = dir_len + 1;
+    }
+    memcpy(*buf + len, name, name_len);
+    (*buf)[len + name_len] = '\0';
+    return 0;
+}
+
+int tar_ext_member(tar_ext_t *ext, const tar_header_t *header, off_t header_offset, tar_member_t *member) {
+    const char *name = ext->name != NULL ? ext->name : ext->global_name;
+    const char *linkname = ext->linkname != NULL ? ext->linkname : ext->global_linkname;
+    int res;
+
+    if (name != NULL) {
+        res = join(&ext->name_buf, &ext->name_cap, NULL, 0, name, strlen(name));
+    } else {
+        // only POSIX ustar headers have a prefix, GNU headers use its place for other fields
+        size_t prefix_len = 0;
+        if (memcmp(header->magic, TMAGIC, TMAGLEN) == 0) {
+            prefix_len = strnlen(header->prefix, sizeof(header->prefix));
+        }
+        res = join(&ext->name_buf, &ext->name_cap, header->prefix, prefix_len, header->name,
+                   strnlen(header->name, sizeof(header->name)));
+    }
+    if (res != 0) {
+        return -1;
+    }
+
+    if (linkname != NULL) {
+        res = join(&ext->link_buf, &ext->link_cap, NULL, 0, linkname, strlen(linkname));
+    } else {
+        res = join(&ext->link_buf, &ext->link_cap, NULL, 0, header->linkname,
+                   strnlen(header->linkname, sizeof(header->linkname)));
+    }
+    if (res != 0) {
+        return -1;
+    }
+
+    int64_t size = ext->size >= 0 ? ext->size : ext->global_size >= 0 ? ext->global_size : TAR_SIZE(header);
+
+    member->header = header;
+    member->header_offset = header_offset;
+    member->data_offset = header_offset + sizeof(tar_header_t);
+    member->size = size > 0 ? (uint64_t) size : 0;
+    member->name = ext->name_buf;
+    member->linkname = ext->link_buf;
+    member->typeflag = header->typeflag;
+    member->digest = ext->digest;
+
+    // the records of 'x', 'L' and 'K' headers only apply to this member
+    free(ext->name);
+    free(ext->linkname);
+    ext->name = NULL;
+    ext->linkname = NULL;
+    ext->size = -1;
+    memset(&ext->digest, 0, sizeof(ext->digest));
+    return 0;
+}
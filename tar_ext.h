@@ -0,0 +1,103 @@
+#ifndef TAR_EXT_H
+#define TAR_EXT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "lib_tar.h"
+
+/* Largest extension header data that is parsed, larger ones are skipped */
+#define TAR_EXT_MAX (1 << 20)
+
+/**
+ * PAX records carrying the digests of a member's data, in lowercase hexadecimal, see tar_verify.h.
+ * They follow the vendor keyword convention, other readers skip them (GNU tar with a warning).
+ */
+#define TAR_PAX_CRC32C "LIBTAR.crc32c"
+#define TAR_PAX_SHA256 "LIBTAR.sha256"
+
+#define TAR_SHA256_LEN 32
+
+/* Digests of the data of a member */
+typedef struct {
+    bool has_crc32c;
+    bool has_sha256;
+    uint32_t crc32c;
+    uint8_t sha256[TAR_SHA256_LEN];
+} tar_digest_t;
+
+/**
+ * An archive member once the extension headers in front of it are applied: its path may come from a GNU long name
+ * or a PAX record instead of the name field, and its size from a base-256 size field or a PAX record.
+ */
+typedef struct {
+    const tar_header_t *header;   /* the member's own header */
+    off_t header_offset;          /* offset of that header in the archive, after its extension headers */
+    off_t data_offset;            /* offset of the first data byte in the archive */
+    uint64_t size;                /* size of the data in bytes */
+    const char *name;             /* full path, NUL-terminated */
+    const char *linkname;         /* full link target, NUL-terminated */
+    char typeflag;
+    tar_digest_t digest;          /* digests of the data found in the PAX records of the member, if any */
+} tar_member_t;
+
+/**
+ * Extension state carried from header to header while an archive is walked.
+ * PAX 'x' records and GNU 'L'/'K' names apply to the next member only, PAX 'g' records to all the following ones.
+ */
+typedef struct {
+    char *name;                   /* path for the next member, NULL if none */
+    char *linkname;               /* link target for the next member, NULL if none */
+    int64_t size;                 /* size of the next member, -1 if none */
+    tar_digest_t digest;          /* digests of the data of the next member */
+    char *global_name;
+    char *global_linkname;
+    int64_t global_size;
+
+    // the path and link target of the last member, valid until the next call to tar_ext_member()
+    char *name_buf;
+    size_t name_cap;
+    char *link_buf;
+    size_t link_cap;
+} tar_ext_t;
+
+/**
+ * Prepares an empty extension state.
+ */
+void tar_ext_init(tar_ext_t *ext);
+
+/**
+ * Releases the buffers of an extension state.
+ */
+void tar_ext_destroy(tar_ext_t *ext);
+
+/**
+ * Checks whether a header is an extension header ('x', 'g', 'L' or 'K') rather than a member of its own.
+ */
+bool tar_is_ext_header(const tar_header_t *header);
+
+/**
+ * Records the content of an extension header, to be applied by tar_ext_member().
+ * PAX records other than path, linkpath, size and the digest records are ignored, as are malformed records.
+ * The digest records only apply to the member of an 'x' header.
+ *
+ * @param data The data of the extension header.
+ * @param len The number of bytes of data.
+ *
+ * @return zero on success, -1 if a value could not be allocated.
+ */
+int tar_ext_add(tar_ext_t *ext, const tar_header_t *header, const void *data, size_t len);
+
+/**
+ * Describes the member of a non-extension header, applying the ustar prefix and the pending extension records,
+ * which are then cleared.
+ *
+ * @param header_offset The offset of the header in the archive, its data is assumed to follow it directly.
+ *
+ * @return zero on success, -1 if the path could not be allocated.
+ */
+int tar_ext_member(tar_ext_t *ext, const tar_header_t *header, off_t header_offset, tar_member_t *member);
+
+#endif
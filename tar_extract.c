@@ -0,0 +1,495 @@
+#define _GNU_SOURCE // copy_file_range() and fallocate()
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "tar_extract.h"
+#include "tar_index.h"
+
+/* A file to write: its path, and the entry holding its data, which differs for a hardlink turned into a copy */
+typedef struct {
+    const tar_index_entry_t *entry;
+    const tar_index_entry_t *data;
+} file_job_t;
+
+/* A directory whose permissions are set once the extraction is over, they may not let its files be created */
+typedef struct {
+    const tar_index_entry_t *entry;
+    mode_t mode;
+} dir_mode_t;
+
+typedef struct {
+    int tar_fd;
+    int dir_fd;
+    const file_job_t *jobs;
+    size_t no_jobs;
+    atomic_size_t next_job;
+    atomic_int error;             /* errno of the first failure, which stops every worker */
+} extract_ctx_t;
+
+typedef struct {
+    const tar_index_entry_t **items;
+    size_t count;
+    size_t capacity;
+} entry_list_t;
+
+static int add_entry(entry_list_t *list, const tar_index_entry_t *entry) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity == 0 ? 1024 : list->capacity * 2;
+        const tar_index_entry_t **items = realloc(list->items, capacity * sizeof(*items));
+        if (items == NULL) {
+            return -1;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = entry;
+    return 0;
+}
+
+static int collect_entry(void *arg, const tar_index_entry_t *entry) {
+    return add_entry(arg, entry) != 0;
+}
+
+static int compare_pointers(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t) *(const void *const *) a, y = (uintptr_t) *(const void *const *) b;
+    return (x > y) - (x < y);
+}
+
+/* Whether a key has a ".." component, which could climb out of the destination */
+static bool has_dotdot(const char *key, size_t key_len) {
+    for (size_t i = 0; i + 2 <= key_len; ++i) {
+        bool component = (i == 0 || key[i - 1] == '/') && (i + 2 == key_len || key[i + 2] == '/');
+        if (component && key[i] == '.' && key[i + 1] == '.') {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Permission bits of an entry, read from its header */
+static mode_t entry_mode(int tar_fd, const tar_index_entry_t *entry) {
+    tar_header_t header;
+    if (pread(tar_fd, &header, sizeof(header), entry->header_offset) != sizeof(header)) {
+        return entry->typeflag == DIRTYPE ? 0755 : 0644;
+    }
+    return tar_number(header.mode, sizeof(header.mode)) & 07777;
+}
+
+/* The directory an entry is created in, kept open for the next entries of the same directory */
+typedef struct {
+    int fd;                       /* -1 until a directory is opened */
+    size_t key_len;
+    char key[TAR_PATH_MAX];
+} parent_dir_t;
+
+static void close_parent(parent_dir_t *parent) {
+    if (parent->fd != -1) {
+        close(parent->fd);
+        parent->fd = -1;
+    }
+}
+
+/**
+ * Opens a directory without following a symlink at its path.
+ * When create is set, a missing directory is made with the given mode, and a file or a symlink in the way is replaced.
+ */
+static int open_dir(int at_fd, const char *name, bool create, mode_t mode) {
+    int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    int fd = openat(at_fd, name, flags);
+    if (fd != -1 || !create) {
+        return fd;
+    }
+    if (errno == ENOTDIR || errno == ELOOP) {
+        if (unlinkat(at_fd, name, 0) != 0) {
+            return -1;
+        }
+    } else if (errno != ENOENT) {
+        return -1;
+    }
+    if (mkdirat(at_fd, name, mode) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    return openat(at_fd, name, flags);
+}
+
+/**
+ * Opens the directory above a key, one component at a time, so that a symlink planted at the path of a directory by
+ * an earlier extraction or by anyone else can't redirect the extraction outside of dir_fd.
+ * The directory stays open in parent, and the files of one directory, which are consecutive in key order, only cost
+ * a walk for the first of them.
+ *
+ * @param create Whether the missing directories are made, and files or symlinks in their way replaced.
+ *               Otherwise a component that is not a directory fails with ELOOP or ENOTDIR.
+ * @param name Set to the last component of the key, to be used relative to the returned descriptor.
+ *
+ * @return a descriptor of the directory, which is dir_fd or the one of parent, or -1 with errno set.
+ */
+static int open_parent(int dir_fd, const char *key, size_t key_len, bool create, parent_dir_t *parent,
+                       const char **name) {
+    size_t parent_len = 0;
+    for (size_t i = 0; i < key_len; ++i) {
+        if (key[i] == '/') {
+            parent_len = i;
+        }
+    }
+    *name = parent_len == 0 ? key : key + parent_len + 1;
+    if (parent_len == 0) {
+        return dir_fd;
+    }
+    if (parent->fd != -1 && parent->key_len == parent_len && memcmp(parent->key, key, parent_len) == 0) {
+        return parent->fd;
+    }
+    if (parent_len >= TAR_PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    close_parent(parent);
+    memcpy(parent->key, key, parent_len);
+    parent->key[parent_len] = '\0';
+    int fd = dir_fd;
+    for (size_t start = 0, end; start < parent_len; start = end + 1) {
+        end = start;
+        while (end < parent_len && parent->key[end] != '/') {
+            end++;
+        }
+        if (end == start) {
+            continue;
+        }
+        parent->key[end] = '\0';
+        int next = open_dir(fd, parent->key + start, create, 0777);
+        parent->key[end] = end == parent_len ? '\0' : '/';
+        int err = errno;
+        if (fd != dir_fd) {
+            close(fd);
+        }
+        if (next == -1) {
+            errno = err;
+            return -1;
+        }
+        fd = next;
+    }
+    parent->fd = fd;
+    parent->key_len = parent_len;
+    return fd;
+}
+
+/* Writes a whole buffer at an offset */
+static int pwrite_all(int fd, const uint8_t *buf, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t res = pwrite(fd, buf + done, len - done, offset + done);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += res;
+    }
+    return 0;
+}
+
+/**
+ * Copies len bytes of the archive from an offset to the start of a file, or less if the archive ends before.
+ * copy_file_range() keeps the data in the kernel, and may even share the blocks on file systems that support it.
+ *
+ * @param buf The buffer of the fallback, allocated on first use and kept by the caller.
+ */
+static int copy_data(int tar_fd, off_t offset, int out_fd, uint64_t len, uint8_t **buf) {
+    off_t in = offset;
+    off_t out = 0;
+    while (len > 0) {
+        ssize_t res = copy_file_range(tar_fd, &in, out_fd, &out, len, 0);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+                break;
+            }
+            return -1;
+        }
+        if (res == 0) {
+            return 0; // the archive is truncated
+        }
+        len -= res;
+    }
+
+    if (len > 0 && *buf == NULL && (*buf = malloc(TAR_EXTRACT_BUF)) == NULL) {
+        return -1;
+    }
+    while (len > 0) {
+        ssize_t res = pread(tar_fd, *buf, len < TAR_EXTRACT_BUF ? len : TAR_EXTRACT_BUF, in);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (res == 0 || pwrite_all(out_fd, *buf, res, out) != 0) {
+            return res == 0 ? 0 : -1;
+        }
+        in += res;
+        out += res;
+        len -= res;
+    }
+    return 0;
+}
+
+/* Creates a file and fills it with the data of a job */
+static int extract_file(extract_ctx_t *ctx, const file_job_t *job, uint8_t **buf, parent_dir_t *parent) {
+    const char *name;
+    int at_fd = open_parent(ctx->dir_fd, job->entry->key, job->entry->key_len, false, parent, &name);
+    if (at_fd == -1) {
+        return -1;
+    }
+    mode_t mode = entry_mode(ctx->tar_fd, job->data);
+    int flags = O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC;
+    int fd = openat(at_fd, name, flags, mode);
+    if (fd == -1 && errno == EEXIST) {
+        // replaced rather than truncated, in case it is a link to some other file
+        if (unlinkat(at_fd, name, 0) != 0) {
+            return -1;
+        }
+        fd = openat(at_fd, name, flags, mode);
+    }
+    if (fd == -1) {
+        return -1;
+    }
+
+    // preallocating keeps the file in few extents, it is only a hint where it isn't supported
+    if (job->data->size > 0) {
+        fallocate(fd, 0, 0, job->data->size);
+    }
+    int res = copy_data(ctx->tar_fd, job->data->data_offset, fd, job->data->size, buf);
+    int err = errno;
+    if (close(fd) != 0 && res == 0) {
+        return -1;
+    }
+    errno = err;
+    return res;
+}
+
+static void *extract_worker(void *arg) {
+    extract_ctx_t *ctx = arg;
+    uint8_t *buf = NULL;
+    parent_dir_t parent = {.fd = -1};
+    while (atomic_load_explicit(&ctx->error, memory_order_relaxed) == 0) {
+        size_t i = atomic_fetch_add(&ctx->next_job, 1);
+        if (i >= ctx->no_jobs) {
+            break;
+        }
+        if (extract_file(ctx, &ctx->jobs[i], &buf, &parent) != 0) {
+            int expected = 0;
+            atomic_compare_exchange_strong(&ctx->error, &expected, errno != 0 ? errno : EIO);
+        }
+    }
+    close_parent(&parent);
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Creates a link, replacing whatever is at its path.
+ *
+ * @param parent The directory of the link, target_parent the one of the target of a hardlink.
+ */
+static int make_link(int dir_fd, const tar_index_entry_t *entry, const tar_index_entry_t *target, parent_dir_t *parent,
+                     parent_dir_t *target_parent) {
+    const char *name, *target_name = NULL;
+    int at_fd = open_parent(dir_fd, entry->key, entry->key_len, false, parent, &name);
+    int target_fd = target == NULL ? -1 : open_parent(dir_fd, target->key, target->key_len, false, target_parent,
+                                                      &target_name);
+    if (at_fd == -1 || (target != NULL && target_fd == -1)) {
+        return -1;
+    }
+    for (int attempt = 0;; ++attempt) {
+        int res = target == NULL ? symlinkat(entry->linkname, at_fd, name)
+                                 : linkat(target_fd, target_name, at_fd, name, 0);
+        if (res == 0 || errno != EEXIST || attempt > 0) {
+            return res;
+        }
+        if (unlinkat(at_fd, name, 0) != 0) {
+            return -1;
+        }
+    }
+}
+
+/* Copies the data of the files with nthreads workers */
+static int run_workers(extract_ctx_t *ctx, unsigned nthreads) {
+    if (nthreads > ctx->no_jobs) {
+        nthreads = ctx->no_jobs > 0 ? ctx->no_jobs : 1;
+    }
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+    unsigned started = 0;
+    while (threads != NULL && started < nthreads && pthread_create(&threads[started], NULL, extract_worker, ctx) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        extract_worker(ctx); // no thread could be created, the jobs are run by the caller
+    }
+    for (unsigned t = 0; t < started; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    int err = atomic_load(&ctx->error);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t tar_extract(int tar_fd, const char *dest_dir, const char *filter, unsigned nthreads) {
+    if (nthreads == 0) {
+        nthreads = TAR_EXTRACT_THREADS;
+    }
+    tar_index_t *idx = tar_index_build(tar_fd);
+    if (idx == NULL) {
+        return -1;
+    }
+
+    // the selected entries come in key order, so a directory is met before its content
+    entry_list_t selected = {0};
+    entry_list_t links = {0};
+    file_job_t *jobs = NULL;
+    dir_mode_t *dirs = NULL;
+    size_t no_jobs = 0, no_dirs = 0;
+    const tar_index_entry_t **by_address = NULL;
+    parent_dir_t parent = {.fd = -1};
+    parent_dir_t target_parent = {.fd = -1};
+    ssize_t no_extracted = 0;
+    int dir_fd = -1;
+    int res = -1;
+
+    // the search stops at the first entry that could not be added
+    ssize_t no_found = tar_find(idx, filter != NULL ? filter : "**", collect_entry, &selected);
+    if (no_found < 0 || (size_t) no_found != selected.count) {
+        errno = ENOMEM;
+        goto out;
+    }
+    jobs = malloc((selected.count + 1) * sizeof(file_job_t));
+    dirs = malloc((selected.count + 1) * sizeof(dir_mode_t));
+    by_address = malloc((selected.count + 1) * sizeof(*by_address));
+    if (jobs == NULL || dirs == NULL || by_address == NULL) {
+        goto out;
+    }
+    // a hardlink is only made if its target is extracted too, which is looked up by address
+    memcpy(by_address, selected.items, selected.count * sizeof(*by_address));
+    qsort(by_address, selected.count, sizeof(*by_address), compare_pointers);
+
+    if (mkdir(dest_dir, 0777) != 0 && errno != EEXIST) {
+        goto out;
+    }
+    dir_fd = open(dest_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1) {
+        goto out;
+    }
+
+    // serial phase: the directories, and the list of files and links
+    for (size_t i = 0; i < selected.count; ++i) {
+        const tar_index_entry_t *entry = selected.items[i];
+        // the "./" entry is dest_dir itself
+        if (entry->key_len == 0 || has_dotdot(entry->key, entry->key_len)) {
+            continue;
+        }
+        const tar_index_entry_t *data = entry;
+        if (entry->typeflag == LNKTYPE) {
+            data = tar_resolve(idx, entry->name);
+            if (data == NULL || (data->typeflag != REGTYPE && data->typeflag != AREGTYPE)) {
+                continue;
+            }
+            if (bsearch(&data, by_address, selected.count, sizeof(*by_address), compare_pointers) != NULL
+                && !has_dotdot(data->key, data->key_len)) {
+                data = NULL; // linked once the target is written
+            }
+        } else if (entry->typeflag != DIRTYPE && entry->typeflag != SYMTYPE && entry->typeflag != REGTYPE
+                   && entry->typeflag != AREGTYPE) {
+            continue;
+        }
+
+        const char *name;
+        int at_fd = open_parent(dir_fd, entry->key, entry->key_len, true, &parent, &name);
+        if (at_fd == -1) {
+            goto out;
+        }
+        if (entry->typeflag == DIRTYPE) {
+            mode_t mode = entry_mode(tar_fd, entry);
+            // the owner needs to write into it until the extraction is over
+            int fd = open_dir(at_fd, name, true, mode | S_IRWXU);
+            if (fd == -1) {
+                goto out;
+            }
+            close(fd);
+            if ((mode & S_IRWXU) != S_IRWXU) {
+                dirs[no_dirs].entry = entry;
+                dirs[no_dirs++].mode = mode;
+            }
+            no_extracted++;
+        } else if (entry->typeflag == SYMTYPE || data == NULL) {
+            if (add_entry(&links, entry) != 0) {
+                goto out;
+            }
+        } else {
+            jobs[no_jobs].entry = entry;
+            jobs[no_jobs++].data = data;
+        }
+    }
+
+    // parallel phase: the file data
+    extract_ctx_t ctx = {.tar_fd = tar_fd, .dir_fd = dir_fd, .jobs = jobs, .no_jobs = no_jobs};
+    atomic_init(&ctx.next_job, 0);
+    atomic_init(&ctx.error, 0);
+    if (run_workers(&ctx, nthreads) != 0) {
+        goto out;
+    }
+    no_extracted += no_jobs;
+
+    // serial phase: the links, then the permissions of the directories
+    for (size_t i = 0; i < links.count; ++i) {
+        const tar_index_entry_t *entry = links.items[i];
+        const tar_index_entry_t *target = entry->typeflag == SYMTYPE ? NULL : tar_resolve(idx, entry->name);
+        if (make_link(dir_fd, entry, target, &parent, &target_parent) != 0) {
+            goto out;
+        }
+        no_extracted++;
+    }
+    for (size_t i = no_dirs; i-- > 0;) {
+        const char *name;
+        int at_fd = open_parent(dir_fd, dirs[i].entry->key, dirs[i].entry->key_len, false, &parent, &name);
+        int fd = at_fd == -1 ? -1 : open_dir(at_fd, name, false, 0);
+        if (fd == -1) {
+            goto out;
+        }
+        int chmod_res = fchmod(fd, dirs[i].mode);
+        close(fd);
+        if (chmod_res != 0) {
+            goto out;
+        }
+    }
+    res = 0;
+
+out:;
+    int err = errno;
+    close_parent(&parent);
+    close_parent(&target_parent);
+    if (dir_fd != -1) {
+        close(dir_fd);
+    }
+    free(selected.items);
+    free(links.items);
+    free(jobs);
+    free(dirs);
+    free(by_address);
+    tar_index_free(idx);
+    errno = err;
+    return res == 0 ? no_extracted : -1;
+}
@@ -0,0 +1,38 @@
+#ifndef TAR_EXTRACT_H
+#define TAR_EXTRACT_H
+
+#include <sys/types.h>
+
+/* Number of threads copying file data when tar_extract() is given zero */
+#ifndef TAR_EXTRACT_THREADS
+#define TAR_EXTRACT_THREADS 8
+#endif
+
+/* Size of the buffer of the pread()/pwrite() fallback, per thread */
+#define TAR_EXTRACT_BUF (1 << 20)
+
+/**
+ * Extracts the entries of an archive under a directory.
+ * The archive is indexed first, so when several headers share a path the last one wins as in tar_index_build().
+ * Directories are created in a serial phase, then the regular files are spread across threads which preallocate each
+ * file with fallocate() and copy its data with copy_file_range(), straight from the archive to the file without going
+ * through user space. A pread()/pwrite() loop takes over where the kernel can't copy between the two file systems.
+ * Symlinks and hardlinks are created last, once every file is written, so that a link of the archive can't redirect a
+ * write outside of dest_dir. A hardlink whose target is not extracted gets a copy of the target's data instead.
+ * The directories on the way to an entry are opened one at a time without following symlinks, and a file or a symlink
+ * found where the archive has a directory, such as one left by an earlier extraction, is replaced by the directory.
+ * Paths with a ".." component are skipped, as are device and FIFO entries. Existing files are replaced.
+ * Permissions come from the headers, minus the umask.
+ *
+ * @param tar_fd A file descriptor of an uncompressed archive.
+ * @param dest_dir The directory to extract into, created if it does not exist.
+ * @param filter A tar_find() pattern selecting the entries to extract, NULL for all of them.
+ *               The directories above a selected entry are created even if they are not selected.
+ * @param nthreads The number of threads copying file data, zero selects TAR_EXTRACT_THREADS.
+ *
+ * @return the number of entries extracted, or -1 with errno set if an entry could not be created, in which case the
+ *         extraction stops, or if the archive could not be indexed or its entries listed (ENOMEM).
+ */
+ssize_t tar_extract(int tar_fd, const char *dest_dir, const char *filter, unsigned nthreads);
+
+#endif
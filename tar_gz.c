@@ -0,0 +1,449 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "tar_gz.h"
+#include "tar_stats.h"
+
+#define WINDOW_SIZE 32768             /* deflate window, the most output a checkpoint needs to resume */
+#define INPUT_CHUNK (128 * 1024)      /* compressed bytes read at once */
+#define INDEX_MAGIC "TARGZIDX"
+#define INDEX_VERSION 1
+#define INDEX_RECORD_SIZE (3 * sizeof(uint64_t) + WINDOW_SIZE) /* a saved checkpoint: out, in, bits and its window */
+
+typedef struct {
+    off_t out;                        /* offset in the uncompressed archive */
+    off_t in;                         /* offset in the compressed file of the first full byte to inflate */
+    int bits;                         /* number of bits of the byte before `in` that belong to the next block */
+    uint8_t window[WINDOW_SIZE];      /* the 32 KiB of output before `out` */
+} checkpoint_t;
+
+/* Header of the saved index, followed by the checkpoints */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t compressed_size;
+    uint64_t uncompressed_size;
+    uint64_t span;
+    uint64_t no_checkpoints;
+} index_header_t;
+
+struct tar_gz {
+    int gz_fd;
+    off_t compressed_size;
+    off_t uncompressed_size;
+    size_t span;
+
+    checkpoint_t *checkpoints;
+    size_t no_checkpoints;
+    size_t checkpoints_capacity;
+
+    // inflate state left by the last read, so sequential reads don't go back to a checkpoint
+    pthread_mutex_t lock;
+    z_stream strm;
+    bool strm_active;
+    off_t strm_out;                   /* uncompressed offset the stream is at */
+    off_t strm_in;                    /* compressed offset of the next byte to feed it */
+    uint8_t input[INPUT_CHUNK];
+};
+
+static tar_gz_t *gz_new(int gz_fd) {
+    tar_gz_t *gz = calloc(1, sizeof(tar_gz_t));
+    if (gz == NULL) {
+        return NULL;
+    }
+    gz->gz_fd = gz_fd;
+    pthread_mutex_init(&gz->lock, NULL);
+
+    struct stat st;
+    if (fstat(gz_fd, &st) == -1) {
+        tar_gz_close(gz);
+        return NULL;
+    }
+    gz->compressed_size = st.st_size;
+    return gz;
+}
+
+void tar_gz_close(tar_gz_t *gz) {
+    if (gz == NULL) {
+        return;
+    }
+    if (gz->strm_active) {
+        inflateEnd(&gz->strm);
+    }
+    pthread_mutex_destroy(&gz->lock);
+    free(gz->checkpoints);
+    free(gz);
+}
+
+off_t tar_gz_size(tar_gz_t *gz) {
+    return gz->uncompressed_size;
+}
+
+/**
+ * Saves a checkpoint, the window being the circular output buffer of the inflate pass, with `left` bytes still free.
+ */
+static int add_checkpoint(tar_gz_t *gz, int bits, off_t in, off_t out, size_t left, const uint8_t *window) {
+    if (gz->no_checkpoints == gz->checkpoints_capacity) {
+        size_t new_capacity = gz->checkpoints_capacity == 0 ? 16 : gz->checkpoints_capacity * 2;
+        checkpoint_t *new_checkpoints = realloc(gz->checkpoints, new_capacity * sizeof(checkpoint_t));
+        if (new_checkpoints == NULL) {
+            return -1;
+        }
+        gz->checkpoints = new_checkpoints;
+        gz->checkpoints_capacity = new_capacity;
+    }
+
+    checkpoint_t *checkpoint = &gz->checkpoints[gz->no_checkpoints++];
+    checkpoint->bits = bits;
+    checkpoint->in = in;
+    checkpoint->out = out;
+    // put the circular window back in order, the oldest bytes first
+    if (left > 0) {
+        memcpy(checkpoint->window, window + WINDOW_SIZE - left, left);
+    }
+    if (left < WINDOW_SIZE) {
+        memcpy(checkpoint->window + left, window, WINDOW_SIZE - left);
+    }
+    return 0;
+}
+
+/* Inflates the whole file once, saving a checkpoint at the first block boundary after every span bytes of output */
+static int build_checkpoints(tar_gz_t *gz) {
+    uint8_t *input = malloc(INPUT_CHUNK);
+    // zeroed, as the first checkpoints save the window before any output has filled it
+    uint8_t *window = calloc(1, WINDOW_SIZE);
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (input == NULL || window == NULL || inflateInit2(&strm, 47) != Z_OK) { // 47: gzip or zlib header, 32K window
+        free(input);
+        free(window);
+        return -1;
+    }
+
+    off_t total_in = 0;
+    off_t total_out = 0;
+    off_t last = 0;
+    int ret = Z_OK;
+    strm.avail_out = 0;
+
+    do {
+        ssize_t res = pread(gz->gz_fd, input, INPUT_CHUNK, total_in);
+        TAR_STATS_ADD(read_calls, 1);
+        TAR_STATS_ADD(bytes_read, res > 0 ? res : 0);
+        if (res <= 0) {
+            ret = Z_DATA_ERROR; // the compressed file ends before the end of the stream
+            break;
+        }
+        strm.avail_in = res;
+        strm.next_in = input;
+
+        do {
+            if (strm.avail_out == 0) {
+                strm.avail_out = WINDOW_SIZE;
+                strm.next_out = window;
+            }
+
+            total_in += strm.avail_in;
+            total_out += strm.avail_out;
+            ret = inflate(&strm, Z_BLOCK); // stop at the end of every deflate block
+            total_in -= strm.avail_in;
+            total_out -= strm.avail_out;
+
+            if (ret == Z_NEED_DICT || ret == Z_MEM_ERROR || ret == Z_DATA_ERROR) {
+                ret = Z_DATA_ERROR;
+                break;
+            }
+            if (ret == Z_STREAM_END) {
+                break;
+            }
+
+            // bit 7 of data_type: at the end of a block header, bit 6: that was the last block
+            if ((strm.data_type & 128) && !(strm.data_type & 64) && (total_out == 0 || total_out - last > gz->span)) {
+                if (add_checkpoint(gz, strm.data_type & 7, total_in, total_out, strm.avail_out, window) != 0) {
+                    ret = Z_MEM_ERROR;
+                    break;
+                }
+                last = total_out;
+            }
+        } while (strm.avail_in != 0);
+    } while (ret == Z_OK || ret == Z_BUF_ERROR);
+
+    inflateEnd(&strm);
+    free(input);
+    free(window);
+
+    if (ret != Z_STREAM_END) {
+        return -1;
+    }
+    gz->uncompressed_size = total_out;
+    return 0;
+}
+
+tar_gz_t *tar_gz_open(int gz_fd, size_t span) {
+    tar_gz_t *gz = gz_new(gz_fd);
+    if (gz == NULL) {
+        return NULL;
+    }
+    gz->span = span == 0 ? TAR_GZ_SPAN : span;
+
+    if (build_checkpoints(gz) != 0) {
+        tar_gz_close(gz);
+        errno = EINVAL;
+        return NULL;
+    }
+    return gz;
+}
+
+/* pread() that retries until len bytes are transferred, returning the number of bytes that could be */
+static size_t pread_full(int fd, void *buf, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t res = pread(fd, (uint8_t *) buf + done, len - done, offset + done);
+        TAR_STATS_ADD(read_calls, 1);
+        if (res <= 0) {
+            break;
+        }
+        TAR_STATS_ADD(bytes_read, res);
+        done += res;
+    }
+    return done;
+}
+
+tar_gz_t *tar_gz_open_index(int gz_fd, int index_fd) {
+    tar_gz_t *gz = gz_new(gz_fd);
+    if (gz == NULL) {
+        return NULL;
+    }
+
+    // the file must hold exactly the checkpoints its header announces, before any of them is allocated
+    index_header_t header;
+    struct stat st;
+    if (fstat(index_fd, &st) == -1
+        || pread_full(index_fd, &header, sizeof(header), 0) != sizeof(header)
+        || memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) != 0
+        || header.version != INDEX_VERSION
+        || header.compressed_size != (uint64_t) gz->compressed_size
+        || header.uncompressed_size > (uint64_t) INT64_MAX
+        || header.no_checkpoints == 0
+        || (uint64_t) st.st_size < sizeof(header)
+        || header.no_checkpoints != ((uint64_t) st.st_size - sizeof(header)) / INDEX_RECORD_SIZE
+        || ((uint64_t) st.st_size - sizeof(header)) % INDEX_RECORD_SIZE != 0
+        || header.no_checkpoints > SIZE_MAX / sizeof(checkpoint_t)) {
+        tar_gz_close(gz);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    gz->span = header.span;
+    gz->uncompressed_size = header.uncompressed_size;
+    gz->no_checkpoints = header.no_checkpoints;
+    gz->checkpoints_capacity = header.no_checkpoints;
+    gz->checkpoints = malloc(header.no_checkpoints * sizeof(checkpoint_t));
+    if (gz->checkpoints == NULL) {
+        tar_gz_close(gz);
+        return NULL;
+    }
+
+    off_t offset = sizeof(header);
+    for (size_t i = 0; i < gz->no_checkpoints; ++i) {
+        checkpoint_t *checkpoint = &gz->checkpoints[i];
+        uint64_t fields[3];
+        // the checkpoints are searched by output offset, starting at 0, and resume inside the compressed file
+        if (pread_full(index_fd, fields, sizeof(fields), offset) != sizeof(fields)
+            || pread_full(index_fd, checkpoint->window, WINDOW_SIZE, offset + sizeof(fields)) != WINDOW_SIZE
+            || (i == 0 ? fields[0] != 0 : fields[0] <= (uint64_t) gz->checkpoints[i - 1].out)
+            || fields[0] > header.uncompressed_size
+            || fields[1] == 0 || fields[1] > header.compressed_size
+            || fields[2] > 7) {
+            tar_gz_close(gz);
+            errno = EINVAL;
+            return NULL;
+        }
+        checkpoint->out = fields[0];
+        checkpoint->in = fields[1];
+        checkpoint->bits = fields[2];
+        offset += INDEX_RECORD_SIZE;
+    }
+    return gz;
+}
+
+/* write() that retries until len bytes are written */
+static int write_full(int fd, const void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t res = write(fd, (const uint8_t *) buf + done, len - done);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += res;
+    }
+    return 0;
+}
+
+int tar_gz_save_index(tar_gz_t *gz, int index_fd) {
+    index_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.compressed_size = gz->compressed_size;
+    header.uncompressed_size = gz->uncompressed_size;
+    header.span = gz->span;
+    header.no_checkpoints = gz->no_checkpoints;
+    if (write_full(index_fd, &header, sizeof(header)) != 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < gz->no_checkpoints; ++i) {
+        checkpoint_t *checkpoint = &gz->checkpoints[i];
+        uint64_t fields[3] = {checkpoint->out, checkpoint->in, checkpoint->bits};
+        if (write_full(index_fd, fields, sizeof(fields)) != 0
+            || write_full(index_fd, checkpoint->window, WINDOW_SIZE) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Binary search of the last checkpoint at or before offset, the first one is always at 0 */
+static checkpoint_t *find_checkpoint(tar_gz_t *gz, off_t offset) {
+    size_t lo = 0;
+    size_t hi = gz->no_checkpoints;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (gz->checkpoints[mid].out <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return &gz->checkpoints[lo];
+}
+
+/* Restarts the inflate stream of the handle at the last checkpoint before offset */
+static int seek_checkpoint(tar_gz_t *gz, off_t offset) {
+    checkpoint_t *checkpoint = find_checkpoint(gz, offset);
+
+    if (gz->strm_active) {
+        inflateEnd(&gz->strm);
+        gz->strm_active = false;
+    }
+    memset(&gz->strm, 0, sizeof(gz->strm));
+    if (inflateInit2(&gz->strm, -15) != Z_OK) { // raw deflate, the checkpoint is past the gzip header
+        return -1;
+    }
+    gz->strm_active = true;
+    gz->strm_in = checkpoint->in;
+    gz->strm_out = checkpoint->out;
+
+    // the checkpoint may start in the middle of a byte
+    if (checkpoint->bits != 0) {
+        uint8_t byte;
+        if (pread_full(gz->gz_fd, &byte, 1, checkpoint->in - 1) != 1) {
+            return -1;
+        }
+        inflatePrime(&gz->strm, checkpoint->bits, byte >> (8 - checkpoint->bits));
+    }
+    // only the last `out` bytes of the window hold output when the checkpoint is near the start
+    if (checkpoint->out > 0) {
+        size_t dict_len = checkpoint->out < WINDOW_SIZE ? (size_t) checkpoint->out : WINDOW_SIZE;
+        inflateSetDictionary(&gz->strm, checkpoint->window + WINDOW_SIZE - dict_len, dict_len);
+    }
+    return 0;
+}
+
+/**
+ * Inflates len bytes of output from the current stream into dest, or discards them if dest is NULL.
+ *
+ * @return the number of bytes inflated, or -1 if the compressed data is corrupted.
+ */
+static ssize_t inflate_to(tar_gz_t *gz, uint8_t *dest, size_t len) {
+    uint8_t discard[WINDOW_SIZE];
+    size_t done = 0;
+
+    while (done < len) {
+        size_t n = len - done;
+        if (dest == NULL && n > WINDOW_SIZE) {
+            n = WINDOW_SIZE;
+        }
+        gz->strm.next_out = dest == NULL ? discard : dest + done;
+        gz->strm.avail_out = n;
+
+        if (gz->strm.avail_in == 0) {
+            size_t res = pread_full(gz->gz_fd, gz->input, INPUT_CHUNK, gz->strm_in);
+            if (res == 0) {
+                return -1;
+            }
+            gz->strm_in += res;
+            gz->strm.next_in = gz->input;
+            gz->strm.avail_in = res;
+        }
+
+        int ret = inflate(&gz->strm, Z_NO_FLUSH);
+        size_t produced = n - gz->strm.avail_out;
+        done += produced;
+        gz->strm_out += produced;
+
+        if (ret == Z_STREAM_END) {
+            break;
+        }
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            return -1;
+        }
+    }
+    return done;
+}
+
+ssize_t tar_gz_pread(tar_gz_t *gz, void *buf, size_t len, off_t offset) {
+    if (offset >= gz->uncompressed_size) {
+        return 0;
+    }
+    if (len > gz->uncompressed_size - offset) {
+        len = gz->uncompressed_size - offset;
+    }
+
+    pthread_mutex_lock(&gz->lock);
+
+    // go back to a checkpoint unless continuing the current stream is closer
+    ssize_t res = 0;
+    bool can_continue = gz->strm_active && gz->strm_out <= offset && find_checkpoint(gz, offset)->out <= gz->strm_out;
+    if (!can_continue && seek_checkpoint(gz, offset) != 0) {
+        res = -1;
+    }
+
+    if (res == 0 && inflate_to(gz, NULL, offset - gz->strm_out) < 0) {
+        res = -1;
+    }
+    if (res == 0) {
+        res = inflate_to(gz, buf, len);
+    }
+
+    if (res < 0) {
+        // the stream state is unknown after an error, start over from a checkpoint next time
+        if (gz->strm_active) {
+            inflateEnd(&gz->strm);
+            gz->strm_active = false;
+        }
+        errno = EIO;
+    }
+
+    pthread_mutex_unlock(&gz->lock);
+    return res;
+}
+
+static ssize_t gz_reader_pread(void *ctx, void *buf, size_t len, off_t offset) {
+    return tar_gz_pread(ctx, buf, len, offset);
+}
+
+tar_reader_t tar_gz_reader(tar_gz_t *gz) {
+    tar_reader_t reader = {gz_reader_pread, gz};
+    return reader;
+}
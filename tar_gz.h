@@ -0,0 +1,74 @@
+#ifndef TAR_GZ_H
+#define TAR_GZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "tar_scan.h"
+
+/* Default distance between two checkpoints, in bytes of uncompressed output */
+#ifndef TAR_GZ_SPAN
+#define TAR_GZ_SPAN (1 << 20)
+#endif
+
+/**
+ * Random access into a gzip-compressed archive.
+ *
+ * The archive is inflated once and the decompressor state (the input position and the last 32 KiB of output) is
+ * saved every span bytes of output at a deflate block boundary, so a read only inflates from the nearest checkpoint
+ * before it. The checkpoints can be saved to a file so later opens skip the inflate pass.
+ * Sequential reads continue from where the previous read stopped, reads are serialized by a lock.
+ * Only single-member gzip files are supported, anything after the end of the first member is ignored.
+ */
+typedef struct tar_gz tar_gz_t;
+
+/**
+ * Inflates the whole compressed archive once to build its checkpoints.
+ *
+ * @param gz_fd A file descriptor of a gzip-compressed tar archive, it is read with pread() and must outlive the handle.
+ * @param span The distance between two checkpoints in bytes of uncompressed output, zero selects TAR_GZ_SPAN.
+ *
+ * @return the handle, or NULL if the file is not a valid gzip file or the checkpoints could not be allocated.
+ */
+tar_gz_t *tar_gz_open(int gz_fd, size_t span);
+
+/**
+ * Opens the compressed archive with checkpoints saved by tar_gz_save_index(), without inflating it.
+ *
+ * @return the handle, or NULL if the index could not be read or does not belong to this compressed file.
+ */
+tar_gz_t *tar_gz_open_index(int gz_fd, int index_fd);
+
+/**
+ * Writes the checkpoints of the handle to a file, to be loaded back with tar_gz_open_index().
+ * The file is native-endian and meant for the machine that wrote it.
+ *
+ * @return zero on success, -1 if the file could not be written.
+ */
+int tar_gz_save_index(tar_gz_t *gz, int index_fd);
+
+/**
+ * Releases the handle. Does not close the compressed file.
+ */
+void tar_gz_close(tar_gz_t *gz);
+
+/**
+ * Size of the uncompressed archive in bytes.
+ */
+off_t tar_gz_size(tar_gz_t *gz);
+
+/**
+ * Reads from the uncompressed archive, inflating from the nearest checkpoint before offset.
+ *
+ * @return the number of bytes read, less than len only at the end of the uncompressed archive,
+ *         or -1 with errno set to EIO if the compressed data is corrupted.
+ */
+ssize_t tar_gz_pread(tar_gz_t *gz, void *buf, size_t len, off_t offset);
+
+/**
+ * Returns a reader over the uncompressed archive, so it can be scanned and indexed with tar_index_build_reader().
+ */
+tar_reader_t tar_gz_reader(tar_gz_t *gz);
+
+#endif
@@ -0,0 +1,1660 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tar_index.h"
+#include "tar_scan.h"
+#include "tar_stats.h"
+
+#define INDEX_INITIAL_CAPACITY 64
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define NO_ENTRY UINT32_MAX
+#define NO_NODE UINT32_MAX
+#define ROOT_NODE 0
+#define ROOT_ENTRY (UINT32_MAX - 1)
+
+/* Most buffers given to one preadv() call by tar_index_read_files(), the IOV_MAX of Linux */
+#define READ_BATCH_IOV 1024
+
+/* Block of the string arena, every string of the index lives in one of them until the index is freed */
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t used;
+    size_t size;
+    char data[];
+} arena_block_t;
+
+/* Resolution state of a link entry */
+enum {
+    LINK_UNRESOLVED,
+    LINK_RESOLVING,               /* on the stack of links being resolved, meeting it again means a cycle */
+    LINK_RESOLVED,
+    LINK_DANGLING,
+    LINK_LOOP
+};
+
+typedef struct {
+    tar_index_entry_t entry;
+    uint32_t next_sibling;        /* next entry in the same directory, NO_ENTRY for the last one */
+    uint32_t dir_node;            /* node of the entry if it is a directory, NO_NODE otherwise */
+    uint32_t link_target;         /* final entry a link resolves to (ROOT_ENTRY for the root), memoized by tar_index_finish() */
+    uint8_t link_state;
+} index_entry_t;
+
+/* Record of an entry in a sidecar file, the counterpart of index_entry_t with offsets in place of pointers */
+typedef struct {
+    uint64_t header_offset;
+    uint64_t data_offset;
+    uint64_t size;
+    uint64_t name;                /* offset of the NUL-terminated name in the string table */
+    uint64_t linkname;            /* offset of the NUL-terminated link target in the string table */
+    uint32_t key_start;           /* offset of the key in the name */
+    uint32_t key_len;
+    uint32_t hash;
+    uint32_t link_target;         /* record a link resolves to, ROOT_ENTRY for the root */
+    uint32_t first_child;         /* first record of a directory in archive order, NO_ENTRY if it has none */
+    uint32_t next_sibling;
+    uint8_t typeflag;
+    uint8_t link_state;
+    uint8_t reserved[6];
+} file_record_t;
+
+/**
+ * Header of a sidecar file, followed by the records sorted by key and by the string table.
+ * Numbers are stored in the byte order of the machine that wrote the file, which then fails the version check
+ * anywhere else.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t archive_size;
+    int64_t archive_mtime_sec;
+    int64_t archive_mtime_nsec;
+    uint64_t first_header_hash;   /* hash of the block at offset 0 */
+    uint64_t last_header_offset;  /* offset of the header of the last member, UINT64_MAX if there is none */
+    uint64_t last_header_hash;
+    uint64_t no_records;
+    uint64_t records_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint32_t root_first_child;
+    uint32_t reserved;
+} file_header_t;
+
+#define INDEX_FILE_MAGIC "TARIDX\0\0"
+#define INDEX_FILE_VERSION 1
+
+/* Materialization state of the entry view of a record */
+enum {
+    VIEW_EMPTY,
+    VIEW_FILLING,
+    VIEW_READY
+};
+
+/* A directory of the tree, keyed by its path, which is a slice of an entry name in the arena */
+typedef struct {
+    const char *key;
+    size_t key_len;
+    uint32_t hash;
+    uint32_t first_child;         /* entries of the directory, in archive order, NO_ENTRY if it has none */
+    uint32_t last_child;
+} dir_node_t;
+
+struct tar_index {
+    tar_reader_t reader;
+
+    // entries in the order they first appear in the archive
+    index_entry_t *entries;
+    size_t no_entries;
+    size_t entries_capacity;
+
+    // open addressing hash table, each slot holds an entry index + 1 (0 means the slot is empty)
+    uint32_t *slots;
+    size_t slots_capacity; // always a power of 2
+
+    // directory tree, node 0 being the root of the archive
+    dir_node_t *nodes;
+    size_t no_nodes;
+    size_t nodes_capacity;
+    uint32_t *node_slots; // same scheme as slots, with node indices
+    size_t node_slots_capacity;
+
+    arena_block_t *arena;
+
+    // entry indices in the byte order of their keys, for the range queries of tar_find() and tar_index_save(), the
+    // first no_sorted entries are in it. Only those need the order, so the array is brought up to date on their first
+    // use after entries were added, under sort_lock since tar_find() may be called from several threads
+    uint32_t *sorted;
+    size_t no_sorted;
+    pthread_mutex_t sort_lock;
+
+    // where the scan stopped, at the blocks that end the archive, and the global extension records met so far,
+    // so that tar_index_refresh() can carry on from there
+    off_t end_offset;
+    tar_ext_t ext;
+
+    // whether the memoized links may be out of date since the last tar_index_finish()
+    bool links_changed;           // a link was added or replaced
+    bool paths_added;             // a new path was added, which a dangling link may name
+    size_t no_dangling;
+
+    // set for an index loaded from a sidecar file, which is queried in place and is read-only
+    const uint8_t *map;
+    size_t map_size;
+    const file_record_t *records; // no_entries records, sorted by key
+    const char *strings;
+    size_t strings_size;
+    uint32_t root_first_child;
+    tar_index_entry_t *views;     // entries handed out for records, filled on first use
+    atomic_uchar *view_states;
+};
+
+size_t tar_key_length(const char *path, size_t len) {
+    while (len > 0 && path[len - 1] == '/') {
+        len--;
+    }
+    return len;
+}
+
+const char *tar_key_start(const char *path) {
+    while (path[0] == '/' || (path[0] == '.' && path[1] == '/')) {
+        path += path[0] == '/' ? 1 : 2;
+    }
+    return path;
+}
+
+size_t tar_key_parent_length(const char *key, size_t key_len) {
+    size_t parent_len = 0;
+    for (size_t i = 0; i < key_len; ++i) {
+        if (key[i] == '/') {
+            parent_len = i;
+        }
+    }
+    return parent_len;
+}
+
+uint32_t tar_key_hash(const char *key, size_t key_len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < key_len; ++i) {
+        hash ^= (unsigned char) key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Compares two keys in byte order, a key sorts before the longer keys it is a prefix of */
+static int compare_keys(const char *a, size_t a_len, const char *b, size_t b_len) {
+    int res = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (res != 0) {
+        return res;
+    }
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+static int compare_entry_keys(const void *a, const void *b) {
+    const tar_index_entry_t *x = &(*(const index_entry_t **) a)->entry;
+    const tar_index_entry_t *y = &(*(const index_entry_t **) b)->entry;
+    return compare_keys(x->key, x->key_len, y->key, y->key_len);
+}
+
+static bool is_link(const tar_index_entry_t *entry) {
+    return entry->typeflag == SYMTYPE || entry->typeflag == LNKTYPE;
+}
+
+/* Copies a NUL-terminated string into the arena */
+static char *arena_strdup(tar_index_t *idx, const char *str) {
+    size_t len = strlen(str);
+    if (idx->arena == NULL || idx->arena->size - idx->arena->used < len + 1) {
+        size_t size = len + 1 > ARENA_BLOCK_SIZE ? len + 1 : ARENA_BLOCK_SIZE;
+        arena_block_t *block = malloc(sizeof(arena_block_t) + size);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->next = idx->arena;
+        block->used = 0;
+        block->size = size;
+        idx->arena = block;
+    }
+
+    char *copy = idx->arena->data + idx->arena->used;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    idx->arena->used += len + 1;
+    return copy;
+}
+
+size_t tar_table_probe(const uint32_t *slots, size_t capacity, const char *key, size_t key_len, uint32_t hash,
+                       tar_same_key_cb_t same_key, const void *arg) {
+    size_t mask = capacity - 1;
+    size_t slot = hash & mask;
+    while (slots[slot] != 0 && !same_key(arg, slots[slot] - 1, key, key_len, hash)) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static bool entry_has_key(const void *arg, uint32_t i, const char *key, size_t key_len, uint32_t hash) {
+    const tar_index_entry_t *entry = &((const tar_index_t *) arg)->entries[i].entry;
+    return entry->hash == hash && entry->key_len == key_len && memcmp(entry->key, key, key_len) == 0;
+}
+
+static bool node_has_key(const void *arg, uint32_t i, const char *key, size_t key_len, uint32_t hash) {
+    const dir_node_t *node = &((const tar_index_t *) arg)->nodes[i];
+    return node->hash == hash && node->key_len == key_len && memcmp(node->key, key, key_len) == 0;
+}
+
+/* Returns the slot holding the key, or the empty slot where it would be inserted */
+static size_t find_slot(tar_index_t *idx, const char *key, size_t key_len, uint32_t hash) {
+    return tar_table_probe(idx->slots, idx->slots_capacity, key, key_len, hash, entry_has_key, idx);
+}
+
+static size_t find_node_slot(tar_index_t *idx, const char *key, size_t key_len, uint32_t hash) {
+    return tar_table_probe(idx->node_slots, idx->node_slots_capacity, key, key_len, hash, node_has_key, idx);
+}
+
+int tar_table_grow(uint32_t **slots, size_t *capacity, const void *items, size_t item_size, size_t hash_offset,
+                   size_t no_items) {
+    // the keys are unique so we only need to find an empty slot for each of them
+    size_t new_capacity = *capacity == 0 ? INDEX_INITIAL_CAPACITY : *capacity * 2;
+    uint32_t *new_slots = calloc(new_capacity, sizeof(uint32_t));
+    if (new_slots == NULL) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < no_items; ++i) {
+        uint32_t hash = *(const uint32_t *) ((const uint8_t *) items + i * item_size + hash_offset);
+        size_t slot = hash & (new_capacity - 1);
+        while (new_slots[slot] != 0) {
+            slot = (slot + 1) & (new_capacity - 1);
+        }
+        new_slots[slot] = i + 1;
+    }
+
+    free(*slots);
+    *slots = new_slots;
+    *capacity = new_capacity;
+    return 0;
+}
+
+/* Makes room for one more item in an array that doubles when it is full */
+static int reserve(void **items, size_t *capacity, size_t no_items, size_t item_size) {
+    if (no_items < *capacity) {
+        return 0;
+    }
+    size_t new_capacity = *capacity == 0 ? INDEX_INITIAL_CAPACITY : *capacity * 2;
+    void *new_items = realloc(*items, new_capacity * item_size);
+    if (new_items == NULL) {
+        return -1;
+    }
+    *items = new_items;
+    *capacity = new_capacity;
+    return 0;
+}
+
+/**
+ * Returns the node of the directory with the given key, creating it if needed.
+ * The key must point into the arena, since the node keeps it.
+ *
+ * @return the node index, or NO_NODE if it could not be allocated.
+ */
+static uint32_t get_node(tar_index_t *idx, const char *key, size_t key_len) {
+    uint32_t hash = tar_key_hash(key, key_len);
+    size_t slot = find_node_slot(idx, key, key_len, hash);
+    if (idx->node_slots[slot] != 0) {
+        return idx->node_slots[slot] - 1;
+    }
+
+    if ((idx->no_nodes + 1) * 2 > idx->node_slots_capacity) {
+        if (tar_table_grow(&idx->node_slots, &idx->node_slots_capacity, idx->nodes, sizeof(dir_node_t),
+                       offsetof(dir_node_t, hash), idx->no_nodes) != 0) {
+            return NO_NODE;
+        }
+        slot = find_node_slot(idx, key, key_len, hash);
+    }
+    if (reserve((void **) &idx->nodes, &idx->nodes_capacity, idx->no_nodes, sizeof(dir_node_t)) != 0) {
+        return NO_NODE;
+    }
+
+    dir_node_t *node = &idx->nodes[idx->no_nodes];
+    node->key = key;
+    node->key_len = key_len;
+    node->hash = hash;
+    node->first_child = NO_ENTRY;
+    node->last_child = NO_ENTRY;
+    idx->node_slots[slot] = ++idx->no_nodes;
+    return idx->no_nodes - 1;
+}
+
+int tar_index_add(tar_index_t *idx, const tar_member_t *member) {
+    if (idx->map != NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // keep the load factor under 1/2
+    if ((idx->no_entries + 1) * 2 > idx->slots_capacity
+        && tar_table_grow(&idx->slots, &idx->slots_capacity, idx->entries, sizeof(index_entry_t),
+                      offsetof(index_entry_t, entry.hash), idx->no_entries) != 0) {
+        return -1;
+    }
+
+    index_entry_t new_entry;
+    tar_index_entry_t *entry = &new_entry.entry;
+    entry->name = arena_strdup(idx, member->name);
+    entry->linkname = arena_strdup(idx, member->linkname);
+    if (entry->name == NULL || entry->linkname == NULL) {
+        return -1;
+    }
+    entry->key = (char *) tar_key_start(entry->name);
+    entry->key_len = tar_key_length(entry->key, strlen(entry->key));
+    entry->header_offset = member->header_offset;
+    entry->data_offset = member->data_offset;
+    entry->size = member->size;
+    entry->typeflag = member->typeflag;
+    entry->hash = tar_key_hash(entry->key, entry->key_len);
+    new_entry.next_sibling = NO_ENTRY;
+    new_entry.dir_node = NO_NODE;
+    new_entry.link_target = NO_ENTRY;
+    new_entry.link_state = LINK_UNRESOLVED;
+
+    if (entry->typeflag == DIRTYPE) {
+        new_entry.dir_node = get_node(idx, entry->key, entry->key_len);
+        if (new_entry.dir_node == NO_NODE) {
+            return -1;
+        }
+    }
+
+    size_t slot = find_slot(idx, entry->key, entry->key_len, entry->hash);
+    if (idx->slots[slot] != 0) {
+        // a later header with the same path replaces the earlier one, but keeps its place in the listing order
+        index_entry_t *old = &idx->entries[idx->slots[slot] - 1];
+        if (is_link(&old->entry) || is_link(entry)) {
+            idx->links_changed = true;
+        }
+        new_entry.next_sibling = old->next_sibling;
+        *old = new_entry;
+        return 0;
+    }
+
+    idx->paths_added = true;
+    if (is_link(entry)) {
+        idx->links_changed = true;
+    }
+
+    // attach the entry to the directory that contains it, unless it is the root itself ("./")
+    uint32_t parent = NO_NODE;
+    if (entry->key_len > 0) {
+        size_t parent_len = tar_key_parent_length(entry->key, entry->key_len);
+        parent = parent_len == 0 ? ROOT_NODE : get_node(idx, entry->key, parent_len);
+        if (parent == NO_NODE) {
+            return -1;
+        }
+    }
+
+    if (reserve((void **) &idx->entries, &idx->entries_capacity, idx->no_entries, sizeof(index_entry_t)) != 0) {
+        return -1;
+    }
+
+    uint32_t i = idx->no_entries++;
+    idx->entries[i] = new_entry;
+    idx->slots[slot] = i + 1;
+
+    if (parent == NO_NODE) {
+        return 0;
+    }
+    dir_node_t *parent_node = &idx->nodes[parent];
+    if (parent_node->last_child == NO_ENTRY) {
+        parent_node->first_child = i;
+    } else {
+        idx->entries[parent_node->last_child].next_sibling = i;
+    }
+    parent_node->last_child = i;
+    return 0;
+}
+
+/**
+ * Brings the sorted path array up to date with the entries added since the last call.
+ * The new entries are sorted on their own and merged into the array, so a refresh that appends a few entries does not
+ * sort the whole index again. A replaced entry keeps its index and its key, so its place does not change.
+ *
+ * @return zero on success, -1 if the array could not be allocated.
+ */
+static int sort_new_entries(tar_index_t *idx) {
+    size_t n = idx->no_entries;
+    size_t old = idx->no_sorted;
+    if (old == n) {
+        return 0;
+    }
+    index_entry_t **added = malloc((n - old) * sizeof(index_entry_t *));
+    uint32_t *merged = malloc(n * sizeof(uint32_t));
+    if (added == NULL || merged == NULL) {
+        free(added);
+        free(merged);
+        return -1;
+    }
+    for (size_t i = old; i < n; ++i) {
+        added[i - old] = &idx->entries[i];
+    }
+    qsort(added, n - old, sizeof(index_entry_t *), compare_entry_keys);
+
+    // the keys are unique, so no two entries compare equal
+    size_t a = 0, b = 0, r = 0;
+    while (a < old && b < n - old) {
+        const tar_index_entry_t *x = &idx->entries[idx->sorted[a]].entry;
+        const tar_index_entry_t *y = &added[b]->entry;
+        if (compare_keys(x->key, x->key_len, y->key, y->key_len) < 0) {
+            merged[r++] = idx->sorted[a++];
+        } else {
+            merged[r++] = added[b++] - idx->entries;
+        }
+    }
+    while (a < old) {
+        merged[r++] = idx->sorted[a++];
+    }
+    while (b < n - old) {
+        merged[r++] = added[b++] - idx->entries;
+    }
+
+    free(added);
+    free(idx->sorted);
+    idx->sorted = merged;
+    idx->no_sorted = n;
+    return 0;
+}
+
+tar_index_t *tar_index_new(int tar_fd) {
+    return tar_index_new_reader(tar_fd_reader(tar_fd));
+}
+
+tar_index_t *tar_index_new_reader(tar_reader_t reader) {
+    tar_index_t *idx = calloc(1, sizeof(tar_index_t));
+    if (idx == NULL) {
+        return NULL;
+    }
+    idx->reader = reader;
+    tar_ext_init(&idx->ext);
+    pthread_mutex_init(&idx->sort_lock, NULL);
+    if (tar_table_grow(&idx->slots, &idx->slots_capacity, NULL, 0, 0, 0) != 0
+        || tar_table_grow(&idx->node_slots, &idx->node_slots_capacity, NULL, 0, 0, 0) != 0
+        || get_node(idx, "", 0) != ROOT_NODE) {
+        tar_index_free(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+tar_index_t *tar_index_build(int tar_fd) {
+    return tar_index_build_reader(tar_fd_reader(tar_fd));
+}
+
+tar_index_t *tar_index_build_reader(tar_reader_t reader) {
+    tar_index_t *idx = tar_index_new_reader(reader);
+    if (idx == NULL) {
+        return NULL;
+    }
+
+    tar_scanner_t sc;
+    if (tar_scan_init_reader(&sc, reader, 0) != 0) {
+        tar_index_free(idx);
+        return NULL;
+    }
+
+    const tar_member_t *member;
+    int res;
+    while ((res = tar_scan_next_member(&sc, &member)) > 0) {
+        if (tar_index_add(idx, member) != 0) {
+            res = -1;
+            break;
+        }
+    }
+    if (res < 0) {
+        tar_scan_destroy(&sc);
+        tar_index_free(idx);
+        return NULL;
+    }
+
+    // keep the position of the end of the archive and the global records for tar_index_refresh()
+    idx->end_offset = sc.next_offset;
+    tar_ext_destroy(&idx->ext);
+    idx->ext = sc.ext;
+    tar_ext_init(&sc.ext);
+    tar_scan_destroy(&sc);
+    if (tar_index_finish(idx) != 0) {
+        tar_index_free(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+ssize_t tar_index_refresh(tar_index_t *idx, int tar_fd) {
+    if (idx->map != NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct stat st;
+    if (fstat(tar_fd, &st) != 0) {
+        return -1;
+    }
+    if (st.st_size < idx->end_offset) {
+        errno = ESTALE; // the archive was truncated or replaced, it is not append-only
+        return -1;
+    }
+
+    tar_scanner_t sc;
+    if (tar_scan_init(&sc, tar_fd, 0) != 0) {
+        return -1;
+    }
+    // new headers overwrite the blocks that ended the archive, the scan starts there
+    sc.next_offset = idx->end_offset;
+    tar_ext_destroy(&sc.ext);
+    sc.ext = idx->ext;
+    tar_ext_init(&idx->ext);
+
+    ssize_t no_added = 0;
+    const tar_member_t *member;
+    int res;
+    while ((res = tar_scan_next_member(&sc, &member)) > 0) {
+        if (tar_index_add(idx, member) != 0) {
+            res = -1;
+            break;
+        }
+        no_added++;
+    }
+
+    idx->ext = sc.ext;
+    tar_ext_init(&sc.ext);
+    if (res == 0) {
+        idx->end_offset = sc.next_offset;
+    }
+    tar_scan_destroy(&sc);
+
+    // the links only need to be resolved again if one of them changed, or if a new path may fix a dangling one, the
+    // new paths take their place in the sorted array on its next use
+    if ((idx->links_changed || (idx->paths_added && idx->no_dangling > 0)) && tar_index_finish(idx) != 0) {
+        res = -1;
+    }
+    idx->links_changed = false;
+    idx->paths_added = false;
+    return res < 0 ? -1 : no_added;
+}
+
+void tar_index_free(tar_index_t *idx) {
+    if (idx == NULL) {
+        return;
+    }
+    while (idx->arena != NULL) {
+        arena_block_t *next = idx->arena->next;
+        free(idx->arena);
+        idx->arena = next;
+    }
+    free(idx->entries);
+    free(idx->slots);
+    free(idx->nodes);
+    free(idx->node_slots);
+    free(idx->sorted);
+    pthread_mutex_destroy(&idx->sort_lock);
+    if (idx->map != NULL) {
+        munmap((void *) idx->map, idx->map_size);
+    }
+    free(idx->views);
+    free(idx->view_states);
+    tar_ext_destroy(&idx->ext);
+    free(idx);
+}
+
+/* String at an offset of the string table of a sidecar file, which ends with a NUL */
+static const char *file_string(tar_index_t *idx, uint64_t offset) {
+    return offset < idx->strings_size ? idx->strings + offset : idx->strings + idx->strings_size - 1;
+}
+
+/* Key of a record of a sidecar file, clamped to the name it is part of so that a corrupt record can't point past it */
+static const char *record_key(tar_index_t *idx, const file_record_t *record, size_t *key_len) {
+    const char *name = file_string(idx, record->name);
+    size_t name_len = strlen(name);
+    size_t key_start = record->key_start <= name_len ? record->key_start : name_len;
+    *key_len = record->key_len <= name_len - key_start ? record->key_len : name_len - key_start;
+    return name + key_start;
+}
+
+/* Fills the entry handed out for a record of a sidecar file */
+static void fill_view(tar_index_t *idx, uint32_t i) {
+    const file_record_t *record = &idx->records[i];
+    tar_index_entry_t *view = &idx->views[i];
+    view->name = (char *) file_string(idx, record->name);
+    view->linkname = (char *) file_string(idx, record->linkname);
+    view->key = (char *) record_key(idx, record, &view->key_len);
+    view->header_offset = record->header_offset;
+    view->data_offset = record->data_offset;
+    view->size = record->size;
+    view->typeflag = record->typeflag;
+    view->hash = record->hash;
+}
+
+/**
+ * Entry at index i. The entries of a loaded index are made from its records the first time they are used, so that
+ * loading does not touch every record.
+ */
+static const tar_index_entry_t *entry_at(tar_index_t *idx, uint32_t i) {
+    if (idx->map == NULL) {
+        return &idx->entries[i].entry;
+    }
+
+    atomic_uchar *state = &idx->view_states[i];
+    if (atomic_load_explicit(state, memory_order_acquire) != VIEW_READY) {
+        unsigned char expected = VIEW_EMPTY;
+        if (atomic_compare_exchange_strong(state, &expected, VIEW_FILLING)) {
+            fill_view(idx, i);
+            atomic_store_explicit(state, VIEW_READY, memory_order_release);
+        } else {
+            // another thread is filling it
+            while (atomic_load_explicit(state, memory_order_acquire) != VIEW_READY) {
+                sched_yield();
+            }
+        }
+    }
+    return &idx->views[i];
+}
+
+/* Number of entries in the sorted path array: the records of a sidecar file are already sorted */
+static size_t no_sorted(tar_index_t *idx) {
+    return idx->map != NULL ? idx->no_entries : idx->no_sorted;
+}
+
+/* Index of the entry at a position of the sorted path array */
+static uint32_t sorted_entry(tar_index_t *idx, size_t r) {
+    return idx->map != NULL ? r : idx->sorted[r];
+}
+
+/* Key of the entry at a position of the sorted path array */
+static const char *sorted_key(tar_index_t *idx, size_t r, size_t *key_len) {
+    if (idx->map != NULL) {
+        return record_key(idx, &idx->records[r], key_len);
+    }
+    const tar_index_entry_t *entry = &idx->entries[idx->sorted[r]].entry;
+    *key_len = entry->key_len;
+    return entry->key;
+}
+
+/* Position of the first key of the sorted path array that does not sort before the given key */
+static size_t lower_bound(tar_index_t *idx, const char *key, size_t key_len) {
+    size_t low = 0;
+    size_t high = no_sorted(idx);
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        size_t mid_len;
+        const char *mid_key = sorted_key(idx, mid, &mid_len);
+        if (compare_keys(mid_key, mid_len, key, key_len) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/* Index of the entry with the given key, or NO_ENTRY */
+static uint32_t lookup_key(tar_index_t *idx, const char *key, size_t key_len) {
+    uint32_t i = NO_ENTRY;
+    if (idx->map == NULL) {
+        size_t slot = find_slot(idx, key, key_len, tar_key_hash(key, key_len));
+        if (idx->slots[slot] != 0) {
+            i = idx->slots[slot] - 1;
+        }
+    } else {
+        // binary search in the sorted records
+        size_t r = lower_bound(idx, key, key_len);
+        if (r < idx->no_entries) {
+            size_t found_len;
+            const char *found = sorted_key(idx, r, &found_len);
+            i = compare_keys(found, found_len, key, key_len) == 0 ? r : NO_ENTRY;
+        }
+    }
+    if (i == NO_ENTRY) {
+        TAR_STATS_ADD(index_misses, 1);
+    } else {
+        TAR_STATS_ADD(index_hits, 1);
+    }
+    return i;
+}
+
+/* A record index read from a sidecar file, NO_ENTRY if it is out of range */
+static uint32_t checked_record(tar_index_t *idx, uint32_t i) {
+    return i < idx->no_entries || i == ROOT_ENTRY ? i : NO_ENTRY;
+}
+
+/**
+ * First child of a directory, in archive order.
+ *
+ * @param i The entry of the directory, ROOT_ENTRY for the root.
+ * @param first Set to the first child, NO_ENTRY if the directory is empty.
+ *
+ * @return whether the entry is a directory.
+ */
+static bool first_child(tar_index_t *idx, uint32_t i, uint32_t *first) {
+    if (idx->map != NULL) {
+        if (i != ROOT_ENTRY && idx->records[i].typeflag != DIRTYPE) {
+            return false;
+        }
+        *first = checked_record(idx, i == ROOT_ENTRY ? idx->root_first_child : idx->records[i].first_child);
+        return true;
+    }
+
+    uint32_t node = i == ROOT_ENTRY ? ROOT_NODE : idx->entries[i].dir_node;
+    if (node == NO_NODE) {
+        return false;
+    }
+    *first = idx->nodes[node].first_child;
+    return true;
+}
+
+/* Next entry in the same directory, NO_ENTRY for the last one */
+static uint32_t next_sibling(tar_index_t *idx, uint32_t i) {
+    if (idx->map != NULL) {
+        uint32_t next = checked_record(idx, idx->records[i].next_sibling);
+        return next == ROOT_ENTRY ? NO_ENTRY : next;
+    }
+    return idx->entries[i].next_sibling;
+}
+
+const tar_index_entry_t *tar_index_lookup(tar_index_t *idx, const char *path) {
+    const char *key = tar_key_start(path);
+    uint32_t i = lookup_key(idx, key, tar_key_length(key, strlen(key)));
+    return i == NO_ENTRY ? NULL : entry_at(idx, i);
+}
+
+/* Index of the entry at a resolved path, ROOT_ENTRY for the root when the archive has no "./" entry */
+static uint32_t lookup_resolved(tar_index_t *idx, const char *path, size_t len) {
+    uint32_t i = lookup_key(idx, path, len);
+    return i == NO_ENTRY && len == 0 ? ROOT_ENTRY : i;
+}
+
+int tar_walk_path(char *buf, size_t *len, const char *path, bool follow_last, int depth, tar_follow_cb_t follow,
+                  void *arg) {
+    const char *p = path;
+    while (*p != '\0') {
+        while (*p == '/') {
+            p++;
+        }
+        const char *component = p;
+        while (*p != '\0' && *p != '/') {
+            p++;
+        }
+        size_t component_len = p - component;
+        const char *rest = p;
+        while (*rest == '/') {
+            rest++;
+        }
+        bool last = *rest == '\0';
+
+        if (component_len == 0 || (component_len == 1 && component[0] == '.')) {
+            continue;
+        }
+        if (component_len == 2 && component[0] == '.' && component[1] == '.') {
+            *len = tar_key_parent_length(buf, *len); // ".." at the root stays at the root
+            continue;
+        }
+
+        if (*len + 1 + component_len + 1 > TAR_PATH_MAX) {
+            return ENAMETOOLONG;
+        }
+        if (*len > 0) {
+            buf[(*len)++] = '/';
+        }
+        memcpy(buf + *len, component, component_len);
+        *len += component_len;
+
+        if (last && !follow_last) {
+            break;
+        }
+        int err = follow(arg, buf, len, depth + 1);
+        if (err != 0) {
+            return err;
+        }
+    }
+    return 0;
+}
+
+int tar_walk_link(const tar_index_entry_t *link, char *buf, size_t *len, int depth, tar_follow_cb_t follow,
+                  void *arg) {
+    *len = 0;
+    if (link->typeflag == SYMTYPE && link->linkname[0] != '/') {
+        *len = tar_key_parent_length(link->key, link->key_len);
+        memcpy(buf, link->key, *len);
+    }
+    return tar_walk_path(buf, len, link->linkname, true, depth, follow, arg);
+}
+
+static int resolve_link(tar_index_t *idx, uint32_t i, int depth, uint32_t *target);
+
+/* Replaces a resolved path by the key of the entry its link resolves to, see tar_follow_cb_t */
+static int follow_link(void *arg, char *buf, size_t *len, int depth) {
+    tar_index_t *idx = arg;
+
+    // a missing component may still be a directory that has no header of its own
+    uint32_t i = lookup_key(idx, buf, *len);
+    if (i == NO_ENTRY || !is_link(entry_at(idx, i))) {
+        return 0;
+    }
+
+    uint32_t target;
+    int err = resolve_link(idx, i, depth, &target);
+    if (err != 0) {
+        return err;
+    }
+    if (target == ROOT_ENTRY) {
+        *len = 0;
+    } else {
+        const tar_index_entry_t *entry = entry_at(idx, target);
+        memcpy(buf, entry->key, entry->key_len);
+        *len = entry->key_len;
+    }
+    return 0;
+}
+
+/**
+ * Resolves the link at index i to its final entry, following chains of links, and memoizes the result.
+ *
+ * @return zero on success, or an errno value as tar_walk_path().
+ */
+static int resolve_link(tar_index_t *idx, uint32_t i, int depth, uint32_t *target) {
+    TAR_STATS_ADD(link_resolutions, 1);
+    if (idx->map != NULL) {
+        // every link of a saved index was resolved before it was saved
+        const file_record_t *record = &idx->records[i];
+        if (record->link_state == LINK_RESOLVED) {
+            *target = checked_record(idx, record->link_target);
+            return *target == NO_ENTRY ? ENOENT : 0;
+        }
+        return record->link_state == LINK_LOOP ? ELOOP : ENOENT;
+    }
+
+    index_entry_t *link = &idx->entries[i];
+    switch (link->link_state) {
+        case LINK_RESOLVED:
+            *target = link->link_target;
+            return 0;
+        case LINK_DANGLING:
+            return ENOENT;
+        case LINK_RESOLVING:
+        case LINK_LOOP:
+            return ELOOP;
+    }
+    if (depth > TAR_MAX_LINK_HOPS) {
+        return ELOOP;
+    }
+
+    link->link_state = LINK_RESOLVING;
+
+    char buf[TAR_PATH_MAX];
+    size_t len;
+    int err = tar_walk_link(&link->entry, buf, &len, depth, follow_link, idx);
+    uint32_t resolved = lookup_resolved(idx, buf, len);
+    if (err == 0 && resolved == NO_ENTRY) {
+        err = ENOENT;
+    }
+
+    // the entries array may not move during the resolution, but take the pointer again to be safe
+    link = &idx->entries[i];
+    if (err != 0) {
+        link->link_state = err == ELOOP ? LINK_LOOP : LINK_DANGLING;
+        return err;
+    }
+    link->link_state = LINK_RESOLVED;
+    link->link_target = resolved;
+    *target = resolved;
+    return 0;
+}
+
+/**
+ * Resolves a path to the index of its entry, ROOT_ENTRY for the root of the archive.
+ * Once tar_index_finish() has memoized every link, this only reads the index.
+ *
+ * @return zero on success, or an errno value: ENOENT if no entry exists at the path, ELOOP, ENAMETOOLONG.
+ */
+static int resolve(tar_index_t *idx, const char *path, bool follow_last, uint32_t *out) {
+    // fast path: the path is the key of an entry, as it almost always is
+    const char *key = tar_key_start(path);
+    uint32_t i = lookup_key(idx, key, tar_key_length(key, strlen(key)));
+    if (i != NO_ENTRY) {
+        if (follow_last && is_link(entry_at(idx, i))) {
+            return resolve_link(idx, i, 0, out);
+        }
+        *out = i;
+        return 0;
+    }
+
+    char buf[TAR_PATH_MAX];
+    size_t len = 0;
+    int err = tar_walk_path(buf, &len, path, follow_last, 0, follow_link, idx);
+    if (err != 0) {
+        return err;
+    }
+    *out = lookup_resolved(idx, buf, len);
+    return *out == NO_ENTRY ? ENOENT : 0;
+}
+
+int tar_index_finish(tar_index_t *idx) {
+    if (idx->map != NULL) {
+        return 0; // already resolved when it was saved
+    }
+
+    // the entries may have changed since the last call, so every link is resolved again
+    for (size_t i = 0; i < idx->no_entries; ++i) {
+        idx->entries[i].link_state = LINK_UNRESOLVED;
+        idx->entries[i].link_target = NO_ENTRY;
+    }
+    idx->no_dangling = 0;
+    for (size_t i = 0; i < idx->no_entries; ++i) {
+        if (is_link(&idx->entries[i].entry)) {
+            uint32_t target;
+            if (resolve_link(idx, i, 0, &target) == ENOENT) {
+                idx->no_dangling++;
+            }
+        }
+    }
+    idx->links_changed = false;
+    idx->paths_added = false;
+    return 0;
+}
+
+const tar_index_entry_t *tar_resolve(tar_index_t *idx, const char *path) {
+    uint32_t i;
+    int err = resolve(idx, path, true, &i);
+    if (err == 0 && i == ROOT_ENTRY) {
+        err = EISDIR; // the root of the archive has no entry
+    }
+    if (err != 0) {
+        errno = err;
+        return NULL;
+    }
+    return entry_at(idx, i);
+}
+
+/* Entry a path names without following a link in its last component, NULL if there is none */
+static const tar_index_entry_t *lookup_nofollow(tar_index_t *idx, const char *path) {
+    uint32_t i;
+    if (resolve(idx, path, false, &i) != 0 || i == ROOT_ENTRY) {
+        return NULL;
+    }
+    return entry_at(idx, i);
+}
+
+int tar_index_check_file_type(tar_index_t *idx, char *path, char typeflag) {
+    const tar_index_entry_t *entry = lookup_nofollow(idx, path);
+    if (entry == NULL) {
+        return 0;
+    }
+
+    // if the argument typeflag is REGTYPE, then we also want to check if the file perhaps has the old regular type AREGTYPE
+    return entry->typeflag == typeflag || (typeflag == REGTYPE && entry->typeflag == AREGTYPE);
+}
+
+int tar_index_exists(tar_index_t *idx, char *path) {
+    return lookup_nofollow(idx, path) != NULL;
+}
+
+int tar_index_is_dir(tar_index_t *idx, char *path) {
+    return tar_index_check_file_type(idx, path, DIRTYPE);
+}
+
+int tar_index_is_file(tar_index_t *idx, char *path) {
+    return tar_index_check_file_type(idx, path, REGTYPE);
+}
+
+int tar_index_is_symlink(tar_index_t *idx, char *path) {
+    return tar_index_check_file_type(idx, path, SYMTYPE);
+}
+
+int tar_index_list(tar_index_t *idx, char *path, char **entries, size_t *no_entries) {
+    // a link is resolved to its linked-to directory, "" and "." both list the root of the archive
+    uint32_t i;
+    uint32_t child;
+    if (resolve(idx, path, true, &i) != 0 || !first_child(idx, i, &child)) {
+        *no_entries = 0;
+        return 0;
+    }
+
+    size_t current = 0;
+    for (; child != NO_ENTRY && current < *no_entries; child = next_sibling(idx, child)) {
+        strcpy(entries[current++], entry_at(idx, child)->name);
+    }
+
+    *no_entries = current;
+    return 1;
+}
+
+ssize_t tar_index_children(tar_index_t *idx, char *path, tar_find_cb_t callback, void *arg) {
+    uint32_t i;
+    uint32_t child;
+    if (resolve(idx, path, true, &i) != 0 || !first_child(idx, i, &child)) {
+        return -1;
+    }
+
+    ssize_t count = 0;
+    for (; child != NO_ENTRY; child = next_sibling(idx, child)) {
+        count++;
+        if (callback(arg, entry_at(idx, child)) != 0) {
+            break;
+        }
+    }
+    return count;
+}
+
+/* Whether a character has a meaning in a tar_find() pattern */
+static bool is_pattern_char(char c) {
+    return c == '*' || c == '?' || c == '[' || c == '\\';
+}
+
+/**
+ * Matches a character against the bracket expression at the start of a pattern, such as "[a-z]" or "[!0-9]".
+ *
+ * @param matched Set to whether the character is in the set.
+ *
+ * @return the end of the expression, or NULL if it is not closed and the '[' is an ordinary character.
+ */
+static const char *match_bracket(const char *p, const char *end, char c, bool *matched) {
+    p++;
+    bool negate = p < end && (*p == '!' || *p == '^');
+    if (negate) {
+        p++;
+    }
+    *matched = false;
+    // a ']' right after the opening bracket is part of the set
+    bool first = true;
+    while (p < end && (*p != ']' || first)) {
+        first = false;
+        char low = *p++;
+        if (low == '\\' && p < end) {
+            low = *p++;
+        }
+        char high = low;
+        if (p + 1 < end && *p == '-' && p[1] != ']') {
+            high = p[1];
+            p += 2;
+            if (high == '\\' && p < end) {
+                high = *p++;
+            }
+        }
+        if ((unsigned char) c >= (unsigned char) low && (unsigned char) c <= (unsigned char) high) {
+            *matched = true;
+        }
+    }
+    if (p == end) {
+        return NULL;
+    }
+    *matched ^= negate;
+    return p + 1;
+}
+
+/**
+ * Matches a key against a glob pattern: '*' matches any characters but '/', '?' a single one and "[...]" one of a
+ * set, while "**" matches across directories, "**" followed by a slash also matching no directory at all.
+ * A backslash makes the next character an ordinary one.
+ */
+static bool glob_match(const char *p, const char *p_end, const char *s, const char *s_end) {
+    while (p < p_end) {
+        if (*p == '*') {
+            if (p + 1 < p_end && p[1] == '*') {
+                const char *rest = p + 2;
+                if (rest < p_end && *rest == '/' && glob_match(rest + 1, p_end, s, s_end)) {
+                    return true;
+                }
+                for (const char *t = s; t <= s_end; ++t) {
+                    if (glob_match(rest, p_end, t, s_end)) {
+                        return true;
+                    }
+                }
+                return false;
+            }
+            for (const char *t = s;; ++t) {
+                if (glob_match(p + 1, p_end, t, s_end)) {
+                    return true;
+                }
+                if (t == s_end || *t == '/') {
+                    return false;
+                }
+            }
+        }
+        if (s == s_end) {
+            return false;
+        }
+
+        if (*p == '?') {
+            if (*s == '/') {
+                return false;
+            }
+            p++;
+            s++;
+            continue;
+        }
+        if (*p == '[') {
+            bool matched;
+            const char *next = match_bracket(p, p_end, *s, &matched);
+            if (next != NULL) {
+                if (!matched || *s == '/') {
+                    return false;
+                }
+                p = next;
+                s++;
+                continue;
+            }
+        }
+        if (*p == '\\' && p + 1 < p_end) {
+            p++;
+        }
+        if (*p != *s) {
+            return false;
+        }
+        p++;
+        s++;
+    }
+    return s == s_end;
+}
+
+ssize_t tar_find(tar_index_t *idx, const char *pattern, tar_find_cb_t callback, void *arg) {
+    const char *p = tar_key_start(pattern);
+    size_t p_len = tar_key_length(p, strlen(p));
+
+    // the pattern is a plain path, or starts with one that all the keys it matches share
+    size_t literal_len = 0;
+    while (literal_len < p_len && !is_pattern_char(p[literal_len])) {
+        literal_len++;
+    }
+    if (literal_len == p_len) {
+        uint32_t i = lookup_key(idx, p, p_len);
+        if (i == NO_ENTRY) {
+            return 0;
+        }
+        callback(arg, entry_at(idx, i));
+        return 1;
+    }
+
+    // the keys that start with the literal part are consecutive in the sorted array
+    if (idx->map == NULL) {
+        pthread_mutex_lock(&idx->sort_lock);
+        int res = sort_new_entries(idx);
+        pthread_mutex_unlock(&idx->sort_lock);
+        if (res != 0) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    ssize_t no_matches = 0;
+    size_t n = no_sorted(idx);
+    for (size_t r = lower_bound(idx, p, literal_len); r < n; ++r) {
+        size_t key_len;
+        const char *key = sorted_key(idx, r, &key_len);
+        if (key_len < literal_len || memcmp(key, p, literal_len) != 0) {
+            break;
+        }
+        // the "./" entry of the root has an empty key, and is not a path a pattern names
+        if (key_len == 0 || !glob_match(p + literal_len, p + p_len, key + literal_len, key + key_len)) {
+            continue;
+        }
+        no_matches++;
+        if (callback(arg, entry_at(idx, sorted_entry(idx, r))) != 0) {
+            break;
+        }
+    }
+    return no_matches;
+}
+
+const tar_index_entry_t *tar_index_lookup_file(tar_index_t *idx, const char *path) {
+    const tar_index_entry_t *entry = tar_resolve(idx, path);
+    if (entry == NULL || (entry->typeflag != REGTYPE && entry->typeflag != AREGTYPE)) {
+        return NULL;
+    }
+    return entry;
+}
+
+ssize_t tar_index_read_file(tar_index_t *idx, char *path, size_t offset, uint8_t *dest, size_t *len) {
+    const tar_index_entry_t *entry = tar_index_lookup_file(idx, path);
+    if (entry == NULL) {
+        return -1;
+    }
+
+    if (offset > entry->size) {
+        return -2;
+    }
+
+    if (*len > entry->size - offset) {
+        *len = entry->size - offset;
+    }
+
+    // a single pread() transfers at most about 2 GiB on Linux, so large reads take several calls
+    size_t done = 0;
+    while (done < *len) {
+        ssize_t res = idx->reader.pread(idx->reader.ctx, (void *) (dest + done), *len - done,
+                                        entry->data_offset + offset + done);
+        if (res == -1) {
+            perror("Failed to read from file");
+            exit(EXIT_FAILURE);
+        }
+        if (res == 0) {
+            break;
+        }
+        done += res;
+    }
+
+    *len = done;
+
+    return (ssize_t) (entry->size - done - offset);
+}
+
+/* One read of a batch, as a range of the archive */
+typedef struct {
+    uint64_t start;
+    size_t len;
+    size_t req;                   /* index of the request it belongs to */
+} read_range_t;
+
+static int compare_ranges(const void *a, const void *b) {
+    const read_range_t *x = a, *y = b;
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+/**
+ * Reads consecutive bytes of the archive into several buffers, with preadv() when the reader has it.
+ * Short reads are resumed, so this only stops early at the end of the archive. The buffers are modified.
+ *
+ * @return the number of bytes read.
+ */
+static size_t read_vector(tar_index_t *idx, struct iovec *iov, int iovcnt, uint64_t offset) {
+    size_t done = 0;
+    while (iovcnt > 0) {
+        ssize_t res;
+        if (idx->reader.preadv != NULL) {
+            res = idx->reader.preadv(idx->reader.ctx, iov, iovcnt, offset + done);
+        } else {
+            res = idx->reader.pread(idx->reader.ctx, iov->iov_base, iov->iov_len, offset + done);
+        }
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to read from file");
+            exit(EXIT_FAILURE);
+        }
+        if (res == 0) {
+            break;
+        }
+        done += res;
+
+        // skip the buffers that were filled, and the filled part of the next one
+        while (iovcnt > 0 && (size_t) res >= iov->iov_len) {
+            res -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + res;
+            iov->iov_len -= res;
+        }
+    }
+    return done;
+}
+
+ssize_t tar_index_read_files(tar_index_t *idx, const tar_read_req_t *reqs, size_t n) {
+    read_range_t *ranges = malloc((n + 1) * sizeof(read_range_t));
+    struct iovec *iov = malloc(READ_BATCH_IOV * sizeof(struct iovec));
+    // the gaps between merged ranges are read into a scratch buffer shared by all of them, allocated before any
+    // result is set so that a failed allocation leaves the results alone
+    uint8_t *gap_buf = n > 1 ? malloc(TAR_READ_MERGE_GAP) : NULL;
+    if (ranges == NULL || iov == NULL || (n > 1 && gap_buf == NULL)) {
+        free(ranges);
+        free(iov);
+        free(gap_buf);
+        return -1;
+    }
+
+    // resolve every path first, the results of reads with nothing to read are already known
+    size_t no_ranges = 0;
+    ssize_t no_read = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const tar_index_entry_t *entry = tar_index_lookup_file(idx, reqs[i].path);
+        if (entry == NULL) {
+            *reqs[i].result = -1;
+            continue;
+        }
+        if (reqs[i].offset > entry->size) {
+            *reqs[i].result = -2;
+            continue;
+        }
+        if (*reqs[i].len > entry->size - reqs[i].offset) {
+            *reqs[i].len = entry->size - reqs[i].offset;
+        }
+        no_read++;
+        if (*reqs[i].len == 0) {
+            *reqs[i].result = (ssize_t) (entry->size - reqs[i].offset);
+            continue;
+        }
+        ranges[no_ranges].start = entry->data_offset + reqs[i].offset;
+        ranges[no_ranges].len = *reqs[i].len;
+        ranges[no_ranges].req = i;
+        // the result is fixed once the number of bytes read is known
+        *reqs[i].result = (ssize_t) (entry->size - reqs[i].offset);
+        no_ranges++;
+    }
+
+    qsort(ranges, no_ranges, sizeof(read_range_t), compare_ranges);
+
+    size_t first = 0;
+    while (first < no_ranges) {
+        // grow the batch while the next range starts at most TAR_READ_MERGE_GAP bytes after the end of the batch
+        uint64_t end = ranges[first].start + ranges[first].len;
+        int iovcnt = 1;
+        size_t last = first + 1;
+        while (last < no_ranges && ranges[last].start >= end && ranges[last].start - end <= TAR_READ_MERGE_GAP
+               && iovcnt + 2 <= READ_BATCH_IOV) {
+            if (ranges[last].start > end) {
+                iovcnt++;
+            }
+            end = ranges[last].start + ranges[last].len;
+            iovcnt++;
+            last++;
+        }
+
+        iovcnt = 0;
+        for (size_t k = first; k < last; ++k) {
+            if (k > first && ranges[k].start > ranges[k - 1].start + ranges[k - 1].len) {
+                iov[iovcnt].iov_base = gap_buf;
+                iov[iovcnt++].iov_len = ranges[k].start - (ranges[k - 1].start + ranges[k - 1].len);
+            }
+            iov[iovcnt].iov_base = reqs[ranges[k].req].dest;
+            iov[iovcnt++].iov_len = ranges[k].len;
+        }
+
+        size_t done = read_vector(idx, iov, iovcnt, ranges[first].start);
+
+        // a read cut short by the end of the archive only got part of its bytes
+        for (size_t k = first; k < last; ++k) {
+            uint64_t position = ranges[k].start - ranges[first].start;
+            size_t got = done <= position ? 0 : done - position < ranges[k].len ? done - position : ranges[k].len;
+            const tar_read_req_t *req = &reqs[ranges[k].req];
+            *req->len = got;
+            *req->result -= got;
+        }
+        first = last;
+    }
+
+    free(gap_buf);
+    free(ranges);
+    free(iov);
+    return no_read;
+}
+
+/* FNV-1a hash of the 512-byte block at an offset of the archive, a block cut short by the end is padded with 0s */
+static uint64_t block_hash(int tar_fd, uint64_t offset) {
+    uint8_t block[sizeof(tar_header_t)] = {0};
+    size_t done = 0;
+    while (done < sizeof(block)) {
+        ssize_t res = pread(tar_fd, block + done, sizeof(block) - done, offset + done);
+        TAR_STATS_ADD(read_calls, 1);
+        TAR_STATS_ADD(bytes_read, res > 0 ? res : 0);
+        if (res == -1) {
+            perror("Failed to read header from file");
+            exit(EXIT_FAILURE);
+        }
+        if (res == 0) {
+            break;
+        }
+        done += res;
+    }
+
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < sizeof(block); ++i) {
+        hash ^= block[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Fills the fields of a sidecar header that identify the archive */
+static int describe_archive(int tar_fd, uint64_t last_header_offset, file_header_t *header) {
+    struct stat st;
+    if (fstat(tar_fd, &st) != 0) {
+        return -1;
+    }
+    header->archive_size = st.st_size;
+    header->archive_mtime_sec = st.st_mtim.tv_sec;
+    header->archive_mtime_nsec = st.st_mtim.tv_nsec;
+    header->first_header_hash = block_hash(tar_fd, 0);
+    header->last_header_offset = last_header_offset;
+    header->last_header_hash = last_header_offset == UINT64_MAX ? 0 : block_hash(tar_fd, last_header_offset);
+    return 0;
+}
+
+/* Writes a whole buffer to a descriptor */
+static int write_all(int fd, const void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t res = write(fd, (const uint8_t *) buf + done, len - done);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += res;
+    }
+    return 0;
+}
+
+int tar_index_save(tar_index_t *idx, int tar_fd, const char *path) {
+    if (idx->map != NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // the records are in the order of the sorted path array, rank maps an entry to its record
+    size_t n = idx->no_entries;
+    uint32_t *rank = malloc((n + 1) * sizeof(uint32_t));
+    pthread_mutex_lock(&idx->sort_lock);
+    int sorted = rank != NULL ? sort_new_entries(idx) : -1;
+    pthread_mutex_unlock(&idx->sort_lock);
+    if (sorted != 0) {
+        free(rank);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (size_t r = 0; r < n; ++r) {
+        rank[idx->sorted[r]] = r;
+    }
+
+    size_t strings_size = 1; // an empty string at offset 0 ends the table
+    uint64_t last_header_offset = UINT64_MAX;
+    for (size_t i = 0; i < n; ++i) {
+        strings_size += strlen(idx->entries[i].entry.name) + 1 + strlen(idx->entries[i].entry.linkname) + 1;
+        if (last_header_offset == UINT64_MAX || (uint64_t) idx->entries[i].entry.header_offset > last_header_offset) {
+            last_header_offset = idx->entries[i].entry.header_offset;
+        }
+    }
+
+    size_t records_offset = sizeof(file_header_t);
+    size_t strings_offset = records_offset + n * sizeof(file_record_t);
+    size_t file_size = strings_offset + strings_size;
+    uint8_t *image = calloc(1, file_size);
+    if (image == NULL) {
+        free(rank);
+        return -1;
+    }
+
+    file_header_t *header = (file_header_t *) image;
+    memcpy(header->magic, INDEX_FILE_MAGIC, sizeof(header->magic));
+    header->version = INDEX_FILE_VERSION;
+    header->record_size = sizeof(file_record_t);
+    header->no_records = n;
+    header->records_offset = records_offset;
+    header->strings_offset = strings_offset;
+    header->strings_size = strings_size;
+    uint32_t root_first = idx->nodes[ROOT_NODE].first_child;
+    header->root_first_child = root_first == NO_ENTRY ? NO_ENTRY : rank[root_first];
+
+    char *strings = (char *) image + strings_offset;
+    size_t used = 1;
+    file_record_t *records = (file_record_t *) (image + records_offset);
+    for (size_t r = 0; r < n; ++r) {
+        const index_entry_t *e = &idx->entries[idx->sorted[r]];
+        file_record_t *record = &records[r];
+        record->header_offset = e->entry.header_offset;
+        record->data_offset = e->entry.data_offset;
+        record->size = e->entry.size;
+        record->key_start = e->entry.key - e->entry.name;
+        record->key_len = e->entry.key_len;
+        record->hash = e->entry.hash;
+        record->typeflag = e->entry.typeflag;
+        record->link_state = e->link_state;
+        record->link_target = e->link_target == NO_ENTRY || e->link_target == ROOT_ENTRY ? e->link_target
+                                                                                       : rank[e->link_target];
+        record->next_sibling = e->next_sibling == NO_ENTRY ? NO_ENTRY : rank[e->next_sibling];
+        record->first_child = NO_ENTRY;
+        if (e->dir_node != NO_NODE && idx->nodes[e->dir_node].first_child != NO_ENTRY) {
+            record->first_child = rank[idx->nodes[e->dir_node].first_child];
+        }
+
+        size_t len = strlen(e->entry.name) + 1;
+        memcpy(strings + used, e->entry.name, len);
+        record->name = used;
+        used += len;
+        len = strlen(e->entry.linkname) + 1;
+        memcpy(strings + used, e->entry.linkname, len);
+        record->linkname = used;
+        used += len;
+    }
+    free(rank);
+
+    if (describe_archive(tar_fd, last_header_offset, header) != 0) {
+        free(image);
+        return -1;
+    }
+
+    // written next to the final path and renamed over it, so that readers never see a partial file
+    size_t path_len = strlen(path);
+    char *tmp_path = malloc(path_len + sizeof(".tmp"));
+    if (tmp_path == NULL) {
+        free(image);
+        return -1;
+    }
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", sizeof(".tmp"));
+
+    int res = -1;
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd != -1) {
+        if (write_all(fd, image, file_size) == 0 && fsync(fd) == 0 && close(fd) == 0) {
+            res = rename(tmp_path, path);
+        } else {
+            int err = errno;
+            close(fd);
+            errno = err;
+        }
+        if (res != 0) {
+            int err = errno;
+            unlink(tmp_path);
+            errno = err;
+        }
+    }
+    free(tmp_path);
+    free(image);
+    return res;
+}
+
+/* Checks that the sections of a mapped sidecar file lie within it and match this version of the library */
+static bool valid_index_file(const uint8_t *map, size_t map_size) {
+    if (map_size < sizeof(file_header_t)) {
+        return false;
+    }
+    const file_header_t *header = (const file_header_t *) map;
+    if (memcmp(header->magic, INDEX_FILE_MAGIC, sizeof(header->magic)) != 0
+        || header->version != INDEX_FILE_VERSION || header->record_size != sizeof(file_record_t)) {
+        return false;
+    }
+    if (header->no_records >= ROOT_ENTRY || header->records_offset % sizeof(uint64_t) != 0
+        || header->records_offset > map_size
+        || header->no_records > (map_size - header->records_offset) / sizeof(file_record_t)) {
+        return false;
+    }
+    if (header->strings_size == 0 || header->strings_offset > map_size
+        || header->strings_size > map_size - header->strings_offset) {
+        return false;
+    }
+    // every string lookup can stop at the NUL that ends the table
+    return map[header->strings_offset + header->strings_size - 1] == '\0';
+}
+
+tar_index_t *tar_index_load(const char *path, int tar_fd) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    const file_header_t *header = map;
+    if (!valid_index_file(map, st.st_size)) {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // the sidecar is stale if the archive was replaced or modified since it was saved
+    file_header_t current;
+    if (describe_archive(tar_fd, header->last_header_offset, &current) != 0) {
+        int err = errno;
+        munmap(map, st.st_size);
+        errno = err;
+        return NULL;
+    }
+    if (current.archive_size != header->archive_size || current.archive_mtime_sec != header->archive_mtime_sec
+        || current.archive_mtime_nsec != header->archive_mtime_nsec
+        || current.first_header_hash != header->first_header_hash
+        || current.last_header_hash != header->last_header_hash) {
+        munmap(map, st.st_size);
+        errno = ESTALE;
+        return NULL;
+    }
+
+    tar_index_t *idx = calloc(1, sizeof(tar_index_t));
+    if (idx == NULL) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    idx->reader = tar_fd_reader(tar_fd);
+    idx->map = map;
+    idx->map_size = st.st_size;
+    idx->records = (const file_record_t *) ((const uint8_t *) map + header->records_offset);
+    idx->no_entries = header->no_records;
+    idx->strings = (const char *) map + header->strings_offset;
+    idx->strings_size = header->strings_size;
+    idx->root_first_child = header->root_first_child;
+
+    // large zeroed allocations are mapped lazily, so this does not touch memory per entry either
+    idx->views = calloc(idx->no_entries + 1, sizeof(tar_index_entry_t));
+    idx->view_states = calloc(idx->no_entries + 1, sizeof(atomic_uchar));
+    if (idx->views == NULL || idx->view_states == NULL) {
+        tar_index_free(idx);
+        return NULL;
+    }
+    return idx;
+}
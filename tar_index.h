@@ -0,0 +1,312 @@
+#ifndef TAR_INDEX_H
+#define TAR_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "lib_tar.h"
+#include "tar_ext.h"
+#include "tar_scan.h"
+
+/* Reads of read_files() separated by at most this many bytes are merged, the gap being read and dropped */
+#ifndef TAR_READ_MERGE_GAP
+#define TAR_READ_MERGE_GAP (64 * 1024)
+#endif
+
+/* Longest path the link resolution works with */
+#define TAR_PATH_MAX 4096
+
+/* Maximum number of links followed to resolve a path, as on Linux */
+#define TAR_MAX_LINK_HOPS 40
+
+/* One archive member as recorded by the index */
+typedef struct {
+    char *name;                   /* full path of the member (prefix, GNU long name or PAX path), NUL-terminated */
+    char *key;                    /* the path the entry is indexed by: name without its leading "./" or "/" */
+    size_t key_len;               /* length of the key without its trailing slashes */
+    char *linkname;               /* link target for SYMTYPE/LNKTYPE entries, NUL-terminated */
+    off_t header_offset;          /* offset of the 512-byte header in the archive */
+    off_t data_offset;            /* offset of the first data byte in the archive */
+    uint64_t size;                /* size of the data in bytes */
+    char typeflag;
+    uint32_t hash;
+} tar_index_entry_t;
+
+/* Opaque path index of an archive, built in a single scan */
+typedef struct tar_index tar_index_t;
+
+/**
+ * Builds a path index of the archive in a single scan of its headers.
+ * Entries are keyed by their full path, leading "./" and trailing slashes excluded, so "dir", "dir/" and "./dir/"
+ * name the same entry.
+ * When several headers share a path, the last one in the archive wins.
+ * A directory tree is built alongside, so listing a directory only touches its children.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ *               The descriptor is kept by the index to read entry data, and must outlive it.
+ *
+ * @return the index, or NULL if it could not be allocated.
+ */
+tar_index_t *tar_index_build(int tar_fd);
+
+/**
+ * Builds a path index of an archive read through a reader, such as a decompression layer, see tar_index_build().
+ * The reader is kept by the index to read entry data, and must outlive it.
+ */
+tar_index_t *tar_index_build_reader(tar_reader_t reader);
+
+/**
+ * Creates an empty index, to be filled with tar_index_add() by code that walks the headers itself.
+ *
+ * @return the index, or NULL if it could not be allocated.
+ */
+tar_index_t *tar_index_new(int tar_fd);
+
+/**
+ * Creates an empty index of an archive read through a reader, see tar_index_new().
+ */
+tar_index_t *tar_index_new_reader(tar_reader_t reader);
+
+/**
+ * Adds an archive member to the index, replacing any previous entry with the same path.
+ * The member is copied, so it only has to be valid during the call.
+ *
+ * @return zero on success, -1 if the entry could not be allocated.
+ */
+int tar_index_add(tar_index_t *idx, const tar_member_t *member);
+
+/**
+ * Completes an index filled with tar_index_add(), resolving and memoizing the target of every link.
+ * Must be called once after the last tar_index_add() and before the index is queried.
+ *
+ * @return zero on success, -1 if the resolution could not be allocated.
+ */
+int tar_index_finish(tar_index_t *idx);
+
+/**
+ * Brings an index up to date with an archive that was appended to since it was built, as "tar -r" does.
+ * The scan starts where the last one stopped, at the blocks that ended the archive, so only the new headers are read.
+ * A new entry replaces an older one with the same path, the last one in the archive wins as in tar_index_build().
+ * The links are resolved again only if a link was added or replaced, or if a new path may be the target of a
+ * dangling link.
+ * An index filled with tar_index_add() is refreshed from the start of the archive.
+ *
+ * @param tar_fd A file descriptor of the archive the index was built from.
+ *
+ * @return the number of entries read from the archive, zero if nothing was appended,
+ *         -1 with errno set if an allocation failed, ESTALE if the archive got shorter, EINVAL for a loaded index.
+ */
+ssize_t tar_index_refresh(tar_index_t *idx, int tar_fd);
+
+/**
+ * Releases an index built by tar_index_build() or loaded by tar_index_load(). Does not close the archive descriptor.
+ */
+void tar_index_free(tar_index_t *idx);
+
+/**
+ * Saves an index to a sidecar file, conventionally named after the archive with an ".idx" suffix ("archive.tar.idx").
+ * The file holds the entries sorted by path with their offsets, sizes, types, resolved links and directory
+ * structure, along with the size and mtime of the archive and a hash of its first and last headers.
+ * It is written to a temporary file next to path and renamed over it.
+ *
+ * @param tar_fd A file descriptor of the archive the index was built from.
+ * @param path The path of the sidecar file.
+ *
+ * @return zero on success, -1 with errno set if the file could not be written,
+ *         or EINVAL if the index was itself loaded from a sidecar file.
+ */
+int tar_index_save(tar_index_t *idx, int tar_fd, const char *path);
+
+/**
+ * Opens the index saved in a sidecar file by tar_index_save() with a single mmap(), without scanning the archive.
+ * The entries are queried in place: exact lookups binary search the sorted paths, and the memoized links and the
+ * directory structure are read from the file, so every tar_index_* query function works on the loaded index.
+ * A loaded index is read-only, tar_index_add() fails on it.
+ *
+ * @param path The path of the sidecar file.
+ * @param tar_fd A file descriptor of the archive. It is kept by the index to read entry data, and must outlive it.
+ *
+ * @return the index, or NULL with errno set: ESTALE if the archive changed since the file was saved (size, mtime,
+ *         first or last header), EINVAL if the file is not a sidecar index of this version, or the error of the
+ *         failed open() or mmap().
+ */
+tar_index_t *tar_index_load(const char *path, int tar_fd);
+
+/**
+ * Looks up the entry at a given path in O(1).
+ *
+ * @return the entry, or NULL if no entry at the given path exists in the archive.
+ *         The entry is owned by the index and lives as long as it.
+ */
+const tar_index_entry_t *tar_index_lookup(tar_index_t *idx, const char *path);
+
+/**
+ * Resolves a path to the entry it finally names, following symlinks and hardlinks anywhere in the path.
+ * "." and ".." are normalized, symlink targets are relative to the directory of the link unless absolute, and hardlink
+ * targets are relative to the root of the archive, so a hardlink resolves to the original entry and its data.
+ * The result of every link is memoized when the index is built, so each link in the path costs one lookup.
+ *
+ * @return the final entry, or NULL with errno set to ENOENT if no entry exists at the path or a link is dangling,
+ *         ELOOP if the links form a cycle (or a chain longer than 40 links), EISDIR for the root of the archive,
+ *         ENAMETOOLONG if a resolved path is longer than TAR_PATH_MAX.
+ */
+const tar_index_entry_t *tar_resolve(tar_index_t *idx, const char *path);
+
+/**
+ * Looks up the file at a given path, following links the same way read_file() does.
+ *
+ * @return the file entry, or NULL if no entry at the given path exists in the archive or the entry is not a file.
+ */
+const tar_index_entry_t *tar_index_lookup_file(tar_index_t *idx, const char *path);
+
+/**
+ * Index-aware versions of the lib_tar.h query functions.
+ * They take the same arguments and return the same values, minus the archive scan.
+ */
+int tar_index_check_file_type(tar_index_t *idx, char *path, char typeflag);
+
+int tar_index_exists(tar_index_t *idx, char *path);
+
+int tar_index_is_dir(tar_index_t *idx, char *path);
+
+int tar_index_is_file(tar_index_t *idx, char *path);
+
+int tar_index_is_symlink(tar_index_t *idx, char *path);
+
+int tar_index_list(tar_index_t *idx, char *path, char **entries, size_t *no_entries);
+
+ssize_t tar_index_read_file(tar_index_t *idx, char *path, size_t offset, uint8_t *dest, size_t *len);
+
+ssize_t tar_index_read_files(tar_index_t *idx, const tar_read_req_t *reqs, size_t n);
+
+/**
+ * Called by tar_find() for every matching entry.
+ *
+ * @param arg The argument given to tar_find().
+ * @param entry The entry, owned by the index.
+ *
+ * @return zero to go on, anything else to stop the search.
+ */
+typedef int (*tar_find_cb_t)(void *arg, const tar_index_entry_t *entry);
+
+/**
+ * Calls back with the entries tar_index_list() lists, in the same order, without a bound on their number or length.
+ *
+ * @param callback Called with arg for every entry of the directory, see tar_find_cb_t.
+ *
+ * @return the number of entries passed to the callback, or -1 if no directory exists at the path.
+ */
+ssize_t tar_index_children(tar_index_t *idx, char *path, tar_find_cb_t callback, void *arg);
+
+/**
+ * Finds the entries whose path matches a pattern, in the byte order of their paths.
+ * A pattern without special characters is an exact path. Otherwise it is a glob where '*' matches any characters
+ * but '/', '?' matches one character but '/', "[a-z]" and "[!a-z]" match one character of a set, "**" matches any
+ * characters including '/', and "**" followed by '/' also matches zero directories; a backslash escapes the next
+ * character. So a directory followed by a slash and '*' lists the directory, followed by a slash and "**" its whole
+ * subtree, "src/a*" the paths of src that start with "a", and "**" followed by a slash and "*.c" the C files anywhere.
+ * Leading "./" and trailing slashes are ignored as in the keys. Links are not followed.
+ * The paths are sorted on the first call after entries were added to the index, so only the range of paths that
+ * start with the part of the pattern before its first special character is visited, found by a binary search.
+ *
+ * @param callback Called with arg for every matching entry.
+ *
+ * @return the number of entries passed to the callback, or -1 with errno set to ENOMEM if the paths could not be
+ *         sorted.
+ */
+ssize_t tar_find(tar_index_t *idx, const char *pattern, tar_find_cb_t callback, void *arg);
+
+/*
+ * The building blocks of the index, for the views built on top of several indexes such as tar_overlay.h, so that
+ * they name, hash and resolve paths the same way.
+ */
+
+/**
+ * Start of the key of a path: leading "./" and "/" are skipped, "./a", "/a" and "a" name the same entry.
+ */
+const char *tar_key_start(const char *path);
+
+/**
+ * Length of a path once its trailing slashes are removed, this is what the index uses as the key.
+ */
+size_t tar_key_length(const char *path, size_t len);
+
+/**
+ * Length of the directory part of a key, without the slash, zero for entries at the root.
+ */
+size_t tar_key_parent_length(const char *key, size_t key_len);
+
+/**
+ * FNV-1a hash of a key, the one stored in tar_index_entry_t.
+ */
+uint32_t tar_key_hash(const char *key, size_t key_len);
+
+/**
+ * Compares a key with the item of an open addressing table, see tar_table_probe().
+ *
+ * @param arg The argument given to tar_table_probe().
+ * @param item The index of the item stored in the slot.
+ */
+typedef bool (*tar_same_key_cb_t)(const void *arg, uint32_t item, const char *key, size_t key_len, uint32_t hash);
+
+/**
+ * Finds the slot holding a key in an open addressing table, whose slots hold an item index + 1 (0 means the slot is
+ * empty) and whose capacity is a power of 2.
+ *
+ * @return the slot holding the key, or the empty slot where it would be inserted.
+ */
+size_t tar_table_probe(const uint32_t *slots, size_t capacity, const char *key, size_t key_len, uint32_t hash,
+                       tar_same_key_cb_t same_key, const void *arg);
+
+/**
+ * Doubles an open addressing table and re-inserts its items, whose keys must be unique.
+ *
+ * @param items The items, item_size bytes apart, each with the hash of its key at hash_offset.
+ *
+ * @return zero on success, -1 if the table could not be allocated, in which case it is left as it was.
+ */
+int tar_table_grow(uint32_t **slots, size_t *capacity, const void *items, size_t item_size, size_t hash_offset,
+                   size_t no_items);
+
+/**
+ * Called by tar_walk_path() with every resolved path it follows: if the path names a link, the callback replaces
+ * it by the path the link resolves to, otherwise it leaves it as it is.
+ *
+ * @param arg The argument given to tar_walk_path().
+ * @param buf The resolved path, without trailing slash, TAR_PATH_MAX bytes long.
+ * @param len The length of the resolved path.
+ * @param depth The number of links followed once this one is, to be checked against TAR_MAX_LINK_HOPS.
+ *
+ * @return zero on success, or an errno value that stops the walk.
+ */
+typedef int (*tar_follow_cb_t)(void *arg, char *buf, size_t *len, int depth);
+
+/**
+ * Appends the components of a path to an already resolved path, normalizing "." and ".." and replacing every link
+ * met along the way by the path it resolves to.
+ *
+ * @param buf The resolved path so far, without trailing slash, TAR_PATH_MAX bytes long. Empty for the root.
+ * @param len The length of the resolved path, updated as components are appended.
+ * @param follow_last Whether a link in the last component is followed too.
+ * @param depth The number of links already followed to get here.
+ * @param follow Called with arg for every component but the last one, and the last one if follow_last is set.
+ *
+ * @return zero on success, or an errno value: ENOENT for a dangling link, ELOOP for a cycle, ENAMETOOLONG, or the
+ *         one returned by the callback.
+ */
+int tar_walk_path(char *buf, size_t *len, const char *path, bool follow_last, int depth, tar_follow_cb_t follow,
+                  void *arg);
+
+/**
+ * Walks the target of a link, see tar_walk_path().
+ * Symlink targets are relative to the directory that contains the link unless they are absolute, hardlink targets are
+ * always relative to the root of the archive.
+ *
+ * @param buf Set to the path the target resolves to, which may name no entry.
+ */
+int tar_walk_link(const tar_index_entry_t *link, char *buf, size_t *len, int depth, tar_follow_cb_t follow,
+                  void *arg);
+
+#endif
@@ -0,0 +1,210 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "tar_ext.h"
+#include "tar_iter.h"
+#include "tar_stats.h"
+
+struct tar_iter {
+    int fd;
+    uint8_t *buf;
+    size_t buf_start;             /* first unconsumed byte of buf */
+    size_t buf_end;               /* end of the valid bytes of buf */
+    uint64_t data_left;           /* bytes of the current entry's data not consumed yet */
+    uint64_t padding_left;        /* bytes of padding after the data of the current entry */
+    bool done;
+    tar_ext_t ext;
+};
+
+tar_iter_t *tar_iter_open(int fd) {
+    tar_iter_t *it = calloc(1, sizeof(tar_iter_t));
+    if (it == NULL) {
+        return NULL;
+    }
+    it->buf = malloc(TAR_ITER_BUFFER_SIZE);
+    if (it->buf == NULL) {
+        free(it);
+        return NULL;
+    }
+    it->fd = fd;
+    tar_ext_init(&it->ext);
+    return it;
+}
+
+void tar_iter_close(tar_iter_t *it) {
+    if (it == NULL) {
+        return;
+    }
+    free(it->buf);
+    tar_ext_destroy(&it->ext);
+    free(it);
+}
+
+/* read() that retries when interrupted, and exits like the rest of the library when the read fails */
+static size_t read_some(int fd, void *buf, size_t len) {
+    while (true) {
+        ssize_t res = read(fd, buf, len);
+        TAR_STATS_ADD(read_calls, 1);
+        if (res >= 0) {
+            TAR_STATS_ADD(bytes_read, res);
+            return res;
+        }
+        if (errno != EINTR) {
+            perror("Failed to read from archive stream");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * Refills the buffer once it has been consumed.
+ *
+ * @return the number of buffered bytes, zero at the end of the stream.
+ */
+static size_t fill(tar_iter_t *it) {
+    if (it->buf_start == it->buf_end) {
+        it->buf_start = 0;
+        it->buf_end = read_some(it->fd, it->buf, TAR_ITER_BUFFER_SIZE);
+    }
+    return it->buf_end - it->buf_start;
+}
+
+/**
+ * Consumes len bytes from the stream, copying them to dest unless it is NULL.
+ * Large reads bypass the buffer once it is empty.
+ *
+ * @return the number of bytes consumed, less than len only at the end of the stream.
+ */
+static uint64_t consume(tar_iter_t *it, void *dest, uint64_t len) {
+    uint64_t done = 0;
+    while (done < len) {
+        if (it->buf_start == it->buf_end && dest != NULL && len - done >= TAR_ITER_BUFFER_SIZE) {
+            size_t res = read_some(it->fd, (uint8_t *) dest + done, len - done);
+            if (res == 0) {
+                break;
+            }
+            done += res;
+            continue;
+        }
+
+        size_t available = fill(it);
+        if (available == 0) {
+            break;
+        }
+        size_t n = len - done < available ? (size_t) (len - done) : available;
+        if (dest != NULL) {
+            memcpy((uint8_t *) dest + done, it->buf + it->buf_start, n);
+        }
+        it->buf_start += n;
+        done += n;
+    }
+    return done;
+}
+
+int tar_iter_skip(tar_iter_t *it) {
+    uint64_t len = it->data_left + it->padding_left;
+    uint64_t res = consume(it, NULL, len);
+    it->data_left = 0;
+    it->padding_left = 0;
+    return res == len ? 0 : TAR_ITER_TRUNCATED;
+}
+
+/**
+ * Reads the data of an extension header and records it, larger data than TAR_EXT_MAX is skipped.
+ *
+ * @return zero on success, TAR_ITER_TRUNCATED if the stream ends in the middle of the data.
+ */
+static int add_ext_header(tar_iter_t *it, const tar_header_t *header) {
+    int64_t size = TAR_SIZE(header);
+    it->data_left = size > 0 ? size : 0;
+    it->padding_left = (512 - it->data_left % 512) % 512;
+    if (it->data_left == 0 || it->data_left > TAR_EXT_MAX) {
+        return tar_iter_skip(it);
+    }
+
+    uint8_t *data = malloc(it->data_left);
+    if (data == NULL) {
+        perror("Failed to allocate an extended header");
+        exit(EXIT_FAILURE);
+    }
+    size_t len = it->data_left;
+    int err = consume(it, data, len) == len ? 0 : TAR_ITER_TRUNCATED;
+    it->data_left = 0;
+    if (err == 0 && tar_ext_add(&it->ext, header, data, len) != 0) {
+        perror("Failed to allocate an extended header");
+        exit(EXIT_FAILURE);
+    }
+    free(data);
+    return err == 0 ? tar_iter_skip(it) : err;
+}
+
+int tar_iter_next(tar_iter_t *it, tar_iter_entry_t *entry) {
+    if (it->done) {
+        return 0;
+    }
+    if (tar_iter_skip(it) != 0) {
+        return TAR_ITER_TRUNCATED;
+    }
+
+    while (true) {
+        uint64_t res = consume(it, &entry->header, sizeof(tar_header_t));
+        if (res == 0) {
+            it->done = true;
+            return 0; // the stream ended without the two empty blocks, accept it like the scanner does
+        }
+        if (res < sizeof(tar_header_t)) {
+            return TAR_ITER_TRUNCATED;
+        }
+
+        // check to see if the header was full of 0s, if that's the case, check that the next block is also 0s
+        if (is_zeros(&entry->header, sizeof(tar_header_t))) {
+            res = consume(it, &entry->header, sizeof(tar_header_t));
+            if (res < sizeof(tar_header_t) || is_zeros(&entry->header, sizeof(tar_header_t))) {
+                it->done = true;
+                return 0; // two empty blocks, this is the end of the tarball
+            }
+        }
+
+        TAR_STATS_ADD(headers_visited, 1);
+        int err = check_header(&entry->header);
+        if (err < 0) {
+            return err;
+        }
+
+        if (!tar_is_ext_header(&entry->header)) {
+            break;
+        }
+        err = add_ext_header(it, &entry->header);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    tar_member_t member;
+    if (tar_ext_member(&it->ext, &entry->header, 0, &member) != 0) {
+        perror("Failed to allocate an extended header");
+        exit(EXIT_FAILURE);
+    }
+    entry->name = member.name;
+    entry->linkname = member.linkname;
+    entry->typeflag = member.typeflag;
+    entry->size = member.size;
+
+    it->data_left = entry->size;
+    it->padding_left = (512 - entry->size % 512) % 512;
+    return 1;
+}
+
+ssize_t tar_iter_read(tar_iter_t *it, void *buf, size_t len) {
+    if (len > it->data_left) {
+        len = it->data_left;
+    }
+    size_t res = consume(it, buf, len);
+    it->data_left -= res;
+    if (res < len) {
+        return TAR_ITER_TRUNCATED;
+    }
+    return res;
+}
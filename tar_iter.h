@@ -0,0 +1,78 @@
+#ifndef TAR_ITER_H
+#define TAR_ITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "lib_tar.h"
+
+/* Size of the internal buffer of an iterator, can be overridden at compile time */
+#ifndef TAR_ITER_BUFFER_SIZE
+#define TAR_ITER_BUFFER_SIZE (128 * 1024)
+#endif
+
+/* The iterator reached a truncated archive, in addition to the check_archive() error codes */
+#define TAR_ITER_TRUNCATED -4
+
+/* An archive member as seen by the iterator, extension headers are applied and not returned */
+typedef struct {
+    tar_header_t header;          /* the raw header */
+    const char *name;             /* full path, NUL-terminated, valid until the next call to tar_iter_next() */
+    const char *linkname;         /* full link target, NUL-terminated, valid as long as name */
+    uint64_t size;                /* size of the data in bytes */
+    char typeflag;
+} tar_iter_entry_t;
+
+/**
+ * Forward-only iterator over an archive, which only uses read() on the descriptor.
+ * It works on pipes and sockets, so a single pass can filter, extract or hash entries as they arrive.
+ */
+typedef struct tar_iter tar_iter_t;
+
+/**
+ * Starts iterating over the archive read from a descriptor, from its current position.
+ *
+ * @param fd A descriptor to read the archive from, it does not need to be seekable.
+ *
+ * @return the iterator, or NULL if it could not be allocated.
+ */
+tar_iter_t *tar_iter_open(int fd);
+
+/**
+ * Releases an iterator. Does not close the descriptor.
+ */
+void tar_iter_close(tar_iter_t *it);
+
+/**
+ * Moves to the next entry, skipping whatever was not read of the data of the current one.
+ * The header is checked the same way check_archive() does.
+ *
+ * @param entry Set to the next entry.
+ *
+ * @return 1 if there is a next entry,
+ *         zero at the end of the archive,
+ *         -1, -2 or -3 if the header has an invalid magic value, version or checksum (see check_archive()),
+ *         TAR_ITER_TRUNCATED if the stream ends in the middle of the archive.
+ */
+int tar_iter_next(tar_iter_t *it, tar_iter_entry_t *entry);
+
+/**
+ * Reads the data of the current entry.
+ *
+ * @param buf A destination buffer.
+ * @param len The size of buf.
+ *
+ * @return the number of bytes read, zero once the whole data was read,
+ *         TAR_ITER_TRUNCATED if the stream ends in the middle of the data.
+ */
+ssize_t tar_iter_read(tar_iter_t *it, void *buf, size_t len);
+
+/**
+ * Skips the rest of the data of the current entry.
+ *
+ * @return zero on success, TAR_ITER_TRUNCATED if the stream ends in the middle of the data.
+ */
+int tar_iter_skip(tar_iter_t *it);
+
+#endif
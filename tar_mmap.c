@@ -0,0 +1,137 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tar_mmap.h"
+#include "tar_stats.h"
+
+struct tar_mmap {
+    int tar_fd;
+    const uint8_t *base;
+    size_t size;
+    tar_index_t *idx;
+};
+
+/* Walks the headers directly in the mapping and adds them to the index */
+static int index_mapping(tar_mmap_t *m) {
+    tar_ext_t ext;
+    tar_ext_init(&ext);
+    int res = 0;
+    uint64_t offset = 0;
+    while (offset + sizeof(tar_header_t) <= m->size) {
+        const tar_header_t *header = (const tar_header_t *) (m->base + offset);
+
+        // two empty blocks, this is the end of the tarball
+        if (is_zeros(header, sizeof(tar_header_t))) {
+            if (offset + 2 * sizeof(tar_header_t) > m->size || is_zeros(header + 1, sizeof(tar_header_t))) {
+                break;
+            }
+            offset += sizeof(tar_header_t);
+            continue;
+        }
+
+        TAR_STATS_ADD(headers_visited, 1);
+        uint64_t file_size;
+        if (tar_is_ext_header(header)) {
+            int64_t size = TAR_SIZE(header);
+            file_size = size > 0 ? size : 0;
+            if (file_size > m->size - offset - sizeof(tar_header_t)) {
+                res = -1; // the data of this entry goes past the end of the archive
+                break;
+            }
+            if (file_size <= TAR_EXT_MAX && tar_ext_add(&ext, header, header + 1, file_size) != 0) {
+                res = -1;
+                break;
+            }
+        } else {
+            tar_member_t member;
+            if (tar_ext_member(&ext, header, offset, &member) != 0) {
+                res = -1;
+                break;
+            }
+            file_size = member.size;
+            if (file_size > m->size - offset - sizeof(tar_header_t)) {
+                res = -1;
+                break;
+            }
+            if (tar_index_add(m->idx, &member) != 0) {
+                res = -1;
+                break;
+            }
+        }
+
+        uint64_t padding = (512 - file_size % 512) % 512;
+        offset += sizeof(tar_header_t) + file_size + padding;
+    }
+    tar_ext_destroy(&ext);
+    return res;
+}
+
+tar_mmap_t *tar_mmap_open(const char *path) {
+    tar_mmap_t *m = calloc(1, sizeof(tar_mmap_t));
+    if (m == NULL) {
+        return NULL;
+    }
+
+    m->tar_fd = open(path, O_RDONLY);
+    if (m->tar_fd == -1) {
+        free(m);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(m->tar_fd, &st) == -1) {
+        tar_mmap_close(m);
+        return NULL;
+    }
+    m->size = st.st_size;
+
+    if (m->size > 0) {
+        void *base = mmap(NULL, m->size, PROT_READ, MAP_SHARED, m->tar_fd, 0);
+        if (base == MAP_FAILED) {
+            m->size = 0;
+            tar_mmap_close(m);
+            return NULL;
+        }
+        m->base = base;
+        madvise(base, m->size, MADV_WILLNEED);
+    }
+
+    m->idx = tar_index_new(m->tar_fd);
+    if (m->idx == NULL || index_mapping(m) != 0 || tar_index_finish(m->idx) != 0) {
+        tar_mmap_close(m);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return m;
+}
+
+void tar_mmap_close(tar_mmap_t *m) {
+    if (m == NULL) {
+        return;
+    }
+    tar_index_free(m->idx);
+    if (m->base != NULL) {
+        munmap((void *) m->base, m->size);
+    }
+    close(m->tar_fd);
+    free(m);
+}
+
+tar_index_t *tar_mmap_index(tar_mmap_t *m) {
+    return m->idx;
+}
+
+int tar_entry_view(tar_mmap_t *m, const char *path, const uint8_t **data, size_t *len) {
+    const tar_index_entry_t *entry = tar_index_lookup_file(m->idx, path);
+    if (entry == NULL) {
+        return -1;
+    }
+
+    *data = m->base + entry->data_offset;
+    *len = entry->size;
+    return 0;
+}
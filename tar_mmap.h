@@ -0,0 +1,45 @@
+#ifndef TAR_MMAP_H
+#define TAR_MMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tar_index.h"
+
+/* An archive mapped in memory once, with its headers indexed straight from the mapping */
+typedef struct tar_mmap tar_mmap_t;
+
+/**
+ * Opens and maps an archive read-only and indexes its headers without any read() call.
+ * The mapping is shared, so every process mapping the same archive shares its pages in the page cache.
+ *
+ * @param path The path of a valid tar archive file.
+ *
+ * @return the handle, or NULL if the archive could not be opened, mapped or indexed (errno is set accordingly).
+ */
+tar_mmap_t *tar_mmap_open(const char *path);
+
+/**
+ * Unmaps the archive and releases the handle. Views returned by tar_entry_view() are no longer valid afterwards.
+ */
+void tar_mmap_close(tar_mmap_t *m);
+
+/**
+ * Returns the index of the mapped archive, so the tar_index.h query functions can be used on it.
+ */
+tar_index_t *tar_mmap_index(tar_mmap_t *m);
+
+/**
+ * Gives direct access to the data of a file in the mapped archive, without copying it.
+ *
+ * @param m The mapped archive.
+ * @param path A path to an entry in the archive.  If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param data Set to the first byte of the file data, which points into the mapping.
+ * @param len Set to the size of the file data in bytes.
+ *
+ * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         zero otherwise.
+ */
+int tar_entry_view(tar_mmap_t *m, const char *path, const uint8_t **data, size_t *len);
+
+#endif
@@ -0,0 +1,536 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tar_overlay.h"
+
+#define OVERLAY_INITIAL_CAPACITY 64
+#define NO_NODE UINT32_MAX
+#define ROOT_NODE (UINT32_MAX - 1)
+
+#define WHITEOUT_PREFIX ".wh."
+#define WHITEOUT_PREFIX_LEN 4
+#define OPAQUE_MARKER ".wh..wh..opq"
+#define OPAQUE_MARKER_LEN 12
+
+/**
+ * A path of the union view: the entry visible there, or a whiteout hiding the path from the layers below it.
+ * Layers are numbered by their position in the descriptor array, so a higher layer is an upper one.
+ */
+typedef struct {
+    const char *key;
+    size_t key_len;
+    uint32_t hash;
+    const tar_index_entry_t *entry; /* NULL for a whiteout, or a directory only known from its opaque marker */
+    int layer;                    /* layer of the entry or of the whiteout */
+    int opaque_layer;             /* highest layer with an opaque marker in the directory, -1 if there is none */
+    bool whiteout;                /* the key was built from the whiteout name, and is owned by the node */
+    uint32_t first_child;         /* visible entries of a directory, NO_NODE if it has none */
+    uint32_t last_child;
+    uint32_t next_sibling;
+} overlay_node_t;
+
+struct tar_overlay {
+    tar_index_t **layers;
+    size_t no_layers;
+
+    // nodes in the order they were merged, from the uppermost layer down
+    overlay_node_t *nodes;
+    size_t no_nodes;
+    size_t nodes_capacity;
+
+    // open addressing hash table, each slot holds a node index + 1 (0 means the slot is empty)
+    uint32_t *slots;
+    size_t slots_capacity;        // always a power of 2
+
+    const tar_index_entry_t *root_entry; // "./" entry of the uppermost layer that has one, NULL if none has
+    uint32_t root_first_child;
+    uint32_t root_last_child;
+    int root_opaque_layer;
+};
+
+static bool is_link(const tar_index_entry_t *entry) {
+    return entry->typeflag == SYMTYPE || entry->typeflag == LNKTYPE;
+}
+
+static bool node_has_key(const void *arg, uint32_t n, const char *key, size_t key_len, uint32_t hash) {
+    const overlay_node_t *node = &((const tar_overlay_t *) arg)->nodes[n];
+    return node->hash == hash && node->key_len == key_len && memcmp(node->key, key, key_len) == 0;
+}
+
+/* Slot holding the node with the given key, or the empty slot where it would go */
+static size_t find_slot(const tar_overlay_t *ov, const char *key, size_t key_len, uint32_t hash) {
+    return tar_table_probe(ov->slots, ov->slots_capacity, key, key_len, hash, node_has_key, ov);
+}
+
+static uint32_t lookup_node(const tar_overlay_t *ov, const char *key, size_t key_len) {
+    size_t slot = find_slot(ov, key, key_len, tar_key_hash(key, key_len));
+    return ov->slots[slot] == 0 ? NO_NODE : ov->slots[slot] - 1;
+}
+
+/* Node of the entry visible at a key, NO_NODE if the key is hidden or names nothing */
+static uint32_t lookup_visible(const tar_overlay_t *ov, const char *key, size_t key_len) {
+    uint32_t n = lookup_node(ov, key, key_len);
+    return n != NO_NODE && ov->nodes[n].entry != NULL ? n : NO_NODE;
+}
+
+/**
+ * Adds a node for a key that has none yet.
+ *
+ * @return the index of the node, or NO_NODE if the table could not grow.
+ */
+static uint32_t add_node(tar_overlay_t *ov, const char *key, size_t key_len, int layer) {
+    // keep the load factor under 1/2
+    if ((ov->no_nodes + 1) * 2 > ov->slots_capacity
+        && tar_table_grow(&ov->slots, &ov->slots_capacity, ov->nodes, sizeof(overlay_node_t),
+                          offsetof(overlay_node_t, hash), ov->no_nodes) != 0) {
+        return NO_NODE;
+    }
+    if (ov->no_nodes == ov->nodes_capacity) {
+        size_t capacity = ov->nodes_capacity * 2;
+        overlay_node_t *nodes = realloc(ov->nodes, capacity * sizeof(overlay_node_t));
+        if (nodes == NULL) {
+            return NO_NODE;
+        }
+        ov->nodes = nodes;
+        ov->nodes_capacity = capacity;
+    }
+
+    uint32_t hash = tar_key_hash(key, key_len);
+    size_t slot = find_slot(ov, key, key_len, hash);
+    overlay_node_t *node = &ov->nodes[ov->no_nodes];
+    memset(node, 0, sizeof(*node));
+    node->key = key;
+    node->key_len = key_len;
+    node->hash = hash;
+    node->layer = layer;
+    node->opaque_layer = -1;
+    node->first_child = NO_NODE;
+    node->last_child = NO_NODE;
+    node->next_sibling = NO_NODE;
+    ov->slots[slot] = ++ov->no_nodes;
+    return ov->no_nodes - 1;
+}
+
+/**
+ * Whether an entry of a layer is hidden by the layers above it: a directory above it is opaque in an upper layer,
+ * or one of its parents is whited out or replaced by a non-directory.
+ * The upper layers are merged first, so their nodes are all in the table.
+ */
+static bool is_hidden(const tar_overlay_t *ov, const char *key, size_t key_len, int layer) {
+    if (ov->root_opaque_layer > layer) {
+        return true;
+    }
+    for (size_t i = 0; i < key_len; ++i) {
+        if (key[i] != '/') {
+            continue;
+        }
+        uint32_t n = lookup_node(ov, key, i);
+        if (n == NO_NODE) {
+            continue;
+        }
+        const overlay_node_t *parent = &ov->nodes[n];
+        if (parent->opaque_layer > layer) {
+            return true;
+        }
+        if (parent->layer > layer
+            && (parent->whiteout || (parent->entry != NULL && parent->entry->typeflag != DIRTYPE))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Merge of one layer, the whiteouts and markers being kept aside until its entries are merged */
+typedef struct {
+    tar_overlay_t *ov;
+    int layer;
+    const tar_index_entry_t **markers;
+    size_t no_markers;
+    size_t markers_capacity;
+    bool failed;
+} merge_ctx_t;
+
+/* Name of an entry within its directory */
+static const char *base_name(const tar_index_entry_t *entry) {
+    size_t parent_len = tar_key_parent_length(entry->key, entry->key_len);
+    return parent_len == 0 ? entry->key : entry->key + parent_len + 1;
+}
+
+static int merge_entry(void *arg, const tar_index_entry_t *entry) {
+    merge_ctx_t *ctx = arg;
+    tar_overlay_t *ov = ctx->ov;
+
+    const char *base = base_name(entry);
+    if ((size_t) (entry->key + entry->key_len - base) >= WHITEOUT_PREFIX_LEN
+        && memcmp(base, WHITEOUT_PREFIX, WHITEOUT_PREFIX_LEN) == 0) {
+        if (ctx->no_markers == ctx->markers_capacity) {
+            size_t capacity = ctx->markers_capacity == 0 ? 64 : ctx->markers_capacity * 2;
+            const tar_index_entry_t **markers = realloc(ctx->markers, capacity * sizeof(*markers));
+            if (markers == NULL) {
+                ctx->failed = true;
+                return 1;
+            }
+            ctx->markers = markers;
+            ctx->markers_capacity = capacity;
+        }
+        ctx->markers[ctx->no_markers++] = entry;
+        return 0;
+    }
+
+    if (is_hidden(ov, entry->key, entry->key_len, ctx->layer)) {
+        return 0;
+    }
+    uint32_t n = lookup_node(ov, entry->key, entry->key_len);
+    if (n != NO_NODE) {
+        // shadowed by an upper layer, unless only its opaque marker was met so far
+        overlay_node_t *node = &ov->nodes[n];
+        if (node->entry == NULL && !node->whiteout && entry->typeflag == DIRTYPE) {
+            node->entry = entry;
+            node->key = entry->key;
+            node->layer = ctx->layer;
+        }
+        return 0;
+    }
+    n = add_node(ov, entry->key, entry->key_len, ctx->layer);
+    if (n == NO_NODE) {
+        ctx->failed = true;
+        return 1;
+    }
+    ov->nodes[n].entry = entry;
+    return 0;
+}
+
+/**
+ * Applies a whiteout or an opaque marker of a layer, which only hides the layers below it.
+ *
+ * @return zero on success, -1 if the node could not be allocated.
+ */
+static int merge_marker(tar_overlay_t *ov, const tar_index_entry_t *marker, int layer) {
+    size_t parent_len = tar_key_parent_length(marker->key, marker->key_len);
+    const char *base = base_name(marker);
+    size_t base_len = marker->key + marker->key_len - base;
+
+    if (base_len == OPAQUE_MARKER_LEN && memcmp(base, OPAQUE_MARKER, OPAQUE_MARKER_LEN) == 0) {
+        if (parent_len == 0) {
+            ov->root_opaque_layer = layer > ov->root_opaque_layer ? layer : ov->root_opaque_layer;
+            return 0;
+        }
+        uint32_t n = lookup_node(ov, marker->key, parent_len);
+        if (n == NO_NODE && (n = add_node(ov, marker->key, parent_len, layer)) == NO_NODE) {
+            return -1;
+        }
+        if (layer > ov->nodes[n].opaque_layer) {
+            ov->nodes[n].opaque_layer = layer;
+        }
+        return 0;
+    }
+    if (base_len <= WHITEOUT_PREFIX_LEN
+        || memcmp(base + WHITEOUT_PREFIX_LEN, WHITEOUT_PREFIX, WHITEOUT_PREFIX_LEN) == 0) {
+        return 0; // other ".wh..wh." names are metadata of the tools that wrote the layer
+    }
+
+    // the hidden path is the marker path without the prefix
+    size_t prefix_len = base - marker->key;
+    size_t key_len = marker->key_len - WHITEOUT_PREFIX_LEN;
+    char *key = malloc(key_len);
+    if (key == NULL) {
+        return -1;
+    }
+    memcpy(key, marker->key, prefix_len);
+    memcpy(key + prefix_len, base + WHITEOUT_PREFIX_LEN, base_len - WHITEOUT_PREFIX_LEN);
+    if (lookup_node(ov, key, key_len) != NO_NODE) {
+        free(key); // an upper layer has the path, or hid it already
+        return 0;
+    }
+    uint32_t n = add_node(ov, key, key_len, layer);
+    if (n == NO_NODE) {
+        free(key);
+        return -1;
+    }
+    ov->nodes[n].whiteout = true;
+    return 0;
+}
+
+/* Links every visible entry to the directory that holds it, once all the layers are merged */
+static void link_children(tar_overlay_t *ov) {
+    for (uint32_t i = 0; i < ov->no_nodes; ++i) {
+        overlay_node_t *node = &ov->nodes[i];
+        if (node->entry == NULL) {
+            continue;
+        }
+        uint32_t *first = &ov->root_first_child;
+        uint32_t *last = &ov->root_last_child;
+        size_t parent_len = tar_key_parent_length(node->key, node->key_len);
+        if (parent_len > 0) {
+            // as in a single archive, a directory without a header of its own can't be listed
+            uint32_t parent = lookup_visible(ov, node->key, parent_len);
+            if (parent == NO_NODE || ov->nodes[parent].entry->typeflag != DIRTYPE) {
+                continue;
+            }
+            first = &ov->nodes[parent].first_child;
+            last = &ov->nodes[parent].last_child;
+        }
+        if (*last == NO_NODE) {
+            *first = i;
+        } else {
+            ov->nodes[*last].next_sibling = i;
+        }
+        *last = i;
+    }
+}
+
+typedef struct {
+    const int *fds;
+    tar_index_t **layers;
+    size_t no_layers;
+    atomic_size_t next_layer;
+} build_ctx_t;
+
+static void *build_worker(void *arg) {
+    build_ctx_t *ctx = arg;
+    size_t i;
+    while ((i = atomic_fetch_add(&ctx->next_layer, 1)) < ctx->no_layers) {
+        ctx->layers[i] = tar_index_build(ctx->fds[i]);
+    }
+    return NULL;
+}
+
+/* Indexes every layer, the layers being spread over up to TAR_OVERLAY_THREADS threads */
+static void build_layers(const int *fds, tar_index_t **layers, size_t no_layers) {
+    build_ctx_t ctx = {.fds = fds, .layers = layers, .no_layers = no_layers};
+    atomic_init(&ctx.next_layer, 0);
+
+    size_t nthreads = no_layers < TAR_OVERLAY_THREADS ? no_layers : TAR_OVERLAY_THREADS;
+    if (nthreads <= 1) {
+        build_worker(&ctx);
+        return;
+    }
+    pthread_t threads[nthreads - 1];
+    size_t started = 0;
+    while (started < nthreads - 1 && pthread_create(&threads[started], NULL, build_worker, &ctx) == 0) {
+        started++;
+    }
+    build_worker(&ctx); // the calling thread takes its share, and all of it if no thread could be created
+    for (size_t t = 0; t < started; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+}
+
+tar_overlay_t *tar_overlay_build(const int *fds, size_t no_layers) {
+    tar_overlay_t *ov = calloc(1, sizeof(tar_overlay_t));
+    if (ov == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    ov->no_layers = no_layers;
+    ov->layers = calloc(no_layers > 0 ? no_layers : 1, sizeof(tar_index_t *));
+    ov->nodes_capacity = OVERLAY_INITIAL_CAPACITY;
+    ov->nodes = malloc(ov->nodes_capacity * sizeof(overlay_node_t));
+    ov->slots_capacity = OVERLAY_INITIAL_CAPACITY * 2;
+    ov->slots = calloc(ov->slots_capacity, sizeof(uint32_t));
+    ov->root_first_child = NO_NODE;
+    ov->root_last_child = NO_NODE;
+    ov->root_opaque_layer = -1;
+    if (ov->layers == NULL || ov->nodes == NULL || ov->slots == NULL) {
+        tar_overlay_free(ov);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    build_layers(fds, ov->layers, no_layers);
+    for (size_t i = 0; i < no_layers; ++i) {
+        if (ov->layers[i] == NULL) {
+            tar_overlay_free(ov);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    // from the uppermost layer down, so that everything that may hide an entry is known when it is merged
+    merge_ctx_t ctx = {.ov = ov};
+    for (size_t i = no_layers; i-- > 0;) {
+        if (ov->root_entry == NULL) {
+            ov->root_entry = tar_index_lookup(ov->layers[i], "");
+        }
+        ctx.layer = (int) i;
+        ctx.no_markers = 0;
+        if (tar_find(ov->layers[i], "**", merge_entry, &ctx) < 0) {
+            ctx.failed = true;
+        }
+        for (size_t m = 0; m < ctx.no_markers && !ctx.failed; ++m) {
+            ctx.failed = merge_marker(ov, ctx.markers[m], ctx.layer) != 0;
+        }
+        if (ctx.failed) {
+            free(ctx.markers);
+            tar_overlay_free(ov);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+    free(ctx.markers);
+
+    link_children(ov);
+    return ov;
+}
+
+void tar_overlay_free(tar_overlay_t *ov) {
+    for (size_t i = 0; i < ov->no_nodes; ++i) {
+        if (ov->nodes[i].whiteout) {
+            free((char *) ov->nodes[i].key);
+        }
+    }
+    if (ov->layers != NULL) {
+        for (size_t i = 0; i < ov->no_layers; ++i) {
+            if (ov->layers[i] != NULL) {
+                tar_index_free(ov->layers[i]);
+            }
+        }
+    }
+    free(ov->layers);
+    free(ov->nodes);
+    free(ov->slots);
+    free(ov);
+}
+
+static int resolve_link(const tar_overlay_t *ov, uint32_t n, int depth, char *buf, size_t *len);
+
+/* Replaces a resolved path by the path its visible link resolves to, see tar_follow_cb_t */
+static int follow_link(void *arg, char *buf, size_t *len, int depth) {
+    const tar_overlay_t *ov = arg;
+    uint32_t n = lookup_visible(ov, buf, *len);
+    if (n == NO_NODE || !is_link(ov->nodes[n].entry)) {
+        return 0;
+    }
+    return resolve_link(ov, n, depth, buf, len);
+}
+
+/**
+ * Replaces the path in buf by the path the link of node n finally resolves to, the links met along the way being
+ * the visible ones of every layer.
+ *
+ * @return zero on success, or an errno value as tar_walk_path().
+ */
+static int resolve_link(const tar_overlay_t *ov, uint32_t n, int depth, char *buf, size_t *len) {
+    if (depth > TAR_MAX_LINK_HOPS) {
+        return ELOOP;
+    }
+    char target[TAR_PATH_MAX];
+    size_t target_len;
+    int err = tar_walk_link(ov->nodes[n].entry, target, &target_len, depth, follow_link, (void *) ov);
+    if (err != 0) {
+        return err;
+    }
+    if (target_len > 0 && lookup_visible(ov, target, target_len) == NO_NODE) {
+        return ENOENT;
+    }
+    memcpy(buf, target, target_len);
+    *len = target_len;
+    return 0;
+}
+
+/**
+ * Resolves a path to the node of its entry, ROOT_NODE for the root.
+ *
+ * @return zero on success, or an errno value: ENOENT if no entry is visible at the path, ELOOP, ENAMETOOLONG.
+ */
+static int resolve(const tar_overlay_t *ov, const char *path, bool follow_last, uint32_t *out) {
+    char buf[TAR_PATH_MAX];
+    size_t len = 0;
+
+    // fast path: the path is the key of an entry, as it almost always is
+    const char *key = tar_key_start(path);
+    uint32_t n = lookup_visible(ov, key, tar_key_length(key, strlen(key)));
+    if (n != NO_NODE && !(follow_last && is_link(ov->nodes[n].entry))) {
+        *out = n;
+        return 0;
+    }
+
+    int err = n != NO_NODE ? resolve_link(ov, n, 1, buf, &len)
+                           : tar_walk_path(buf, &len, path, follow_last, 0, follow_link, (void *) ov);
+    if (err != 0) {
+        return err;
+    }
+    *out = len == 0 ? ROOT_NODE : lookup_visible(ov, buf, len);
+    return *out == NO_NODE ? ENOENT : 0;
+}
+
+const tar_index_entry_t *tar_overlay_resolve(tar_overlay_t *ov, const char *path, size_t *layer) {
+    uint32_t n;
+    int err = resolve(ov, path, true, &n);
+    if (err == 0 && n == ROOT_NODE) {
+        err = EISDIR; // the root of the view has no entry
+    }
+    if (err != 0) {
+        errno = err;
+        return NULL;
+    }
+    if (layer != NULL) {
+        *layer = ov->nodes[n].layer;
+    }
+    return ov->nodes[n].entry;
+}
+
+/* Entry a path names without following a link in its last component, NULL if there is none */
+static const tar_index_entry_t *lookup_nofollow(const tar_overlay_t *ov, const char *path) {
+    uint32_t n;
+    if (resolve(ov, path, false, &n) != 0) {
+        return NULL;
+    }
+    return n == ROOT_NODE ? ov->root_entry : ov->nodes[n].entry;
+}
+
+int tar_overlay_check_file_type(tar_overlay_t *ov, char *path, char typeflag) {
+    const tar_index_entry_t *entry = lookup_nofollow(ov, path);
+    if (entry == NULL) {
+        return 0;
+    }
+    return entry->typeflag == typeflag || (typeflag == REGTYPE && entry->typeflag == AREGTYPE);
+}
+
+int tar_overlay_exists(tar_overlay_t *ov, char *path) {
+    return lookup_nofollow(ov, path) != NULL;
+}
+
+int tar_overlay_is_dir(tar_overlay_t *ov, char *path) {
+    return tar_overlay_check_file_type(ov, path, DIRTYPE);
+}
+
+int tar_overlay_is_file(tar_overlay_t *ov, char *path) {
+    return tar_overlay_check_file_type(ov, path, REGTYPE);
+}
+
+int tar_overlay_is_symlink(tar_overlay_t *ov, char *path) {
+    return tar_overlay_check_file_type(ov, path, SYMTYPE);
+}
+
+int tar_overlay_list(tar_overlay_t *ov, char *path, char **entries, size_t *no_entries) {
+    // a link is resolved to its linked-to directory, "" and "." both list the root of the view
+    uint32_t n;
+    if (resolve(ov, path, true, &n) != 0 || (n != ROOT_NODE && ov->nodes[n].entry->typeflag != DIRTYPE)) {
+        *no_entries = 0;
+        return 0;
+    }
+
+    size_t current = 0;
+    uint32_t child = n == ROOT_NODE ? ov->root_first_child : ov->nodes[n].first_child;
+    for (; child != NO_NODE && current < *no_entries; child = ov->nodes[child].next_sibling) {
+        strcpy(entries[current++], ov->nodes[child].entry->name);
+    }
+
+    *no_entries = current;
+    return 1;
+}
+
+ssize_t tar_overlay_read_file(tar_overlay_t *ov, char *path, size_t offset, uint8_t *dest, size_t *len) {
+    size_t layer;
+    const tar_index_entry_t *entry = tar_overlay_resolve(ov, path, &layer);
+    if (entry == NULL || (entry->typeflag != REGTYPE && entry->typeflag != AREGTYPE)) {
+        return -1;
+    }
+    // the name is the exact key of the entry in its layer, which the index finds in one lookup
+    return tar_index_read_file(ov->layers[layer], entry->name, offset, dest, len);
+}
@@ -0,0 +1,79 @@
+#ifndef TAR_OVERLAY_H
+#define TAR_OVERLAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "tar_index.h"
+
+/* Most threads indexing the layers of an overlay at once */
+#ifndef TAR_OVERLAY_THREADS
+#define TAR_OVERLAY_THREADS 8
+#endif
+
+/**
+ * Union view of a stack of archives, as the layers of a container image: a path names the entry of the uppermost
+ * layer that has it, unless an upper layer hides it.
+ * Every layer is indexed once, then the indexes are merged into a single path table holding the visible entry of
+ * every path, so a query is one lookup whatever the number of layers. Directories list the children of every layer
+ * they are visible in.
+ * An upper layer hides the entries of the lower ones with the OCI and overlayfs conventions:
+ *  - an entry at a path shadows the entries at the same path below it, and a non-directory also shadows whatever the
+ *    lower layers have under that path;
+ *  - a whiteout, an entry named ".wh." followed by a name, removes that name and its subtree from the lower layers;
+ *  - an opaque marker, an entry named ".wh..wh..opq", hides the lower contents of the directory that holds it,
+ *    while the directory itself and the contents of its own layer stay visible.
+ * Whiteouts and markers are never visible themselves. Links are resolved on the union view, so a link of an upper
+ * layer may point to an entry of a lower one.
+ * An overlay is read-only once built, and its queries are safe to call from several threads.
+ */
+typedef struct tar_overlay tar_overlay_t;
+
+/**
+ * Indexes a stack of archives, in parallel threads, and merges their indexes.
+ *
+ * @param fds File descriptors of uncompressed archives, from the lowest layer to the uppermost one, the order of the
+ *            layers in an image manifest. They are kept by the overlay to read entry data, and must outlive it.
+ * @param no_layers The number of descriptors.
+ *
+ * @return the overlay, or NULL with errno set to ENOMEM if it could not be allocated.
+ */
+tar_overlay_t *tar_overlay_build(const int *fds, size_t no_layers);
+
+/**
+ * Releases an overlay and the indexes of its layers. Does not close the archive descriptors.
+ */
+void tar_overlay_free(tar_overlay_t *ov);
+
+/**
+ * Resolves a path on the union view to the entry it finally names, following links as tar_resolve() does.
+ *
+ * @param layer Set to the position in fds of the archive that holds the entry, for the functions that take a
+ *              descriptor, such as tar_entry_open(). May be NULL.
+ *
+ * @return the entry, owned by the index of its layer, or NULL with errno set as tar_resolve().
+ */
+const tar_index_entry_t *tar_overlay_resolve(tar_overlay_t *ov, const char *path, size_t *layer);
+
+/**
+ * Union versions of the lib_tar.h query functions.
+ * They take the same arguments and return the same values as if the layers had been extracted on top of each other.
+ * tar_overlay_list() lists the entries of every layer that are visible in the directory, each once, with its name
+ * in the archive that holds it.
+ */
+int tar_overlay_check_file_type(tar_overlay_t *ov, char *path, char typeflag);
+
+int tar_overlay_exists(tar_overlay_t *ov, char *path);
+
+int tar_overlay_is_dir(tar_overlay_t *ov, char *path);
+
+int tar_overlay_is_file(tar_overlay_t *ov, char *path);
+
+int tar_overlay_is_symlink(tar_overlay_t *ov, char *path);
+
+int tar_overlay_list(tar_overlay_t *ov, char *path, char **entries, size_t *no_entries);
+
+ssize_t tar_overlay_read_file(tar_overlay_t *ov, char *path, size_t offset, uint8_t *dest, size_t *len);
+
+#endif
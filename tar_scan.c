@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "tar_scan.h"
+#include "tar_stats.h"
+
+static ssize_t fd_pread(void *ctx, void *buf, size_t len, off_t offset) {
+    ssize_t res = pread((int) (intptr_t) ctx, buf, len, offset);
+    TAR_STATS_ADD(read_calls, 1);
+    TAR_STATS_ADD(bytes_read, res > 0 ? res : 0);
+    return res;
+}
+
+static ssize_t fd_preadv(void *ctx, const struct iovec *iov, int iovcnt, off_t offset) {
+    ssize_t res = preadv((int) (intptr_t) ctx, iov, iovcnt, offset);
+    TAR_STATS_ADD(read_calls, 1);
+    TAR_STATS_ADD(bytes_read, res > 0 ? res : 0);
+    return res;
+}
+
+tar_reader_t tar_fd_reader(int tar_fd) {
+    tar_reader_t reader = {fd_pread, (void *) (intptr_t) tar_fd, fd_preadv};
+    return reader;
+}
+
+int tar_scan_init(tar_scanner_t *sc, int tar_fd, size_t chunk_size) {
+    return tar_scan_init_reader(sc, tar_fd_reader(tar_fd), chunk_size);
+}
+
+int tar_scan_init_reader(tar_scanner_t *sc, tar_reader_t reader, size_t chunk_size) {
+    if (chunk_size == 0) {
+        chunk_size = TAR_SCAN_CHUNK_SIZE;
+    }
+    // a chunk has to hold two blocks after the alignment slack, so that an end of archive can always be checked at once
+    if (chunk_size < 2 * TAR_SCAN_ALIGN) {
+        chunk_size = 2 * TAR_SCAN_ALIGN;
+    }
+    chunk_size = (chunk_size + TAR_SCAN_ALIGN - 1) / TAR_SCAN_ALIGN * TAR_SCAN_ALIGN;
+
+    void *buf;
+    if (posix_memalign(&buf, TAR_SCAN_ALIGN, chunk_size) != 0) {
+        return -1;
+    }
+
+    sc->reader = reader;
+    sc->buf = buf;
+    sc->chunk_size = chunk_size;
+    sc->buf_offset = 0;
+    sc->buf_len = 0;
+    sc->next_offset = 0;
+    tar_ext_init(&sc->ext);
+    return 0;
+}
+
+void tar_scan_destroy(tar_scanner_t *sc) {
+    free(sc->buf);
+    sc->buf = NULL;
+    tar_ext_destroy(&sc->ext);
+}
+
+/**
+ * Makes sure the block at the given offset is in the buffer, reading a new chunk if needed.
+ *
+ * @return a pointer to the block in the buffer, or NULL if the archive ends before the end of the block.
+ */
+static const uint8_t *get_block(tar_scanner_t *sc, off_t offset) {
+    if (offset >= sc->buf_offset && offset + sizeof(tar_header_t) <= sc->buf_offset + sc->buf_len) {
+        return sc->buf + (offset - sc->buf_offset);
+    }
+
+    sc->buf_offset = offset / TAR_SCAN_ALIGN * TAR_SCAN_ALIGN;
+    sc->buf_len = 0;
+    while (sc->buf_len < sc->chunk_size) {
+        ssize_t res = sc->reader.pread(sc->reader.ctx, sc->buf + sc->buf_len, sc->chunk_size - sc->buf_len,
+                                       sc->buf_offset + sc->buf_len);
+        if (res == -1) {
+            perror("Failed to read header from file");
+            exit(EXIT_FAILURE);
+        }
+        if (res == 0) {
+            break;
+        }
+        sc->buf_len += res;
+    }
+
+    if (offset + sizeof(tar_header_t) > sc->buf_offset + sc->buf_len) {
+        return NULL;
+    }
+    return sc->buf + (offset - sc->buf_offset);
+}
+
+/**
+ * Reads the data of an extension header and records it.
+ * The data is taken from the buffer when it is already there, and read on the side otherwise, so that the header
+ * stays valid in the buffer.
+ *
+ * @return zero on success, -1 if the data could not be allocated.
+ */
+static int add_ext_header(tar_scanner_t *sc, const tar_header_t *header, off_t header_offset) {
+    int64_t size = TAR_SIZE(header);
+    if (size <= 0 || size > TAR_EXT_MAX) {
+        return 0;
+    }
+    off_t data_offset = header_offset + sizeof(tar_header_t);
+    if (data_offset + size <= sc->buf_offset + (off_t) sc->buf_len) {
+        return tar_ext_add(&sc->ext, header, sc->buf + (data_offset - sc->buf_offset), size);
+    }
+
+    uint8_t *data = malloc(size);
+    if (data == NULL) {
+        return -1;
+    }
+    size_t done = 0;
+    while (done < (size_t) size) {
+        ssize_t res = sc->reader.pread(sc->reader.ctx, data + done, size - done, data_offset + done);
+        if (res == -1) {
+            perror("Failed to read header from file");
+            exit(EXIT_FAILURE);
+        }
+        if (res == 0) {
+            break; // truncated, the archive ends before the member it applies to anyway
+        }
+        done += res;
+    }
+    int res = tar_ext_add(&sc->ext, header, data, done);
+    free(data);
+    return res;
+}
+
+/**
+ * Parses the next non-null header and moves past its data.
+ *
+ * @return 1 if a header was parsed, zero at the end of the archive, -1 if an allocation failed.
+ */
+static int scan_header(tar_scanner_t *sc, const tar_header_t **header, off_t *header_offset) {
+    while (true) {
+        const uint8_t *block = get_block(sc, sc->next_offset);
+        if (block == NULL) {
+            return 0;
+        }
+
+        // check to see if the header was full of 0s, if that's the case, check that the next block is also 0s
+        if (is_zeros(block, sizeof(tar_header_t))) {
+            const uint8_t *next_block = get_block(sc, sc->next_offset + sizeof(tar_header_t));
+            if (next_block == NULL || is_zeros(next_block, sizeof(tar_header_t))) {
+                return 0; // two empty blocks, this is the end of the tarball
+            }
+            sc->next_offset += sizeof(tar_header_t);
+            continue;
+        }
+
+        *header = (const tar_header_t *) block;
+        *header_offset = sc->next_offset;
+        TAR_STATS_ADD(headers_visited, 1);
+
+        uint64_t file_size;
+        if (tar_is_ext_header(*header)) {
+            if (add_ext_header(sc, *header, *header_offset) != 0) {
+                return -1;
+            }
+            int64_t size = TAR_SIZE(*header);
+            file_size = size > 0 ? size : 0;
+        } else {
+            if (tar_ext_member(&sc->ext, *header, *header_offset, &sc->member) != 0) {
+                return -1;
+            }
+            file_size = sc->member.size;
+        }
+
+        uint64_t padding = (512 - file_size % 512) % 512;
+        sc->next_offset += sizeof(tar_header_t) + file_size + padding;
+        return 1;
+    }
+}
+
+int tar_scan_next(tar_scanner_t *sc, const tar_header_t **header, off_t *header_offset) {
+    int res = scan_header(sc, header, header_offset);
+    if (res < 0) {
+        perror("Failed to allocate an extended header");
+        exit(EXIT_FAILURE);
+    }
+    return res;
+}
+
+int tar_scan_next_member(tar_scanner_t *sc, const tar_member_t **member) {
+    const tar_header_t *header;
+    off_t header_offset;
+    int res;
+    while ((res = scan_header(sc, &header, &header_offset)) > 0) {
+        if (!tar_is_ext_header(header)) {
+            *member = &sc->member;
+            return 1;
+        }
+    }
+    return res;
+}
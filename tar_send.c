@@ -0,0 +1,116 @@
+#define _GNU_SOURCE // splice()
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include "tar_send.h"
+
+/* Whether a failed sendfile() or splice() means this kind of descriptor is not supported, rather than a real error */
+static bool unsupported(int err) {
+    return err == EINVAL || err == ENOSYS || err == EOPNOTSUPP;
+}
+
+/* Writes a whole buffer, or as much as a non-blocking descriptor accepts */
+static ssize_t write_some(int fd, const uint8_t *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t res = write(fd, buf + done, len - done);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return done > 0 && errno == EAGAIN ? (ssize_t) done : -1;
+        }
+        done += res;
+    }
+    return done;
+}
+
+/**
+ * Moves bytes of the archive to the output with read() and write(), for the descriptors the kernel can't move them
+ * between directly.
+ *
+ * @return the number of bytes sent, or -1 with errno set if nothing could be sent.
+ */
+static ssize_t copy_range(int tar_fd, off_t offset, int out_fd, size_t len) {
+    size_t chunk = len < TAR_SEND_CHUNK ? len : TAR_SEND_CHUNK;
+    uint8_t *buf = malloc(chunk);
+    if (buf == NULL) {
+        return -1;
+    }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t res = pread(tar_fd, buf, len - done < chunk ? len - done : chunk, offset + done);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to read from file");
+            exit(EXIT_FAILURE);
+        }
+        if (res == 0) {
+            break;
+        }
+        ssize_t written = write_some(out_fd, buf, res);
+        if (written == -1) {
+            if (done == 0) {
+                free(buf);
+                return -1;
+            }
+            break;
+        }
+        done += written;
+        if (written < res) {
+            break; // the output is full
+        }
+    }
+    free(buf);
+    return done;
+}
+
+ssize_t tar_index_send_entry(tar_index_t *idx, int tar_fd, char *path, int out_fd, size_t offset, size_t len) {
+    const tar_index_entry_t *entry = tar_index_lookup_file(idx, path);
+    if (entry == NULL) {
+        return -1;
+    }
+    if (offset > entry->size) {
+        return -2;
+    }
+    if (len == 0 || len > entry->size - offset) {
+        len = entry->size - offset;
+    }
+
+    // splice() moves pages into a pipe without copying them, sendfile() covers sockets and the other descriptors
+    struct stat st;
+    bool pipe = fstat(out_fd, &st) == 0 && S_ISFIFO(st.st_mode);
+    off_t in = entry->data_offset + offset;
+    size_t done = 0;
+    while (done < len) {
+        size_t chunk = len - done < TAR_SEND_CHUNK ? len - done : TAR_SEND_CHUNK;
+        ssize_t res = pipe ? splice(tar_fd, &in, out_fd, NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE)
+                           : sendfile(out_fd, tar_fd, &in, chunk);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (done == 0 && unsupported(errno)) {
+                res = copy_range(tar_fd, in, out_fd, len);
+                return res == -1 ? -3 : res;
+            }
+            if (done == 0) {
+                return -3;
+            }
+            break; // a non-blocking output is full, or the reader went away after some bytes were sent
+        }
+        if (res == 0) {
+            break; // the archive is truncated
+        }
+        done += res;
+    }
+    return done;
+}
@@ -0,0 +1,22 @@
+#ifndef TAR_SEND_H
+#define TAR_SEND_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "tar_index.h"
+
+/* Most bytes moved by one sendfile() or splice() call, so that one large file does not hog the output descriptor */
+#ifndef TAR_SEND_CHUNK
+#define TAR_SEND_CHUNK (1 << 20)
+#endif
+
+/**
+ * Sends a byte range of a file of the archive to a descriptor, see tar_send_entry() in lib_tar.h.
+ *
+ * @param idx An index of the archive, built or loaded.
+ * @param tar_fd A file descriptor of the uncompressed archive the index describes, the data is sent from it.
+ */
+ssize_t tar_index_send_entry(tar_index_t *idx, int tar_fd, char *path, int out_fd, size_t offset, size_t len);
+
+#endif
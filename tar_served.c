@@ -0,0 +1,23 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tar_daemon.h"
+
+/**
+ * Keeps the indexes of a set of archives resident and serves the lib_tar.h queries on them to the processes that
+ * use tar_client.h, until it gets SIGINT or SIGTERM.
+ *
+ * Usage: tar_served socket archive...
+ */
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s socket archive...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (tar_daemon_run(argv[1], argv + 2, argc - 2) == -1) {
+        perror("tar_daemon_run");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,209 @@
+#include <string.h>
+#include "tar_simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define BLOCK_SIZE 512
+
+/* CRC-32C polynomial, bit-reversed */
+#define CRC32C_POLY 0x82f63b78u
+
+static uint32_t (*header_sum_kernel)(const void *block) = tar_header_sum_swar;
+static bool (*is_zeros_kernel)(const void *buf, size_t size) = tar_block_is_zeros_swar;
+static const char *kernel_name = "swar";
+static uint32_t (*crc32c_kernel)(uint32_t crc, const void *buf, size_t len) = tar_crc32c_table;
+
+/* CRC-32C of every byte value, filled with the kernels */
+static uint32_t crc32c_lookup[256];
+
+/* Picks the fastest kernels the CPU supports before main() runs, so the dispatch never races between threads */
+__attribute__((constructor))
+static void select_kernels(void) {
+    for (uint32_t b = 0; b < 256; ++b) {
+        uint32_t crc = b;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_lookup[b] = crc;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        header_sum_kernel = tar_header_sum_avx2;
+        is_zeros_kernel = tar_block_is_zeros_avx2;
+        kernel_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        header_sum_kernel = tar_header_sum_sse2;
+        is_zeros_kernel = tar_block_is_zeros_sse2;
+        kernel_name = "sse2";
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_kernel = tar_crc32c_sse42;
+    }
+#endif
+}
+
+uint32_t tar_header_sum(const void *block) {
+    return header_sum_kernel(block);
+}
+
+bool tar_block_is_zeros(const void *buf, size_t size) {
+    return is_zeros_kernel(buf, size);
+}
+
+uint32_t tar_crc32c(uint32_t crc, const void *buf, size_t len) {
+    return crc32c_kernel(crc, buf, len);
+}
+
+const char *tar_simd_kernel(void) {
+    return kernel_name;
+}
+
+/* Replaces the contribution of the chksum field in a full block sum by 8 ASCII spaces */
+static uint32_t fix_chksum_field(const uint8_t *block, uint32_t sum) {
+    for (int i = TAR_CHKSUM_OFFSET; i < TAR_CHKSUM_OFFSET + TAR_CHKSUM_LEN; ++i) {
+        sum -= block[i];
+    }
+    return sum + TAR_CHKSUM_LEN * ' ';
+}
+
+static bool tail_is_zeros(const uint8_t *buf, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        if (buf[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint32_t tar_header_sum_swar(const void *block) {
+    const uint8_t *bytes = block;
+    const uint64_t low_bytes = 0x00ff00ff00ff00ffULL;
+
+    // add the bytes pairwise into 4 16-bit lanes, each lane gets at most 2 * 64 * 255 which fits in 16 bits
+    uint64_t lanes = 0;
+    for (int i = 0; i < BLOCK_SIZE; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        lanes += (word & low_bytes) + ((word >> 8) & low_bytes);
+    }
+
+    uint32_t sum = (lanes & 0xffff) + ((lanes >> 16) & 0xffff) + ((lanes >> 32) & 0xffff) + (lanes >> 48);
+    return fix_chksum_field(bytes, sum);
+}
+
+bool tar_block_is_zeros_swar(const void *buf, size_t size) {
+    const uint8_t *bytes = buf;
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        uint64_t words[4];
+        memcpy(words, bytes + i, 32);
+        if ((words[0] | words[1] | words[2] | words[3]) != 0) {
+            return false;
+        }
+    }
+    return tail_is_zeros(bytes + i, size - i);
+}
+
+uint32_t tar_crc32c_table(uint32_t crc, const void *buf, size_t len) {
+    const uint8_t *bytes = buf;
+    crc = ~crc;
+    for (size_t i = 0; i < len; ++i) {
+        crc = (crc >> 8) ^ crc32c_lookup[(crc ^ bytes[i]) & 0xff];
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sse2")))
+uint32_t tar_header_sum_sse2(const void *block) {
+    const uint8_t *bytes = block;
+    const __m128i zero = _mm_setzero_si128();
+
+    // psadbw against zero sums each group of 8 bytes into a 64-bit lane
+    __m128i acc = zero;
+    for (int i = 0; i < BLOCK_SIZE; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (bytes + i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+    }
+
+    uint32_t sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+    return fix_chksum_field(bytes, sum);
+}
+
+__attribute__((target("avx2")))
+uint32_t tar_header_sum_avx2(const void *block) {
+    const uint8_t *bytes = block;
+    const __m256i zero = _mm256_setzero_si256();
+
+    __m256i acc = zero;
+    for (int i = 0; i < BLOCK_SIZE; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (bytes + i));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(v, zero));
+    }
+
+    __m128i halves = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    uint32_t sum = _mm_cvtsi128_si32(halves) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(halves, halves));
+    return fix_chksum_field(bytes, sum);
+}
+
+__attribute__((target("sse2")))
+bool tar_block_is_zeros_sse2(const void *buf, size_t size) {
+    const uint8_t *bytes = buf;
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        __m128i v = _mm_or_si128(
+                _mm_or_si128(_mm_loadu_si128((const __m128i *) (bytes + i)), _mm_loadu_si128((const __m128i *) (bytes + i + 16))),
+                _mm_or_si128(_mm_loadu_si128((const __m128i *) (bytes + i + 32)), _mm_loadu_si128((const __m128i *) (bytes + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff) {
+            return false;
+        }
+    }
+    return tar_block_is_zeros_swar(bytes + i, size - i);
+}
+
+__attribute__((target("avx2")))
+bool tar_block_is_zeros_avx2(const void *buf, size_t size) {
+    const uint8_t *bytes = buf;
+    size_t i = 0;
+    for (; i + 128 <= size; i += 128) {
+        __m256i v = _mm256_or_si256(
+                _mm256_or_si256(_mm256_loadu_si256((const __m256i *) (bytes + i)), _mm256_loadu_si256((const __m256i *) (bytes + i + 32))),
+                _mm256_or_si256(_mm256_loadu_si256((const __m256i *) (bytes + i + 64)), _mm256_loadu_si256((const __m256i *) (bytes + i + 96))));
+        if (!_mm256_testz_si256(v, v)) {
+            return false;
+        }
+    }
+    return tar_block_is_zeros_swar(bytes + i, size - i);
+}
+
+__attribute__((target("sse4.2")))
+uint32_t tar_crc32c_sse42(uint32_t crc, const void *buf, size_t len) {
+    const uint8_t *bytes = buf;
+    size_t i = 0;
+#if defined(__x86_64__)
+    uint64_t crc64 = ~crc;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t) crc64;
+#else
+    crc = ~crc;
+    for (; i + 4 <= len; i += 4) {
+        uint32_t word;
+        memcpy(&word, bytes + i, 4);
+        crc = _mm_crc32_u32(crc, word);
+    }
+#endif
+    for (; i < len; ++i) {
+        crc = _mm_crc32_u8(crc, bytes[i]);
+    }
+    return ~crc;
+}
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef TAR_SIMD_H
+#define TAR_SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Offset and length of the chksum field in a header */
+#define TAR_CHKSUM_OFFSET 148
+#define TAR_CHKSUM_LEN 8
+
+/**
+ * Computes the checksum of a 512-byte header block, i.e. the sum of its unsigned bytes with the chksum field counted
+ * as ASCII spaces, without copying the block.
+ * The kernel is chosen once at startup from what the CPU supports (AVX2, SSE2, or a portable SWAR fallback).
+ */
+uint32_t tar_header_sum(const void *block);
+
+/**
+ * Checks whether a buffer only contains zero bytes, reading it a word (or a vector) at a time.
+ */
+bool tar_block_is_zeros(const void *buf, size_t size);
+
+/**
+ * Updates a CRC-32C (Castagnoli, the checksum of iSCSI and ext4) with the bytes of a buffer.
+ * Uses the crc32 instruction of SSE4.2 when the CPU has it, a table otherwise.
+ *
+ * @param crc The CRC of the bytes before the buffer, zero to start.
+ *
+ * @return the CRC of the bytes so far, to be given to the next call.
+ */
+uint32_t tar_crc32c(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * Name of the kernel selected at startup: "avx2", "sse2" or "swar".
+ */
+const char *tar_simd_kernel(void);
+
+/* The individual kernels, exposed for benchmarking. The SSE2/AVX2 ones must only be called if the CPU supports them */
+uint32_t tar_header_sum_swar(const void *block);
+
+bool tar_block_is_zeros_swar(const void *buf, size_t size);
+
+uint32_t tar_crc32c_table(uint32_t crc, const void *buf, size_t len);
+
+#if defined(__x86_64__) || defined(__i386__)
+uint32_t tar_header_sum_sse2(const void *block);
+
+uint32_t tar_header_sum_avx2(const void *block);
+
+bool tar_block_is_zeros_sse2(const void *buf, size_t size);
+
+bool tar_block_is_zeros_avx2(const void *buf, size_t size);
+
+uint32_t tar_crc32c_sse42(uint32_t crc, const void *buf, size_t len);
+#endif
+
+#endif
@@ -0,0 +1,95 @@
+#include <string.h>
+#include <time.h>
+#include "tar_stats.h"
+
+static const char *const func_names[TAR_STATS_NO_FUNCS] = {
+    "check_archive", "exists", "is_dir", "is_file", "is_symlink", "list", "read_file"
+};
+
+const char *tar_stats_func_name(tar_stats_func_t func) {
+    return func < TAR_STATS_NO_FUNCS ? func_names[func] : "unknown";
+}
+
+#ifdef TAR_STATS
+
+tar_stats_counters_t tar_stats_counters;
+
+typedef struct {
+    atomic_uint_fast64_t calls;
+    atomic_uint_fast64_t total_ns;
+    atomic_uint_fast64_t max_ns;
+    atomic_uint_fast64_t buckets[TAR_STATS_BUCKETS];
+} latency_counters_t;
+
+static latency_counters_t latencies[TAR_STATS_NO_FUNCS];
+
+uint64_t tar_stats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void tar_stats_record(tar_stats_func_t func, uint64_t start_ns) {
+    uint64_t ns = tar_stats_clock() - start_ns;
+    latency_counters_t *l = &latencies[func];
+
+    // the bucket is the number of bits of the latency in microseconds
+    uint64_t us = ns / 1000;
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    if (bucket >= TAR_STATS_BUCKETS) {
+        bucket = TAR_STATS_BUCKETS - 1;
+    }
+
+    atomic_fetch_add_explicit(&l->calls, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&l->total_ns, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&l->buckets[bucket], 1, memory_order_relaxed);
+    uint_fast64_t max = atomic_load_explicit(&l->max_ns, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&l->max_ns, &max, ns, memory_order_relaxed,
+                                                              memory_order_relaxed)) {
+    }
+}
+
+void tar_stats_get(tar_stats_t *stats) {
+    stats->headers_visited = atomic_load_explicit(&tar_stats_counters.headers_visited, memory_order_relaxed);
+    stats->read_calls = atomic_load_explicit(&tar_stats_counters.read_calls, memory_order_relaxed);
+    stats->bytes_read = atomic_load_explicit(&tar_stats_counters.bytes_read, memory_order_relaxed);
+    stats->link_resolutions = atomic_load_explicit(&tar_stats_counters.link_resolutions, memory_order_relaxed);
+    stats->index_hits = atomic_load_explicit(&tar_stats_counters.index_hits, memory_order_relaxed);
+    stats->index_misses = atomic_load_explicit(&tar_stats_counters.index_misses, memory_order_relaxed);
+    for (int f = 0; f < TAR_STATS_NO_FUNCS; ++f) {
+        stats->latency[f].calls = atomic_load_explicit(&latencies[f].calls, memory_order_relaxed);
+        stats->latency[f].total_ns = atomic_load_explicit(&latencies[f].total_ns, memory_order_relaxed);
+        stats->latency[f].max_ns = atomic_load_explicit(&latencies[f].max_ns, memory_order_relaxed);
+        for (int b = 0; b < TAR_STATS_BUCKETS; ++b) {
+            stats->latency[f].buckets[b] = atomic_load_explicit(&latencies[f].buckets[b], memory_order_relaxed);
+        }
+    }
+}
+
+void tar_stats_reset(void) {
+    atomic_store_explicit(&tar_stats_counters.headers_visited, 0, memory_order_relaxed);
+    atomic_store_explicit(&tar_stats_counters.read_calls, 0, memory_order_relaxed);
+    atomic_store_explicit(&tar_stats_counters.bytes_read, 0, memory_order_relaxed);
+    atomic_store_explicit(&tar_stats_counters.link_resolutions, 0, memory_order_relaxed);
+    atomic_store_explicit(&tar_stats_counters.index_hits, 0, memory_order_relaxed);
+    atomic_store_explicit(&tar_stats_counters.index_misses, 0, memory_order_relaxed);
+    for (int f = 0; f < TAR_STATS_NO_FUNCS; ++f) {
+        atomic_store_explicit(&latencies[f].calls, 0, memory_order_relaxed);
+        atomic_store_explicit(&latencies[f].total_ns, 0, memory_order_relaxed);
+        atomic_store_explicit(&latencies[f].max_ns, 0, memory_order_relaxed);
+        for (int b = 0; b < TAR_STATS_BUCKETS; ++b) {
+            atomic_store_explicit(&latencies[f].buckets[b], 0, memory_order_relaxed);
+        }
+    }
+}
+
+#else
+
+void tar_stats_get(tar_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+}
+
+void tar_stats_reset(void) {
+}
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef TAR_STATS_H
+#define TAR_STATS_H
+
+#include <stdint.h>
+
+/**
+ * Counters of the work done by the library, to tell why a call is slow: the headers it scanned, the bytes it read,
+ * the links it followed.
+ * They are only maintained when the library is built with TAR_STATS defined ("make STATS=1"), otherwise the counting
+ * is compiled out and tar_stats_get() reports zeros. The counters are shared by all threads and updated atomically.
+ * The library only reads the archive at explicit offsets, so there is no lseek() to count, only read calls.
+ */
+
+/* Functions whose latency is recorded */
+typedef enum {
+    TAR_STATS_CHECK_ARCHIVE,
+    TAR_STATS_EXISTS,
+    TAR_STATS_IS_DIR,
+    TAR_STATS_IS_FILE,
+    TAR_STATS_IS_SYMLINK,
+    TAR_STATS_LIST,
+    TAR_STATS_READ_FILE,
+    TAR_STATS_NO_FUNCS
+} tar_stats_func_t;
+
+/* Buckets of a latency histogram: bucket 0 counts the calls under 1 µs, bucket i > 0 the calls from 2^(i-1) µs to
+ * 2^i µs, the last bucket also counting anything slower */
+#define TAR_STATS_BUCKETS 32
+
+typedef struct {
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[TAR_STATS_BUCKETS];
+} tar_stats_latency_t;
+
+typedef struct {
+    uint64_t headers_visited;     /* headers parsed while walking an archive, extension headers included */
+    uint64_t read_calls;          /* read(), pread() and preadv() calls on archive files */
+    uint64_t bytes_read;
+    uint64_t link_resolutions;    /* links followed while resolving paths and memoizing links */
+    uint64_t index_hits;          /* lookups of a path in an index that found an entry */
+    uint64_t index_misses;
+    tar_stats_latency_t latency[TAR_STATS_NO_FUNCS];
+} tar_stats_t;
+
+/**
+ * Takes a snapshot of the counters since the start of the process or the last tar_stats_reset().
+ * Calls running concurrently may be partly counted.
+ */
+void tar_stats_get(tar_stats_t *stats);
+
+/**
+ * Sets every counter back to zero.
+ */
+void tar_stats_reset(void);
+
+/**
+ * Name of a function, such as "read_file", to label exported metrics.
+ */
+const char *tar_stats_func_name(tar_stats_func_t func);
+
+// used by the library to update the counters
+#ifdef TAR_STATS
+#include <stdatomic.h>
+
+typedef struct {
+    atomic_uint_fast64_t headers_visited;
+    atomic_uint_fast64_t read_calls;
+    atomic_uint_fast64_t bytes_read;
+    atomic_uint_fast64_t link_resolutions;
+    atomic_uint_fast64_t index_hits;
+    atomic_uint_fast64_t index_misses;
+} tar_stats_counters_t;
+
+extern tar_stats_counters_t tar_stats_counters;
+
+uint64_t tar_stats_clock(void);
+
+void tar_stats_record(tar_stats_func_t func, uint64_t start_ns);
+
+#define TAR_STATS_ADD(counter, n) atomic_fetch_add_explicit(&tar_stats_counters.counter, (n), memory_order_relaxed)
+#define TAR_STATS_START(start) uint64_t start = tar_stats_clock()
+#define TAR_STATS_END(func, start) tar_stats_record(func, start)
+#else
+#define TAR_STATS_ADD(counter, n) ((void) 0)
+#define TAR_STATS_START(start) ((void) 0)
+#define TAR_STATS_END(func, start) ((void) 0)
+#endif
+
+#endif
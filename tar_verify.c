@@ -0,0 +1,501 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tar_index.h"
+#include "tar_scan.h"
+#include "tar_simd.h"
+#include "tar_verify.h"
+
+/* Round constants of SHA-256, the fractional parts of the cube roots of the first 64 primes */
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+/* Mixes a 64-byte block into the state */
+static void sha256_block(uint32_t *state, const uint8_t *block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = (uint32_t) block[4 * i] << 24 | (uint32_t) block[4 * i + 1] << 16 | (uint32_t) block[4 * i + 2] << 8
+               | block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; ++i) {
+        uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+static void sha256_init(tar_sha256_t *sha) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(sha->state, initial, sizeof(initial));
+    sha->length = 0;
+    sha->block_len = 0;
+}
+
+static void sha256_update(tar_sha256_t *sha, const uint8_t *bytes, size_t len) {
+    sha->length += len;
+    if (sha->block_len > 0) {
+        size_t n = 64 - sha->block_len < len ? 64 - sha->block_len : len;
+        memcpy(sha->block + sha->block_len, bytes, n);
+        sha->block_len += n;
+        bytes += n;
+        len -= n;
+        if (sha->block_len < 64) {
+            return;
+        }
+        sha256_block(sha->state, sha->block);
+        sha->block_len = 0;
+    }
+    // whole blocks are hashed in place
+    for (; len >= 64; bytes += 64, len -= 64) {
+        sha256_block(sha->state, bytes);
+    }
+    memcpy(sha->block, bytes, len);
+    sha->block_len = len;
+}
+
+static void sha256_final(tar_sha256_t *sha, uint8_t *digest) {
+    // a 1 bit, zeros up to 8 bytes before the end of a block, then the length in bits
+    uint64_t bits = sha->length * 8;
+    sha->block[sha->block_len++] = 0x80;
+    if (sha->block_len > 56) {
+        memset(sha->block + sha->block_len, 0, 64 - sha->block_len);
+        sha256_block(sha->state, sha->block);
+        sha->block_len = 0;
+    }
+    memset(sha->block + sha->block_len, 0, 56 - sha->block_len);
+    for (int i = 0; i < 8; ++i) {
+        sha->block[56 + i] = bits >> (56 - 8 * i);
+    }
+    sha256_block(sha->state, sha->block);
+    for (int i = 0; i < 8; ++i) {
+        digest[4 * i] = sha->state[i] >> 24;
+        digest[4 * i + 1] = sha->state[i] >> 16;
+        digest[4 * i + 2] = sha->state[i] >> 8;
+        digest[4 * i + 3] = sha->state[i];
+    }
+}
+
+void tar_digest_init(tar_digest_ctx_t *ctx, int digests) {
+    ctx->digests = digests;
+    ctx->crc32c = 0;
+    sha256_init(&ctx->sha256);
+}
+
+void tar_digest_update(tar_digest_ctx_t *ctx, const void *buf, size_t len) {
+    if (ctx->digests & TAR_DIGEST_CRC32C) {
+        ctx->crc32c = tar_crc32c(ctx->crc32c, buf, len);
+    }
+    if (ctx->digests & TAR_DIGEST_SHA256) {
+        sha256_update(&ctx->sha256, buf, len);
+    }
+}
+
+void tar_digest_final(tar_digest_ctx_t *ctx, tar_digest_t *digest) {
+    memset(digest, 0, sizeof(*digest));
+    if (ctx->digests & TAR_DIGEST_CRC32C) {
+        digest->has_crc32c = true;
+        digest->crc32c = ctx->crc32c;
+    }
+    if (ctx->digests & TAR_DIGEST_SHA256) {
+        digest->has_sha256 = true;
+        sha256_final(&ctx->sha256, digest->sha256);
+    }
+}
+
+/* The data of one entry to hash */
+typedef struct {
+    const tar_index_entry_t *entry;
+    tar_manifest_entry_t *out;
+    int digests;
+    tar_digest_t result;
+    bool truncated;               /* the archive ends before the data of the entry */
+} digest_job_t;
+
+typedef struct {
+    int tar_fd;
+    const uint8_t *map;           /* the whole archive, NULL if it is read with pread() */
+    uint64_t map_size;
+    digest_job_t *jobs;
+    size_t no_jobs;
+    atomic_size_t next_job;
+    atomic_int error;             /* errno of the first failure, which stops every worker */
+} digest_ctx_t;
+
+/* Hashes the data of an entry, from the mapping or with reads of buf */
+static void hash_entry(digest_ctx_t *ctx, digest_job_t *job, uint8_t *buf) {
+    const tar_index_entry_t *entry = job->entry;
+    tar_digest_ctx_t digest;
+    tar_digest_init(&digest, job->digests);
+
+    if (ctx->map != NULL) {
+        if (entry->data_offset + entry->size > ctx->map_size) {
+            job->truncated = true;
+            return;
+        }
+        tar_digest_update(&digest, ctx->map + entry->data_offset, entry->size);
+        tar_digest_final(&digest, &job->result);
+        return;
+    }
+
+    uint64_t done = 0;
+    while (done < entry->size) {
+        size_t len = entry->size - done < TAR_VERIFY_CHUNK ? entry->size - done : TAR_VERIFY_CHUNK;
+        ssize_t res = pread(ctx->tar_fd, buf, len, entry->data_offset + done);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to read from file");
+            exit(EXIT_FAILURE);
+        }
+        if (res == 0) {
+            job->truncated = true;
+            return;
+        }
+        tar_digest_update(&digest, buf, res);
+        done += res;
+    }
+    tar_digest_final(&digest, &job->result);
+}
+
+static void *digest_worker(void *arg) {
+    digest_ctx_t *ctx = arg;
+    uint8_t *buf = NULL;
+    if (ctx->map == NULL && (buf = malloc(TAR_VERIFY_CHUNK)) == NULL) {
+        int expected = 0;
+        atomic_compare_exchange_strong(&ctx->error, &expected, ENOMEM);
+        return NULL;
+    }
+
+    size_t i;
+    while (atomic_load_explicit(&ctx->error, memory_order_relaxed) == 0
+           && (i = atomic_fetch_add(&ctx->next_job, 1)) < ctx->no_jobs) {
+        hash_entry(ctx, &ctx->jobs[i], buf);
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Largest entries first, so that the last jobs to start are short ones */
+static int compare_job_sizes(const void *a, const void *b) {
+    uint64_t x = ((const digest_job_t *) a)->entry->size, y = ((const digest_job_t *) b)->entry->size;
+    return (x < y) - (x > y);
+}
+
+/**
+ * Hashes the data of every job, spread over threads.
+ *
+ * @return zero on success, -1 with errno set if a buffer could not be allocated.
+ */
+static int run_jobs(int tar_fd, digest_job_t *jobs, size_t no_jobs, unsigned nthreads) {
+    digest_ctx_t ctx = {.tar_fd = tar_fd, .jobs = jobs, .no_jobs = no_jobs};
+    atomic_init(&ctx.next_job, 0);
+    atomic_init(&ctx.error, 0);
+    qsort(jobs, no_jobs, sizeof(digest_job_t), compare_job_sizes);
+
+    // a regular file is mapped once and every thread hashes straight from the page cache
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(tar_fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, tar_fd, 0);
+    }
+    if (map != MAP_FAILED) {
+        madvise(map, st.st_size, MADV_WILLNEED);
+        ctx.map = map;
+        ctx.map_size = st.st_size;
+    }
+
+    if (nthreads == 0) {
+        nthreads = TAR_VERIFY_THREADS;
+    }
+    if (nthreads > no_jobs) {
+        nthreads = no_jobs > 0 ? no_jobs : 1;
+    }
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+    unsigned started = 0;
+    while (threads != NULL && started < nthreads && pthread_create(&threads[started], NULL, digest_worker, &ctx) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        digest_worker(&ctx); // no thread could be created, the jobs are run by the caller
+    }
+    for (unsigned t = 0; t < started; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+
+    if (map != MAP_FAILED) {
+        munmap(map, st.st_size);
+    }
+    int err = atomic_load(&ctx.error);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/* Entries of a manifest being built */
+typedef struct {
+    tar_manifest_t *manifest;
+    size_t capacity;
+    bool failed;
+} manifest_builder_t;
+
+/* Appends an entry with a copy of the path, leading "./" and "/" removed */
+static tar_manifest_entry_t *add_manifest_entry(manifest_builder_t *builder, const char *path) {
+    tar_manifest_t *manifest = builder->manifest;
+    if (manifest->no_entries == builder->capacity) {
+        size_t capacity = builder->capacity == 0 ? 256 : builder->capacity * 2;
+        tar_manifest_entry_t *entries = realloc(manifest->entries, capacity * sizeof(tar_manifest_entry_t));
+        if (entries == NULL) {
+            builder->failed = true;
+            return NULL;
+        }
+        manifest->entries = entries;
+        builder->capacity = capacity;
+    }
+    while (path[0] == '/' || (path[0] == '.' && path[1] == '/')) {
+        path += path[0] == '/' ? 1 : 2;
+    }
+    tar_manifest_entry_t *entry = &manifest->entries[manifest->no_entries];
+    memset(entry, 0, sizeof(*entry));
+    entry->path = strdup(path);
+    if (entry->path == NULL) {
+        builder->failed = true;
+        return NULL;
+    }
+    manifest->no_entries++;
+    return entry;
+}
+
+static int collect_file(void *arg, const tar_index_entry_t *entry) {
+    manifest_builder_t *builder = arg;
+    if (entry->typeflag == REGTYPE || entry->typeflag == AREGTYPE) {
+        return add_manifest_entry(builder, entry->key) == NULL;
+    }
+    return 0;
+}
+
+tar_manifest_t *tar_manifest_build(int tar_fd, int digests, unsigned nthreads) {
+    tar_manifest_t *manifest = calloc(1, sizeof(tar_manifest_t));
+    tar_index_t *idx = manifest == NULL ? NULL : tar_index_build(tar_fd);
+    if (idx == NULL) {
+        free(manifest);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // the index visits the paths in byte order, which is the order of the manifest
+    manifest_builder_t builder = {.manifest = manifest};
+    if (tar_find(idx, "**", collect_file, &builder) < 0) {
+        builder.failed = true;
+    }
+    digest_job_t *jobs = builder.failed ? NULL : calloc(manifest->no_entries + 1, sizeof(digest_job_t));
+    if (jobs == NULL) {
+        tar_index_free(idx);
+        tar_manifest_free(manifest);
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (size_t i = 0; i < manifest->no_entries; ++i) {
+        jobs[i].entry = tar_index_lookup(idx, manifest->entries[i].path);
+        jobs[i].out = &manifest->entries[i];
+        jobs[i].digests = digests;
+    }
+
+    int res = run_jobs(tar_fd, jobs, manifest->no_entries, nthreads);
+    for (size_t i = 0; i < manifest->no_entries && res == 0; ++i) {
+        if (jobs[i].truncated) {
+            jobs[i].out->status = TAR_VERIFY_MISSING; // no digest, its data is not all there
+        } else {
+            jobs[i].out->digest = jobs[i].result;
+        }
+    }
+    free(jobs);
+    tar_index_free(idx);
+    if (res != 0) {
+        tar_manifest_free(manifest);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return manifest;
+}
+
+/* A manifest entry and its position in the archive, to tell which of the members with the same path comes last */
+typedef struct {
+    tar_manifest_entry_t entry;
+    size_t position;
+} ordered_entry_t;
+
+/* Orders manifest entries by path, the later one in the archive first among equal paths */
+static int compare_ordered_entries(const void *a, const void *b) {
+    const ordered_entry_t *x = a, *y = b;
+    int res = strcmp(x->entry.path, y->entry.path);
+    return res != 0 ? res : (x->position < y->position) - (x->position > y->position);
+}
+
+tar_manifest_t *tar_manifest_from_pax(int tar_fd) {
+    tar_manifest_t *manifest = calloc(1, sizeof(tar_manifest_t));
+    tar_scanner_t sc;
+    if (manifest == NULL || tar_scan_init(&sc, tar_fd, 0) != 0) {
+        free(manifest);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // every header is checked as check_archive() does, extension headers included since they carry the digests
+    manifest_builder_t builder = {.manifest = manifest};
+    const tar_header_t *header;
+    off_t header_offset;
+    bool invalid = false;
+    while (!builder.failed && !invalid && tar_scan_next(&sc, &header, &header_offset) > 0) {
+        const tar_member_t *member = &sc.member;
+        invalid = check_header(header) != 0;
+        if (invalid || tar_is_ext_header(header) || (!member->digest.has_crc32c && !member->digest.has_sha256)) {
+            continue;
+        }
+        tar_manifest_entry_t *entry = add_manifest_entry(&builder, member->name);
+        if (entry != NULL) {
+            entry->digest = member->digest;
+        }
+    }
+    tar_scan_destroy(&sc);
+
+    // the entries are in archive order, the last member with a path wins as in the index
+    ordered_entry_t *ordered = NULL;
+    if (!builder.failed && !invalid) {
+        ordered = malloc((manifest->no_entries + 1) * sizeof(ordered_entry_t));
+    }
+    if (ordered == NULL) {
+        tar_manifest_free(manifest);
+        errno = invalid ? EINVAL : ENOMEM;
+        return NULL;
+    }
+    for (size_t i = 0; i < manifest->no_entries; ++i) {
+        ordered[i].entry = manifest->entries[i];
+        ordered[i].position = i;
+    }
+    qsort(ordered, manifest->no_entries, sizeof(ordered_entry_t), compare_ordered_entries);
+    size_t kept = 0;
+    for (size_t i = 0; i < manifest->no_entries; ++i) {
+        if (kept > 0 && strcmp(manifest->entries[kept - 1].path, ordered[i].entry.path) == 0) {
+            free(ordered[i].entry.path);
+            continue;
+        }
+        manifest->entries[kept++] = ordered[i].entry;
+    }
+    manifest->no_entries = kept;
+    free(ordered);
+    return manifest;
+}
+
+void tar_manifest_free(tar_manifest_t *manifest) {
+    for (size_t i = 0; i < manifest->no_entries; ++i) {
+        free(manifest->entries[i].path);
+    }
+    free(manifest->entries);
+    free(manifest);
+}
+
+/* Compares the digests the manifest has with the computed ones */
+static int compare_digests(const tar_digest_t *expected, const tar_digest_t *computed) {
+    if (expected->has_crc32c && expected->crc32c != computed->crc32c) {
+        return TAR_VERIFY_MISMATCH;
+    }
+    if (expected->has_sha256 && memcmp(expected->sha256, computed->sha256, TAR_SHA256_LEN) != 0) {
+        return TAR_VERIFY_MISMATCH;
+    }
+    return TAR_VERIFY_OK;
+}
+
+ssize_t tar_verify_content(int tar_fd, tar_manifest_t *manifest, unsigned nthreads) {
+    if (manifest == NULL) {
+        tar_manifest_t *embedded = tar_manifest_from_pax(tar_fd);
+        if (embedded == NULL) {
+            return -1;
+        }
+        ssize_t res = tar_verify_content(tar_fd, embedded, nthreads);
+        tar_manifest_free(embedded);
+        return res;
+    }
+
+    tar_index_t *idx = tar_index_build(tar_fd);
+    digest_job_t *jobs = idx == NULL ? NULL : calloc(manifest->no_entries + 1, sizeof(digest_job_t));
+    if (jobs == NULL) {
+        if (idx != NULL) {
+            tar_index_free(idx);
+        }
+        errno = ENOMEM;
+        return -1;
+    }
+
+    size_t no_jobs = 0;
+    ssize_t failed = 0;
+    for (size_t i = 0; i < manifest->no_entries; ++i) {
+        tar_manifest_entry_t *m = &manifest->entries[i];
+        int digests = (m->digest.has_crc32c ? TAR_DIGEST_CRC32C : 0) | (m->digest.has_sha256 ? TAR_DIGEST_SHA256 : 0);
+        const tar_index_entry_t *entry = tar_index_lookup_file(idx, m->path);
+        if (entry == NULL) {
+            m->status = TAR_VERIFY_MISSING;
+            failed++;
+        } else if (digests == 0) {
+            m->status = TAR_VERIFY_UNCHECKED;
+        } else {
+            jobs[no_jobs++] = (digest_job_t) {.entry = entry, .out = m, .digests = digests};
+        }
+    }
+
+    ssize_t res = run_jobs(tar_fd, jobs, no_jobs, nthreads);
+    for (size_t i = 0; i < no_jobs && res == 0; ++i) {
+        tar_manifest_entry_t *m = jobs[i].out;
+        m->status = jobs[i].truncated ? TAR_VERIFY_MISSING : compare_digests(&m->digest, &jobs[i].result);
+        failed += m->status != TAR_VERIFY_OK;
+    }
+    free(jobs);
+    tar_index_free(idx);
+    return res == 0 ? failed : -1;
+}
@@ -0,0 +1,119 @@
+#ifndef TAR_VERIFY_H
+#define TAR_VERIFY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "tar_ext.h"
+
+/* Number of threads hashing entries when the functions below are given zero */
+#ifndef TAR_VERIFY_THREADS
+#define TAR_VERIFY_THREADS 8
+#endif
+
+/* Size of the reads of an entry when the archive can't be mapped, per thread */
+#define TAR_VERIFY_CHUNK (1 << 20)
+
+/* Digests to compute, or-ed together */
+#define TAR_DIGEST_CRC32C 1
+#define TAR_DIGEST_SHA256 2
+
+/* State of a SHA-256 computation */
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;              /* bytes hashed so far */
+    uint8_t block[64];            /* bytes of the current block */
+    size_t block_len;
+} tar_sha256_t;
+
+/* State of a digest computation over data given in pieces */
+typedef struct {
+    int digests;
+    uint32_t crc32c;
+    tar_sha256_t sha256;
+} tar_digest_ctx_t;
+
+/**
+ * Starts a digest computation.
+ *
+ * @param digests TAR_DIGEST_CRC32C, TAR_DIGEST_SHA256 or both.
+ */
+void tar_digest_init(tar_digest_ctx_t *ctx, int digests);
+
+/**
+ * Adds the bytes of a buffer to a digest computation. CRC-32C uses tar_crc32c(), the SSE4.2 instruction if present.
+ */
+void tar_digest_update(tar_digest_ctx_t *ctx, const void *buf, size_t len);
+
+/**
+ * Completes a digest computation, only the digests it was started with are set.
+ */
+void tar_digest_final(tar_digest_ctx_t *ctx, tar_digest_t *digest);
+
+/* Results of the check of a manifest entry */
+enum {
+    TAR_VERIFY_UNCHECKED,         /* the entry has no digest to compare */
+    TAR_VERIFY_OK,
+    TAR_VERIFY_MISMATCH,          /* a digest differs */
+    TAR_VERIFY_MISSING,           /* no file at the path, the entry is not a file, or its data is cut short */
+};
+
+/* Expected digests of a file of the archive */
+typedef struct {
+    char *path;
+    tar_digest_t digest;
+    int status;                   /* set by tar_verify_content() */
+} tar_manifest_entry_t;
+
+typedef struct {
+    tar_manifest_entry_t *entries;
+    size_t no_entries;
+} tar_manifest_t;
+
+/**
+ * Computes the digests of every regular file of an archive, in parallel, to be checked later by
+ * tar_verify_content() or embedded in another archive by tar_writer_set_digests().
+ *
+ * @param tar_fd A file descriptor of an uncompressed archive.
+ * @param digests The digests to compute, TAR_DIGEST_CRC32C and/or TAR_DIGEST_SHA256.
+ * @param nthreads The number of hashing threads, zero selects TAR_VERIFY_THREADS.
+ *
+ * @return the manifest, its entries sorted by path, or NULL with errno set to ENOMEM.
+ */
+tar_manifest_t *tar_manifest_build(int tar_fd, int digests, unsigned nthreads);
+
+/**
+ * Collects the digests an archive carries in the TAR_PAX_CRC32C and TAR_PAX_SHA256 records of its members.
+ *
+ * @return the manifest, with an entry for every member that has one of the records, or NULL with errno set to ENOMEM,
+ *         or to EINVAL if a header of the archive is invalid (see check_archive()).
+ */
+tar_manifest_t *tar_manifest_from_pax(int tar_fd);
+
+/**
+ * Releases a manifest built by the functions above.
+ */
+void tar_manifest_free(tar_manifest_t *manifest);
+
+/**
+ * Checks the data of the files of an archive against their expected digests, which check_archive() can't do since it
+ * only checks the headers.
+ * The archive is indexed once, then the entries are spread over threads, the largest first so that no thread is left
+ * with a large file at the end. Each one is read straight from a mapping of the archive when it is a regular file,
+ * with pread() otherwise, and only the digests the manifest holds for it are computed.
+ * Paths are resolved as read_file() does, so a hardlink is checked against the data of its target.
+ *
+ * @param tar_fd A file descriptor of an uncompressed archive.
+ * @param manifest The expected digests, the status of every entry is set. NULL checks the digests the archive carries
+ *                 in its own PAX records.
+ * @param nthreads The number of hashing threads, zero selects TAR_VERIFY_THREADS.
+ *
+ * @return the number of entries whose status is TAR_VERIFY_MISMATCH or TAR_VERIFY_MISSING, zero if the content is
+ *         intact, or -1 with errno set to ENOMEM, or to EINVAL if manifest is NULL and a header of the archive is
+ *         invalid.
+ */
+ssize_t tar_verify_content(int tar_fd, tar_manifest_t *manifest, unsigned nthreads);
+
+#endif
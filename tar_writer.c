@@ -0,0 +1,639 @@
+#define _GNU_SOURCE // copy_file_range()
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "lib_tar.h"
+#include "tar_verify.h"
+#include "tar_writer.h"
+
+/* Most buffers given to one writev() call, the IOV_MAX of Linux */
+#define WRITE_BATCH_IOV 1024
+
+/* Size of the buffer of the read()/write() fallback for large file bodies */
+#define COPY_BUF_SIZE (1 << 20)
+
+/* An entry queued for the next batch */
+typedef struct {
+    char typeflag;
+    char *name;
+    char *linkname;
+    char *src_path;               /* source of a regular file */
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+    uint64_t size;
+    int src_fd;                   /* source of a body copied by copy_body(), -1 otherwise */
+    uint8_t *data;                /* body of a small file, read while the batch is prepared */
+    int err;                      /* errno of a source file that could not be read */
+    int digests;                  /* TAR_DIGEST_* of the writer when the entry was added */
+    tar_digest_t digest;          /* digests of the body, stored in PAX records */
+    uint8_t *pax;                 /* PAX header and records in front of the entry, NULL if it needs none */
+    size_t pax_len;
+    tar_header_t header;
+} writer_entry_t;
+
+struct tar_writer {
+    int fd;
+    int nthreads;
+    int digests;                  /* TAR_DIGEST_* given to the files added from now on, zero for none */
+    writer_entry_t *entries;
+    size_t no_entries;
+    atomic_size_t next_entry;     /* next entry to prepare, shared by the threads */
+    int err;                      /* errno of the first failure, every later call fails with it */
+    struct iovec iov[WRITE_BATCH_IOV];
+    int iovcnt;
+    uint8_t *copy_buf;
+};
+
+/* Padding after a body and blocks that end the archive */
+static const uint8_t zeros[2 * sizeof(tar_header_t)];
+
+/* Bytes of padding that bring a size to a multiple of the block size */
+static size_t padding(uint64_t size) {
+    return (sizeof(tar_header_t) - size % sizeof(tar_header_t)) % sizeof(tar_header_t);
+}
+
+/**
+ * Stores a number in a header field: as NUL-terminated octal digits when it fits, as a big-endian base-256 number
+ * with the high bit of the first byte set otherwise, which is what tar_number() reads back.
+ */
+static void put_number(char *field, size_t len, uint64_t value) {
+    if ((len - 1) * 3 >= 64 || value >> ((len - 1) * 3) == 0) {
+        for (size_t i = len - 1; i-- > 0;) {
+            field[i] = (char) ('0' + (value & 7));
+            value >>= 3;
+        }
+        field[len - 1] = '\0';
+        return;
+    }
+    for (size_t i = len; i-- > 1;) {
+        field[i] = (char) (value & 0xff);
+        value >>= 8;
+    }
+    field[0] = (char) 0x80;
+}
+
+/* Copies a string into a header field, which is not NUL-terminated if the string fills it */
+static void put_string(char *field, size_t len, const char *str) {
+    size_t str_len = strnlen(str, len);
+    memcpy(field, str, str_len);
+}
+
+/**
+ * Splits a path into the ustar prefix and name fields, at a slash that leaves at most 155 bytes before it and
+ * 100 after it.
+ *
+ * @return whether the path fits.
+ */
+static bool split_path(tar_header_t *header, const char *path) {
+    size_t len = strlen(path);
+    if (len <= sizeof(header->name)) {
+        put_string(header->name, sizeof(header->name), path);
+        return true;
+    }
+    size_t first = len - sizeof(header->name) - 1;
+    for (size_t i = first; i < len - 1 && i <= sizeof(header->prefix); ++i) {
+        if (path[i] == '/') {
+            memcpy(header->prefix, path, i);
+            put_string(header->name, sizeof(header->name), path + i + 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Appends a "<length> <key>=<value>\n" PAX record, the length counting the whole record */
+static size_t put_pax_record(char *dest, const char *key, const char *value) {
+    size_t base = strlen(key) + strlen(value) + 3; // the space, '=' and '\n'
+    size_t len = base + 1;
+    while (len != base + (size_t) snprintf(NULL, 0, "%zu", len)) {
+        len = base + snprintf(NULL, 0, "%zu", len);
+    }
+    if (dest != NULL) {
+        sprintf(dest, "%zu %s=%s\n", len, key, value);
+    }
+    return len;
+}
+
+/* Fills the fields of a header that are common to entries and PAX headers */
+static void init_header(tar_header_t *header, char typeflag, mode_t mode, uid_t uid, gid_t gid, uint64_t size,
+                        time_t mtime) {
+    memset(header, 0, sizeof(*header));
+    header->typeflag = typeflag;
+    put_number(header->mode, sizeof(header->mode), mode & 07777);
+    put_number(header->uid, sizeof(header->uid), uid);
+    put_number(header->gid, sizeof(header->gid), gid);
+    put_number(header->size, sizeof(header->size), size);
+    put_number(header->mtime, sizeof(header->mtime), mtime < 0 ? 0 : (uint64_t) mtime);
+    memcpy(header->magic, TMAGIC, TMAGLEN);
+    memcpy(header->version, TVERSION, TVERSLEN);
+}
+
+/* Writes bytes as lowercase hexadecimal digits followed by a NUL */
+static void put_hex(char *dest, const uint8_t *bytes, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; ++i) {
+        dest[2 * i] = digits[bytes[i] >> 4];
+        dest[2 * i + 1] = digits[bytes[i] & 0xf];
+    }
+    dest[2 * len] = '\0';
+}
+
+/**
+ * Encodes the header of an entry, preceded by a PAX header when the path or the link target is too long for the
+ * ustar fields, or when the digests of the body are stored.
+ *
+ * @return zero on success, -1 if the PAX records could not be allocated.
+ */
+static int encode_entry(writer_entry_t *e) {
+    tar_header_t *header = &e->header;
+    init_header(header, e->typeflag, e->mode, e->uid, e->gid, e->size, e->mtime);
+    bool long_name = !split_path(header, e->name);
+    bool long_link = e->linkname != NULL && strlen(e->linkname) > sizeof(header->linkname);
+    if (e->linkname != NULL) {
+        put_string(header->linkname, sizeof(header->linkname), e->linkname);
+    }
+    if (long_name) {
+        put_string(header->name, sizeof(header->name), e->name); // truncated, for readers that skip PAX headers
+    }
+    set_header_checksum(header);
+
+    const char *keys[4];
+    const char *values[4];
+    size_t no_records = 0;
+    char crc_value[9];
+    char sha_value[2 * TAR_SHA256_LEN + 1];
+    if (long_name) {
+        keys[no_records] = "path";
+        values[no_records++] = e->name;
+    }
+    if (long_link) {
+        keys[no_records] = "linkpath";
+        values[no_records++] = e->linkname;
+    }
+    if (e->digest.has_crc32c) {
+        uint8_t crc[4] = {e->digest.crc32c >> 24, e->digest.crc32c >> 16, e->digest.crc32c >> 8, e->digest.crc32c};
+        put_hex(crc_value, crc, sizeof(crc));
+        keys[no_records] = TAR_PAX_CRC32C;
+        values[no_records++] = crc_value;
+    }
+    if (e->digest.has_sha256) {
+        put_hex(sha_value, e->digest.sha256, TAR_SHA256_LEN);
+        keys[no_records] = TAR_PAX_SHA256;
+        values[no_records++] = sha_value;
+    }
+    if (no_records == 0) {
+        return 0;
+    }
+
+    size_t records_len = 0;
+    for (size_t i = 0; i < no_records; ++i) {
+        records_len += put_pax_record(NULL, keys[i], values[i]);
+    }
+    e->pax_len = sizeof(tar_header_t) + records_len + padding(records_len);
+    e->pax = calloc(1, e->pax_len + 1); // sprintf() ends the last record with a NUL, which the padding covers
+    if (e->pax == NULL) {
+        return -1;
+    }
+    tar_header_t *pax_header = (tar_header_t *) e->pax;
+    init_header(pax_header, XHDTYPE, 0644, e->uid, e->gid, records_len, e->mtime);
+    put_string(pax_header->name, sizeof(pax_header->name), "PaxHeader");
+    set_header_checksum(pax_header);
+    char *records = (char *) e->pax + sizeof(tar_header_t);
+    for (size_t i = 0, used = 0; i < no_records; ++i) {
+        used += put_pax_record(records + used, keys[i], values[i]);
+    }
+    return 0;
+}
+
+/**
+ * Computes the digests of a large file, read in chunks, as copy_body() will write it: padded with zeros if it
+ * shrank.
+ */
+static void digest_file(writer_entry_t *e, int fd, int digests) {
+    uint8_t *buf = calloc(1, TAR_VERIFY_CHUNK);
+    if (buf == NULL) {
+        e->err = ENOMEM;
+        return;
+    }
+    tar_digest_ctx_t ctx;
+    tar_digest_init(&ctx, digests);
+    uint64_t done = 0;
+    bool shrunk = false;
+    while (done < e->size) {
+        size_t len = e->size - done < TAR_VERIFY_CHUNK ? e->size - done : TAR_VERIFY_CHUNK;
+        ssize_t res = len;
+        if (!shrunk) {
+            res = pread(fd, buf, len, done);
+            if (res == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                e->err = errno;
+                break;
+            }
+            if (res == 0) {
+                shrunk = true;
+                memset(buf, 0, TAR_VERIFY_CHUNK);
+                continue;
+            }
+        }
+        tar_digest_update(&ctx, buf, res);
+        done += res;
+    }
+    tar_digest_final(&ctx, &e->digest);
+    free(buf);
+}
+
+/**
+ * Opens the source of a file entry and takes its size and metadata, reading its content if it is small.
+ * A file that shrinks after its size is taken is padded with zeros, so that the archive stays well-formed.
+ */
+static void read_source(writer_entry_t *e, int digests) {
+    if (e->src_path == NULL) {
+        return;
+    }
+    int fd = open(e->src_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        e->err = errno;
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        e->err = errno;
+        close(fd);
+        return;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        e->err = EINVAL; // only regular files have a body to archive
+        close(fd);
+        return;
+    }
+    e->mode = st.st_mode;
+    e->uid = st.st_uid;
+    e->gid = st.st_gid;
+    e->mtime = st.st_mtim.tv_sec;
+    e->size = st.st_size;
+    if (e->size > TAR_WRITER_INLINE_MAX) {
+        e->src_fd = fd;
+        if (digests != 0) {
+            digest_file(e, fd, digests);
+        }
+        return;
+    }
+
+    e->data = calloc(1, e->size + 1);
+    if (e->data == NULL) {
+        e->err = ENOMEM;
+        close(fd);
+        return;
+    }
+    size_t done = 0;
+    while (done < e->size) {
+        ssize_t res = pread(fd, e->data + done, e->size - done, done);
+        if (res == -1 && errno == EINTR) {
+            continue;
+        }
+        if (res == -1) {
+            e->err = errno;
+            break;
+        }
+        if (res == 0) {
+            break;
+        }
+        done += res;
+    }
+    close(fd);
+
+    if (digests != 0) {
+        tar_digest_ctx_t ctx;
+        tar_digest_init(&ctx, digests);
+        tar_digest_update(&ctx, e->data, e->size);
+        tar_digest_final(&ctx, &e->digest);
+    }
+}
+
+/**
+ * Reads the source of an entry and encodes its header, in the threads of a parallel writer.
+ * The digests of the body are computed here too, as they go in the PAX records of the header.
+ */
+static void prepare_entry(writer_entry_t *e) {
+    read_source(e, e->digests);
+    if (e->err == 0 && encode_entry(e) != 0) {
+        e->err = ENOMEM;
+    }
+}
+
+static void *prepare_worker(void *arg) {
+    tar_writer_t *w = arg;
+    size_t i;
+    while ((i = atomic_fetch_add(&w->next_entry, 1)) < w->no_entries) {
+        prepare_entry(&w->entries[i]);
+    }
+    return NULL;
+}
+
+/* Prepares the entries of the batch, spread over the threads of the writer */
+static void prepare_batch(tar_writer_t *w) {
+    int nthreads = w->nthreads;
+    if ((size_t) nthreads > w->no_entries) {
+        nthreads = w->no_entries > 0 ? w->no_entries : 1;
+    }
+    atomic_store(&w->next_entry, 0);
+    if (nthreads <= 1) {
+        prepare_worker(w);
+        return;
+    }
+    pthread_t threads[nthreads];
+    int started = 0;
+    while (started < nthreads && pthread_create(&threads[started], NULL, prepare_worker, w) == 0) {
+        started++;
+    }
+    prepare_worker(w); // the calling thread takes its share, and all of it if no thread could be created
+    for (int t = 0; t < started; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+}
+
+/* Writes the gathered buffers with as few writev() calls as the descriptor allows */
+static int flush_iov(tar_writer_t *w) {
+    struct iovec *iov = w->iov;
+    int iovcnt = w->iovcnt;
+    w->iovcnt = 0;
+    while (iovcnt > 0) {
+        ssize_t res = writev(w->fd, iov, iovcnt);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        // skip the buffers that were written, and the written part of the next one
+        while (iovcnt > 0 && (size_t) res >= iov->iov_len) {
+            res -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + res;
+            iov->iov_len -= res;
+        }
+    }
+    return 0;
+}
+
+/* Gathers a buffer into the next writev() call */
+static int add_iov(tar_writer_t *w, const void *buf, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    if (w->iovcnt == WRITE_BATCH_IOV && flush_iov(w) != 0) {
+        return -1;
+    }
+    w->iov[w->iovcnt].iov_base = (void *) buf;
+    w->iov[w->iovcnt++].iov_len = len;
+    return 0;
+}
+
+/* Writes a whole buffer at the position of the descriptor */
+static int write_all(int fd, const uint8_t *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t res = write(fd, buf + done, len - done);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += res;
+    }
+    return 0;
+}
+
+/**
+ * Copies the body of a large file to the archive, with copy_file_range() when both descriptors allow it, so that the
+ * data stays in the kernel.
+ */
+static int copy_body(tar_writer_t *w, writer_entry_t *e) {
+    off_t in = 0;
+    uint64_t left = e->size;
+    bool kernel_copy = true;
+    while (left > 0 && kernel_copy) {
+        ssize_t res = copy_file_range(e->src_fd, &in, w->fd, NULL, left, 0);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EXDEV && errno != EINVAL && errno != EBADF && errno != ENOSYS && errno != EOPNOTSUPP) {
+                return -1;
+            }
+            kernel_copy = false; // a pipe, a socket or an O_APPEND descriptor
+        } else if (res == 0) {
+            break; // the file shrank
+        } else {
+            left -= res;
+        }
+    }
+
+    if (left > 0 && w->copy_buf == NULL && (w->copy_buf = malloc(COPY_BUF_SIZE)) == NULL) {
+        return -1;
+    }
+    bool shrunk = kernel_copy;
+    while (left > 0) {
+        size_t chunk = left < COPY_BUF_SIZE ? left : COPY_BUF_SIZE;
+        if (!shrunk) {
+            ssize_t res = pread(e->src_fd, w->copy_buf, chunk, in);
+            if (res == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            if (res == 0) {
+                // the file shrank, fill the rest of its size with zeros
+                shrunk = true;
+                continue;
+            }
+            chunk = res;
+        } else {
+            memset(w->copy_buf, 0, chunk);
+        }
+        if (write_all(w->fd, w->copy_buf, chunk) != 0) {
+            return -1;
+        }
+        in += chunk;
+        left -= chunk;
+    }
+    return 0;
+}
+
+/* Releases what an entry holds once it is written */
+static void free_entry(writer_entry_t *e) {
+    free(e->name);
+    free(e->linkname);
+    free(e->src_path);
+    free(e->data);
+    free(e->pax);
+    if (e->src_fd != -1) {
+        close(e->src_fd);
+    }
+}
+
+/**
+ * Writes the queued entries: their sources are read and their headers encoded, then everything goes out in archive
+ * order, small bodies gathered with the headers and large ones copied in between.
+ */
+static int write_batch(tar_writer_t *w) {
+    prepare_batch(w);
+
+    int res = 0;
+    for (size_t i = 0; i < w->no_entries && res == 0; ++i) {
+        writer_entry_t *e = &w->entries[i];
+        if (e->err != 0) {
+            errno = e->err;
+            res = -1;
+        }
+    }
+
+    for (size_t i = 0; i < w->no_entries && res == 0; ++i) {
+        writer_entry_t *e = &w->entries[i];
+        if (add_iov(w, e->pax, e->pax_len) != 0 || add_iov(w, &e->header, sizeof(tar_header_t)) != 0) {
+            res = -1;
+            break;
+        }
+        if (e->data != NULL) {
+            res = add_iov(w, e->data, e->size);
+        } else if (e->src_fd != -1) {
+            res = flush_iov(w) != 0 ? -1 : copy_body(w, e);
+        }
+        if (res == 0) {
+            res = add_iov(w, zeros, padding(e->size));
+        }
+    }
+    if (res == 0) {
+        res = flush_iov(w);
+    }
+    w->iovcnt = 0;
+
+    int err = errno;
+    for (size_t i = 0; i < w->no_entries; ++i) {
+        free_entry(&w->entries[i]);
+    }
+    w->no_entries = 0;
+    if (res != 0) {
+        w->err = err;
+        errno = err;
+    }
+    return res;
+}
+
+tar_writer_t *tar_writer_open(int fd) {
+    return tar_writer_open_parallel(fd, 1);
+}
+
+tar_writer_t *tar_writer_open_parallel(int fd, int nthreads) {
+    tar_writer_t *w = calloc(1, sizeof(tar_writer_t));
+    if (w == NULL) {
+        return NULL;
+    }
+    w->entries = malloc(TAR_WRITER_BATCH * sizeof(writer_entry_t));
+    if (w->entries == NULL) {
+        free(w);
+        return NULL;
+    }
+    w->fd = fd;
+    w->nthreads = nthreads < 1 ? 1 : nthreads;
+    atomic_init(&w->next_entry, 0);
+    return w;
+}
+
+/**
+ * Queues an entry, and writes the batch once it is full.
+ * The strings are copied, name gets a trailing slash for a directory.
+ */
+static int queue_entry(tar_writer_t *w, char typeflag, const char *name, const char *linkname, const char *src_path,
+                       mode_t mode, time_t mtime) {
+    if (w->err != 0) {
+        errno = w->err;
+        return -1;
+    }
+
+    writer_entry_t *e = &w->entries[w->no_entries];
+    memset(e, 0, sizeof(*e));
+    e->typeflag = typeflag;
+    e->mode = mode;
+    e->uid = getuid();
+    e->gid = getgid();
+    e->mtime = mtime;
+    e->src_fd = -1;
+    e->digests = w->digests;
+
+    size_t name_len = strlen(name);
+    bool add_slash = typeflag == DIRTYPE && (name_len == 0 || name[name_len - 1] != '/');
+    e->name = malloc(name_len + 2);
+    if (e->name != NULL) {
+        memcpy(e->name, name, name_len);
+        strcpy(e->name + name_len, add_slash ? "/" : "");
+    }
+    e->linkname = linkname == NULL ? NULL : strdup(linkname);
+    e->src_path = src_path == NULL ? NULL : strdup(src_path);
+    if (e->name == NULL || (linkname != NULL && e->linkname == NULL) || (src_path != NULL && e->src_path == NULL)) {
+        free_entry(e);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (++w->no_entries == TAR_WRITER_BATCH) {
+        return write_batch(w);
+    }
+    return 0;
+}
+
+void tar_writer_set_digests(tar_writer_t *w, int digests) {
+    w->digests = digests;
+}
+
+int tar_writer_add_file(tar_writer_t *w, const char *name, const char *src_path) {
+    return queue_entry(w, REGTYPE, name, NULL, src_path, 0, 0);
+}
+
+int tar_writer_add_dir(tar_writer_t *w, const char *name, mode_t mode, time_t mtime) {
+    return queue_entry(w, DIRTYPE, name, NULL, NULL, mode, mtime);
+}
+
+int tar_writer_add_symlink(tar_writer_t *w, const char *name, const char *target, time_t mtime) {
+    return queue_entry(w, SYMTYPE, name, target, NULL, 0777, mtime);
+}
+
+int tar_writer_close(tar_writer_t *w) {
+    int res = -1;
+    if (w->err != 0) {
+        errno = w->err;
+    } else if (write_batch(w) == 0) {
+        w->iov[0].iov_base = (void *) zeros;
+        w->iov[0].iov_len = sizeof(zeros);
+        w->iovcnt = 1;
+        res = flush_iov(w);
+    }
+
+    int err = errno;
+    for (size_t i = 0; i < w->no_entries; ++i) {
+        free_entry(&w->entries[i]);
+    }
+    free(w->entries);
+    free(w->copy_buf);
+    free(w);
+    errno = err;
+    return res;
+}
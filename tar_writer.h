@@ -0,0 +1,95 @@
+#ifndef TAR_WRITER_H
+#define TAR_WRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Number of entries queued before they are written out in one batch */
+#ifndef TAR_WRITER_BATCH
+#define TAR_WRITER_BATCH 512
+#endif
+
+/* Files up to this size are read into memory and written along with their header, larger ones are copied */
+#ifndef TAR_WRITER_INLINE_MAX
+#define TAR_WRITER_INLINE_MAX (64 * 1024)
+#endif
+
+/**
+ * Writer of a POSIX ustar archive, which appends entries at the current position of a descriptor.
+ * Entries are queued and written in batches: the source files of a batch are opened, small ones read and every header
+ * encoded with its checksum (by several threads with tar_writer_open_parallel()), then the headers, small file bodies
+ * and padding are gathered into writev() calls of many entries each. Larger file bodies go from the
+ * source file to the archive with copy_file_range(), or read() and write() where the kernel can't copy.
+ * The archive is the same whatever the number of threads: entries come out in the order they were added.
+ * Paths longer than the name field are split into the ustar prefix when possible, and stored in a PAX record
+ * otherwise, as are long link targets. Sizes of 8 GiB and more are stored in base-256.
+ * A writer is not thread-safe.
+ */
+typedef struct tar_writer tar_writer_t;
+
+/**
+ * Creates a writer that reads the source files from the calling thread.
+ *
+ * @param fd A descriptor open for writing, a file, a pipe or a socket. The archive starts at its current position.
+ *
+ * @return the writer, or NULL if it could not be allocated.
+ */
+tar_writer_t *tar_writer_open(int fd);
+
+/**
+ * Creates a writer that opens and reads the source files of each batch with several threads, see tar_writer_open().
+ *
+ * @param nthreads The number of threads, 1 or less behaves exactly like tar_writer_open().
+ */
+tar_writer_t *tar_writer_open_parallel(int fd, int nthreads);
+
+/**
+ * Stores the digests of the files added from now on in PAX records (TAR_PAX_CRC32C, TAR_PAX_SHA256), so that the
+ * archive carries its own verification data for tar_verify_content().
+ * The digests are computed when a batch is prepared, in the threads of a parallel writer, which reads a large file
+ * once more before it is copied.
+ *
+ * @param digests TAR_DIGEST_CRC32C and/or TAR_DIGEST_SHA256 from tar_verify.h, zero to stop.
+ */
+void tar_writer_set_digests(tar_writer_t *w, int digests);
+
+/**
+ * Adds a regular file, whose content, mode, owner and mtime are taken from a file on disk when the batch is written.
+ *
+ * @param name The path of the entry in the archive.
+ * @param src_path The file to read, links are followed.
+ *
+ * @return zero on success, -1 with errno set if the entry could not be queued, or if writing the batch failed,
+ *         including because a queued source file could not be read.
+ */
+int tar_writer_add_file(tar_writer_t *w, const char *name, const char *src_path);
+
+/**
+ * Adds a directory. A slash is appended to the name if it has none.
+ *
+ * @param mode The permission bits.
+ * @param mtime The modification time, in seconds since the epoch.
+ *
+ * @return as tar_writer_add_file().
+ */
+int tar_writer_add_dir(tar_writer_t *w, const char *name, mode_t mode, time_t mtime);
+
+/**
+ * Adds a symlink.
+ *
+ * @param target The path the link points to, stored as is.
+ *
+ * @return as tar_writer_add_file().
+ */
+int tar_writer_add_symlink(tar_writer_t *w, const char *name, const char *target, time_t mtime);
+
+/**
+ * Writes the queued entries and the two zero blocks that end the archive, then releases the writer.
+ * Does not close the descriptor.
+ *
+ * @return zero on success, -1 with errno set if writing failed, now or in an earlier call.
+ */
+int tar_writer_close(tar_writer_t *w);
+
+#endif
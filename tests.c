@@ -1,15 +1,56 @@
+#define _GNU_SOURCE // nftw() flags
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
-#include <sys/types.h>
-#include <sys/stat.h>
 #include <stdlib.h>
-#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <zlib.h>
 
 #include "lib_tar.h"
+#include "tar_async.h"
+#include "tar_client.h"
+#include "tar_daemon.h"
+#include "tar_entry.h"
+#include "tar_extract.h"
+#include "tar_gz.h"
+#include "tar_index.h"
+#include "tar_iter.h"
+#include "tar_mmap.h"
+#include "tar_overlay.h"
+#include "tar_scan.h"
+#include "tar_simd.h"
+#include "tar_stats.h"
+#include "tar_verify.h"
+#include "tar_writer.h"
 
 /**
- * You are free to use this file to write tests for your implementation
+ * Behaviour tests of the library: the queries on the tar_file given on the command line (test_archive.tar), then on
+ * small archives built here for the cases it doesn't have. Prints the checks that fail, and exits with 1 if any did.
  */
 
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+
+static int no_checks = 0;
+static int no_failures = 0;
+
+static void check(bool ok, const char *expr, const char *file, int line) {
+    no_checks++;
+    if (!ok) {
+        no_failures++;
+        printf("%s:%d: check failed: %s\n", file, line, expr);
+    }
+}
+
 void debug_dump(const uint8_t *bytes, size_t len) {
     for (int i = 0; i < len;) {
         printf("%04x:  ", (int) i);
@@ -25,6 +66,1565 @@ void debug_dump(const uint8_t *bytes, size_t len) {
     }
 }
 
+/* Directory the generated archives are written to, removed on exit */
+static char tmp_dir[] = "/tmp/lib_tar_tests.XXXXXX";
+
+static const char *tmp_path(const char *name) {
+    static char path[sizeof(tmp_dir) + 256];
+    snprintf(path, sizeof(path), "%s/%s", tmp_dir, name);
+    return path;
+}
+
+static int remove_file(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    return remove(path);
+}
+
+/* An archive built in memory, one member at a time */
+typedef struct {
+    uint8_t *data;
+    size_t len;
+} archive_t;
+
+static void append(archive_t *a, const void *buf, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    a->data = realloc(a->data, a->len + len);
+    memcpy(a->data + a->len, buf, len);
+    a->len += len;
+}
+
+/* Copies a string into a header field, without the NUL when it fills the field */
+static void set_field(char *field, size_t field_size, const char *value, size_t len) {
+    memcpy(field, value, len < field_size ? len : field_size);
+}
+
+/* Appends a ustar header and its padded data, the name going to the prefix field when it is too long */
+static void add_member(archive_t *a, const char *name, char typeflag, const char *linkname, const void *data,
+                       size_t size) {
+    tar_header_t header;
+    memset(&header, 0, sizeof(header));
+    size_t name_len = strlen(name);
+    if (name_len > sizeof(header.name)) {
+        const char *slash = name + name_len - sizeof(header.name) - 1;
+        while (*slash != '/') {
+            slash++;
+        }
+        set_field(header.prefix, sizeof(header.prefix), name, slash - name);
+        set_field(header.name, sizeof(header.name), slash + 1, strlen(slash + 1));
+    } else {
+        set_field(header.name, sizeof(header.name), name, name_len);
+    }
+    snprintf(header.mode, sizeof(header.mode), "%07o", typeflag == DIRTYPE ? 0755 : 0644);
+    snprintf(header.uid, sizeof(header.uid), "%07o", 1000);
+    snprintf(header.gid, sizeof(header.gid), "%07o", 1000);
+    char size_field[24]; // the tests keep to sizes that take 11 octal digits
+    snprintf(size_field, sizeof(size_field), "%011zo", size);
+    set_field(header.size, sizeof(header.size), size_field, strlen(size_field));
+    snprintf(header.mtime, sizeof(header.mtime), "%011o", 1700000000);
+    header.typeflag = typeflag;
+    if (linkname != NULL) {
+        set_field(header.linkname, sizeof(header.linkname), linkname, strlen(linkname));
+    }
+    memcpy(header.magic, TMAGIC, TMAGLEN);
+    memcpy(header.version, TVERSION, TVERSLEN);
+    set_header_checksum(&header);
+    append(a, &header, sizeof(header));
+
+    static const uint8_t zeros[512];
+    append(a, data, size);
+    append(a, zeros, (512 - size % 512) % 512);
+}
+
+static void add_file(archive_t *a, const char *name, const char *content) {
+    add_member(a, name, REGTYPE, NULL, content, strlen(content));
+}
+
+/* Writes the archive, ended by two zero blocks, to a file of the temporary directory and opens it for reading */
+static int archive_fd(archive_t *a, const char *name) {
+    static const uint8_t end[1024];
+    int fd = open(tmp_path(name), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || write(fd, a->data, a->len) != (ssize_t) a->len || write(fd, end, sizeof(end)) != sizeof(end)) {
+        perror("Failed to write test archive");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+static void free_archive(archive_t *a) {
+    free(a->data);
+    a->data = NULL;
+    a->len = 0;
+}
+
+/* Calls list() and returns its result, the names it listed going to names separated by spaces */
+static int list_names(int tar_fd, char *path, char *names, size_t *no_entries) {
+    char *entries[16];
+    for (int i = 0; i < 16; ++i) {
+        entries[i] = calloc(512, 1);
+    }
+    if (*no_entries > 16) {
+        *no_entries = 16;
+    }
+    int res = list(tar_fd, path, entries, no_entries);
+    names[0] = '\0';
+    for (size_t i = 0; i < *no_entries; ++i) {
+        strcat(names, i == 0 ? "" : " ");
+        strcat(names, entries[i]);
+    }
+    for (int i = 0; i < 16; ++i) {
+        free(entries[i]);
+    }
+    return res;
+}
+
+/* Reads a whole file with read_file() into a NUL-terminated buffer */
+static ssize_t read_string(int tar_fd, char *path, char *buf, size_t size) {
+    size_t len = size - 1;
+    ssize_t res = read_file(tar_fd, path, 0, (uint8_t *) buf, &len);
+    buf[res < 0 ? 0 : len] = '\0';
+    return res;
+}
+
+/* The queries on test_archive.tar, which holds a directory tree and symlinks to files and directories */
+static void test_queries(int fd) {
+    CHECK(check_archive(fd) > 0);
+    CHECK(exists(fd, "dir/") == 1);
+    CHECK(exists(fd, "dir/dir2/file2.txt") == 1);
+    CHECK(exists(fd, "linked_file") == 1);
+    CHECK(exists(fd, "di") == 0);
+    CHECK(exists(fd, "dir/file2") == 0);
+    CHECK(is_dir(fd, "dir/") == 1);
+    CHECK(is_dir(fd, "dir/dir2/") == 1);
+    CHECK(is_dir(fd, "dir/file2.txt") == 0);
+    CHECK(is_file(fd, "dir/file1_og.txt") == 1);
+    CHECK(is_file(fd, "dir/") == 0);
+    CHECK(is_symlink(fd, "linked_dir") == 1);
+    CHECK(is_symlink(fd, "dir/file1_symlink.txt") == 1);
+    CHECK(is_symlink(fd, "dir/file1_og.txt") == 0);
+
+    char names[16 * 512];
+    size_t no_entries = 16;
+    CHECK(list_names(fd, "dir/", names, &no_entries) != 0);
+    CHECK(no_entries == 6);
+    CHECK(strstr(names, "dir/dir2/") != NULL && strstr(names, "dir/file1_symlink.txt") != NULL);
+    // a symlink to a directory lists the directory
+    no_entries = 16;
+    CHECK(list_names(fd, "linked_dir2", names, &no_entries) != 0);
+    CHECK(no_entries == 1 && strcmp(names, "dir/dir2/file2.txt") == 0);
+    no_entries = 2;
+    CHECK(list_names(fd, "dir/", names, &no_entries) != 0 && no_entries == 2);
+    no_entries = 16;
+    CHECK(list_names(fd, "dir/file2.txt", names, &no_entries) == 0 && no_entries == 0);
+    no_entries = 16;
+    CHECK(list_names(fd, "nothing/", names, &no_entries) == 0 && no_entries == 0);
+
+    char buf[1024];
+    CHECK(read_string(fd, "linked_file", buf, sizeof(buf)) == 0);
+    char direct[1024];
+    CHECK(read_string(fd, "dir/file2.txt", direct, sizeof(direct)) == 0 && strcmp(buf, direct) == 0);
+    CHECK(strlen(direct) == 16);
+    // a symlink is read through, from an offset, into a buffer too small for the rest of the file
+    size_t len = 10;
+    CHECK(read_file(fd, "dir/file1_symlink.txt", 800, (uint8_t *) buf, &len) == 31 && len == 10);
+    len = sizeof(buf);
+    CHECK(read_file(fd, "dir/file1_og.txt", 841, (uint8_t *) buf, &len) == 0 && len == 0);
+    len = sizeof(buf);
+    CHECK(read_file(fd, "dir/file1_og.txt", 842, (uint8_t *) buf, &len) == -2);
+    len = sizeof(buf);
+    CHECK(read_file(fd, "dir/", 0, (uint8_t *) buf, &len) == -1);
+    len = sizeof(buf);
+    CHECK(read_file(fd, "dir/missing", 0, (uint8_t *) buf, &len) == -1);
+}
+
+/* The index itself: key normalization, and the last header of a path winning */
+static void test_index(void) {
+    archive_t a = {0};
+    add_member(&a, "./top/", DIRTYPE, NULL, NULL, 0);
+    add_file(&a, "./top/a.txt", "first");
+    add_file(&a, "top/b.txt", "b");
+    add_file(&a, "top/a.txt", "second");
+    int fd = archive_fd(&a, "index.tar");
+
+    tar_index_t *idx = tar_index_build(fd);
+    CHECK(idx != NULL);
+    const tar_index_entry_t *top = tar_index_lookup(idx, "top");
+    CHECK(top != NULL && top->typeflag == DIRTYPE);
+    CHECK(tar_index_lookup(idx, "./top/") == top && tar_index_lookup(idx, "top/") == top);
+    const tar_index_entry_t *entry = tar_index_lookup(idx, "top/a.txt");
+    CHECK(entry != NULL && entry->size == 6);
+    CHECK(tar_index_lookup(idx, "top/c.txt") == NULL);
+    tar_index_free(idx);
+
+    char buf[64];
+    CHECK(read_string(fd, "top/a.txt", buf, sizeof(buf)) == 0 && strcmp(buf, "second") == 0);
+    CHECK(check_archive(fd) == 4);
+    close(fd);
+    free_archive(&a);
+}
+
+/* The index kept between calls on a descriptor is dropped once the archive changes */
+static void test_index_cache(void) {
+    archive_t a = {0};
+    add_file(&a, "a.txt", "a");
+    int fd = archive_fd(&a, "cache.tar");
+    CHECK(exists(fd, "a.txt") == 1);
+    CHECK(exists(fd, "b.txt") == 0);
+
+    // appended over the end blocks, as "tar -r" does
+    add_file(&a, "b.txt", "b");
+    close(archive_fd(&a, "cache.tar"));
+    CHECK(exists(fd, "b.txt") == 1);
+
+    // another archive queried in between keeps its own index
+    archive_t other = {0};
+    add_file(&other, "c.txt", "c");
+    int other_fd = archive_fd(&other, "cache_other.tar");
+    CHECK(exists(other_fd, "c.txt") == 1 && exists(other_fd, "a.txt") == 0);
+    CHECK(exists(fd, "c.txt") == 0 && exists(fd, "a.txt") == 1);
+
+    // rewritten in place to the same size and modification time, which only clearing the index reveals
+    struct stat st;
+    fstat(fd, &st);
+    a.data[512 + 512] = 'd'; // b.txt's header follows a.txt's header and data
+    set_header_checksum((tar_header_t *) (a.data + 512 + 512));
+    CHECK(pwrite(fd, a.data + 512 + 512, 512, 512 + 512) == 512);
+    struct timespec times[2] = {st.st_atim, st.st_mtim};
+    futimens(fd, times);
+    CHECK(exists(fd, "d.txt") == 0);
+    tar_index_cache_clear(fd);
+    CHECK(exists(fd, "d.txt") == 1 && exists(fd, "b.txt") == 0);
+    tar_index_cache_clear(-1);
+    CHECK(exists(other_fd, "c.txt") == 1);
+    close(other_fd);
+    close(fd);
+    free_archive(&other);
+    free_archive(&a);
+}
+
+/* Entry views point into the mapping, links resolved */
+static void test_mmap(void) {
+    archive_t a = {0};
+    add_member(&a, "d/", DIRTYPE, NULL, NULL, 0);
+    add_file(&a, "d/f.txt", "mapped data");
+    add_member(&a, "d/empty", REGTYPE, NULL, NULL, 0);
+    add_member(&a, "l", SYMTYPE, "d/f.txt", NULL, 0);
+    close(archive_fd(&a, "mmap.tar"));
+
+    tar_mmap_t *m = tar_mmap_open(tmp_path("mmap.tar"));
+    CHECK(m != NULL);
+    const uint8_t *data;
+    size_t len;
+    CHECK(tar_entry_view(m, "d/f.txt", &data, &len) == 0 && len == 11 && memcmp(data, "mapped data", 11) == 0);
+    const uint8_t *via_link;
+    CHECK(tar_entry_view(m, "l", &via_link, &len) == 0 && via_link == data);
+    CHECK(tar_entry_view(m, "d/empty", &data, &len) == 0 && len == 0);
+    CHECK(tar_entry_view(m, "d", &data, &len) == -1);
+    CHECK(tar_entry_view(m, "d/missing", &data, &len) == -1);
+    CHECK(tar_index_is_dir(tar_mmap_index(m), "d/") == 1);
+    CHECK(tar_index_is_symlink(tar_mmap_index(m), "l") == 1);
+    tar_mmap_close(m);
+
+    errno = 0;
+    CHECK(tar_mmap_open(tmp_path("missing.tar")) == NULL && errno == ENOENT);
+    free_archive(&a);
+}
+
+/* Headers straddling the chunks of the scanner, and an entry larger than a chunk skipped without being read */
+static void test_scanner(void) {
+    archive_t a = {0};
+    char big[10000];
+    memset(big, 'x', sizeof(big));
+    add_member(&a, "big", REGTYPE, NULL, big, sizeof(big));
+    char name[32];
+    for (int i = 0; i < 20; ++i) {
+        snprintf(name, sizeof(name), "small%d", i);
+        add_member(&a, name, REGTYPE, NULL, big, i * 50);
+    }
+    int fd = archive_fd(&a, "scan.tar");
+
+    tar_scanner_t sc;
+    CHECK(tar_scan_init(&sc, fd, 4096) == 0);
+    const tar_header_t *header;
+    off_t offset, expected = 0;
+    int no_headers = 0;
+    bool offsets_ok = true;
+    while (tar_scan_next(&sc, &header, &offset) == 1) {
+        offsets_ok = offsets_ok && offset == expected;
+        expected += 512 + (TAR_SIZE(header) + 511) / 512 * 512;
+        no_headers++;
+    }
+    tar_scan_destroy(&sc);
+    CHECK(no_headers == 21 && offsets_ok);
+    CHECK(lseek(fd, 0, SEEK_CUR) == (off_t) a.len + 1024); // the scanner doesn't move the file offset
+    CHECK(check_archive(fd) == 21);
+    close(fd);
+
+    // check_archive() reports the first invalid header
+    tar_header_t *small1 = (tar_header_t *) (a.data + 512 + 10240 + 512); // after big, its data and small0
+    small1->chksum[0] ^= 1;
+    fd = archive_fd(&a, "scan.tar");
+    CHECK(check_archive(fd) == -3);
+    close(fd);
+    small1->version[0] = '1';
+    set_header_checksum(small1);
+    fd = archive_fd(&a, "scan.tar");
+    CHECK(check_archive(fd) == -2);
+    close(fd);
+    small1->magic[0] = 'x';
+    set_header_checksum(small1);
+    fd = archive_fd(&a, "scan.tar");
+    CHECK(check_archive(fd) == -1);
+    close(fd);
+    free_archive(&a);
+}
+
+/* The kernel selected for this CPU agrees with the portable one and with a plain loop */
+static void test_simd(void) {
+    uint8_t block[512];
+    bool sums_ok = true;
+    srand(4);
+    for (int round = 0; round < 100; ++round) {
+        for (size_t i = 0; i < sizeof(block); ++i) {
+            block[i] = round == 0 ? 0xff : rand();
+        }
+        uint32_t sum = 0;
+        for (size_t i = 0; i < sizeof(block); ++i) {
+            sum += i >= TAR_CHKSUM_OFFSET && i < TAR_CHKSUM_OFFSET + TAR_CHKSUM_LEN ? ' ' : block[i];
+        }
+        sums_ok = sums_ok && tar_header_sum(block) == sum && tar_header_sum_swar(block) == sum;
+    }
+    CHECK(sums_ok);
+
+    // a single non-zero byte anywhere, in buffers of any length and alignment
+    uint8_t buf[1100] = {0};
+    bool zeros_ok = true;
+    for (size_t len = 0; len < 1090; len += 7) {
+        for (size_t start = 0; start < 8; start += 3) {
+            zeros_ok = zeros_ok && tar_block_is_zeros(buf + start, len) && tar_block_is_zeros_swar(buf + start, len);
+            for (size_t i = 0; i < len; i += 5) {
+                buf[start + i] = 1;
+                zeros_ok = zeros_ok && !tar_block_is_zeros(buf + start, len)
+                           && !tar_block_is_zeros_swar(buf + start, len);
+                buf[start + i] = 0;
+            }
+        }
+    }
+    CHECK(zeros_ok);
+
+    CHECK(tar_crc32c(0, "123456789", 9) == 0xe3069283);
+    CHECK(tar_crc32c_table(0, "123456789", 9) == 0xe3069283);
+    CHECK(tar_crc32c(tar_crc32c(0, "1234", 4), "56789", 5) == 0xe3069283);
+    CHECK(tar_crc32c(0, block, sizeof(block)) == tar_crc32c_table(0, block, sizeof(block)));
+}
+
+/* The threads of check_archive_parallel() report the first invalid header in archive order */
+static void test_check_parallel(void) {
+    archive_t a = {0};
+    char name[32];
+    for (int i = 0; i < 300; ++i) {
+        snprintf(name, sizeof(name), "f%d", i);
+        add_file(&a, name, name); // one data block each
+    }
+    int fd = archive_fd(&a, "parallel.tar");
+    CHECK(check_archive_parallel(fd, 1) == 300);
+    CHECK(check_archive_parallel(fd, 4) == 300);
+    close(fd);
+
+    tar_header_t *early = (tar_header_t *) (a.data + 100 * 1024);
+    tar_header_t *late = (tar_header_t *) (a.data + 250 * 1024);
+    late->chksum[0] ^= 1;
+    fd = archive_fd(&a, "parallel.tar");
+    CHECK(check_archive_parallel(fd, 4) == -3);
+    close(fd);
+    early->magic[0] = 'x';
+    set_header_checksum(early);
+    fd = archive_fd(&a, "parallel.tar");
+    CHECK(check_archive_parallel(fd, 4) == -1);
+    CHECK(check_archive(fd) == -1);
+    close(fd);
+    free_archive(&a);
+}
+
+static int shared_fd;
+
+static void *read_concurrently(void *arg) {
+    char buf[1024];
+    for (int i = 0; i < 200; ++i) {
+        if (read_string(shared_fd, "linked_file", buf, sizeof(buf)) != 0 || strlen(buf) != 16
+            || is_dir(shared_fd, "dir/dir2") != 1) {
+            return (void *) 1;
+        }
+    }
+    return NULL;
+}
+
+/* The queries read with pread(), they leave the file offset alone and can share a descriptor between threads */
+static void test_shared_fd(int fd) {
+    CHECK(lseek(fd, 123, SEEK_SET) == 123);
+    char buf[1024];
+    CHECK(read_string(fd, "dir/file1_og.txt", buf, sizeof(buf)) == 0 && strlen(buf) == 841);
+    CHECK(exists(fd, "dir/") == 1 && check_archive(fd) > 0);
+    CHECK(lseek(fd, 0, SEEK_CUR) == 123);
+
+    shared_fd = fd;
+    pthread_t threads[4];
+    for (int t = 0; t < 4; ++t) {
+        pthread_create(&threads[t], NULL, read_concurrently, NULL);
+    }
+    bool threads_ok = true;
+    for (int t = 0; t < 4; ++t) {
+        void *res;
+        pthread_join(threads[t], &res);
+        threads_ok = threads_ok && res == NULL;
+    }
+    CHECK(threads_ok);
+    CHECK(lseek(fd, 0, SEEK_CUR) == 123);
+}
+
+static int count_entry(void *arg, const tar_index_entry_t *entry) {
+    (*(int *) arg)++;
+    return 0;
+}
+
+/* list() walks the children of a directory in archive order, whatever the depth and the size of the archive */
+static void test_list_tree(void) {
+    archive_t a = {0};
+    add_member(&a, "top/", DIRTYPE, NULL, NULL, 0);
+    add_file(&a, "top/z", "z");
+    add_member(&a, "top/sub/", DIRTYPE, NULL, NULL, 0);
+    char name[64];
+    for (int i = 0; i < 100; ++i) {
+        snprintf(name, sizeof(name), "top/sub/f%d", i);
+        add_file(&a, name, "x");
+    }
+    add_file(&a, "top/a", "a");
+    add_file(&a, "top/z", "replaced");
+    add_file(&a, "other", "o");
+    int fd = archive_fd(&a, "tree.tar");
+
+    char names[16 * 512];
+    size_t no_entries = 16;
+    CHECK(list_names(fd, "top", names, &no_entries) != 0);
+    CHECK(no_entries == 3 && strcmp(names, "top/z top/sub/ top/a") == 0); // a replaced entry keeps its place
+    no_entries = 16;
+    CHECK(list_names(fd, "", names, &no_entries) != 0 && strcmp(names, "top/ other") == 0);
+    no_entries = 16;
+    CHECK(list_names(fd, "./", names, &no_entries) != 0 && strcmp(names, "top/ other") == 0);
+    no_entries = 3;
+    CHECK(list_names(fd, "top/sub/", names, &no_entries) != 0);
+    CHECK(no_entries == 3 && strcmp(names, "top/sub/f0 top/sub/f1 top/sub/f2") == 0);
+    no_entries = 16;
+    CHECK(list_names(fd, "top/a", names, &no_entries) == 0 && no_entries == 0);
+
+    tar_index_t *idx = tar_index_build(fd);
+    int count = 0;
+    CHECK(tar_index_children(idx, "top/sub", count_entry, &count) == 100 && count == 100);
+    CHECK(tar_index_children(idx, "top/a", count_entry, &count) == -1);
+    tar_index_free(idx);
+    close(fd);
+    free_archive(&a);
+}
+
+/* Links anywhere in a path, relative targets, hardlinks, cycles and dangling links */
+static void test_links(void) {
+    archive_t a = {0};
+    add_member(&a, "d/", DIRTYPE, NULL, NULL, 0);
+    add_member(&a, "d/sub/", DIRTYPE, NULL, NULL, 0);
+    add_file(&a, "d/sub/f", "target data");
+    add_member(&a, "ld", SYMTYPE, "d", NULL, 0);
+    add_member(&a, "d/sub/up", SYMTYPE, "../sub/./f", NULL, 0);
+    add_member(&a, "chain1", SYMTYPE, "chain2", NULL, 0);
+    add_member(&a, "chain2", SYMTYPE, "ld/sub/up", NULL, 0);
+    add_member(&a, "hard", LNKTYPE, "d/sub/f", NULL, 0);
+    add_member(&a, "loop1", SYMTYPE, "loop2", NULL, 0);
+    add_member(&a, "loop2", SYMTYPE, "loop1", NULL, 0);
+    add_member(&a, "dangling", SYMTYPE, "d/nothing", NULL, 0);
+    int fd = archive_fd(&a, "links.tar");
+
+    tar_index_t *idx = tar_index_build(fd);
+    const tar_index_entry_t *f = tar_index_lookup(idx, "d/sub/f");
+    CHECK(f != NULL);
+    CHECK(tar_resolve(idx, "ld/sub/f") == f);
+    CHECK(tar_resolve(idx, "d/sub/up") == f);
+    CHECK(tar_resolve(idx, "chain1") == f);
+    CHECK(tar_resolve(idx, "hard") == f);
+    CHECK(tar_resolve(idx, "ld/sub/../sub/f") == f);
+    CHECK(tar_resolve(idx, "ld") == tar_index_lookup(idx, "d"));
+    errno = 0;
+    CHECK(tar_resolve(idx, "loop1") == NULL && errno == ELOOP);
+    errno = 0;
+    CHECK(tar_resolve(idx, "loop2/x") == NULL && errno == ELOOP);
+    errno = 0;
+    CHECK(tar_resolve(idx, "dangling") == NULL && errno == ENOENT);
+    errno = 0;
+    CHECK(tar_resolve(idx, "") == NULL && errno == EISDIR);
+    tar_index_free(idx);
+
+    char buf[64];
+    CHECK(read_string(fd, "chain1", buf, sizeof(buf)) == 0 && strcmp(buf, "target data") == 0);
+    CHECK(read_string(fd, "hard", buf, sizeof(buf)) == 0 && strcmp(buf, "target data") == 0);
+    CHECK(read_string(fd, "loop1", buf, sizeof(buf)) == -1);
+    CHECK(read_string(fd, "dangling", buf, sizeof(buf)) == -1);
+    CHECK(is_symlink(fd, "loop1") == 1 && exists(fd, "loop1") == 1);
+    char names[16 * 512];
+    size_t no_entries = 16;
+    CHECK(list_names(fd, "ld/sub", names, &no_entries) != 0 && strcmp(names, "d/sub/f d/sub/up") == 0);
+    close(fd);
+    free_archive(&a);
+}
+
+/* Writes the first len bytes of an archive to a pipe in small writes, then closes it */
+typedef struct {
+    int fd;
+    const uint8_t *data;
+    size_t len;
+} pipe_writer_t;
+
+static void *write_pipe(void *arg) {
+    pipe_writer_t *w = arg;
+    for (size_t done = 0; done < w->len;) {
+        ssize_t res = write(w->fd, w->data + done, w->len - done < 700 ? w->len - done : 700);
+        if (res <= 0) {
+            break;
+        }
+        done += res;
+    }
+    close(w->fd);
+    return NULL;
+}
+
+/* Iterates over the archive sent through a pipe, returning the names and the data read separated by spaces */
+static int iterate_pipe(archive_t *a, size_t len, char *out) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return -100;
+    }
+    pipe_writer_t w = {.fd = fds[1], .data = a->data, .len = len};
+    pthread_t thread;
+    pthread_create(&thread, NULL, write_pipe, &w);
+
+    tar_iter_t *it = tar_iter_open(fds[0]);
+    tar_iter_entry_t entry;
+    int res;
+    out[0] = '\0';
+    while ((res = tar_iter_next(it, &entry)) == 1) {
+        strcat(out, entry.name);
+        strcat(out, " ");
+        // the data of "skip" is left for tar_iter_next() to skip, the others are read a few bytes at a time
+        if (strcmp(entry.name, "skip") != 0) {
+            char buf[5];
+            ssize_t n;
+            while ((n = tar_iter_read(it, buf, sizeof(buf) - 1)) > 0) {
+                buf[n] = '\0';
+                strcat(out, buf);
+            }
+            if (n < 0) {
+                res = n;
+                break;
+            }
+            strcat(out, " ");
+        }
+    }
+    tar_iter_close(it);
+    close(fds[0]);
+    pthread_join(thread, NULL);
+    return res;
+}
+
+/* The iterator only reads forward, so it works on a pipe, and reports an archive cut short */
+static void test_iterator(void) {
+    archive_t a = {0};
+    add_file(&a, "first", "one two three");
+    char big[3000];
+    memset(big, 'b', sizeof(big));
+    add_member(&a, "skip", REGTYPE, NULL, big, sizeof(big));
+    add_member(&a, "dir/", DIRTYPE, NULL, NULL, 0);
+    add_file(&a, "dir/last", "end");
+    static const uint8_t end[1024];
+    append(&a, end, sizeof(end));
+
+    char out[4096];
+    CHECK(iterate_pipe(&a, a.len, out) == 0);
+    CHECK(strcmp(out, "first one two three skip dir/  dir/last end ") == 0);
+    // cut in the middle of the data of "skip"
+    CHECK(iterate_pipe(&a, 1024 + 1500, out) == TAR_ITER_TRUNCATED);
+    // cut in the padding after the data of "dir/last"
+    CHECK(iterate_pipe(&a, a.len - 1024 - 100, out) == TAR_ITER_TRUNCATED);
+    free_archive(&a);
+}
+
+/* Writes the archive, with its end blocks, gzip-compressed to a file of the temporary directory */
+static int gzip_fd(archive_t *a, const char *name) {
+    static const uint8_t end[1024];
+    append(a, end, sizeof(end));
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    deflateInit2(&strm, Z_BEST_SPEED, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY); // 31: gzip header
+    size_t cap = deflateBound(&strm, a->len);
+    uint8_t *out = malloc(cap);
+    strm.next_in = a->data;
+    strm.avail_in = a->len;
+    strm.next_out = out;
+    strm.avail_out = cap;
+    deflate(&strm, Z_FINISH);
+    size_t out_len = cap - strm.avail_out;
+    deflateEnd(&strm);
+    a->len -= sizeof(end);
+
+    int fd = open(tmp_path(name), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || write(fd, out, out_len) != (ssize_t) out_len) {
+        perror("Failed to write test archive");
+        exit(EXIT_FAILURE);
+    }
+    free(out);
+    return fd;
+}
+
+/* Reads at random offsets of a compressed archive match the uncompressed bytes */
+static bool gz_reads_match(tar_gz_t *gz, archive_t *a) {
+    uint8_t buf[5000];
+    for (int i = 0; i < 200; ++i) {
+        off_t offset = rand() % (a->len + 1024);
+        ssize_t res = tar_gz_pread(gz, buf, sizeof(buf), offset);
+        size_t left = a->len + 1024 - offset;
+        size_t in_data = offset < (off_t) a->len ? a->len - offset : 0;
+        if (res != (ssize_t) (left < sizeof(buf) ? left : sizeof(buf))
+            || memcmp(buf, a->data + offset, (size_t) res < in_data ? (size_t) res : in_data) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Random access into a gzip archive from its checkpoints, built by inflating it or loaded from a saved index */
+static void test_gzip(void) {
+    archive_t a = {0};
+    char name[32];
+    char data[20000];
+    srand(10);
+    for (int i = 0; i < 100; ++i) {
+        for (size_t j = 0; j < sizeof(data); ++j) {
+            data[j] = 'a' + rand() % 4; // compresses, but not to nothing
+        }
+        snprintf(name, sizeof(name), "f%d", i);
+        add_member(&a, name, REGTYPE, NULL, data, sizeof(data) - i);
+    }
+    int gz_fd = gzip_fd(&a, "gz.tar.gz");
+
+    tar_gz_t *gz = tar_gz_open(gz_fd, 64 * 1024);
+    CHECK(gz != NULL);
+    CHECK(tar_gz_size(gz) == (off_t) a.len + 1024);
+    CHECK(gz_reads_match(gz, &a));
+
+    tar_index_t *idx = tar_index_build_reader(tar_gz_reader(gz));
+    const tar_index_entry_t *entry = tar_index_lookup(idx, "f50");
+    char buf[64];
+    size_t len = 10;
+    CHECK(entry != NULL && entry->size == sizeof(data) - 50);
+    CHECK(tar_index_read_file(idx, "f50", 100, (uint8_t *) buf, &len) > 0 && len == 10);
+    CHECK(memcmp(buf, a.data + entry->data_offset + 100, 10) == 0);
+    tar_index_free(idx);
+
+    int index_fd = open(tmp_path("gz.tar.gz.idx"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(tar_gz_save_index(gz, index_fd) == 0);
+    tar_gz_close(gz);
+    gz = tar_gz_open_index(gz_fd, index_fd);
+    CHECK(gz != NULL && gz_reads_match(gz, &a));
+    tar_gz_close(gz);
+
+    // a checkpoint count that doesn't match the file is rejected before anything is allocated
+    uint64_t no_checkpoints = (uint64_t) 1 << 60;
+    CHECK(pwrite(index_fd, &no_checkpoints, sizeof(no_checkpoints), 40) == sizeof(no_checkpoints));
+    errno = 0;
+    CHECK(tar_gz_open_index(gz_fd, index_fd) == NULL && errno == EINVAL);
+    close(index_fd);
+
+    // the index of another compressed file
+    add_file(&a, "more", "data");
+    int other_fd = gzip_fd(&a, "other.tar.gz");
+    index_fd = open(tmp_path("gz.tar.gz.idx"), O_RDONLY);
+    CHECK(tar_gz_open_index(other_fd, index_fd) == NULL);
+    close(index_fd);
+    close(other_fd);
+    close(gz_fd);
+    free_archive(&a);
+}
+
+static int count_member(void *arg, const tar_index_entry_t *entry) {
+    int *counts = arg;
+    counts[entry->typeflag == DIRTYPE ? 0 : 1]++;
+    return 0;
+}
+
+/* The benchmark archives of gen_archive are valid, hold the entries asked for, and are the same for the same seed */
+static void test_gen_archive(void) {
+    if (access("./gen_archive", X_OK) != 0) {
+        printf("gen_archive not built, skipping its tests (make check builds it)\n");
+        return;
+    }
+    char cmd[512];
+    for (int i = 0; i < 2; ++i) {
+        snprintf(cmd, sizeof(cmd), "./gen_archive -n 500 -s uniform:0:2000 -d 2 -w 3 -l 0.1 -r 7 -o %s/gen%d.tar",
+                 tmp_dir, i);
+        CHECK(system(cmd) == 0);
+    }
+    snprintf(cmd, sizeof(cmd), "cmp -s %s/gen0.tar %s/gen1.tar", tmp_dir, tmp_dir);
+    CHECK(system(cmd) == 0);
+
+    int fd = open(tmp_path("gen0.tar"), O_RDONLY);
+    CHECK(fd != -1 && check_archive(fd) > 500);
+    tar_index_t *idx = tar_index_build(fd);
+    int counts[2] = {0, 0};
+    tar_find(idx, "**", count_member, counts);
+    CHECK(counts[0] > 0 && counts[1] == 500); // directories, then files and symlinks
+    tar_index_free(idx);
+    close(fd);
+}
+
+/* Appends a PAX record, whose length counts its own digits */
+static void add_pax_record(char *records, const char *key, const char *value) {
+    size_t len = strlen(key) + strlen(value) + 3; // the space, '=' and the newline
+    size_t total = len + 1;
+    while (total != len + snprintf(NULL, 0, "%zu", total)) {
+        total = len + snprintf(NULL, 0, "%zu", total);
+    }
+    sprintf(records + strlen(records), "%zu %s=%s\n", total, key, value);
+}
+
+/* Paths longer than the name field, from the ustar prefix, PAX records and GNU long names, and large sizes */
+static void test_long_names(void) {
+    char long_dir[200], long_name[600], long_link[300];
+    memset(long_dir, 'd', 150);
+    long_dir[150] = '\0';
+    snprintf(long_name, sizeof(long_name), "%s/%0200d", long_dir, 7);
+    memset(long_link, 'l', 250);
+    long_link[250] = '\0';
+
+    archive_t a = {0};
+    add_file(&a, "dir/with/a/prefix/because/the/name/is/long/enough/to/not/fit/in/the/hundred/bytes/of/the/name/field",
+             "prefix");
+    char records[2048] = "";
+    add_pax_record(records, "path", long_name);
+    add_pax_record(records, "linkpath", long_link);
+    add_member(&a, "PaxHeader", XHDTYPE, NULL, records, strlen(records));
+    add_member(&a, "truncated", SYMTYPE, "truncated", NULL, 0);
+    add_member(&a, "././@LongLink", GNUTYPE_LONGNAME, NULL, long_dir, strlen(long_dir) + 1);
+    add_file(&a, "short", "gnu");
+    records[0] = '\0';
+    add_pax_record(records, "size", "3");
+    add_member(&a, "PaxHeader", XHDTYPE, NULL, records, strlen(records));
+    add_member(&a, "pax_size", REGTYPE, NULL, "abc", 3);
+    // the size field says 0, the data is only found with the size of the record
+    tar_header_t *header = (tar_header_t *) (a.data + a.len - 1024);
+    snprintf(header->size, sizeof(header->size), "%011o", 0);
+    set_header_checksum(header);
+    add_file(&a, "base256", "0123456789");
+    // the size of the last member in base-256, as GNU tar writes sizes of 8 GiB and more
+    header = (tar_header_t *) (a.data + a.len - 1024);
+    memset(header->size, 0, sizeof(header->size));
+    header->size[0] = (char) 0x80;
+    header->size[11] = 10;
+    set_header_checksum(header);
+    int fd = archive_fd(&a, "long.tar");
+
+    CHECK(check_archive(fd) == 8);
+    char buf[64];
+    CHECK(read_string(fd, "dir/with/a/prefix/because/the/name/is/long/enough/to/not/fit/in/the/hundred/bytes/of/the/"
+                          "name/field", buf, sizeof(buf)) == 0 && strcmp(buf, "prefix") == 0);
+    CHECK(is_symlink(fd, long_name) == 1 && exists(fd, "truncated") == 0);
+    tar_index_t *idx = tar_index_build(fd);
+    const tar_index_entry_t *entry = tar_index_lookup(idx, long_name);
+    CHECK(entry != NULL && strcmp(entry->linkname, long_link) == 0);
+    entry = tar_index_lookup(idx, long_dir);
+    CHECK(entry != NULL && entry->size == 3);
+    CHECK(tar_index_lookup(idx, "short") == NULL);
+    entry = tar_index_lookup(idx, "base256");
+    CHECK(entry != NULL && entry->size == 10);
+    tar_index_free(idx);
+    CHECK(read_string(fd, long_dir, buf, sizeof(buf)) == 0 && strcmp(buf, "gnu") == 0);
+    CHECK(read_string(fd, "pax_size", buf, sizeof(buf)) == 0 && strcmp(buf, "abc") == 0);
+    CHECK(read_string(fd, "base256", buf, sizeof(buf)) == 0 && strcmp(buf, "0123456789") == 0);
+    close(fd);
+    free_archive(&a);
+}
+
+/* An index saved next to the archive answers the same queries once loaded, until the archive changes */
+static void test_sidecar(void) {
+    archive_t a = {0};
+    add_member(&a, "d/", DIRTYPE, NULL, NULL, 0);
+    add_file(&a, "d/b", "bee");
+    add_file(&a, "d/a", "ay");
+    add_member(&a, "l", SYMTYPE, "d/b", NULL, 0);
+    add_member(&a, "loop", SYMTYPE, "loop", NULL, 0);
+    int fd = archive_fd(&a, "sidecar.tar");
+    char *idx_path = strdup(tmp_path("sidecar.tar.idx"));
+
+    tar_index_t *built = tar_index_build(fd);
+    CHECK(tar_index_save(built, fd, idx_path) == 0);
+    tar_index_free(built);
+
+    tar_index_t *idx = tar_index_load(idx_path, fd);
+    CHECK(idx != NULL);
+    CHECK(tar_index_is_dir(idx, "d") == 1 && tar_index_is_symlink(idx, "l") == 1 && tar_index_exists(idx, "x") == 0);
+    CHECK(tar_resolve(idx, "l") == tar_index_lookup(idx, "d/b"));
+    errno = 0;
+    CHECK(tar_resolve(idx, "loop") == NULL && errno == ELOOP);
+    char *entries[4];
+    char names[4][512];
+    for (int i = 0; i < 4; ++i) {
+        entries[i] = names[i];
+    }
+    size_t no_entries = 4;
+    CHECK(tar_index_list(idx, "d/", entries, &no_entries) != 0 && no_entries == 2);
+    CHECK(strcmp(names[0], "d/b") == 0 && strcmp(names[1], "d/a") == 0); // archive order, not path order
+    char buf[16];
+    size_t len = sizeof(buf);
+    CHECK(tar_index_read_file(idx, "l", 0, (uint8_t *) buf, &len) == 0 && len == 3 && memcmp(buf, "bee", 3) == 0);
+    int count = 0;
+    CHECK(tar_find(idx, "d/*", count_entry, &count) == 2 && count == 2);
+    CHECK(tar_index_save(idx, fd, tmp_path("again.idx")) == -1 && errno == EINVAL);
+    tar_index_free(idx);
+
+    // keys pointing past the string table: the 104-byte file header is followed by 72-byte records, whose key offset
+    // and length are at bytes 40 and 44
+    int corrupt = open(idx_path, O_RDWR);
+    uint8_t bad_key[8];
+    memset(bad_key, 0xff, sizeof(bad_key));
+    for (int r = 0; r < 5; ++r) {
+        CHECK(pwrite(corrupt, bad_key, sizeof(bad_key), 104 + r * 72 + 40) == sizeof(bad_key));
+    }
+    close(corrupt);
+    idx = tar_index_load(idx_path, fd);
+    CHECK(idx != NULL);
+    count = 0;
+    CHECK(tar_find(idx, "**", count_entry, &count) >= 0 && tar_find(idx, "d/b", count_entry, &count) >= 0);
+    tar_index_free(idx);
+
+    // appended to, the archive has a new size
+    add_file(&a, "new", "n");
+    close(archive_fd(&a, "sidecar.tar"));
+    errno = 0;
+    CHECK(tar_index_load(idx_path, fd) == NULL && errno == ESTALE);
+
+    int junk = open(tmp_path("junk.idx"), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(write(junk, a.data, 4096) == 4096);
+    close(junk);
+    errno = 0;
+    CHECK(tar_index_load(tmp_path("junk.idx"), fd) == NULL && errno == EINVAL);
+    free(idx_path);
+    close(fd);
+    free_archive(&a);
+}
+
+/* A batch of reads in any order gives what read_file() gives for each of them */
+static void test_read_files(void) {
+    archive_t a = {0};
+    char name[32], content[64];
+    for (int i = 0; i < 50; ++i) {
+        snprintf(name, sizeof(name), "f%d", i);
+        snprintf(content, sizeof(content), "content of file %d", i);
+        add_file(&a, name, content);
+    }
+    add_member(&a, "l", SYMTYPE, "f7", NULL, 0);
+    int fd = archive_fd(&a, "batch.tar");
+
+    char *paths[] = {"f42", "f3", "l", "f3", "missing", "f10", "f11", "f12"};
+    size_t offsets[] = {0, 8, 0, 0, 0, 100, 5, 0};
+    size_t sizes[] = {64, 64, 64, 4, 64, 64, 64, 0};
+    size_t n = sizeof(paths) / sizeof(paths[0]);
+    uint8_t bufs[8][64], expected[64];
+    size_t lens[8];
+    ssize_t results[8];
+    tar_read_req_t reqs[8];
+    for (size_t i = 0; i < n; ++i) {
+        lens[i] = sizes[i];
+        reqs[i] = (tar_read_req_t) {.path = paths[i], .offset = offsets[i], .dest = bufs[i], .len = &lens[i],
+                                    .result = &results[i]};
+    }
+    CHECK(read_files(fd, reqs, n) == 6);
+    bool same = true;
+    for (size_t i = 0; i < n; ++i) {
+        size_t len = sizes[i];
+        ssize_t res = read_file(fd, paths[i], offsets[i], expected, &len);
+        same = same && res == results[i] && (res < 0 || (len == lens[i] && memcmp(expected, bufs[i], len) == 0));
+    }
+    CHECK(same);
+    CHECK(results[4] == -1 && results[5] == -2 && results[3] == 13 && lens[3] == 4);
+    CHECK(lens[2] == 17 && memcmp(bufs[2], "content of file 7", 17) == 0);
+    close(fd);
+    free_archive(&a);
+}
+
+/* One asynchronous read and what it completed with */
+typedef struct {
+    int calls;
+    ssize_t result;
+    size_t len;
+    uint8_t buf[32];
+} async_read_t;
+
+static void async_done(void *arg, ssize_t result, size_t len) {
+    async_read_t *read = arg;
+    read->calls++;
+    read->result = result;
+    read->len = len;
+}
+
+/* Reads completed out of order by io_uring or by the thread pool, more of them than can be in flight */
+static void test_async(void) {
+    archive_t a = {0};
+    char name[32], content[64];
+    for (int i = 0; i < 30; ++i) {
+        snprintf(name, sizeof(name), "f%d", i);
+        snprintf(content, sizeof(content), "async content %d", i);
+        add_file(&a, name, content);
+    }
+    int fd = archive_fd(&a, "async.tar");
+
+    for (int flags = 0; flags <= TAR_ASYNC_NO_URING; ++flags) {
+        tar_async_t *ctx = tar_async_open(fd, NULL, 4, flags);
+        CHECK(ctx != NULL);
+        async_read_t reads[32];
+        memset(reads, 0, sizeof(reads));
+        bool started = true;
+        for (int i = 0; i < 30; ++i) {
+            snprintf(name, sizeof(name), "f%d", i);
+            started = started && tar_read_async(ctx, name, i % 3, reads[i].buf, 10, async_done, &reads[i]) == 0;
+        }
+        started = started && tar_read_async(ctx, "missing", 0, reads[30].buf, 10, async_done, &reads[30]) == 0;
+        started = started && tar_read_async(ctx, "f1", 100, reads[31].buf, 10, async_done, &reads[31]) == 0;
+        CHECK(started);
+        int completed = 0;
+        for (int res; (res = tar_wait(ctx)) > 0;) {
+            completed += res;
+        }
+        CHECK(completed == 32);
+
+        bool reads_ok = true;
+        for (int i = 0; i < 30; ++i) {
+            snprintf(content, sizeof(content), "async content %d", i);
+            reads_ok = reads_ok && reads[i].calls == 1 && reads[i].len == 10
+                       && reads[i].result == (ssize_t) strlen(content) - i % 3 - 10
+                       && memcmp(reads[i].buf, content + i % 3, 10) == 0;
+        }
+        CHECK(reads_ok);
+        CHECK(reads[30].calls == 1 && reads[30].result == -1);
+        CHECK(reads[31].calls == 1 && reads[31].result == -2);
+        tar_async_close(ctx);
+    }
+    close(fd);
+    free_archive(&a);
+}
+
+/* An index brought up to date with what was appended to its archive */
+static void test_refresh(void) {
+    archive_t a = {0};
+    add_file(&a, "a", "old a");
+    add_member(&a, "link", SYMTYPE, "later", NULL, 0);
+    int fd = archive_fd(&a, "refresh.tar");
+    tar_index_t *idx = tar_index_build(fd);
+    errno = 0;
+    CHECK(tar_resolve(idx, "link") == NULL && errno == ENOENT);
+    CHECK(tar_index_refresh(idx, fd) == 0);
+
+    add_file(&a, "a", "new a");
+    add_file(&a, "later", "appended");
+    close(archive_fd(&a, "refresh.tar"));
+    CHECK(tar_index_refresh(idx, fd) == 2);
+    char buf[16];
+    size_t len = sizeof(buf);
+    CHECK(tar_index_read_file(idx, "a", 0, (uint8_t *) buf, &len) == 0 && len == 5 && memcmp(buf, "new a", 5) == 0);
+    CHECK(tar_resolve(idx, "link") == tar_index_lookup(idx, "later")); // the dangling link found its target
+    int count = 0;
+    CHECK(tar_find(idx, "*", count_entry, &count) == 3);
+
+    // an archive that got shorter is not the one indexed any more
+    a.len = 1024;
+    close(archive_fd(&a, "refresh.tar"));
+    errno = 0;
+    CHECK(tar_index_refresh(idx, fd) == -1 && errno == ESTALE);
+    tar_index_free(idx);
+
+    tar_index_t *built = tar_index_build(fd);
+    CHECK(tar_index_save(built, fd, tmp_path("refresh.idx")) == 0);
+    tar_index_free(built);
+    idx = tar_index_load(tmp_path("refresh.idx"), fd);
+    errno = 0;
+    CHECK(idx != NULL && tar_index_refresh(idx, fd) == -1 && errno == EINVAL);
+    tar_index_free(idx);
+    close(fd);
+    free_archive(&a);
+}
+
+static int collect_key(void *arg, const tar_index_entry_t *entry) {
+    char *out = arg;
+    strcat(out, out[0] == '\0' ? "" : " ");
+    strncat(out, entry->key, entry->key_len);
+    return 0;
+}
+
+static int stop_search(void *arg, const tar_index_entry_t *entry) {
+    return 1;
+}
+
+/* The keys tar_find() matches, in the order it gives them */
+static const char *find_keys(tar_index_t *idx, const char *pattern) {
+    static char out[4096];
+    out[0] = '\0';
+    tar_find(idx, pattern, collect_key, out);
+    return out;
+}
+
+/* Globs over the sorted paths, which are sorted again on the first search after a refresh */
+static void test_find(void) {
+    archive_t a = {0};
+    add_member(&a, "src/", DIRTYPE, NULL, NULL, 0);
+    add_file(&a, "src/main.c", "");
+    add_file(&a, "src/b.h", "");
+    add_member(&a, "src/lib/", DIRTYPE, NULL, NULL, 0);
+    add_file(&a, "src/lib/util.c", "");
+    add_file(&a, "src/a.c", "");
+    add_file(&a, "top.c", "");
+    add_file(&a, "star*", "");
+    add_file(&a, "srcx", "");
+    int fd = archive_fd(&a, "find.tar");
+    tar_index_t *idx = tar_index_build(fd);
+
+    CHECK(strcmp(find_keys(idx, "src/*"), "src/a.c src/b.h src/lib src/main.c") == 0);
+    CHECK(strcmp(find_keys(idx, "src/**"), "src/a.c src/b.h src/lib src/lib/util.c src/main.c") == 0);
+    CHECK(strcmp(find_keys(idx, "**/*.c"), "src/a.c src/lib/util.c src/main.c top.c") == 0);
+    CHECK(strcmp(find_keys(idx, "src/**/*.c"), "src/a.c src/lib/util.c src/main.c") == 0);
+    CHECK(strcmp(find_keys(idx, "src/[a-b].?"), "src/a.c src/b.h") == 0);
+    CHECK(strcmp(find_keys(idx, "src/[!a-b]*"), "src/lib src/main.c") == 0);
+    CHECK(strcmp(find_keys(idx, "src*"), "src srcx") == 0);
+    CHECK(strcmp(find_keys(idx, "star\\*"), "star*") == 0);
+    CHECK(strcmp(find_keys(idx, "./src/lib/"), "src/lib") == 0);
+    CHECK(strcmp(find_keys(idx, "src/missing*"), "") == 0);
+
+    int count = 0;
+    CHECK(tar_find(idx, "**", count_entry, &count) == 9 && count == 9);
+    // the search stops when the callback asks to
+    CHECK(tar_find(idx, "**", stop_search, NULL) == 1);
+
+    add_file(&a, "src/0first.c", "");
+    close(archive_fd(&a, "find.tar"));
+    CHECK(tar_index_refresh(idx, fd) == 1);
+    CHECK(strcmp(find_keys(idx, "src/*.c"), "src/0first.c src/a.c src/main.c") == 0);
+    tar_index_free(idx);
+    close(fd);
+    free_archive(&a);
+}
+
+/* Reads a small file of the temporary directory into a NUL-terminated buffer, "" if it can't be read */
+static const char *file_content(const char *name) {
+    static char buf[256];
+    int fd = open(tmp_path(name), O_RDONLY | O_NOFOLLOW);
+    ssize_t len = fd == -1 ? 0 : read(fd, buf, sizeof(buf) - 1);
+    buf[len < 0 ? 0 : len] = '\0';
+    if (fd != -1) {
+        close(fd);
+    }
+    return buf;
+}
+
+/* Extraction of files, directories and links, and of an archive over links a previous one left */
+static void test_extract(void) {
+    archive_t a = {0};
+    add_member(&a, "d/", DIRTYPE, NULL, NULL, 0);
+    add_file(&a, "d/f", "file data");
+    add_file(&a, "d/deep/er/g", "implicit parents");
+    add_member(&a, "d/sym", SYMTYPE, "f", NULL, 0);
+    add_member(&a, "hard", LNKTYPE, "d/f", NULL, 0);
+    add_file(&a, "../escape", "outside");
+    add_file(&a, "other/h", "filtered out");
+    int fd = archive_fd(&a, "extract.tar");
+
+    CHECK(tar_extract(fd, tmp_path("out"), "d/**", 2) == 3); // "d" itself and the implicit parents are not entries
+    CHECK(strcmp(file_content("out/d/f"), "file data") == 0);
+    CHECK(strcmp(file_content("out/d/deep/er/g"), "implicit parents") == 0);
+    char target[64] = "";
+    CHECK(readlink(tmp_path("out/d/sym"), target, sizeof(target)) == 1 && target[0] == 'f');
+    struct stat st;
+    CHECK(lstat(tmp_path("out/other"), &st) == -1 && lstat(tmp_path("escape"), &st) == -1);
+
+    CHECK(tar_extract(fd, tmp_path("out"), NULL, 0) == 6); // "../escape" is skipped
+    struct stat st_hard, st_f;
+    CHECK(stat(tmp_path("out/hard"), &st_hard) == 0 && stat(tmp_path("out/d/f"), &st_f) == 0);
+    CHECK(st_hard.st_ino == st_f.st_ino);
+    CHECK(strcmp(file_content("out/other/h"), "filtered out") == 0);
+    CHECK(lstat(tmp_path("escape"), &st) == -1);
+    close(fd);
+    free_archive(&a);
+
+    // a symlink left by an earlier extraction where the next archive has a directory is replaced, not followed
+    CHECK(mkdir(tmp_path("outside"), 0755) == 0);
+    add_member(&a, "planted", SYMTYPE, "../outside", NULL, 0);
+    fd = archive_fd(&a, "planted.tar");
+    CHECK(tar_extract(fd, tmp_path("out2"), NULL, 1) == 1);
+    close(fd);
+    free_archive(&a);
+    add_file(&a, "planted/payload", "stays inside");
+    fd = archive_fd(&a, "planted.tar");
+    CHECK(tar_extract(fd, tmp_path("out2"), NULL, 1) == 1);
+    CHECK(lstat(tmp_path("out2/planted"), &st) == 0 && S_ISDIR(st.st_mode));
+    CHECK(strcmp(file_content("out2/planted/payload"), "stays inside") == 0);
+    CHECK(lstat(tmp_path("outside/payload"), &st) == -1);
+    close(fd);
+    free_archive(&a);
+}
+
+/* Reads what is waiting in a descriptor into a NUL-terminated buffer */
+static const char *drain(int fd) {
+    static char buf[256];
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    buf[len < 0 ? 0 : len] = '\0';
+    return buf;
+}
+
+/* File ranges sent to a pipe, a socket and a regular file, each with the system call it supports */
+static void test_send(void) {
+    archive_t a = {0};
+    add_file(&a, "f", "0123456789abcdef");
+    add_member(&a, "l", SYMTYPE, "f", NULL, 0);
+    add_member(&a, "d/", DIRTYPE, NULL, NULL, 0);
+    int fd = archive_fd(&a, "send.tar");
+
+    int fds[2];
+    CHECK(pipe(fds) == 0);
+    CHECK(tar_send_entry(fd, "f", fds[1], 0, 0) == 16 && strcmp(drain(fds[0]), "0123456789abcdef") == 0);
+    CHECK(tar_send_entry(fd, "l", fds[1], 10, 3) == 3 && strcmp(drain(fds[0]), "abc") == 0);
+    CHECK(tar_send_entry(fd, "f", fds[1], 16, 0) == 0);
+    CHECK(tar_send_entry(fd, "f", fds[1], 17, 0) == -2);
+    CHECK(tar_send_entry(fd, "d", fds[1], 0, 0) == -1 && tar_send_entry(fd, "missing", fds[1], 0, 0) == -1);
+    close(fds[0]);
+    signal(SIGPIPE, SIG_IGN);
+    errno = 0;
+    CHECK(tar_send_entry(fd, "f", fds[1], 0, 0) == -3 && errno == EPIPE);
+    close(fds[1]);
+
+    int sockets[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+    CHECK(tar_send_entry(fd, "f", sockets[0], 4, 100) == 12 && strcmp(drain(sockets[1]), "456789abcdef") == 0);
+    close(sockets[0]);
+    close(sockets[1]);
+
+    int out = open(tmp_path("sent"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(tar_send_entry(fd, "f", out, 0, 4) == 4 && tar_send_entry(fd, "f", out, 12, 0) == 4);
+    CHECK(close(out) == 0 && strcmp(file_content("sent"), "0123cdef") == 0);
+    close(fd);
+    free_archive(&a);
+}
+
+/* The counters follow the work of the calls with "make STATS=1", and stay at zero otherwise */
+static void test_stats(void) {
+    archive_t a = {0};
+    char name[32];
+    for (int i = 0; i < 40; ++i) {
+        snprintf(name, sizeof(name), "f%d", i);
+        add_file(&a, name, name);
+    }
+    add_member(&a, "l", SYMTYPE, "f3", NULL, 0);
+    int fd = archive_fd(&a, "stats.tar");
+
+    tar_stats_reset();
+    CHECK(check_archive(fd) == 41);
+    char buf[16];
+    CHECK(read_string(fd, "l", buf, sizeof(buf)) == 0 && exists(fd, "missing") == 0);
+    tar_stats_t stats;
+    tar_stats_get(&stats);
+    CHECK(strcmp(tar_stats_func_name(TAR_STATS_READ_FILE), "read_file") == 0);
+#ifdef TAR_STATS
+    CHECK(stats.headers_visited >= 41 && stats.read_calls > 0 && stats.bytes_read >= a.len);
+    CHECK(stats.link_resolutions > 0 && stats.index_hits > 0 && stats.index_misses > 0);
+    const tar_stats_latency_t *latency = &stats.latency[TAR_STATS_CHECK_ARCHIVE];
+    uint64_t in_buckets = 0;
+    for (int i = 0; i < TAR_STATS_BUCKETS; ++i) {
+        in_buckets += latency->buckets[i];
+    }
+    CHECK(latency->calls == 1 && in_buckets == 1 && latency->max_ns <= latency->total_ns);
+    CHECK(stats.latency[TAR_STATS_READ_FILE].calls == 1 && stats.latency[TAR_STATS_EXISTS].calls == 1);
+    CHECK(stats.latency[TAR_STATS_LIST].calls == 0);
+    tar_stats_reset();
+    tar_stats_get(&stats);
+#endif
+    CHECK(stats.headers_visited == 0 && stats.read_calls == 0 && stats.latency[TAR_STATS_READ_FILE].calls == 0);
+    close(fd);
+    free_archive(&a);
+}
+
+/* An open entry reads in chunks from its position, and never past the end of its file into the next member */
+static void test_entry(void) {
+    archive_t a = {0};
+    char data[1500];
+    for (size_t i = 0; i < sizeof(data); ++i) {
+        data[i] = 'a' + i % 26;
+    }
+    add_member(&a, "f", REGTYPE, NULL, data, sizeof(data));
+    add_file(&a, "next", "next member");
+    add_member(&a, "l", SYMTYPE, "f", NULL, 0);
+    add_member(&a, "d/", DIRTYPE, NULL, NULL, 0);
+    int fd = archive_fd(&a, "entry.tar");
+
+    tar_entry_t *e = tar_entry_open(fd, "l");
+    CHECK(e != NULL && tar_entry_size(e) == sizeof(data));
+    char buf[2000];
+    size_t done = 0;
+    for (ssize_t res; (res = tar_entry_read(e, buf + done, 64)) > 0;) {
+        done += res;
+    }
+    CHECK(done == sizeof(data) && memcmp(buf, data, sizeof(data)) == 0);
+    CHECK(tar_entry_read(e, buf, sizeof(buf)) == 0);
+
+    CHECK(tar_entry_seek(e, -10, SEEK_END) == sizeof(data) - 10);
+    CHECK(tar_entry_read(e, buf, sizeof(buf)) == 10 && memcmp(buf, data + sizeof(data) - 10, 10) == 0);
+    CHECK(tar_entry_seek(e, 100, SEEK_SET) == 100 && tar_entry_seek(e, 5, SEEK_CUR) == 105);
+    CHECK(tar_entry_pread(e, buf, 4, 1000) == 4 && memcmp(buf, data + 1000, 4) == 0);
+    CHECK(tar_entry_read(e, buf, 4) == 4 && memcmp(buf, data + 105, 4) == 0); // pread left the position alone
+    CHECK(tar_entry_seek(e, 5000, SEEK_SET) == 5000 && tar_entry_read(e, buf, sizeof(buf)) == 0);
+    CHECK(tar_entry_pread(e, buf, sizeof(buf), 1490) == 10);
+    errno = 0;
+    CHECK(tar_entry_seek(e, -1, SEEK_SET) == -1 && errno == EINVAL);
+    tar_entry_close(e);
+
+    // later opens reuse the index of the descriptor instead of scanning the archive again
+    tar_stats_reset();
+    errno = 0;
+    CHECK(tar_entry_open(fd, "d") == NULL && errno == ENOENT);
+    errno = 0;
+    CHECK(tar_entry_open(fd, "missing") == NULL && errno == ENOENT);
+    tar_stats_t stats;
+    tar_stats_get(&stats);
+    CHECK(stats.headers_visited == 0);
+
+    tar_index_t *idx = tar_index_build(fd);
+    e = tar_index_entry_open(idx, fd, "next");
+    tar_index_free(idx);
+    CHECK(e != NULL && tar_entry_read(e, buf, sizeof(buf)) == 11 && memcmp(buf, "next member", 11) == 0);
+    tar_entry_close(e);
+    close(fd);
+    free_archive(&a);
+}
+
+/* Writes a source file to the temporary directory */
+static void write_tmp_file(const char *name, const void *data, size_t len) {
+    int fd = open(tmp_path(name), O_WRONLY | O_CREAT | O_TRUNC, 0640);
+    if (fd == -1 || write(fd, data, len) != (ssize_t) len) {
+        perror("Failed to write test file");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+/* Writes the sources of test_writer() to an archive with a number of threads, and opens the archive */
+static int write_archive(const char *name, int nthreads, size_t no_files) {
+    int fd = open(tmp_path(name), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    tar_writer_t *w = tar_writer_open_parallel(fd, nthreads);
+    char entry[512], src[64];
+    int res = tar_writer_add_dir(w, "files", 0750, 1700000000);
+    for (size_t i = 0; i < no_files && res == 0; ++i) {
+        snprintf(entry, sizeof(entry), "files/%zu", i);
+        snprintf(src, sizeof(src), "%s/src%zu", tmp_dir, i % 4);
+        res = tar_writer_add_file(w, entry, src);
+    }
+    memset(entry, 'n', 300);
+    strcpy(entry + 300, "/long");
+    res = res == 0 ? tar_writer_add_file(w, entry, tmp_path("big")) : res;
+    res = res == 0 ? tar_writer_add_symlink(w, "link", "files/1", 1700000000) : res;
+    return tar_writer_close(w) == 0 && res == 0 ? fd : -1;
+}
+
+/* Archives written in batches read back entry for entry, the same bytes whatever the number of threads */
+static void test_writer(void) {
+    char data[100];
+    for (int i = 0; i < 4; ++i) {
+        char src[16];
+        snprintf(src, sizeof(src), "src%d", i);
+        memset(data, '0' + i, sizeof(data));
+        write_tmp_file(src, data, i * 30); // src0 is empty
+    }
+    size_t big_len = 3 * TAR_WRITER_INLINE_MAX + 7;
+    uint8_t *big = malloc(big_len);
+    for (size_t i = 0; i < big_len; ++i) {
+        big[i] = i * 7;
+    }
+    write_tmp_file("big", big, big_len);
+
+    // more files than a batch holds
+    int fd = write_archive("written1.tar", 1, TAR_WRITER_BATCH + 100);
+    CHECK(fd != -1 && check_archive(fd) > TAR_WRITER_BATCH + 100);
+    char buf[128];
+    CHECK(read_string(fd, "files/7", buf, sizeof(buf)) == 0 && strlen(buf) == 90 && buf[0] == '3');
+    CHECK(read_string(fd, "files/4", buf, sizeof(buf)) == 0 && buf[0] == '\0');
+    CHECK(read_string(fd, "link", buf, sizeof(buf)) == 0 && strlen(buf) == 30);
+    CHECK(is_dir(fd, "files") == 1);
+    char long_name[512];
+    memset(long_name, 'n', 300);
+    strcpy(long_name + 300, "/long");
+    uint8_t *read_back = malloc(big_len);
+    size_t len = big_len;
+    CHECK(read_file(fd, long_name, 0, read_back, &len) == 0 && len == big_len && memcmp(read_back, big, len) == 0);
+    free(read_back);
+
+    int parallel_fd = write_archive("written4.tar", 4, TAR_WRITER_BATCH + 100);
+    CHECK(parallel_fd != -1);
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "cmp -s %s/written1.tar %s/written4.tar", tmp_dir, tmp_dir);
+    CHECK(system(cmd) == 0);
+    close(parallel_fd);
+    close(fd);
+
+    // a source that can't be read fails the batch, and the writer with it
+    fd = open(tmp_path("failed.tar"), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    tar_writer_t *w = tar_writer_open_parallel(fd, 2);
+    CHECK(tar_writer_add_file(w, "missing", tmp_path("missing")) == 0); // only queued
+    errno = 0;
+    CHECK(tar_writer_close(w) == -1 && errno == ENOENT);
+    close(fd);
+    free(big);
+}
+
+/* Calls tar_overlay_list() and returns the names it listed separated by spaces */
+static const char *overlay_names(tar_overlay_t *ov, char *path) {
+    static char names[16 * 512];
+    char *entries[16];
+    for (int i = 0; i < 16; ++i) {
+        entries[i] = calloc(512, 1);
+    }
+    size_t no_entries = 16;
+    names[0] = '\0';
+    if (tar_overlay_list(ov, path, entries, &no_entries) == 0) {
+        strcpy(names, "(none)");
+    }
+    for (size_t i = 0; i < no_entries; ++i) {
+        strcat(names, i == 0 ? "" : " ");
+        strcat(names, entries[i]);
+    }
+    for (int i = 0; i < 16; ++i) {
+        free(entries[i]);
+    }
+    return names;
+}
+
+/* Layers stacked with shadowing, whiteouts, opaque directories, and links across layers */
+static void test_overlay(void) {
+    archive_t lower = {0};
+    add_member(&lower, "etc/", DIRTYPE, NULL, NULL, 0);
+    add_file(&lower, "etc/a", "a0");
+    add_file(&lower, "etc/b", "b0");
+    add_member(&lower, "etc/sub/", DIRTYPE, NULL, NULL, 0);
+    add_file(&lower, "etc/sub/x", "x0");
+    add_member(&lower, "opt/", DIRTYPE, NULL, NULL, 0);
+    add_file(&lower, "opt/o", "o0");
+    add_file(&lower, "var/v", "v0");
+    archive_t upper = {0};
+    add_file(&upper, "etc/a", "a1");
+    add_file(&upper, "etc/.wh.b", "");
+    add_member(&upper, "etc/sub/", DIRTYPE, NULL, NULL, 0);
+    add_file(&upper, "etc/sub/.wh..wh..opq", "");
+    add_file(&upper, "etc/sub/y", "y1");
+    add_file(&upper, "opt", "now a file");
+    add_member(&upper, "down", SYMTYPE, "var/v", NULL, 0);
+    add_member(&upper, "hidden", SYMTYPE, "etc/sub/x", NULL, 0);
+    int fds[2] = {archive_fd(&lower, "lower.tar"), archive_fd(&upper, "upper.tar")};
+
+    tar_overlay_t *ov = tar_overlay_build(fds, 2);
+    CHECK(ov != NULL);
+    char buf[32];
+    size_t len = sizeof(buf);
+    CHECK(tar_overlay_read_file(ov, "etc/a", 0, (uint8_t *) buf, &len) == 0 && len == 2 && memcmp(buf, "a1", 2) == 0);
+    CHECK(tar_overlay_exists(ov, "etc/b") == 0 && tar_overlay_exists(ov, "etc/.wh.b") == 0);
+    CHECK(tar_overlay_is_dir(ov, "etc/sub") == 1 && tar_overlay_exists(ov, "etc/sub/x") == 0);
+    CHECK(tar_overlay_is_file(ov, "etc/sub/y") == 1 && tar_overlay_exists(ov, "etc/sub/.wh..wh..opq") == 0);
+    CHECK(strcmp(overlay_names(ov, "etc/sub"), "etc/sub/y") == 0);
+    CHECK(strcmp(overlay_names(ov, "etc"), "etc/a etc/sub/") == 0);
+    CHECK(tar_overlay_is_file(ov, "opt") == 1 && tar_overlay_exists(ov, "opt/o") == 0);
+    CHECK(strcmp(overlay_names(ov, "opt"), "(none)") == 0);
+
+    size_t layer = 99;
+    const tar_index_entry_t *entry = tar_overlay_resolve(ov, "down", &layer);
+    CHECK(entry != NULL && layer == 0 && tar_overlay_is_symlink(ov, "down") == 1);
+    len = sizeof(buf);
+    CHECK(tar_overlay_read_file(ov, "down", 0, (uint8_t *) buf, &len) == 0 && len == 2 && memcmp(buf, "v0", 2) == 0);
+    errno = 0;
+    CHECK(tar_overlay_resolve(ov, "hidden", NULL) == NULL && errno == ENOENT);
+    tar_overlay_free(ov);
+    close(fds[0]);
+    close(fds[1]);
+    free_archive(&lower);
+    free_archive(&upper);
+}
+
+/* Returns the entry of a manifest with a path, NULL if there is none */
+static tar_manifest_entry_t *manifest_entry(tar_manifest_t *manifest, const char *path) {
+    for (size_t i = 0; i < manifest->no_entries; ++i) {
+        if (strcmp(manifest->entries[i].path, path) == 0) {
+            return &manifest->entries[i];
+        }
+    }
+    return NULL;
+}
+
+/* Digests embedded by the writer verify, until a data byte changes or a file goes away */
+static void test_verify(void) {
+    tar_digest_ctx_t ctx;
+    tar_digest_t digest;
+    tar_digest_init(&ctx, TAR_DIGEST_CRC32C | TAR_DIGEST_SHA256);
+    tar_digest_update(&ctx, "ab", 2);
+    tar_digest_update(&ctx, "c", 1);
+    tar_digest_final(&ctx, &digest);
+    const uint8_t abc_sha256[4] = {0xba, 0x78, 0x16, 0xbf};
+    CHECK(digest.has_crc32c && digest.has_sha256 && memcmp(digest.sha256, abc_sha256, 4) == 0);
+    tar_digest_init(&ctx, TAR_DIGEST_CRC32C);
+    tar_digest_update(&ctx, "123456789", 9);
+    tar_digest_final(&ctx, &digest);
+    CHECK(digest.has_crc32c && !digest.has_sha256 && digest.crc32c == 0xe3069283);
+
+    write_tmp_file("checked", "content to be checked", 21);
+    write_tmp_file("plain", "no digest", 9);
+    int fd = open(tmp_path("digests.tar"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    tar_writer_t *w = tar_writer_open(fd);
+    tar_writer_set_digests(w, TAR_DIGEST_CRC32C | TAR_DIGEST_SHA256);
+    CHECK(tar_writer_add_file(w, "checked", tmp_path("checked")) == 0);
+    tar_writer_set_digests(w, 0);
+    CHECK(tar_writer_add_file(w, "plain", tmp_path("plain")) == 0);
+    CHECK(tar_writer_close(w) == 0);
+
+    tar_manifest_t *embedded = tar_manifest_from_pax(fd);
+    CHECK(embedded != NULL && embedded->no_entries == 1 && strcmp(embedded->entries[0].path, "checked") == 0);
+    CHECK(tar_verify_content(fd, NULL, 2) == 0);
+    tar_manifest_t *manifest = tar_manifest_build(fd, TAR_DIGEST_SHA256, 2);
+    CHECK(manifest != NULL && manifest->no_entries == 2);
+    CHECK(tar_verify_content(fd, manifest, 0) == 0);
+    CHECK(manifest_entry(manifest, "plain")->status == TAR_VERIFY_OK);
+
+    // a manifest entry with no file behind it, and one with no digest
+    tar_manifest_entry_t extra[2] = {{.path = "gone", .digest = manifest->entries[0].digest}, {.path = "plain"}};
+    tar_manifest_t partial = {.entries = extra, .no_entries = 2};
+    CHECK(tar_verify_content(fd, &partial, 1) == 1);
+    CHECK(extra[0].status == TAR_VERIFY_MISSING && extra[1].status == TAR_VERIFY_UNCHECKED);
+
+    // flip a byte of the checked file's data
+    char archive[8192];
+    ssize_t archive_len = pread(fd, archive, sizeof(archive), 0);
+    char *data = memmem(archive, archive_len, "content to be checked", 21);
+    CHECK(data != NULL);
+    if (data != NULL) {
+        char flipped = data[3] ^ 1;
+        pwrite(fd, &flipped, 1, data + 3 - archive);
+    }
+    CHECK(tar_verify_content(fd, NULL, 2) == 1);
+    CHECK(tar_verify_content(fd, manifest, 2) == 1);
+    CHECK(manifest_entry(manifest, "checked")->status == TAR_VERIFY_MISMATCH);
+    CHECK(manifest_entry(manifest, "plain")->status == TAR_VERIFY_OK);
+    tar_manifest_free(manifest);
+    tar_manifest_free(embedded);
+    close(fd);
+
+    // a path added twice keeps the digests of the last member, whose data the index reads
+    fd = open(tmp_path("twice.tar"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    w = tar_writer_open(fd);
+    tar_writer_set_digests(w, TAR_DIGEST_CRC32C);
+    CHECK(tar_writer_add_file(w, "same", tmp_path("checked")) == 0);
+    CHECK(tar_writer_add_file(w, "same", tmp_path("plain")) == 0);
+    CHECK(tar_writer_close(w) == 0);
+    embedded = tar_manifest_from_pax(fd);
+    CHECK(embedded != NULL && embedded->no_entries == 1 && tar_verify_content(fd, embedded, 1) == 0);
+    tar_manifest_free(embedded);
+
+    // a header with a bad checksum is an invalid archive, not a lack of memory
+    char chksum = '7';
+    CHECK(pwrite(fd, &chksum, 1, offsetof(tar_header_t, chksum)) == 1);
+    errno = 0;
+    CHECK(tar_manifest_from_pax(fd) == NULL && errno == EINVAL);
+    errno = 0;
+    CHECK(tar_verify_content(fd, NULL, 1) == -1 && errno == EINVAL);
+    close(fd);
+}
+
+/* Every query answered by a daemon, with the answer lib_tar gives on the archive itself */
+static void test_daemon(void) {
+    archive_t a = {0};
+    add_member(&a, "dir/", DIRTYPE, NULL, NULL, 0);
+    add_file(&a, "dir/one", "first file");
+    add_file(&a, "dir/two", "second file, a bit longer");
+    add_member(&a, "dir/sub/", DIRTYPE, NULL, NULL, 0);
+    add_member(&a, "link", SYMTYPE, "dir/two", NULL, 0);
+    int fd = archive_fd(&a, "served.tar");
+    archive_t other = {0};
+    add_file(&other, "other", "not served");
+    int other_fd = archive_fd(&other, "unserved.tar");
+
+    char *socket_path = strdup(tmp_path("daemon.sock"));
+    char *archives[] = {strdup(tmp_path("served.tar"))};
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(tar_daemon_run(socket_path, archives, 1) == 0 ? 0 : 1);
+    }
+    // wait for the daemon to index the archive and listen
+    int conn = -1;
+    for (int i = 0; i < 500 && conn == -1; ++i) {
+        conn = tar_client_open(socket_path, archives[0]);
+        if (conn == -1) {
+            usleep(10000);
+        }
+    }
+    CHECK(conn != -1);
+
+    char *paths[] = {"dir", "dir/", "dir/one", "dir/two", "dir/sub", "link", "missing", "dir/one/x"};
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); ++i) {
+        CHECK(tar_client_exists(conn, paths[i]) == exists(fd, paths[i]));
+        CHECK(tar_client_is_dir(conn, paths[i]) == is_dir(fd, paths[i]));
+        CHECK(tar_client_is_file(conn, paths[i]) == is_file(fd, paths[i]));
+        CHECK(tar_client_is_symlink(conn, paths[i]) == is_symlink(fd, paths[i]));
+    }
+
+    char *entries[8], *expected[8];
+    for (int i = 0; i < 8; ++i) {
+        entries[i] = calloc(512, 1);
+        expected[i] = calloc(512, 1);
+    }
+    size_t no_entries = 8, no_expected = 8;
+    CHECK(tar_client_list(conn, "dir", entries, &no_entries) == list(fd, "dir", expected, &no_expected));
+    CHECK(no_entries == 3 && no_entries == no_expected);
+    for (size_t i = 0; i < no_entries && i < no_expected; ++i) {
+        CHECK(strcmp(entries[i], expected[i]) == 0);
+    }
+    no_entries = 8;
+    CHECK(tar_client_list(conn, "dir/one", entries, &no_entries) == 0 && no_entries == 0);
+    for (int i = 0; i < 8; ++i) {
+        free(entries[i]);
+        free(expected[i]);
+    }
+
+    uint8_t buf[64], expected_buf[64];
+    size_t len = 5, expected_len = 5;
+    CHECK(tar_client_read_file(conn, "link", 7, buf, &len) == read_file(fd, "link", 7, expected_buf, &expected_len));
+    CHECK(len == 5 && expected_len == 5 && memcmp(buf, expected_buf, 5) == 0 && memcmp(buf, "file,", 5) == 0);
+    len = sizeof(buf);
+    CHECK(tar_client_read_file(conn, "dir/one", 0, buf, &len) == 0 && len == 10 && memcmp(buf, "first file", 10) == 0);
+    len = sizeof(buf);
+    CHECK(tar_client_read_file(conn, "dir/one", 20, buf, &len) == -2);
+    len = sizeof(buf);
+    CHECK(tar_client_read_file(conn, "dir/sub", 0, buf, &len) == -1);
+
+    errno = 0;
+    CHECK(tar_client_open(socket_path, tmp_path("unserved.tar")) == -1 && errno == ENOENT);
+    tar_client_close(conn);
+
+    // the daemon stops cleanly on SIGTERM and removes its socket
+    int status = -1;
+    kill(pid, SIGTERM);
+    CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    CHECK(access(socket_path, F_OK) == -1);
+    free(archives[0]);
+    free(socket_path);
+    close(fd);
+    close(other_fd);
+    free_archive(&a);
+    free_archive(&other);
+}
+
 int main(int argc, char **argv) {
     if (argc < 2) {
         printf("Usage: %s tar_file\n", argv[0]);
@@ -36,57 +1636,41 @@ int main(int argc, char **argv) {
         perror("open(tar_file)");
         return -1;
     }
+    if (mkdtemp(tmp_dir) == NULL) {
+        perror("mkdtemp");
+        return -1;
+    }
 
-//    /*            check archive test:            */
-//    int ret = check_archive(fd);
-//    printf("check_archive returned %d (positive number == success)\n", ret);
-//    lseek(fd, 0, SEEK_SET);
-
-
-    /*            is ___ test:            */
-//    int is_directory = is_symlink(fd, "linked_file");
-//    printf("is_symlink returned %d\n", is_directory);
-//    lseek(fd, 0, SEEK_SET);
-
-//    /*            exists test :            */
-//    int file_exists = exists(fd, "di");
-//    printf("exists returned : %d\n", file_exists);
-//    lseek(fd, 0, SEEK_SET);
-
-
-//    /*            list test:            */
-//    size_t arr_size = 6;
-//    size_t no_entries = 6;
-//    char **entries = malloc(no_entries * sizeof(char *));
-//    for (int i = 0; i < arr_size; ++i) {
-//        entries[i] = calloc(512, sizeof(char));
-//    }
-//    int list_res = list(fd, "linked_dir", entries, &no_entries);
-//    printf("list returned : %d\n", list_res);
-//    for (int i = 0; i < arr_size; ++i) {
-//        printf("entry %d: %s\n", i, entries[i]);
-//        free(entries[i]);
-//    }
-//    printf("\n");
-//    free(entries);
-//    lseek(fd, 0, SEEK_SET);
-
-
-    /*            read_file test:            */
-    size_t size = 1000;
-    uint8_t *buf = malloc(size);
-    lseek(fd, 0, SEEK_SET);
-
-    printf("len before: %zu\n", size);
-    ssize_t file_read = read_file(fd, "dir/file1_symlink.txt", 0, buf, &size);
-    printf("File content:\n");
-    for (int i = 0; i < size; i++)
-        printf("%c", buf[i]);
-    printf("\nread_file returned : %zd\n", file_read);
-    printf("len after: %zu\n", size);
-    free(buf);
-    lseek(fd, 0, SEEK_SET);
-
+    test_queries(fd);
+    test_index();
+    test_index_cache();
+    test_mmap();
+    test_scanner();
+    test_simd();
+    test_check_parallel();
+    test_shared_fd(fd);
+    test_list_tree();
+    test_links();
+    test_iterator();
+    test_gzip();
+    test_gen_archive();
+    test_long_names();
+    test_sidecar();
+    test_read_files();
+    test_async();
+    test_refresh();
+    test_find();
+    test_extract();
+    test_send();
+    test_stats();
+    test_entry();
+    test_writer();
+    test_overlay();
+    test_verify();
+    test_daemon();
 
-    return 0;
+    close(fd);
+    nftw(tmp_dir, remove_file, 16, FTW_DEPTH | FTW_PHYS);
+    printf("%d checks, %d failed\n", no_checks, no_failures);
+    return no_failures == 0 ? 0 : 1;
 }